@@ -86,7 +86,8 @@ START_ENUM(EnvBindings)
   eHdr        = 1, 
   eImpSamples = 2,
   eSortParameters = 3,
-  eGridKeys = 4
+  eGridKeys = 4,
+  eRecordedRays = 5
 END_ENUM();
 
 
@@ -206,6 +207,13 @@ struct SortingParameters
 {
   
   uint numCoherenceBitsTotal; //1-32 Zero meaning No sorting
+  // Key bits of each enabled feature, 0 shares the bits the others leave evenly. Up to 15, see
+  // packKeyComposition in sorting_keys.h. The finished flag always takes one bit
+  uint originBits;
+  uint directionBits;
+  uint estimatedEndpointBits;
+  uint realEndpointBits;
+  uint interleaveFeatures; // 0: the features are concatenated, 1: interleaved bit by bit
   bool sortAfterASTraversal; // when to sort|  0: before TraceRay; 1: after TraceRay
   //Which Information to use
   bool noSort;
@@ -250,6 +258,8 @@ struct RtxState
   int estimatedEndpoint;
   int realEndpoint;
   int isFinished;
+  uint keyComposition;      // packKeyComposition of the sorting parameters
+  int recordRayDepth;       // bounce whose rays are written to eRecordedRays, -1 records nothing
 };
 
 // Structure used for retrieving the primitive information in the closest hit
@@ -438,6 +448,14 @@ struct GridCube
   int right;
 };
 
+// One ray per pixel read back for the .rays files of the sorting key tools, see sorting_key_bench.hpp
+struct RecordedRay
+{
+  vec3  origin;
+  vec3  direction;
+  float hitT;  // hit distance of the ray, SORTKEY_NO_HIT (INFINITY) for a miss
+};
+
 
 
 #endif  // COMMON_HOST_DEVICE
@@ -317,7 +317,8 @@ vec3 visualizeSortingKey(vec3 CubePosition, Ray r, float t, ivec3 gridSpace)
 
   int index = gridSpace.z*(rtxState.gridY*rtxState.gridX) + gridSpace.y*rtxState.gridX + gridSpace.x;
 
-  int hashCode = returnHashCode(normalized_isect,index);
+  // color by the sorting flags only, the coherence bit count lives above bit 7
+  int hashCode = returnHashCode(normalized_isect,index) & 0xFF;
 
   float val  = clamp((hashCode*10 - low) / (high - low), 0.0, 1.0);
     
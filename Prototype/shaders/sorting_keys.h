@@ -0,0 +1,435 @@
+/*
+  Sorting key functions shared by keyCreation.glsl and the host (src/sorting_keys.hpp)
+*/
+
+#ifndef SORTING_KEYS_H
+#define SORTING_KEYS_H
+
+// Written in the part of GLSL that also compiles as C++. On the host the GLSL built-ins are
+// taken from glm and everything lives in namespace sortkey; include host_device.h first.
+//
+// A key is built in two steps. The ray is quantized: positions and directions are scaled and
+// taken as the IEEE bits of the scaled floats (floatBitsToInt), or with normalized keys mapped to
+// [0,1] and taken as fixed point numbers of as many bits as the scale. Bits of those are
+// interleaved into a 64 bit Morton code, whose upper half is the key. The morton* functions below are the
+// reference of the second step, the host has faster interleaves that must match them bit for bit.
+
+#ifdef __cplusplus
+#include <glm/glm.hpp>
+namespace sortkey {
+using ivec3 = glm::ivec3;
+using glm::abs;
+using glm::acos;
+using glm::atan;
+using glm::clamp;
+using glm::floatBitsToInt;
+using glm::max;
+using glm::min;
+using glm::normalize;
+#define SORTKEY_FUNC inline
+#else
+#define SORTKEY_FUNC
+#endif
+
+const float SORTKEY_PI     = 3.14159265358979323846f;
+const float SORTKEY_NO_HIT = 1e32f;  // hitT of a ray that missed, INFINITY in globals.glsl
+
+struct KeyQuantization
+{
+  bool normalized;  // fixed point in the scene bounds instead of the float bits
+  vec3 sceneMin;
+  vec3 sceneMax;
+};
+
+SORTKEY_FUNC float largestSceneExtent(vec3 sceneMin, vec3 sceneMax)
+{
+  float largestExtent = 0.0f;
+  largestExtent       = max(largestExtent, abs(sceneMax.x - sceneMin.x));
+  largestExtent       = max(largestExtent, abs(sceneMax.y - sceneMin.y));
+  largestExtent       = max(largestExtent, abs(sceneMax.z - sceneMin.z));
+  return largestExtent;
+}
+
+//-----------------------------------------------------------------------
+// Quantization
+//
+
+// `scale` is 2^bits - 1, so the fixed point value of 1 has all bits set
+SORTKEY_FUNC ivec3 quantizeUnit(vec3 t, float scale, bool normalized)
+{
+  if(normalized)
+    return ivec3(clamp(t, 0.0f, 1.0f) * scale);
+  return floatBitsToInt(t * scale);
+}
+
+// Positions outside the scene bounds, like the endpoints of missed rays, clamp to its faces
+SORTKEY_FUNC ivec3 quantizePosition(vec3 p, float scale, KeyQuantization quantization)
+{
+  if(quantization.normalized)
+  {
+    vec3 extent = max(quantization.sceneMax - quantization.sceneMin, vec3(1e-6f));
+    return quantizeUnit((p - quantization.sceneMin) / extent, scale, true);
+  }
+  vec3 a = (p - vec3(0)) / vec3(1);
+  return floatBitsToInt(a * scale);
+}
+
+// azimuth and polar angle in [0,1], z is unused
+SORTKEY_FUNC ivec3 quantizeSphericalDirection(vec3 direction, float scale, KeyQuantization quantization)
+{
+  vec3 nd = normalize(direction);
+  vec3 b;
+  b.x = atan(nd.y, nd.x) / (2.0f * SORTKEY_PI) + 0.5f;
+  b.y = acos(nd.z) / SORTKEY_PI;
+  b.z = 0.0f;
+  return quantizeUnit(b, scale, quantization.normalized);
+}
+
+SORTKEY_FUNC ivec3 quantizeDirection(vec3 direction, float scale, KeyQuantization quantization)
+{
+  vec3 b = (normalize(direction) + 1.0f) * 0.5f;
+  return quantizeUnit(b, scale, quantization.normalized);
+}
+
+SORTKEY_FUNC vec3 rayEndpoint(vec3 origin, vec3 direction, float rayLength)
+{
+  return origin + direction * rayLength;
+}
+
+// Half the length of the ray of the last bounce, a fifth of the scene if that one missed
+SORTKEY_FUNC float estimatedRayLength(float rayLengthLastPass, float sceneExtent)
+{
+  return rayLengthLastPass == SORTKEY_NO_HIT ? 0.2f * sceneExtent : 0.5f * rayLengthLastPass;
+}
+
+//-----------------------------------------------------------------------
+// Interleaving, the reference
+//
+
+// 21 bits per axis
+SORTKEY_FUNC uint64_t mortonOrigin(ivec3 ia)
+{
+  uint64_t mortonCode = 0;
+  for(int i = 22; i >= 2; --i)
+  {
+    mortonCode |= uint64_t(((ia.x >> i) & 1)) << (3 * i - 3);  // max 63
+    mortonCode |= uint64_t(((ia.y >> i) & 1)) << (3 * i - 4);  // max 62
+    mortonCode |= uint64_t(((ia.z >> i) & 1)) << (3 * i - 5);  // max 61
+  }
+  mortonCode |= uint64_t((ia.x & 1));  // max 0
+  return mortonCode;
+}
+
+// Reis et al. [2017], origin then direction. The code stays below bit 32, see SortingKeyReis
+SORTKEY_FUNC uint64_t mortonReis(ivec3 ia, ivec3 ib)
+{
+  uint64_t mortonCode = 0;
+  for(int i = 7; i >= 1; --i)
+  {
+    mortonCode |= uint64_t(((ia.x >> i) & 1)) << (3 * i + 10);  // max 31
+    mortonCode |= uint64_t(((ia.y >> i) & 1)) << (3 * i + 9);   // max 30
+    mortonCode |= uint64_t(((ia.z >> i) & 1)) << (3 * i + 8);   // max 29
+  }
+  mortonCode |= uint64_t((ia.x & 1)) << (10);  // max 10
+
+  for(int i = 7; i >= 3; --i)
+  {
+    mortonCode |= uint64_t(((ib.x >> i) & 1)) << (2 * i - 5);  // max 9
+    mortonCode |= uint64_t(((ib.y >> i) & 1)) << (2 * i - 6);  // max 8
+  }
+  return mortonCode;
+}
+
+// Costa et al., direction then origin
+SORTKEY_FUNC uint64_t mortonCosta(ivec3 ia, ivec3 ib)
+{
+  uint64_t mortonCode = 0;
+  for(int i = 12; i >= 9; --i)
+  {
+    mortonCode |= uint64_t(((ib.x >> i) & 1)) << (2 * i + 39);  // max 63
+    mortonCode |= uint64_t(((ib.y >> i) & 1)) << (2 * i + 38);  // max 62
+  }
+  for(int i = 7; i >= 1; --i)
+  {
+    mortonCode |= uint64_t(((ia.x >> i) & 1)) << (3 * i + 19);  // max 40
+    mortonCode |= uint64_t(((ia.y >> i) & 1)) << (3 * i + 18);  // max 39
+    mortonCode |= uint64_t(((ia.z >> i) & 1)) << (3 * i + 17);  // max 38
+  }
+  return mortonCode;
+}
+
+// Aila et al., origin and direction interleaved
+SORTKEY_FUNC uint64_t mortonAila(ivec3 ia, ivec3 ib)
+{
+  uint64_t mortonCode = 0;
+  for(int i = 12; i >= 10; --i)
+  {
+    mortonCode |= uint64_t(((ia.x >> i) & 1)) << (3 * i + 27);  // max 63
+    mortonCode |= uint64_t(((ia.y >> i) & 1)) << (3 * i + 26);  // max 62
+    mortonCode |= uint64_t(((ia.z >> i) & 1)) << (3 * i + 25);  // max 61
+  }
+  for(int i = 9; i >= 1; --i)
+  {
+    mortonCode |= uint64_t(((ia.x >> i) & 1)) << (6 * i + 0);  // max 54
+    mortonCode |= uint64_t(((ia.y >> i) & 1)) << (6 * i - 1);  // max 53
+    mortonCode |= uint64_t(((ia.z >> i) & 1)) << (6 * i - 2);  // max 52
+  }
+  for(int i = 12; i >= 4; --i)
+  {
+    mortonCode |= uint64_t(((ib.x >> i) & 1)) << (6 * i - 21);  // max 51
+    mortonCode |= uint64_t(((ib.y >> i) & 1)) << (6 * i - 22);  // max 50
+    mortonCode |= uint64_t(((ib.z >> i) & 1)) << (6 * i - 23);  // max 49
+  }
+  return mortonCode;
+}
+
+// Spherical direction, 16 bits per angle, azimuth on the odd bits
+SORTKEY_FUNC uint mortonDirection(ivec3 ib)
+{
+  uint mortonCode = 0u;
+  for(int i = 15; i >= 0; --i)
+  {
+    mortonCode |= uint((ib.x >> i) & 1) << (2 * i + 1);  // max 31
+    mortonCode |= uint((ib.y >> i) & 1) << (2 * i);      // max 30
+  }
+  return mortonCode;
+}
+
+// Two points interleaved, the endpoint estimations pass the endpoint as both
+SORTKEY_FUNC uint64_t mortonTwoPoint(ivec3 ia, ivec3 ib)
+{
+  uint64_t mortonCode = 0;
+  for(int i = 14; i >= 4; --i)
+  {
+    mortonCode |= uint64_t(((ia.x >> i) & 1)) << (6 * i - 21);  // max 63
+    mortonCode |= uint64_t(((ia.y >> i) & 1)) << (6 * i - 22);  // max 62
+    mortonCode |= uint64_t(((ia.z >> i) & 1)) << (6 * i - 23);  // max 61
+  }
+  for(int i = 14; i >= 5; --i)
+  {
+    mortonCode |= uint64_t(((ib.x >> i) & 1)) << (6 * i - 24);  // max 60
+    mortonCode |= uint64_t(((ib.y >> i) & 1)) << (6 * i - 25);  // max 59
+    mortonCode |= uint64_t(((ib.z >> i) & 1)) << (6 * i - 26);  // max 58
+  }
+  mortonCode |= uint64_t(ib.x & 1);
+  return mortonCode;
+}
+
+//-----------------------------------------------------------------------
+// Keys
+//
+
+SORTKEY_FUNC uint SortingKeyOrigin(vec3 origin, KeyQuantization quantization)
+{
+  return uint(mortonOrigin(quantizePosition(origin, 8388607.0f, quantization)) >> 32);  // 23b/dim
+}
+
+SORTKEY_FUNC uint SortingKeyReis(vec3 origin, vec3 direction, KeyQuantization quantization)
+{
+  ivec3 ia = quantizePosition(origin, 255.0f, quantization);  // 8b/dim
+  ivec3 ib = quantizeSphericalDirection(direction, 255.0f, quantization);
+  // the upper half of the code, the key of every other mode, is empty. With the float bits the key
+  // stays 0 as it always was, normalized keys take the code itself
+  uint64_t mortonCode = mortonReis(ia, ib);
+  return quantization.normalized ? uint(mortonCode) : uint(mortonCode >> 32);
+}
+
+SORTKEY_FUNC uint SortingKeyCosta(vec3 origin, vec3 direction, KeyQuantization quantization)
+{
+  ivec3 ia = quantizePosition(origin, 8191.0f, quantization);  // 13b/dim
+  ivec3 ib = quantizeSphericalDirection(direction, 8191.0f, quantization);
+  return uint(mortonCosta(ia, ib) >> 32);
+}
+
+SORTKEY_FUNC uint SortingKeyAila(vec3 origin, vec3 direction, KeyQuantization quantization)
+{
+  ivec3 ia = quantizePosition(origin, 8191.0f, quantization);  // 13b/dim
+  ivec3 ib = quantizeDirection(direction, 8191.0f, quantization);
+  return uint(mortonAila(ia, ib) >> 32);
+}
+
+SORTKEY_FUNC uint SortingKeyDirection(vec3 direction, KeyQuantization quantization)
+{
+  return mortonDirection(quantizeSphericalDirection(direction, 65535.0f, quantization));  // 16b/angle
+}
+
+SORTKEY_FUNC uint SortingKeyTwoPoint(vec3 origin, vec3 direction, float rayLength, KeyQuantization quantization)
+{
+  ivec3 ia = quantizePosition(origin, 32767.0f, quantization);  // 15b/dim
+  ivec3 ib = quantizePosition(rayEndpoint(origin, direction, rayLength), 32767.0f, quantization);
+  return uint(mortonTwoPoint(ia, ib) >> 32);
+}
+
+SORTKEY_FUNC uint SortingKeyEndPointEstimationHard(vec3 origin, vec3 direction, KeyQuantization quantization)
+{
+  float rayLength = 0.2f * largestSceneExtent(quantization.sceneMin, quantization.sceneMax);
+  ivec3 ib        = quantizePosition(rayEndpoint(origin, direction, rayLength), 32767.0f, quantization);
+  return uint(mortonTwoPoint(ib, ib) >> 32);
+}
+
+SORTKEY_FUNC uint SortingKeyEndPointEstimationAdaptive(vec3 origin, vec3 direction, float rayLengthLastPass, KeyQuantization quantization)
+{
+  float sceneExtent = largestSceneExtent(quantization.sceneMin, quantization.sceneMax);
+  float rayLength   = estimatedRayLength(rayLengthLastPass, sceneExtent);
+  ivec3 ib          = quantizePosition(rayEndpoint(origin, direction, rayLength), 32767.0f, quantization);
+  return uint(mortonTwoPoint(ib, ib) >> 32);
+}
+
+//-----------------------------------------------------------------------
+// Composed keys
+//
+// The sorting parameters pick features of the ray, each one is a 32 bit key of its own with the
+// coarsest bits on top. The composed key has numCoherenceBitsTotal bits, the ones reorderThreadNV
+// considers, and each enabled feature contributes its most significant bits to it: concatenated,
+// the finished flag first, or interleaved one bit per feature and round.
+
+const int KEY_FEATURE_FINISHED           = 0;  // one bit, set if the path ends after this bounce
+const int KEY_FEATURE_ORIGIN             = 1;
+const int KEY_FEATURE_DIRECTION          = 2;
+const int KEY_FEATURE_ESTIMATED_ENDPOINT = 3;
+const int KEY_FEATURE_REAL_ENDPOINT      = 4;
+const int KEY_NUM_FEATURES               = 5;
+
+// Budgets of the features except the finished flag, 4 bits each from origin up, 0 meaning an even
+// share of the bits the others leave. The interleave flag is bit 16. This is the layout of
+// RtxState::keyComposition and of the parameter hash from bit 14 on.
+const uint KEY_BUDGET_BITS     = 4u;
+const uint KEY_BUDGET_MAX      = 15u;
+const uint KEY_INTERLEAVE_FLAG = 1u << 16;
+
+struct KeyComposition
+{
+  uint totalBits;
+  bool interleave;
+  bool enabled[KEY_NUM_FEATURES];
+  uint requestedBits[KEY_NUM_FEATURES];  // 0: an even share of what is left
+};
+
+struct KeyBudget
+{
+  uint bits[KEY_NUM_FEATURES];
+};
+
+struct KeyFeatureValues
+{
+  uint values[KEY_NUM_FEATURES];
+};
+
+SORTKEY_FUNC uint packKeyComposition(uint originBits, uint directionBits, uint estimatedEndpointBits, uint realEndpointBits, bool interleave)
+{
+  uint packed = min(originBits, KEY_BUDGET_MAX);
+  packed |= min(directionBits, KEY_BUDGET_MAX) << KEY_BUDGET_BITS;
+  packed |= min(estimatedEndpointBits, KEY_BUDGET_MAX) << (2u * KEY_BUDGET_BITS);
+  packed |= min(realEndpointBits, KEY_BUDGET_MAX) << (3u * KEY_BUDGET_BITS);
+  return interleave ? packed | KEY_INTERLEAVE_FLAG : packed;
+}
+
+SORTKEY_FUNC KeyComposition keyComposition(uint totalBits, bool rayOrigin, bool rayDirection, bool estimatedEndpoint, bool realEndpoint, bool isFinished, uint packed)
+{
+  KeyComposition composition;
+  composition.totalBits  = min(totalBits, 32u);
+  composition.interleave = (packed & KEY_INTERLEAVE_FLAG) != 0u;
+
+  composition.enabled[KEY_FEATURE_FINISHED]           = isFinished;
+  composition.enabled[KEY_FEATURE_ORIGIN]             = rayOrigin;
+  composition.enabled[KEY_FEATURE_DIRECTION]          = rayDirection;
+  composition.enabled[KEY_FEATURE_ESTIMATED_ENDPOINT] = estimatedEndpoint;
+  composition.enabled[KEY_FEATURE_REAL_ENDPOINT]      = realEndpoint;
+
+  composition.requestedBits[KEY_FEATURE_FINISHED] = 1u;
+  for(int f = KEY_FEATURE_ORIGIN; f < KEY_NUM_FEATURES; ++f)
+    composition.requestedBits[f] = (packed >> (uint(f - KEY_FEATURE_ORIGIN) * KEY_BUDGET_BITS)) & KEY_BUDGET_MAX;
+  return composition;
+}
+
+// Requested budgets are granted in feature order while bits are left, what remains is shared
+// evenly by the features without a request, the first ones get the odd bits
+SORTKEY_FUNC KeyBudget keyBudget(KeyComposition composition)
+{
+  KeyBudget budget;
+  uint      left   = composition.totalBits;
+  uint      shares = 0u;
+  for(int f = 0; f < KEY_NUM_FEATURES; ++f)
+  {
+    budget.bits[f] = 0u;
+    if(!composition.enabled[f])
+      continue;
+    if(composition.requestedBits[f] == 0u)
+    {
+      shares++;
+      continue;
+    }
+    budget.bits[f] = min(composition.requestedBits[f], left);
+    left -= budget.bits[f];
+  }
+
+  uint share = shares > 0u ? left / shares : 0u;
+  uint extra = shares > 0u ? left - share * shares : 0u;
+  for(int f = 0; f < KEY_NUM_FEATURES; ++f)
+  {
+    if(!composition.enabled[f] || composition.requestedBits[f] != 0u)
+      continue;
+    budget.bits[f] = share + (extra > 0u ? 1u : 0u);
+    extra          = extra > 0u ? extra - 1u : 0u;
+  }
+  return budget;
+}
+
+// The top `bits` bits of `value` appended below `key`
+SORTKEY_FUNC uint appendKeyBits(uint key, uint value, uint bits)
+{
+  if(bits == 0u)
+    return key;
+  if(bits >= 32u)
+    return value;
+  return (key << bits) | (value >> (32u - bits));
+}
+
+SORTKEY_FUNC uint composeSortingKey(KeyComposition composition, KeyFeatureValues features)
+{
+  KeyBudget budget = keyBudget(composition);
+  uint      key    = 0u;
+  if(!composition.interleave)
+  {
+    for(int f = 0; f < KEY_NUM_FEATURES; ++f)
+      key = appendKeyBits(key, features.values[f], budget.bits[f]);
+    return key;
+  }
+
+  // level l takes bit 31 - l of every feature that has more than l bits
+  for(uint level = 0u; level < 32u; ++level)
+  {
+    for(int f = 0; f < KEY_NUM_FEATURES; ++f)
+    {
+      if(level < budget.bits[f])
+        key = (key << 1) | ((features.values[f] >> (31u - level)) & 1u);
+    }
+  }
+  return key;
+}
+
+SORTKEY_FUNC KeyFeatureValues sortingKeyFeatures(KeyComposition composition, vec3 origin, vec3 direction, float hitT, bool finished, KeyQuantization quantization)
+{
+  KeyFeatureValues features;
+  features.values[KEY_FEATURE_FINISHED] = finished ? 0x80000000u : 0u;
+  features.values[KEY_FEATURE_ORIGIN]   = composition.enabled[KEY_FEATURE_ORIGIN] ? SortingKeyOrigin(origin, quantization) : 0u;
+  features.values[KEY_FEATURE_DIRECTION] =
+      composition.enabled[KEY_FEATURE_DIRECTION] ? SortingKeyDirection(direction, quantization) : 0u;
+  features.values[KEY_FEATURE_ESTIMATED_ENDPOINT] =
+      composition.enabled[KEY_FEATURE_ESTIMATED_ENDPOINT] ? SortingKeyEndPointEstimationAdaptive(origin, direction, hitT, quantization) : 0u;
+  features.values[KEY_FEATURE_REAL_ENDPOINT] =
+      composition.enabled[KEY_FEATURE_REAL_ENDPOINT] ? SortingKeyTwoPoint(origin, direction, hitT, quantization) : 0u;
+  return features;
+}
+
+// `hitT` is the hit distance of the last bounce, like in createSortingKey
+SORTKEY_FUNC uint SortingKeyComposed(KeyComposition composition, vec3 origin, vec3 direction, float hitT, bool finished, KeyQuantization quantization)
+{
+  return composeSortingKey(composition, sortingKeyFeatures(composition, origin, direction, hitT, finished, quantization));
+}
+
+#ifdef __cplusplus
+}  // namespace sortkey
+#endif
+
+#endif
@@ -29,18 +29,16 @@
 #include "random.glsl"
 
 //-----------------------------------------------------------------------
-// Shoot a ray an return the information of the closest hit, in the
-// PtPayload structure (PRD)
+// ClosestHit of the uber shader: the sorting parameters come from the
+// push constants, so one pipeline runs every configuration. Mirrors the
+// specialized ClosestHit below branch for branch
 //
-void ClosestHit(Ray r,int  depth)
+void ClosestHitPush(Ray r,int  depth)
 {
   uint rayFlags = gl_RayFlagsCullBackFacingTrianglesEXT;
   prd.hitT      = INFINITY;
-  uint64_t start; 
-  uint64_t end; 
-  int ID = int(gl_LaunchIDEXT.y) * int(gl_LaunchSizeEXT.x) + int(gl_LaunchIDEXT.x);
-  
-  if(NOSORTING)
+
+  if(rtxState.noSort > 0)
   {
         traceRayEXT(topLevelAS,   // acceleration structure
                 rayFlags,     // rayFlags
@@ -57,13 +55,12 @@ void ClosestHit(Ray r,int  depth)
   }
   else 
   {
+    uint code = createSortingKeyFromPushConstants(r);
 
-    uint code = createSortingKeyFromSpecialization(r);
 
-
-    if(!AFTERASTRAVERSAL)
+    if(rtxState.sortAfterASTraversal == 0)
     {
-      reorderThreadNV(code,_sortingParameters.numCoherenceBitsTotal);
+      reorderThreadNV(code,rtxState.numCoherenceBitsTotal);
     }
 
 
@@ -82,17 +79,15 @@ void ClosestHit(Ray r,int  depth)
                 INFINITY,
                 0);
 
-    if(AFTERASTRAVERSAL)
+    if(rtxState.sortAfterASTraversal > 0)
     {
-      if(HITOBJECT)
+      if(rtxState.hitObject > 0)
       {
-        reorderThreadNV(hObj, code,_sortingParameters.numCoherenceBitsTotal );
-        //reorderThreadNV(hObj,code,_sortingParameters.numCoherenceBitsTotal);
+        reorderThreadNV(hObj, code,rtxState.numCoherenceBitsTotal );
       }
       else
       {
-        reorderThreadNV(code,_sortingParameters.numCoherenceBitsTotal);
-        //reorderThreadNV(hObj);
+        reorderThreadNV(code,rtxState.numCoherenceBitsTotal);
       }
     }
 
@@ -100,15 +95,39 @@ void ClosestHit(Ray r,int  depth)
   }
 }
 
-void ClosestHitPush(Ray r,int  depth)
+//-----------------------------------------------------------------------
+// Writes the ray of this pixel at bounce rtxState.recordRayDepth, with the
+// distance it traveled, for the .rays files of the sorting key tools
+//
+void recordRay(Ray r, int depth)
+{
+  uint ID = gl_LaunchIDEXT.y * gl_LaunchSizeEXT.x + gl_LaunchIDEXT.x;
+  if(depth == rtxState.recordRayDepth && ID < recordedRays.length())
+  {
+    recordedRays[ID] = RecordedRay(r.origin, r.direction, prd.hitT);
+  }
+}
+
+//-----------------------------------------------------------------------
+// Shoot a ray an return the information of the closest hit, in the
+// PtPayload structure (PRD)
+//
+void ClosestHit(Ray r,int  depth)
 {
+  if(DYNAMIC_SORTING)
+  {
+    ClosestHitPush(r,depth);
+    recordRay(r, depth);
+    return;
+  }
+
   uint rayFlags = gl_RayFlagsCullBackFacingTrianglesEXT;
   prd.hitT      = INFINITY;
   uint64_t start; 
   uint64_t end; 
   int ID = int(gl_LaunchIDEXT.y) * int(gl_LaunchSizeEXT.x) + int(gl_LaunchIDEXT.x);
   
-  if(rtxState.noSort > 0)
+  if(NOSORTING)
   {
         traceRayEXT(topLevelAS,   // acceleration structure
                 rayFlags,     // rayFlags
@@ -125,15 +144,15 @@ void ClosestHitPush(Ray r,int  depth)
   }
   else 
   {
-  /*
+
     uint code = createSortingKeyFromSpecialization(r);
 
 
-    if(rtxState.sortAfterASTraversal == 0)
+    if(!AFTERASTRAVERSAL)
     {
       reorderThreadNV(code,_sortingParameters.numCoherenceBitsTotal);
     }
-  */
+
 
     hitObjectNV hObj;
     hitObjectRecordEmptyNV(hObj); //Initialize to an empty hit object
@@ -150,14 +169,9 @@ void ClosestHitPush(Ray r,int  depth)
                 INFINITY,
                 0);
 
-    if(rtxState.hitObject > 0)
-      {
-        reorderThreadNV(hObj);
-      }
-    /*
-    if(rtxState.sortAfterASTraversal > 0)
+    if(AFTERASTRAVERSAL)
     {
-      if(rtxState.hitObject > 0)
+      if(HITOBJECT)
       {
         reorderThreadNV(hObj, code,_sortingParameters.numCoherenceBitsTotal );
         //reorderThreadNV(hObj,code,_sortingParameters.numCoherenceBitsTotal);
@@ -168,11 +182,12 @@ void ClosestHitPush(Ray r,int  depth)
         //reorderThreadNV(hObj);
       }
     }
-*/
+
     hitObjectExecuteShaderNV(hObj, 0);
   }
-}
 
+  recordRay(r, depth);
+}
 
 //-----------------------------------------------------------------------
 // Shoot a ray an return the information of the closest hit, in the
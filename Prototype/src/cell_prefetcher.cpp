@@ -0,0 +1,53 @@
+#include "cell_prefetcher.hpp"
+#include <algorithm>
+
+void CellPrefetcher::update(glm::vec3 position, float elapsedSeconds)
+{
+  if(m_tracking && elapsedSeconds > 0.0f)
+  {
+    glm::vec3 velocity = (position - m_position) / elapsedSeconds;
+    m_velocity         = glm::mix(m_velocity, velocity, velocitySmoothing);
+  }
+  m_position = position;
+  m_tracking = true;
+}
+
+std::vector<glm::vec3> CellPrefetcher::predictPath() const
+{
+  std::vector<glm::vec3> path;
+  if(!m_tracking || glm::dot(m_velocity, m_velocity) == 0.0f)
+    return path;
+  for(uint32_t step = 1; step <= pathSteps; step++)
+    path.emplace_back(m_position + m_velocity * (lookaheadSeconds * float(step) / float(pathSteps)));
+  return path;
+}
+
+void CellPrefetcher::reset()
+{
+  m_velocity = glm::vec3(0.0f);
+  m_tracking = false;
+  m_targets.clear();
+}
+
+std::vector<int> CellPrefetcher::setTargets(const std::vector<int>& hashCodes)
+{
+  std::vector<int> added;
+  for(int hashCode : hashCodes)
+  {
+    if(std::find(m_targets.begin(), m_targets.end(), hashCode) == m_targets.end()
+       && std::find(added.begin(), added.end(), hashCode) == added.end())
+      added.emplace_back(hashCode);
+  }
+  m_targets = hashCodes;
+  m_stats.targets += added.size();
+  return added;
+}
+
+void CellPrefetcher::recordCrossing(int hashCode, bool ready)
+{
+  m_stats.crossings++;
+  if(std::find(m_targets.begin(), m_targets.end(), hashCode) != m_targets.end())
+    m_stats.predicted++;
+  if(ready)
+    m_stats.ready++;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+struct PrefetchStats
+{
+  uint64_t targets{0};    // configurations that became a target ahead of a crossing
+  uint64_t crossings{0};  // cell crossings into a cell with a best configuration
+  uint64_t predicted{0};  // crossings whose configuration was a target before the crossing
+  uint64_t ready{0};      // crossings whose pipeline was built when the camera arrived, the hits
+
+  float hitRate() const { return crossings > 0 ? float(ready) / float(crossings) : 0.0f; }
+  float predictedRate() const { return crossings > 0 ? float(predicted) / float(crossings) : 0.0f; }
+};
+
+// Predicts where the camera is heading so the pipelines of the cells it reaches next can be built
+// before it crosses into them. The velocity is an exponential average over the frames, the path
+// is sampled along it up to lookaheadSeconds ahead. The caller maps the path to cells and their
+// configurations and passes those to setTargets, which returns the ones to request.
+class CellPrefetcher
+{
+public:
+  bool     enabled{true};
+  float    lookaheadSeconds{1.0f};
+  uint32_t pathSteps{4};             // positions sampled along the predicted path
+  float    velocitySmoothing{0.2f};  // weight of the latest frame in the velocity average
+
+  void                   update(glm::vec3 position, float elapsedSeconds);
+  std::vector<glm::vec3> predictPath() const;  // empty while the camera stands still
+  void                   reset();
+
+  // `hashCodes` are the configurations of the predicted cells this frame. Returns those that were
+  // not targets the frame before, a target that drops out and returns is returned again
+  std::vector<int> setTargets(const std::vector<int>& hashCodes);
+  // the camera entered a cell whose best configuration is `hashCode`, `ready` if its pipeline was built
+  void          recordCrossing(int hashCode, bool ready);
+  PrefetchStats stats() const { return m_stats; }
+
+private:
+  glm::vec3        m_position{0.0f};
+  glm::vec3        m_velocity{0.0f};  // scene units per second
+  bool             m_tracking{false};
+  std::vector<int> m_targets;
+  PrefetchStats    m_stats;
+};
@@ -0,0 +1,163 @@
+#include "deferred_operation_pool.hpp"
+#include <algorithm>
+
+// pool and queue of the calling thread if it is a worker, its own tasks are queued locally
+static thread_local DeferredOperationPool* t_pool   = nullptr;
+static thread_local uint32_t               t_worker = 0;
+
+DeferredOperationPool& DeferredOperationPool::shared()
+{
+  static DeferredOperationPool pool;
+  static std::once_flag        started;
+  std::call_once(started, []() { pool.start(std::max(1u, std::thread::hardware_concurrency())); });
+  return pool;
+}
+
+void DeferredOperationPool::start(uint32_t numWorkers)
+{
+  stop();
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_stopping = false;
+  m_queues.clear();
+  for(uint32_t i = 0; i < std::max(numWorkers, 1u); i++)
+    m_queues.emplace_back(std::make_unique<WorkerQueue>());
+  for(uint32_t i = 0; i < std::max(numWorkers, 1u); i++)
+    m_workers.emplace_back(&DeferredOperationPool::work, this, i);
+}
+
+void DeferredOperationPool::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stopping = true;
+  }
+  m_wake.notify_all();
+  for(std::thread& worker : m_workers)
+    worker.join();
+  m_workers.clear();
+}
+
+void DeferredOperationPool::submit(Task task)
+{
+  bool queued = false;
+  {
+    // queued under m_mutex, stop cannot let the workers go between the check and the count
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(!m_stopping)
+    {
+      queued = true;
+      uint32_t                    queue = t_pool == this ? t_worker : m_nextQueue++ % uint32_t(m_queues.size());
+      std::lock_guard<std::mutex> queueLock(m_queues[queue]->mutex);
+      m_queues[queue]->tasks.emplace_back(std::move(task));
+      m_queued++;
+    }
+  }
+  // without workers the caller runs it
+  if(queued)
+    m_wake.notify_one();
+  else
+    task();
+}
+
+// The newest task of the own queue, else the oldest of another one
+bool DeferredOperationPool::take(uint32_t worker, Task& task, bool& stolen)
+{
+  for(uint32_t i = 0; i < m_queues.size(); i++)
+  {
+    uint32_t                    queue = (worker + i) % uint32_t(m_queues.size());
+    std::lock_guard<std::mutex> lock(m_queues[queue]->mutex);
+    std::deque<Task>&           tasks = m_queues[queue]->tasks;
+    if(tasks.empty())
+      continue;
+    stolen = i != 0;
+    if(stolen)
+    {
+      task = std::move(tasks.front());
+      tasks.pop_front();
+    }
+    else
+    {
+      task = std::move(tasks.back());
+      tasks.pop_back();
+    }
+    return true;
+  }
+  return false;
+}
+
+void DeferredOperationPool::work(uint32_t worker)
+{
+  t_pool   = this;
+  t_worker = worker;
+  while(true)
+  {
+    {
+      // a claimed task is in one of the queues, submit counts it after queueing it
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_wake.wait(lock, [this]() { return m_queued > 0 || m_stopping; });
+      if(m_queued == 0)
+        return;
+      m_queued--;
+      m_stats.tasks++;
+    }
+    Task task;
+    bool stolen;
+    while(!take(worker, task, stolen))
+      std::this_thread::yield();
+    if(stolen)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stats.steals++;
+    }
+    task();
+  }
+}
+
+VkResult DeferredOperationPool::join(VkDevice device, VkDeferredOperationKHR operation)
+{
+  struct Joins
+  {
+    std::mutex              mutex;
+    std::condition_variable done;
+    uint32_t                outstanding{0};  // join tasks queued or running
+  };
+  auto joins = std::make_shared<Joins>();
+
+  uint32_t concurrency = std::min(vkGetDeferredOperationMaxConcurrencyKHR(device, operation), numWorkers());
+  if(concurrency == 0)
+    return vkGetDeferredOperationResultKHR(device, operation);
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.operations++;
+  }
+
+  // VK_THREAD_IDLE_KHR: the operation has no work for this thread right now but is not done,
+  // the task is queued again. Any other result means this thread is done with it
+  std::function<void()> joinTask = [this, device, operation, joins, &joinTask]() {
+    if(vkDeferredOperationJoinKHR(device, operation) == VK_THREAD_IDLE_KHR)
+    {
+      submit(joinTask);
+      return;
+    }
+    std::lock_guard<std::mutex> lock(joins->mutex);
+    if(--joins->outstanding == 0)
+      joins->done.notify_all();
+  };
+
+  {
+    std::lock_guard<std::mutex> lock(joins->mutex);
+    joins->outstanding = concurrency;
+  }
+  for(uint32_t i = 0; i < concurrency; i++)
+    submit(joinTask);
+
+  std::unique_lock<std::mutex> lock(joins->mutex);
+  joins->done.wait(lock, [&joins]() { return joins->outstanding == 0; });
+  return vkGetDeferredOperationResultKHR(device, operation);
+}
+
+DeferredOperationStats DeferredOperationPool::stats()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_stats;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <vulkan/vulkan_core.h>
+
+struct DeferredOperationStats
+{
+  uint64_t operations{0};  // deferred operations joined
+  uint64_t tasks{0};       // join tasks run, a task that found the operation idle is run again
+  uint64_t steals{0};      // tasks a worker took from the queue of another
+};
+
+// Process wide pool of threads that join deferred host operations: pipeline builds, and
+// acceleration structure builds on the host. One thread per hardware thread, so concurrent
+// operations share the cores instead of each starting threads of its own. Every worker has its
+// own queue and steals from the others when it runs dry, several operations progress at once.
+class DeferredOperationPool
+{
+public:
+  using Task = std::function<void()>;
+
+  static DeferredOperationPool& shared();  // started on first use, stopped at exit
+
+  ~DeferredOperationPool() { stop(); }
+
+  void start(uint32_t numWorkers);
+  // runs the queued tasks, then joins the workers. Tasks submitted afterwards run on the caller
+  void stop();
+  void submit(Task task);
+
+  // Joins `operation` on up to its maximum concurrency of workers and returns its result. The
+  // calling thread only waits, the work is done by the pool, so it must not be a task of the pool
+  VkResult join(VkDevice device, VkDeferredOperationKHR operation);
+
+  uint32_t               numWorkers() const { return uint32_t(m_workers.size()); }
+  DeferredOperationStats stats();
+
+private:
+  struct WorkerQueue
+  {
+    std::deque<Task> tasks;
+    std::mutex       mutex;
+  };
+
+  bool take(uint32_t worker, Task& task, bool& stolen);
+  void work(uint32_t worker);
+
+  std::vector<std::unique_ptr<WorkerQueue>> m_queues;
+  std::vector<std::thread>                  m_workers;
+  uint32_t                                  m_nextQueue{0};  // round robin for tasks submitted from outside the pool
+  size_t                                    m_queued{0};     // tasks in all queues not yet claimed by a worker
+  bool                                      m_stopping{true};  // until start
+  DeferredOperationStats                    m_stats;
+  std::mutex                                m_mutex;  // all members but the queues, which have their own
+  std::condition_variable                   m_wake;
+};
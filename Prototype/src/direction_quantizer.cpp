@@ -0,0 +1,92 @@
+#include "direction_quantizer.hpp"
+#include <algorithm>
+#include <cmath>
+
+// names of the cube sides in saved sorting grids, indexed by CubeSide
+static const char* cubeSideNames[NUM_CUBE_SIDES] = {"top", "bottom", "left", "right", "front", "back"};
+
+glm::vec3 cubeSideNormal(CubeSide side)
+{
+  static const glm::vec3 normals[NUM_CUBE_SIDES] = {{0, 1, 0}, {0, -1, 0}, {-1, 0, 0}, {1, 0, 0}, {0, 0, 1}, {0, 0, -1}};
+  return normals[side];
+}
+
+// octahedral map of a unit vector to [0,1]^2, the lower hemisphere is folded over the diagonals
+static glm::vec2 octahedralEncode(glm::vec3 n)
+{
+  n /= std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+  glm::vec2 p(n.x, n.y);
+  if(n.z < 0.0f)
+  {
+    p = glm::vec2((1.0f - std::abs(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f), (1.0f - std::abs(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f));
+  }
+  return p * 0.5f + 0.5f;
+}
+
+static glm::vec3 octahedralDecode(glm::vec2 uv)
+{
+  glm::vec2 p = uv * 2.0f - 1.0f;
+  glm::vec3 n(p.x, p.y, 1.0f - std::abs(p.x) - std::abs(p.y));
+  if(n.z < 0.0f)
+  {
+    n.x = (1.0f - std::abs(p.y)) * (p.x >= 0.0f ? 1.0f : -1.0f);
+    n.y = (1.0f - std::abs(p.x)) * (p.y >= 0.0f ? 1.0f : -1.0f);
+  }
+  return glm::normalize(n);
+}
+
+uint32_t DirectionQuantizer::bin(glm::vec3 direction) const
+{
+  if(mode == eCubeBinning)
+  {
+    // the dominant axis, ties resolve in the order up/down, left/right, front/back
+    glm::vec3 a = glm::abs(direction);
+    if(a.y >= a.x && a.y >= a.z)
+      return direction.y > 0.0f ? CubeUp : CubeDown;
+    if(a.x >= a.z)
+      return direction.x > 0.0f ? CubeRight : CubeLeft;
+    return direction.z > 0.0f ? CubeFront : CubeBack;
+  }
+
+  glm::vec2 uv = octahedralEncode(direction);
+  uint32_t  u  = std::min(uint32_t(uv.x * resolution), resolution - 1);
+  uint32_t  v  = std::min(uint32_t(uv.y * resolution), resolution - 1);
+  return v * resolution + u;
+}
+
+glm::vec3 DirectionQuantizer::binCenter(uint32_t bin) const
+{
+  if(mode == eCubeBinning)
+    return cubeSideNormal(CubeSide(bin));
+
+  glm::vec2 uv((float(bin % resolution) + 0.5f) / resolution, (float(bin / resolution) + 0.5f) / resolution);
+  return octahedralDecode(uv);
+}
+
+std::string DirectionQuantizer::binName(uint32_t bin) const
+{
+  if(mode == eCubeBinning)
+    return cubeSideNames[bin];
+  return "oct_" + std::to_string(bin % resolution) + "_" + std::to_string(bin / resolution);
+}
+
+int DirectionQuantizer::binFromName(const std::string& name) const
+{
+  for(uint32_t bin = 0; bin < numBins(); bin++)
+  {
+    if(binName(bin) == name)
+      return int(bin);
+  }
+  return -1;
+}
+
+bool DirectionQuantizer::setMode(const std::string& name)
+{
+  if(name == "cube")
+    mode = eCubeBinning;
+  else if(name == "octahedral")
+    mode = eOctahedralBinning;
+  else
+    return false;
+  return true;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <glm/glm.hpp>
+
+// Sides of the display cube of a grid cell, also the bin order of eCubeBinning
+enum CubeSide
+{
+  CubeUp,
+  CubeDown,
+  CubeLeft,
+  CubeRight,
+  CubeFront,
+  CubeBack
+};
+
+const int NUM_CUBE_SIDES = 6;
+
+glm::vec3 cubeSideNormal(CubeSide side);
+
+enum DirectionBinning
+{
+  eCubeBinning,        // the six axis directions, the original cube sides
+  eOctahedralBinning,  // resolution x resolution bins of an octahedral map of the sphere
+};
+
+// Maps a view direction to one of numBins() bins. Every grid cell keeps one timing
+// record set per bin, so the bin count trades training time against view precision.
+struct DirectionQuantizer
+{
+  DirectionBinning mode{eCubeBinning};
+  uint32_t         resolution{4};  // bins per axis of the octahedral map
+
+  uint32_t    numBins() const { return mode == eCubeBinning ? NUM_CUBE_SIDES : resolution * resolution; }
+  uint32_t    bin(glm::vec3 direction) const;
+  glm::vec3   binCenter(uint32_t bin) const;  // normalized direction in the middle of a bin
+  std::string binName(uint32_t bin) const;    // key of the bin in saved sorting grids
+  int         binFromName(const std::string& name) const;  // -1 if the name is not a bin of this quantizer
+
+  const char* modeName() const { return mode == eCubeBinning ? "cube" : "octahedral"; }
+  bool        setMode(const std::string& name);
+};
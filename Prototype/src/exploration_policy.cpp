@@ -0,0 +1,279 @@
+#include "exploration_policy.hpp"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+
+using json = nlohmann::json;
+
+ExplorationState collectExplorationState(const Grid& grid, const CubeSideStorage& side)
+{
+  ExplorationState state;
+  state.arms.reserve(side.numElements);
+  uint32_t first = grid.firstSlot(side);
+  for(uint32_t slot = first; slot < first + side.numElements; slot++)
+  {
+    ArmStatistics arm;
+    arm.hashCode    = grid.timings.hashCode[slot];
+    arm.cycles      = grid.timings.totalCycles[slot];
+    arm.meanFps     = grid.timings.fps[slot];
+    arm.varianceFps = grid.timings.fpsVariance(slot);
+    state.arms.push_back(arm);
+    state.totalCycles += arm.cycles;
+  }
+  return state;
+}
+
+static int fastestArm(const ExplorationState& state)
+{
+  int best = -1;
+  for(int i = 0; i < int(state.arms.size()); i++)
+  {
+    if(best < 0 || state.arms[i].meanFps > state.arms[best].meanFps)
+      best = i;
+  }
+  return best;
+}
+
+//--------------------------------------------------------------------------------------------------
+//
+int EpsilonGreedyPolicy::choose(const ExplorationState& state)
+{
+  float r = std::uniform_real_distribution<float>(0.0f, 1.0f)(rng);
+  if(state.arms.empty() || (r < state.epsilon && state.untestedAvailable))
+    return -1;
+  return fastestArm(state);
+}
+
+//--------------------------------------------------------------------------------------------------
+//
+int UCB1Policy::choose(const ExplorationState& state)
+{
+  if(state.arms.empty() || (state.untestedAvailable && state.arms.size() < maxArms))
+    return -1;
+
+  float maxMean = state.arms[fastestArm(state)].meanFps;
+  float minMean = maxMean;
+  for(const ArmStatistics& arm : state.arms)
+    minMean = std::min(minMean, arm.meanFps);
+  if(maxMean - minMean <= 0.0f)
+    return fastestArm(state);
+
+  // rewards are scaled to [0,1] between the slowest and the fastest arm, as UCB1 assumes bounded rewards
+  float logCycles = std::log(float(std::max(state.totalCycles, 1)));
+  int   best      = 0;
+  float bestScore = -1.0f;
+  for(int i = 0; i < int(state.arms.size()); i++)
+  {
+    const ArmStatistics& arm   = state.arms[i];
+    float                bonus = explorationWeight * std::sqrt(2.0f * logCycles / float(std::max(arm.cycles, 1)));
+    float                score = (arm.meanFps - minMean) / (maxMean - minMean) + bonus;
+    if(score > bestScore)
+    {
+      bestScore = score;
+      best      = i;
+    }
+  }
+  return best;
+}
+
+//--------------------------------------------------------------------------------------------------
+//
+int ThompsonSamplingPolicy::choose(const ExplorationState& state)
+{
+  if(state.arms.size() < 2)
+    return state.untestedAvailable || state.arms.empty() ? -1 : 0;
+
+  // arms with a single cycle have no variance yet, they use the pooled variance of the others
+  double pooledVariance = 0.0;
+  int    pooledArms     = 0;
+  double meanOfMeans    = 0.0;
+  for(const ArmStatistics& arm : state.arms)
+  {
+    meanOfMeans += arm.meanFps;
+    if(arm.cycles > 1)
+    {
+      pooledVariance += arm.varianceFps;
+      pooledArms++;
+    }
+  }
+  meanOfMeans /= double(state.arms.size());
+  if(pooledArms > 0)
+    pooledVariance /= double(pooledArms);
+  else
+    pooledVariance = (0.05 * meanOfMeans) * (0.05 * meanOfMeans);
+
+  int    best       = -1;
+  double bestSample = 0.0;
+  for(int i = 0; i < int(state.arms.size()); i++)
+  {
+    const ArmStatistics& arm      = state.arms[i];
+    double               variance = arm.cycles > 1 ? arm.varianceFps : pooledVariance;
+    double               sample   = std::normal_distribution<double>(arm.meanFps, std::sqrt(variance / arm.cycles) + 1e-6)(rng);
+    if(best < 0 || sample > bestSample)
+    {
+      bestSample = sample;
+      best       = i;
+    }
+  }
+
+  if(state.untestedAvailable)
+  {
+    // prior of an unmeasured configuration: the distribution of the measured means
+    double spread = 0.0;
+    for(const ArmStatistics& arm : state.arms)
+      spread += (arm.meanFps - meanOfMeans) * (arm.meanFps - meanOfMeans);
+    spread = spread / double(state.arms.size() - 1) + pooledVariance;
+
+    double sample = std::normal_distribution<double>(meanOfMeans, std::sqrt(spread) + 1e-6)(rng);
+    if(sample > bestSample)
+      return -1;
+  }
+  return best;
+}
+
+std::unique_ptr<ExplorationPolicy> createExplorationPolicy(ExplorationPolicyType type)
+{
+  switch(type)
+  {
+    case eUCB1:
+      return std::make_unique<UCB1Policy>();
+    case eThompsonSampling:
+      return std::make_unique<ThompsonSamplingPolicy>();
+    default:
+      return std::make_unique<EpsilonGreedyPolicy>();
+  }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Offline replay
+//
+static void replaySide(ExplorationPolicy&        policy,
+                       const std::vector<float>& means,
+                       const ReplaySettings&     settings,
+                       std::mt19937&             rng,
+                       ReplayResult&             result)
+{
+  float bestMean = *std::max_element(means.begin(), means.end());
+
+  ExplorationState state;
+  state.epsilon = settings.epsilon;
+  std::vector<int>    armConfig;  // recorded configuration behind each arm
+  std::vector<double> armM2;
+  std::vector<int>    untested(means.size());
+  for(int i = 0; i < int(means.size()); i++)
+    untested[i] = i;
+
+  for(int cycle = 0; cycle < settings.cyclesPerSide; cycle++)
+  {
+    state.untestedAvailable = !untested.empty();
+    int arm = policy.choose(state);
+    if(arm < 0)
+    {
+      // like the async pipeline buffer, a new configuration is a random unmeasured one
+      int pick = std::uniform_int_distribution<int>(0, int(untested.size()) - 1)(rng);
+      armConfig.push_back(untested[pick]);
+      untested.erase(untested.begin() + pick);
+      state.arms.push_back({0, 0, 0.0f, 0.0f});
+      armM2.push_back(0.0);
+      arm = int(state.arms.size()) - 1;
+    }
+
+    // normal_distribution needs a positive deviation, a mean of 0 fps or no noise is replayed as is
+    float mean      = means[armConfig[arm]];
+    float deviation = settings.relativeNoise * mean;
+    float fps       = deviation > 0.0f ? std::max(0.0f, std::normal_distribution<float>(mean, deviation)(rng)) : mean;
+
+    ArmStatistics& stats = state.arms[arm];
+    float          delta = fps - stats.meanFps;
+    stats.cycles++;
+    stats.meanFps += delta / float(stats.cycles);
+    armM2[arm] += delta * (fps - stats.meanFps);
+    stats.varianceFps = stats.cycles > 1 ? float(armM2[arm] / (stats.cycles - 1)) : 0.0f;
+    state.totalCycles++;
+
+    result.meanRegret += bestMean - mean;
+    result.bestPickedRate += mean == bestMean ? 1.0 : 0.0;
+  }
+}
+
+std::vector<ReplayResult> replayRecordedTimings(const json& recorded, const ReplaySettings& settings)
+{
+  // collect the recorded mean fps of every cube side that measured more than one configuration
+  std::vector<std::vector<float>> sides;
+  for(auto& cell : recorded.items())
+  {
+    if(!cell.value().is_object())
+      continue;
+    for(auto& side : cell.value().items())
+    {
+      if(!side.value().is_object() || side.value().size() < 2)
+        continue;
+      std::vector<float> means;
+      for(auto& timing : side.value().items())
+      {
+        if(timing.value().is_number())
+          means.push_back(timing.value().get<float>());
+      }
+      if(means.size() > 1)
+        sides.push_back(means);
+    }
+  }
+
+  std::vector<ReplayResult> results;
+  for(int type = 0; type < eNumExplorationPolicies; type++)
+  {
+    std::unique_ptr<ExplorationPolicy> policy = createExplorationPolicy(ExplorationPolicyType(type));
+
+    ReplayResult result;
+    result.policy = policy->name();
+    result.sides  = int(sides.size());
+    for(int run = 0; run < settings.runs; run++)
+    {
+      // every policy sees the same noise sequence of a run
+      std::mt19937 rng(settings.seed + run);
+      policy->seed(settings.seed + run);
+      for(const std::vector<float>& means : sides)
+      {
+        replaySide(*policy, means, settings, rng, result);
+      }
+    }
+    double numSideRuns = std::max(1.0, double(sides.size()) * settings.runs);
+    result.meanRegret /= numSideRuns;
+    result.bestPickedRate /= numSideRuns * settings.cyclesPerSide;
+    results.push_back(result);
+  }
+  return results;
+}
+
+int runExplorationReplay(const std::string& filename, const ReplaySettings& settings)
+{
+  std::ifstream file(filename);
+  if(!file.is_open())
+  {
+    printf("could not open recorded timings %s\n", filename.c_str());
+    return 1;
+  }
+  json recorded = json::parse(file, nullptr, false);
+  if(recorded.is_discarded())
+  {
+    printf("%s is not a valid sorting grid file\n", filename.c_str());
+    return 1;
+  }
+
+  std::vector<ReplayResult> results = replayRecordedTimings(recorded, settings);
+  if(results.empty() || results[0].sides == 0)
+  {
+    printf("%s contains no cube side with more than one measured configuration\n", filename.c_str());
+    return 1;
+  }
+
+  printf("replayed %d cube sides, %d runs of %d cycles, noise %.1f%%\n", results[0].sides, settings.runs,
+         settings.cyclesPerSide, settings.relativeNoise * 100.0f);
+  printf("%-20s %16s %12s\n", "policy", "regret [fps*cyc]", "best picked");
+  for(const ReplayResult& result : results)
+  {
+    printf("%-20s %16.1f %11.1f%%\n", result.policy.c_str(), result.meanRegret, result.bestPickedRate * 100.0);
+  }
+  return 0;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "sorting_grid.hpp"
+
+// Timing statistics of one configuration measured on a cube side
+struct ArmStatistics
+{
+  int   hashCode;
+  int   cycles;
+  float meanFps;
+  float varianceFps;  // sample variance of the per cycle fps, 0 below two cycles
+};
+
+// Everything a policy may look at to pick the configuration for the next cycle of a cube side
+struct ExplorationState
+{
+  std::vector<ArmStatistics> arms;  // configurations already measured on this side
+  int   totalCycles{0};
+  float epsilon{0.2f};              // exploration rate, only used by the epsilon greedy policy
+  bool  untestedAvailable{false};   // an unmeasured configuration is ready to be run
+};
+
+ExplorationState collectExplorationState(const Grid& grid, const CubeSideStorage& side);
+
+enum ExplorationPolicyType
+{
+  eEpsilonGreedy,
+  eUCB1,
+  eThompsonSampling,
+  eNumExplorationPolicies
+};
+
+// Decides which configuration is timed next on a cube side.
+// choose() returns an index into state.arms, or -1 to run an unmeasured configuration.
+// -1 is only returned when state.untestedAvailable is set or no arm exists yet.
+class ExplorationPolicy
+{
+public:
+  virtual ~ExplorationPolicy() = default;
+  virtual const char* name() const                          = 0;
+  virtual int         choose(const ExplorationState& state) = 0;
+
+  void seed(uint32_t value) { rng.seed(value); }
+
+protected:
+  std::mt19937 rng{std::random_device{}()};
+};
+
+// The original behaviour: with probability epsilon a new configuration, otherwise the fastest one
+class EpsilonGreedyPolicy : public ExplorationPolicy
+{
+public:
+  const char* name() const override { return "Epsilon Greedy"; }
+  int         choose(const ExplorationState& state) override;
+};
+
+// UCB1 on the mean fps normalized between the slowest and the fastest arm. Every arm is tried once until
+// `maxArms` configurations have been measured, after that only the measured ones compete.
+// The textbook weight of 1 keeps exploring far too long on replayed grids, hence the lower default.
+class UCB1Policy : public ExplorationPolicy
+{
+public:
+  UCB1Policy(uint32_t maxArms = 16, float explorationWeight = 0.2f)
+      : maxArms(maxArms)
+      , explorationWeight(explorationWeight)
+  {
+  }
+  const char* name() const override { return "UCB1"; }
+  int         choose(const ExplorationState& state) override;
+
+  uint32_t maxArms;
+  float    explorationWeight;
+};
+
+// Thompson sampling with a normal posterior of the mean fps of each arm. An unmeasured
+// configuration is drawn from the spread of the measured arm means, so trying a new one
+// becomes unlikely once a side has found a configuration well above the rest.
+class ThompsonSamplingPolicy : public ExplorationPolicy
+{
+public:
+  const char* name() const override { return "Thompson Sampling"; }
+  int         choose(const ExplorationState& state) override;
+};
+
+std::unique_ptr<ExplorationPolicy> createExplorationPolicy(ExplorationPolicyType type);
+
+
+// Offline replay of recorded timings to compare the regret of the policies without a GPU.
+// Every configuration stored in a saved sorting grid becomes an arm whose per cycle fps is
+// drawn from a normal distribution around the recorded mean.
+struct ReplaySettings
+{
+  int      cyclesPerSide{100};
+  int      runs{20};
+  float    relativeNoise{0.05f};  // standard deviation of a cycle relative to its mean fps
+  float    epsilon{0.2f};
+  uint32_t seed{1};
+};
+
+struct ReplayResult
+{
+  std::string policy;
+  int         sides{0};
+  double      meanRegret{0.0};      // cumulative regret in fps*cycles per side
+  double      bestPickedRate{0.0};  // fraction of cycles that ran the best configuration
+};
+
+std::vector<ReplayResult> replayRecordedTimings(const nlohmann::json& recorded, const ReplaySettings& settings);
+int runExplorationReplay(const std::string& filename, const ReplaySettings& settings);
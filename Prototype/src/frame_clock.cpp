@@ -0,0 +1,95 @@
+#include "frame_clock.hpp"
+#include <chrono>
+#include <cstdio>
+
+double CpuFrameClock::steadyClockMs()
+{
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void CpuFrameClock::beginFrame(VkCommandBuffer /*cmdBuf*/, uint32_t cycle)
+{
+  // the previous frame ends where this one begins
+  double now = m_now();
+  if(m_lastBegin >= 0.0)
+    m_completed.push_back({m_lastCycle, now - m_lastBegin});
+  m_lastBegin = now;
+  m_lastCycle = cycle;
+}
+
+void CpuFrameClock::collect(std::vector<FrameSample>& samples)
+{
+  samples.insert(samples.end(), m_completed.begin(), m_completed.end());
+  m_completed.clear();
+}
+
+void CycleMeasurement::add(const FrameSample& sample)
+{
+  if(sample.cycle != cycle)
+  {
+    discarded++;
+    return;
+  }
+  if(skipped < warmupFrames)
+  {
+    skipped++;
+    return;
+  }
+  frames++;
+  timeMs += sample.timeMs;
+}
+
+void CycleMeasurement::next()
+{
+  cycle++;
+  frames  = 0;
+  timeMs  = 0.0;
+  skipped = 0;
+}
+
+int checkFrameClock()
+{
+  int  failures = 0;
+  auto expect   = [&](bool condition, const char* what) {
+    if(!condition)
+    {
+      printf("frame clock: %s\n", what);
+      failures++;
+    }
+  };
+
+  double                   now = 0.0;
+  CpuFrameClock            clock([&] { return now; });
+  CycleMeasurement         measurement;
+  std::vector<FrameSample> samples;
+  auto                     render = [&](int frames, double frameTime) {
+    for(int frame = 0; frame < frames; frame++)
+    {
+      clock.beginFrame(VK_NULL_HANDLE, measurement.cycle);
+      now += frameTime;
+    }
+    clock.collect(samples);
+    for(const FrameSample& sample : samples)
+      measurement.add(sample);
+    samples.clear();
+  };
+
+  // 10 frames of 2 ms: the last one is still open, the first is the warmup frame
+  render(10, 2.0);
+  expect(measurement.frames == 8 && measurement.timeMs == 16.0, "a cycle does not sum its frames after the warmup");
+
+  // the open frame of the first cycle completes in the second and is discarded
+  measurement.next();
+  render(5, 3.0);
+  expect(measurement.discarded == 1, "a late frame of the previous cycle was not discarded");
+  expect(measurement.frames == 3 && measurement.timeMs == 9.0, "the second cycle does not skip its own warmup frame");
+
+  clock.collect(samples);
+  expect(samples.empty(), "collect returned frames twice");
+
+  measurement.warmupFrames = 0;
+  measurement.next();
+  render(3, 1.0);
+  expect(measurement.discarded == 2 && measurement.frames == 2 && measurement.timeMs == 2.0, "a cycle without warmup lost frames");
+  return failures;
+}
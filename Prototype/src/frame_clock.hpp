@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include "vulkan/vulkan_core.h"
+
+// Time of one frame, tagged with the measurement cycle it was rendered in
+struct FrameSample
+{
+  uint32_t cycle;
+  double   timeMs;
+};
+
+// Measures frames of the key inference loop. Frames are tagged when they are recorded, their times
+// arrive later (a few frames for GPU timestamps), so the tag tells which cycle they belong to.
+class FrameClock
+{
+public:
+  virtual ~FrameClock() = default;
+
+  // around the trace dispatch of one frame
+  virtual void beginFrame(VkCommandBuffer cmdBuf, uint32_t cycle) = 0;
+  virtual void endFrame(VkCommandBuffer cmdBuf)                   = 0;
+  // appends the frames that completed since the last call, never waits for the GPU
+  virtual void        collect(std::vector<FrameSample>& samples) = 0;
+  virtual const char* name() const                                = 0;
+};
+
+// Fallback without timestamp queries: the time between the beginnings of two frames. It includes
+// present, tonemapping and the UI, like the ImGui frame time used before.
+class CpuFrameClock : public FrameClock
+{
+public:
+  explicit CpuFrameClock(std::function<double()> now = steadyClockMs)
+      : m_now(std::move(now))
+  {
+  }
+
+  void        beginFrame(VkCommandBuffer cmdBuf, uint32_t cycle) override;
+  void        endFrame(VkCommandBuffer cmdBuf) override {}
+  void        collect(std::vector<FrameSample>& samples) override;
+  const char* name() const override { return "CPU frame clock"; }
+
+  static double steadyClockMs();
+
+private:
+  std::function<double()>  m_now;
+  std::vector<FrameSample> m_completed;
+  double                   m_lastBegin{-1.0};
+  uint32_t                 m_lastCycle{0};
+};
+
+// Frames of the running measurement cycle. Late samples of earlier cycles are discarded,
+// as are the first `warmupFrames` of every cycle, which follow a pipeline switch or camera jump.
+struct CycleMeasurement
+{
+  uint32_t warmupFrames{1};
+  uint32_t cycle{0};
+  uint32_t frames{0};      // measured frames of `cycle`
+  double   timeMs{0.0};    // summed time of these frames
+  uint32_t skipped{0};     // warmup frames of `cycle` seen so far
+  uint32_t discarded{0};   // samples of earlier cycles, over all cycles
+
+  void add(const FrameSample& sample);
+  void next();  // closes the cycle, frames recorded from now on carry the new `cycle`
+};
+
+// Feeds CpuFrameClock with a scripted clock into CycleMeasurement, CPU only. Returns the number of failed checks
+int checkFrameClock();
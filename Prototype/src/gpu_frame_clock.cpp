@@ -0,0 +1,93 @@
+#include "gpu_frame_clock.hpp"
+#include <cstdio>
+
+bool GpuFrameClock::init(VkDevice device, VkPhysicalDevice physicalDevice, uint32_t queueFamilyIndex, uint32_t ringSize)
+{
+  uint32_t familyCount = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount, nullptr);
+  std::vector<VkQueueFamilyProperties> families(familyCount);
+  vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount, families.data());
+  uint32_t validBits = queueFamilyIndex < familyCount ? families[queueFamilyIndex].timestampValidBits : 0;
+
+  VkPhysicalDeviceVulkan12Features features12{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES};
+  VkPhysicalDeviceFeatures2        features{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2};
+  features.pNext = &features12;
+  vkGetPhysicalDeviceFeatures2(physicalDevice, &features);
+
+  if(validBits == 0 || features12.hostQueryReset == VK_FALSE)
+  {
+    printf("No timestamps or host query reset on queue family %u, cycles are timed on the CPU\n", queueFamilyIndex);
+    return false;
+  }
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+  m_tickMs    = double(properties.limits.timestampPeriod) / 1000000.0;
+  m_validMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+
+  VkQueryPoolCreateInfo queryInfo{VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+  queryInfo.queryType  = VK_QUERY_TYPE_TIMESTAMP;
+  queryInfo.queryCount = 2 * ringSize;
+  if(vkCreateQueryPool(device, &queryInfo, nullptr, &m_queryPool) != VK_SUCCESS)
+    return false;
+  vkResetQueryPool(device, m_queryPool, 0, queryInfo.queryCount);
+
+  m_device = device;
+  m_slots.assign(ringSize, Slot());
+  m_next   = 0;
+  m_oldest = 0;
+  m_open   = -1;
+  return true;
+}
+
+void GpuFrameClock::deinit()
+{
+  if(m_queryPool != VK_NULL_HANDLE)
+    vkDestroyQueryPool(m_device, m_queryPool, nullptr);
+  m_queryPool = VK_NULL_HANDLE;
+  m_slots.clear();
+}
+
+void GpuFrameClock::beginFrame(VkCommandBuffer cmdBuf, uint32_t cycle)
+{
+  Slot& slot = m_slots[m_next];
+  if(slot.pending)
+  {
+    // the GPU is more than the whole ring behind, its queries cannot be reused yet
+    untimedFrames++;
+    m_open = -1;
+    return;
+  }
+  slot   = {cycle, true};
+  m_open = int(m_next);
+  m_next = (m_next + 1) % uint32_t(m_slots.size());
+  // written once all earlier commands completed, so the previous frame is not part of the time
+  vkCmdWriteTimestamp(cmdBuf, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, m_queryPool, 2 * uint32_t(m_open));
+}
+
+void GpuFrameClock::endFrame(VkCommandBuffer cmdBuf)
+{
+  if(m_open < 0)
+    return;
+  vkCmdWriteTimestamp(cmdBuf, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, m_queryPool, 2 * uint32_t(m_open) + 1);
+  m_open = -1;
+}
+
+void GpuFrameClock::collect(std::vector<FrameSample>& samples)
+{
+  // slots complete in submission order, stop at the first one still in flight
+  while(m_slots[m_oldest].pending && int(m_oldest) != m_open)
+  {
+    uint64_t results[4]{};  // begin, availability, end, availability
+    vkGetQueryPoolResults(m_device, m_queryPool, 2 * m_oldest, 2, sizeof(results), results, 2 * sizeof(uint64_t),
+                          VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+    if(results[1] == 0 || results[3] == 0)
+      break;
+
+    uint64_t ticks = (results[2] - results[0]) & m_validMask;
+    samples.push_back({m_slots[m_oldest].cycle, double(ticks) * m_tickMs});
+    vkResetQueryPool(m_device, m_queryPool, 2 * m_oldest, 2);
+    m_slots[m_oldest].pending = false;
+    m_oldest                  = (m_oldest + 1) % uint32_t(m_slots.size());
+  }
+}
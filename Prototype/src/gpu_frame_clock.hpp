@@ -0,0 +1,41 @@
+#pragma once
+
+#include "frame_clock.hpp"
+
+// GPU time of the trace dispatch alone, from a timestamp before and after it. The queries form a
+// ring of `ringSize` frames that is read back in order without waiting: a frame is collected once
+// both of its timestamps are available and its queries are then reset from the host
+// (hostQueryReset, Vulkan 1.2 core, enabled by nvvk::Context when supported).
+// A frame whose ring slot has not been read back yet is not timed.
+class GpuFrameClock : public FrameClock
+{
+public:
+  ~GpuFrameClock() override { deinit(); }
+
+  // false if the queue family has no timestamps or the device no host query reset
+  bool init(VkDevice device, VkPhysicalDevice physicalDevice, uint32_t queueFamilyIndex, uint32_t ringSize = 8);
+  void deinit();
+
+  void        beginFrame(VkCommandBuffer cmdBuf, uint32_t cycle) override;
+  void        endFrame(VkCommandBuffer cmdBuf) override;
+  void        collect(std::vector<FrameSample>& samples) override;
+  const char* name() const override { return "GPU timestamps"; }
+
+  uint32_t untimedFrames{0};  // frames that found their ring slot still in flight
+
+private:
+  struct Slot
+  {
+    uint32_t cycle{0};
+    bool     pending{false};  // written by a submitted frame, not read back yet
+  };
+
+  VkDevice          m_device{VK_NULL_HANDLE};
+  VkQueryPool       m_queryPool{VK_NULL_HANDLE};
+  std::vector<Slot> m_slots;
+  uint32_t          m_next{0};      // slot of the next frame
+  uint32_t          m_oldest{0};    // oldest slot that may be pending
+  int               m_open{-1};     // slot between beginFrame and endFrame, -1 if the frame is not timed
+  double            m_tickMs{0.0};  // timestampPeriod in ms
+  uint64_t          m_validMask{~0ull};
+};
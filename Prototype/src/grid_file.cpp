@@ -0,0 +1,549 @@
+#include "grid_file.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static_assert(sizeof(int) == 4 && sizeof(float) == 4, "the timing pool is stored with 32 bit elements");
+
+// read only mapping of a whole file, data() is null if the file could not be mapped
+class MappedFile
+{
+public:
+  explicit MappedFile(const std::string& filename)
+  {
+#ifdef _WIN32
+    m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    LARGE_INTEGER size{};
+    if(m_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+      return;
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if(m_mapping == nullptr)
+      return;
+    m_data = static_cast<const uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+    m_size = m_data ? size_t(size.QuadPart) : 0;
+#else
+    m_file = open(filename.c_str(), O_RDONLY);
+    struct stat info{};
+    if(m_file < 0 || fstat(m_file, &info) != 0 || info.st_size == 0)
+      return;
+    void* mapped = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, m_file, 0);
+    if(mapped == MAP_FAILED)
+      return;
+    m_data = static_cast<const uint8_t*>(mapped);
+    m_size = size_t(info.st_size);
+#endif
+  }
+
+  ~MappedFile()
+  {
+#ifdef _WIN32
+    if(m_data)
+      UnmapViewOfFile(m_data);
+    if(m_mapping)
+      CloseHandle(m_mapping);
+    if(m_file != INVALID_HANDLE_VALUE)
+      CloseHandle(m_file);
+#else
+    if(m_data)
+      munmap(const_cast<uint8_t*>(m_data), m_size);
+    if(m_file >= 0)
+      close(m_file);
+#endif
+  }
+
+  MappedFile(const MappedFile&)            = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const uint8_t* data() const { return m_data; }
+  size_t         size() const { return m_size; }
+
+private:
+  const uint8_t* m_data{nullptr};
+  size_t         m_size{0};
+#ifdef _WIN32
+  HANDLE m_file{INVALID_HANDLE_VALUE};
+  HANDLE m_mapping{nullptr};
+#else
+  int m_file{-1};
+#endif
+};
+
+static uint64_t alignSection(uint64_t offset)
+{
+  return (offset + 7) & ~uint64_t(7);
+}
+
+// size of the header written by version 1, the fields of later versions are appended
+static const uint32_t GRID_FILE_HEADER_SIZE_V1 = uint32_t(offsetof(GridFileHeader, requireSignificance));
+
+// the timing section holds five (version 1) or nine arrays of numSlots elements, before version 3 followed
+// by the index table of twice that size
+static uint64_t timingSectionSize(uint64_t numSlots, uint32_t version)
+{
+  return numSlots * 4 * (version == 1 ? 5 : 9) + (version < 3 ? numSlots * 2 * sizeof(uint32_t) : 0);
+}
+
+static uint64_t sideRecordSize(uint32_t version)
+{
+  return version < 3 ? sizeof(GridFileSideV2) : sizeof(GridFileSide);
+}
+
+template <typename T>
+static uint8_t* writeArray(uint8_t* dst, const std::vector<T>& values)
+{
+  if(!values.empty())
+    memcpy(dst, values.data(), values.size() * sizeof(T));
+  return dst + values.size() * sizeof(T);
+}
+
+template <typename T>
+static const uint8_t* readArray(const uint8_t* src, std::vector<T>& values, size_t count)
+{
+  values.resize(count);
+  if(count)
+    memcpy(values.data(), src, count * sizeof(T));
+  return src + count * sizeof(T);
+}
+
+bool saveGridBinary(const Grid& grid, const std::string& filename)
+{
+  const TimingPool& pool     = grid.timings;
+  const uint64_t    numSlots = pool.numSlots();
+  if(pool.frameTimeMax.size() != numSlots || numSlots > UINT32_MAX)
+  {
+    printf("Sorting grid not saved, the timing pool of its %zu sides is inconsistent\n", grid.sides.size());
+    return false;
+  }
+
+  GridFileHeader header{};
+  memcpy(header.magic, GRID_FILE_MAGIC, sizeof(header.magic));
+  header.version                = GRID_FILE_VERSION;
+  header.headerSize             = sizeof(GridFileHeader);
+  header.gridDimensions[0]      = grid.gridDimensions.x;
+  header.gridDimensions[1]      = grid.gridDimensions.y;
+  header.gridDimensions[2]      = grid.gridDimensions.z;
+  header.binningMode            = uint32_t(grid.quantizer.mode);
+  header.binningResolution      = grid.quantizer.resolution;
+  header.adaptiveEnabled        = grid.adaptive.enabled ? 1 : 0;
+  header.adaptiveMaxDepth       = grid.adaptive.maxDepth;
+  header.adaptiveMinCycles      = grid.adaptive.minCycles;
+  header.adaptiveSplitVariation = grid.adaptive.splitVariation;
+  header.numCells               = uint32_t(grid.gridSpaces.size());
+  header.numSides               = uint32_t(grid.sides.size());
+  header.sideCapacity           = 0;
+  header.numSlots               = uint32_t(numSlots);
+  header.cellsOffset            = alignSection(sizeof(GridFileHeader));
+  header.sidesOffset            = alignSection(header.cellsOffset + header.numCells * sizeof(GridFileCell));
+  header.timingsOffset          = alignSection(header.sidesOffset + header.numSides * sizeof(GridFileSide));
+  header.fileSize               = header.timingsOffset + timingSectionSize(numSlots, GRID_FILE_VERSION);
+  header.requireSignificance    = grid.statistics.requireSignificance ? 1 : 0;
+  header.confidence             = grid.statistics.confidence;
+
+  // the whole file is assembled in memory and written at once
+  std::vector<uint8_t> buffer(header.fileSize, 0);
+  memcpy(buffer.data(), &header, sizeof(header));
+
+  GridFileCell* cells = reinterpret_cast<GridFileCell*>(buffer.data() + header.cellsOffset);
+  for(size_t index = 0; index < grid.gridSpaces.size(); index++)
+  {
+    const GridSpace& space = grid.gridSpaces[index];
+    GridFileCell&    cell  = cells[index];
+    cell.firstSide         = space.cube.firstSide;
+    cell.numSides          = space.cube.numSides;
+    cell.parent            = space.parent;
+    cell.firstChild        = space.firstChild;
+    cell.depth             = space.depth;
+    cell.merges            = space.merges;
+    for(int axis = 0; axis < 3; axis++)
+    {
+      cell.rootCell[axis] = space.rootCell[axis];
+      cell.localMin[axis] = space.localMin[axis];
+    }
+    cell.localSize = space.localSize;
+  }
+
+  GridFileSide* sides = reinterpret_cast<GridFileSide*>(buffer.data() + header.sidesOffset);
+  for(size_t index = 0; index < grid.sides.size(); index++)
+  {
+    const CubeSideStorage& side = grid.sides[index];
+    sides[index]                = {side.firstSlot, side.capacity, side.numElements, side.bestHash, side.bestpipelineFPS};
+  }
+
+  uint8_t* timings = buffer.data() + header.timingsOffset;
+  timings          = writeArray(timings, pool.hashCode);
+  timings          = writeArray(timings, pool.frames);
+  timings          = writeArray(timings, pool.fps);
+  timings          = writeArray(timings, pool.totalCycles);
+  timings          = writeArray(timings, pool.fpsM2);
+  timings          = writeArray(timings, pool.frameTimeMean);
+  timings          = writeArray(timings, pool.frameTimeM2);
+  timings          = writeArray(timings, pool.frameTimeMin);
+  writeArray(timings, pool.frameTimeMax);
+
+  std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char*>(buffer.data()), std::streamsize(buffer.size()));
+  if(!out)
+  {
+    printf("Could not write sorting grid %s\n", filename.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Checks that every range referenced by the cells and sides lies inside the stored arrays, that every
+// cell has one side per direction bin and that the octree links form a tree: depth grows by one from
+// parent to child, so following them cannot loop. Blocks of sides may overlap, they are copied apart
+// when the sides are packed into a new pool
+static bool validateGridFile(const GridFileHeader& header, const GridFileCell* cells, const GridFileSide* sides)
+{
+  for(int axis = 0; axis < 3; axis++)
+  {
+    if(header.gridDimensions[axis] <= 0 || uint32_t(header.gridDimensions[axis]) > header.numCells)
+      return false;
+  }
+  uint64_t numRootCells = uint64_t(header.gridDimensions[0]) * header.gridDimensions[1] * header.gridDimensions[2];
+  if(numRootCells > header.numCells)
+    return false;
+  if(header.version < 3
+     && (header.sideCapacity == 0 || (header.sideCapacity & (header.sideCapacity - 1)) != 0
+         || uint64_t(header.numSides) * header.sideCapacity != header.numSlots))
+    return false;
+  if(header.binningMode > eOctahedralBinning || header.binningResolution == 0 || header.binningResolution > 0xFFFF)
+    return false;
+
+  DirectionQuantizer quantizer;
+  quantizer.mode       = DirectionBinning(header.binningMode);
+  quantizer.resolution = header.binningResolution;
+  uint32_t numBins     = quantizer.numBins();
+
+  for(uint32_t index = 0; index < header.numCells; index++)
+  {
+    const GridFileCell& cell = cells[index];
+    if(cell.numSides != numBins || uint64_t(cell.firstSide) + cell.numSides > header.numSides)
+      return false;
+
+    bool root = index < numRootCells;
+    if(cell.parent < -1 || cell.parent >= int32_t(header.numCells) || root != (cell.parent == -1))
+      return false;
+    if(root ? cell.depth != 0 : uint64_t(cells[cell.parent].depth) + 1 != cell.depth)
+      return false;
+
+    if(cell.firstChild < -1
+       || (cell.firstChild >= 0 && (uint64_t(cell.firstChild) < numRootCells || uint64_t(cell.firstChild) + 8 > header.numCells)))
+      return false;
+    for(int child = 0; cell.firstChild >= 0 && child < 8; child++)
+    {
+      const GridFileCell& childCell = cells[cell.firstChild + child];
+      if(childCell.parent != int32_t(index) || uint64_t(cell.depth) + 1 != childCell.depth)
+        return false;
+    }
+  }
+  for(uint32_t index = 0; index < header.numSides; index++)
+  {
+    const GridFileSide& side = sides[index];
+    if((side.capacity & (side.capacity - 1)) != 0 || side.numElements > side.capacity
+       || uint64_t(side.firstSlot) + side.capacity > header.numSlots)
+      return false;
+  }
+  return true;
+}
+
+bool loadGridBinary(Grid& grid, const std::string& filename)
+{
+  MappedFile file(filename);
+  if(!file.data() || file.size() < GRID_FILE_HEADER_SIZE_V1)
+  {
+    printf("Could not map sorting grid %s\n", filename.c_str());
+    return false;
+  }
+
+  // fields a version 1 header does not have keep their defaults
+  GridFileHeader header{};
+  header.requireSignificance = 1;
+  header.confidence          = TimingStatisticsSettings().confidence;
+  memcpy(&header, file.data(), GRID_FILE_HEADER_SIZE_V1);
+  uint32_t expectedHeaderSize = header.version == 1 ? GRID_FILE_HEADER_SIZE_V1 : uint32_t(sizeof(GridFileHeader));
+  if(memcmp(header.magic, GRID_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version < 1 || header.version > GRID_FILE_VERSION
+     || header.headerSize != expectedHeaderSize || file.size() < expectedHeaderSize)
+  {
+    printf("%s is not a sorting grid file of version 1 to %u\n", filename.c_str(), GRID_FILE_VERSION);
+    return false;
+  }
+  memcpy(&header, file.data(), expectedHeaderSize);
+  if(header.fileSize != file.size() || header.cellsOffset + uint64_t(header.numCells) * sizeof(GridFileCell) > header.sidesOffset
+     || header.sidesOffset + uint64_t(header.numSides) * sideRecordSize(header.version) > header.timingsOffset
+     || header.timingsOffset + timingSectionSize(header.numSlots, header.version) > header.fileSize)
+  {
+    printf("Sorting grid %s is truncated or corrupt\n", filename.c_str());
+    return false;
+  }
+
+  // sides of versions 1 and 2 own the block at sideIndex * sideCapacity
+  const GridFileCell*       cells = reinterpret_cast<const GridFileCell*>(file.data() + header.cellsOffset);
+  std::vector<GridFileSide> sides(header.numSides);
+  if(header.version < 3)
+  {
+    const GridFileSideV2* stored = reinterpret_cast<const GridFileSideV2*>(file.data() + header.sidesOffset);
+    for(uint32_t index = 0; index < header.numSides; index++)
+    {
+      uint32_t sideIndex = std::min(stored[index].sideIndex, header.numSides);  // past the pool, rejected below
+      sides[index] = {sideIndex * header.sideCapacity, header.sideCapacity, stored[index].numElements, stored[index].bestHash,
+                      stored[index].bestFps};
+    }
+  }
+  else if(header.numSides > 0)
+  {
+    memcpy(sides.data(), file.data() + header.sidesOffset, size_t(header.numSides) * sizeof(GridFileSide));
+  }
+  if(!validateGridFile(header, cells, sides.data()))
+  {
+    printf("Sorting grid %s is inconsistent\n", filename.c_str());
+    return false;
+  }
+
+  Grid loaded;
+  loaded.gridDimensions                 = glm::ivec3(header.gridDimensions[0], header.gridDimensions[1], header.gridDimensions[2]);
+  loaded.quantizer.mode                 = DirectionBinning(header.binningMode);
+  loaded.quantizer.resolution           = header.binningResolution;
+  loaded.adaptive.enabled               = header.adaptiveEnabled != 0;
+  loaded.adaptive.maxDepth              = header.adaptiveMaxDepth;
+  loaded.adaptive.minCycles             = header.adaptiveMinCycles;
+  loaded.adaptive.splitVariation        = header.adaptiveSplitVariation;
+  loaded.statistics.requireSignificance = header.requireSignificance != 0;
+  loaded.statistics.confidence          = header.confidence;
+
+  loaded.gridSpaces.resize(header.numCells);
+  for(uint32_t index = 0; index < header.numCells; index++)
+  {
+    const GridFileCell& cell  = cells[index];
+    GridSpace&          space = loaded.gridSpaces[index];
+    space.cube                = {cell.firstSide, cell.numSides};
+    space.parent              = cell.parent;
+    space.firstChild          = cell.firstChild;
+    space.depth               = cell.depth;
+    space.merges              = cell.merges;
+    space.rootCell            = glm::ivec3(cell.rootCell[0], cell.rootCell[1], cell.rootCell[2]);
+    space.localMin            = glm::vec3(cell.localMin[0], cell.localMin[1], cell.localMin[2]);
+    space.localSize           = cell.localSize;
+  }
+
+  loaded.sides.resize(header.numSides);
+  for(uint32_t index = 0; index < header.numSides; index++)
+  {
+    CubeSideStorage& side = loaded.sides[index];
+    side.firstSlot        = sides[index].firstSlot;
+    side.capacity         = sides[index].capacity;
+    side.numElements      = sides[index].numElements;
+    side.bestHash         = sides[index].bestHash;
+    side.bestpipelineFPS  = sides[index].bestFps;
+  }
+
+  TimingPool&    pool     = loaded.timings;
+  const uint8_t* timings  = file.data() + header.timingsOffset;
+  timings                 = readArray(timings, pool.hashCode, header.numSlots);
+  timings                 = readArray(timings, pool.frames, header.numSlots);
+  timings                 = readArray(timings, pool.fps, header.numSlots);
+  timings                 = readArray(timings, pool.totalCycles, header.numSlots);
+  timings                 = readArray(timings, pool.fpsM2, header.numSlots);
+  if(header.version >= 2)
+  {
+    timings = readArray(timings, pool.frameTimeMean, header.numSlots);
+    timings = readArray(timings, pool.frameTimeM2, header.numSlots);
+    timings = readArray(timings, pool.frameTimeMin, header.numSlots);
+    readArray(timings, pool.frameTimeMax, header.numSlots);
+  }
+  else
+  {
+    // version 1 only has the fps, the frame time of its mean stands in without spread
+    pool.frameTimeMean.resize(header.numSlots);
+    pool.frameTimeM2.assign(header.numSlots, 0.0f);
+    for(uint32_t slot = 0; slot < header.numSlots; slot++)
+      pool.frameTimeMean[slot] = pool.fps[slot] > 0.0f ? 1000.0f / pool.fps[slot] : 0.0f;
+    pool.frameTimeMin = pool.frameTimeMean;
+    pool.frameTimeMax = pool.frameTimeMean;
+  }
+  // the stored index table is not trusted, an entry pointing past its side or a table without an
+  // empty entry would make findTiming read out of bounds or probe forever
+  loaded.repackTimings();
+  loaded.collectFreeChildBlocks();
+  grid = std::move(loaded);
+  return true;
+}
+
+static std::string rootCellKey(int x, int y, int z)
+{
+  return "(" + std::to_string(x) + "," + std::to_string(y) + "," + std::to_string(z) + ")";
+}
+
+static void writeGridJsonCell(const Grid& grid, nlohmann::json& js, const std::string& key, uint32_t cell, bool onlyBest)
+{
+  const GridSpace& space  = grid.gridSpaces[cell];
+  nlohmann::json&  target = onlyBest ? js["Observations"][key] : js[key];
+
+  for(uint32_t bin = 0; bin < grid.quantizer.numBins(); bin++)
+  {
+    const CubeSideStorage& side    = grid.sides[space.cube.firstSide + bin];
+    std::string            binName = grid.quantizer.binName(bin);
+    if(side.numElements == 0)
+    {
+      target[binName] = 1;
+      continue;
+    }
+    if(onlyBest)
+    {
+      target[binName] = {side.bestHash, side.bestpipelineFPS};
+      continue;
+    }
+    for(uint32_t element = 0; element < side.numElements; element++)
+    {
+      uint32_t     slot   = grid.firstSlot(side) + element;
+      TimingObject timing = grid.getTiming(side, element);
+      target[binName][std::to_string(timing.hashCode)] = timing.fps;
+      // kept beside the cells, the loader only reads the fps above
+      js["Frame Time Statistics"][key][binName][std::to_string(timing.hashCode)] = {
+          {"mean", timing.frameTimeMean},
+          {"stddev", std::sqrt(grid.timings.frameTimeVariance(slot))},
+          {"min", timing.frameTimeMin},
+          {"max", timing.frameTimeMax},
+          {"cycles", timing.totalCycles},
+          {"confidenceInterval", grid.frameTimeConfidenceInterval(slot)}};
+    }
+    // with statistics.requireSignificance the best is not always the highest fps
+    js["Best Configurations"][key][binName] = side.bestHash;
+  }
+
+  if(space.firstChild >= 0)
+  {
+    for(uint32_t octant = 0; octant < 8; octant++)
+      writeGridJsonCell(grid, js, key + "/" + std::to_string(octant), uint32_t(space.firstChild) + octant, onlyBest);
+  }
+}
+
+void writeGridJson(const Grid& grid, nlohmann::json& js, bool onlyBest)
+{
+  for(int x = 0; x < grid.gridDimensions.x; x++)
+  {
+    for(int y = 0; y < grid.gridDimensions.y; y++)
+    {
+      for(int z = 0; z < grid.gridDimensions.z; z++)
+        writeGridJsonCell(grid, js, rootCellKey(x, y, z), uint32_t(grid.cellIndex(glm::ivec3(x, y, z))), onlyBest);
+    }
+  }
+}
+
+void readGridJson(Grid& grid, const nlohmann::json& js, float timePerCycle)
+{
+  // a single restored cycle never passes the significance test, the highest fps wins instead
+  bool requireSignificance            = grid.statistics.requireSignificance;
+  grid.statistics.requireSignificance = false;
+
+  // octree children are not restored, the binary format keeps the full tree
+  for(int x = 0; x < grid.gridDimensions.x; x++)
+  {
+    for(int y = 0; y < grid.gridDimensions.y; y++)
+    {
+      for(int z = 0; z < grid.gridDimensions.z; z++)
+      {
+        std::string key = rootCellKey(x, y, z);
+        if(!js.contains(key))
+          continue;
+        GridSpace& space = grid.at(glm::ivec3(x, y, z));
+        for(auto& recorded : js[key].items())
+        {
+          int bin = grid.quantizer.binFromName(recorded.key());
+          // bins without any timing are stored as 1
+          if(bin < 0 || !recorded.value().is_object())
+            continue;
+          CubeSideStorage& side = grid.side(space, uint32_t(bin));
+          for(auto& timing : recorded.value().items())
+          {
+            float fps = timing.value().get<float>();
+            grid.recordCycle(side, std::stoi(timing.key()), int(std::lround(fps * timePerCycle / 1000.0f)), timePerCycle);
+          }
+
+          const nlohmann::json* best = nullptr;
+          if(js.contains("Best Configurations") && js["Best Configurations"].contains(key)
+             && js["Best Configurations"][key].contains(recorded.key()))
+            best = &js["Best Configurations"][key][recorded.key()];
+          int slot = best != nullptr ? grid.findTiming(side, best->get<int>()) : -1;
+          if(slot >= 0)
+          {
+            side.bestHash        = grid.timings.hashCode[slot];
+            side.bestpipelineFPS = grid.timings.fps[slot];
+          }
+        }
+      }
+    }
+  }
+  grid.statistics.requireSignificance = requireSignificance;
+}
+
+int checkGridJson()
+{
+  int  failures = 0;
+  auto expect   = [&](bool condition, const char* what) {
+    if(!condition)
+    {
+      printf("grid json: %s\n", what);
+      failures++;
+    }
+  };
+
+  // configuration 100 is listed first in every bin but measured slowest, 300 is the best. In the second
+  // cell 200 has the higher mean from a single lucky cycle, so 300 stays the best under the significance test
+  const float timePerCycle = 200.0f;
+  Grid        saved;
+  saved.build(glm::ivec3(2, 1, 1), DirectionQuantizer());
+  for(uint32_t bin = 0; bin < saved.quantizer.numBins(); bin++)
+  {
+    CubeSideStorage& first = saved.side(saved.gridSpaces[0], bin);
+    for(int cycle = 0; cycle < 4; cycle++)
+    {
+      saved.recordCycle(first, 100, 10 + cycle % 2, timePerCycle);
+      saved.recordCycle(first, 200, 14 + cycle % 2, timePerCycle);
+      saved.recordCycle(first, 300, 20 + cycle % 2 + int(bin), timePerCycle);
+    }
+    CubeSideStorage& second = saved.side(saved.gridSpaces[1], bin);
+    for(int cycle = 0; cycle < 4; cycle++)
+      saved.recordCycle(second, 300, 20 + cycle % 2, timePerCycle);
+    saved.recordCycle(second, 200, 40, timePerCycle);
+  }
+  expect(saved.side(saved.gridSpaces[0], 0).bestHash == 300 && saved.side(saved.gridSpaces[1], 0).bestHash == 300,
+         "the saved grid does not have the expected best configurations");
+
+  nlohmann::json js;
+  writeGridJson(saved, js, false);
+  nlohmann::json parsed = nlohmann::json::parse(js.dump());
+
+  Grid loaded;
+  loaded.build(saved.gridDimensions, saved.quantizer);
+  readGridJson(loaded, parsed, timePerCycle);
+  bool sameBest = loaded.statistics.requireSignificance == saved.statistics.requireSignificance;
+  for(size_t side = 0; side < saved.sides.size(); side++)
+    sameBest &= loaded.sides[side].bestHash == saved.sides[side].bestHash && loaded.sides[side].numElements == saved.sides[side].numElements;
+  expect(sameBest, "a loaded grid does not report the best configurations that were saved");
+
+  // dumps written before the best configurations were stored fall back to the highest fps
+  parsed.erase("Best Configurations");
+  Grid legacy;
+  legacy.build(saved.gridDimensions, saved.quantizer);
+  readGridJson(legacy, parsed, timePerCycle);
+  expect(legacy.side(legacy.gridSpaces[0], 0).bestHash == 300 && legacy.side(legacy.gridSpaces[1], 0).bestHash == 200,
+         "a dump without best configurations does not restore the highest fps as the best");
+  return failures;
+}
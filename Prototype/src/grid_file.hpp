@@ -0,0 +1,92 @@
+#pragma once
+
+#include <string>
+#include "sorting_grid.hpp"
+
+// Binary sorting grid files (.sgrid)
+//
+// The file is a header followed by sections that have the layout of the in-memory arrays of a Grid:
+// the cells, the view direction bins and the SoA timing pool including its hash index, so restoring
+// is a map of the file plus one copy per array. The hash index is rebuilt from the hash codes while the
+// sides are packed into a new pool, the index tables stored by versions 1 and 2 are not trusted, a corrupt
+// one could send lookups out of bounds. The JSON export stays available as a debug dump.
+// All values are little endian, sections start at 8 byte aligned offsets.
+
+const char     GRID_FILE_MAGIC[4]    = {'S', 'G', 'R', 'D'};
+const uint32_t GRID_FILE_VERSION     = 3;  // 2: frame time statistics, 3: blocks sized per side. Versions 1 and 2 are still read
+const char     GRID_FILE_EXTENSION[] = ".sgrid";
+
+struct GridFileHeader
+{
+  char     magic[4];
+  uint32_t version;
+  uint32_t headerSize;  // sizeof(GridFileHeader) of the writer
+  int32_t  gridDimensions[3];
+  uint32_t binningMode;
+  uint32_t binningResolution;
+  uint32_t adaptiveEnabled;
+  uint32_t adaptiveMaxDepth;
+  int32_t  adaptiveMinCycles;
+  float    adaptiveSplitVariation;
+  uint32_t numCells;
+  uint32_t numSides;
+  uint32_t sideCapacity;   // versions 1 and 2: slots of every side, side i owns the block at i * sideCapacity
+  uint32_t numSlots;       // slots of the timing pool, including released blocks
+  uint64_t cellsOffset;    // GridFileCell[numCells]
+  uint64_t sidesOffset;    // GridFileSide[numSides], versions 1 and 2: GridFileSideV2[numSides]
+  uint64_t timingsOffset;  // hashCode, frames, fps, totalCycles, fpsM2, (version 2: frameTimeMean, frameTimeM2,
+                           // frameTimeMin, frameTimeMax) [numSlots] each, (versions 1 and 2: indexTable[2 * numSlots])
+  uint64_t fileSize;
+  // version 2
+  uint32_t requireSignificance;
+  float    confidence;
+};
+
+struct GridFileCell
+{
+  uint32_t firstSide;
+  uint32_t numSides;
+  int32_t  parent;
+  int32_t  firstChild;
+  uint32_t depth;
+  uint32_t merges;
+  int32_t  rootCell[3];
+  float    localMin[3];
+  float    localSize;
+  uint32_t padding;
+};
+
+struct GridFileSide
+{
+  uint32_t firstSlot;
+  uint32_t capacity;
+  uint32_t numElements;
+  int32_t  bestHash;
+  float    bestFps;
+};
+
+struct GridFileSideV2
+{
+  uint32_t sideIndex;
+  uint32_t numElements;
+  int32_t  bestHash;
+  float    bestFps;
+};
+
+// Both print the reason and return false on failure, `grid` is left unchanged if loading fails
+bool saveGridBinary(const Grid& grid, const std::string& filename);
+bool loadGridBinary(Grid& grid, const std::string& filename);
+
+// JSON dump (.json) of the timings. Cells are keyed "(x,y,z)", octree children "<key>/<octant>" with
+// octant = x + 2y + 4z, bins by DirectionQuantizer::binName. With `onlyBest` only the best configuration
+// and fps of every bin are written under "Observations", otherwise the fps of every configuration,
+// its frame time statistics and the best configuration of every bin under "Best Configurations"
+void writeGridJson(const Grid& grid, nlohmann::json& js, bool onlyBest);
+
+// Restores the fps of the uniform cells of a dump into `grid`, which is built with the dimensions and
+// binning of the dump, as one cycle of `timePerCycle` ms each. The best configuration is the stored
+// one, or the highest fps for dumps without "Best Configurations"
+void readGridJson(Grid& grid, const nlohmann::json& js, float timePerCycle);
+
+// Saves a grid to JSON and restores it, CPU only. Returns the number of failed checks
+int checkGridJson();
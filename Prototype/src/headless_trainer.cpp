@@ -0,0 +1,181 @@
+#include "headless_trainer.hpp"
+#include <algorithm>
+#include <cstdio>
+
+// integer hash to derive a stable frame time per cell, bin and configuration
+static uint32_t mixBits(uint32_t value)
+{
+  value ^= value >> 16;
+  value *= 0x7feb352dU;
+  value ^= value >> 15;
+  value *= 0x846ca68bU;
+  value ^= value >> 16;
+  return value;
+}
+
+double MockTimingSource::frameTime(uint32_t cell, uint32_t bin, int hashCode) const
+{
+  uint32_t key = mixBits(mixBits(mixBits(cell) ^ bin) ^ uint32_t(hashCode));
+  return 2.0 + 2.0 * double(key & 0xffff) / 65535.0;
+}
+
+double MockTimingSource::timeFrames(uint32_t cell, uint32_t bin, int hashCode, uint32_t frames)
+{
+  calls++;
+  if(relativeNoise <= 0.0f)
+    return frameTime(cell, bin, hashCode) * frames;
+  std::normal_distribution<double> noise(1.0, relativeNoise);
+  return frameTime(cell, bin, hashCode) * frames * std::max(0.5, noise(rng));
+}
+
+std::vector<TrainingStep> buildTrainingSchedule(const Grid& grid)
+{
+  std::vector<uint32_t> cells;
+  for(int i = 0; i < grid.gridDimensions.x; i++)
+  {
+    for(int j = 0; j < grid.gridDimensions.y; j++)
+    {
+      for(int k = 0; k < grid.gridDimensions.z; k++)
+      {
+        grid.collectLeaves(uint32_t(grid.cellIndex(glm::ivec3(i, j, k))), cells);
+      }
+    }
+  }
+
+  std::vector<TrainingStep> schedule;
+  schedule.reserve(cells.size() * grid.quantizer.numBins());
+  for(uint32_t cell : cells)
+  {
+    for(uint32_t bin = 0; bin < grid.quantizer.numBins(); bin++)
+      schedule.push_back({cell, bin});
+  }
+  return schedule;
+}
+
+size_t runHeadlessTraining(Grid& grid, TimingSource& source, const std::vector<int>& configurations, const HeadlessTrainingSettings& settings)
+{
+  std::vector<TrainingStep> schedule = buildTrainingSchedule(grid);
+  size_t                    cycles   = 0;
+  for(size_t step = 0; step < schedule.size(); step++)
+  {
+    const TrainingStep& current = schedule[step];
+    for(int hashCode : configurations)
+    {
+      for(uint32_t repetition = 0; repetition < settings.repetitions; repetition++)
+      {
+        double time = source.timeFrames(current.cell, current.bin, hashCode, settings.framesPerConfig);
+        grid.recordCycle(grid.side(grid.gridSpaces[current.cell], current.bin), hashCode, int(settings.framesPerConfig), float(time));
+        cycles++;
+      }
+    }
+    if(current.bin + 1 == grid.quantizer.numBins())
+      printf("trained cell %u (%zu/%zu steps)\n", current.cell, step + 1, schedule.size());
+  }
+  return cycles;
+}
+
+namespace {
+// Mock timings that also record the order in which the steps and configurations are timed
+class RecordingTimingSource : public MockTimingSource
+{
+public:
+  RecordingTimingSource()
+      : MockTimingSource(1, 0.0f)
+  {
+  }
+  double timeFrames(uint32_t cell, uint32_t bin, int hashCode, uint32_t frames) override
+  {
+    visits.push_back({cell, bin, hashCode});
+    return MockTimingSource::timeFrames(cell, bin, hashCode, frames);
+  }
+
+  struct Visit
+  {
+    uint32_t cell;
+    uint32_t bin;
+    int      hashCode;
+  };
+  std::vector<Visit> visits;
+};
+}  // namespace
+
+int checkHeadlessTraining()
+{
+  int  failures = 0;
+  auto expect   = [&](bool condition, const char* what) {
+    if(!condition)
+    {
+      printf("headless training: %s\n", what);
+      failures++;
+    }
+  };
+
+  // a 3x2x1 grid whose first cell is split, so the schedule mixes uniform cells and octree leaves
+  Grid grid;
+  grid.build(glm::ivec3(3, 2, 1), DirectionQuantizer());
+  grid.adaptive.enabled        = true;
+  grid.adaptive.minCycles      = 2;
+  grid.adaptive.splitVariation = 0.01f;
+  grid.recordCycle(grid.sides[0], 1, 50, 100.0f);
+  grid.recordCycle(grid.sides[0], 1, 100, 100.0f);
+  expect(grid.refine(0), "the first cell did not split");
+
+  std::vector<uint32_t> leaves;
+  for(int i = 0; i < grid.gridDimensions.x; i++)
+  {
+    for(int j = 0; j < grid.gridDimensions.y; j++)
+    {
+      uint32_t cell = uint32_t(grid.cellIndex(glm::ivec3(i, j, 0)));
+      for(uint32_t child = 0; child < 8 && grid.gridSpaces[cell].firstChild >= 0; child++)
+        leaves.push_back(uint32_t(grid.gridSpaces[cell].firstChild) + child);
+      if(grid.gridSpaces[cell].firstChild < 0)
+        leaves.push_back(cell);
+    }
+  }
+
+  const std::vector<int>   configurations = {11, 23, 37, 41, 59};
+  HeadlessTrainingSettings settings;
+  settings.repetitions = 2;  // a significant gain needs two cycles of the challenger
+  RecordingTimingSource source;
+  size_t                cycles = runHeadlessTraining(grid, source, configurations, settings);
+
+  uint32_t numBins = grid.quantizer.numBins();
+  size_t   steps   = leaves.size() * numBins;
+  expect(cycles == steps * configurations.size() * settings.repetitions, "the cycle count is not steps x configurations x repetitions");
+  expect(source.visits.size() == cycles, "the timing source was not called once per cycle");
+
+  // every live leaf x every bin, cells in schedule order, each configuration repeated in place
+  std::vector<RecordingTimingSource::Visit> expected;
+  for(uint32_t leaf : leaves)
+  {
+    for(uint32_t bin = 0; bin < numBins; bin++)
+    {
+      for(int hashCode : configurations)
+        expected.insert(expected.end(), settings.repetitions, {leaf, bin, hashCode});
+    }
+  }
+  bool order = expected.size() == source.visits.size();
+  for(size_t visit = 0; visit < expected.size() && order; visit++)
+  {
+    order = source.visits[visit].cell == expected[visit].cell && source.visits[visit].bin == expected[visit].bin
+            && source.visits[visit].hashCode == expected[visit].hashCode;
+  }
+  expect(order, "the steps were not visited leaf by leaf and bin by bin");
+
+  bool bestMatches = true;
+  for(uint32_t leaf : leaves)
+  {
+    for(uint32_t bin = 0; bin < numBins; bin++)
+    {
+      int fastest = configurations[0];
+      for(int hashCode : configurations)
+      {
+        if(source.frameTime(leaf, bin, hashCode) < source.frameTime(leaf, bin, fastest))
+          fastest = hashCode;
+      }
+      bestMatches &= grid.side(grid.gridSpaces[leaf], bin).bestHash == fastest;
+    }
+  }
+  expect(bestMatches, "the best configuration of a bin is not the one with the lowest mock frame time");
+  return failures;
+}
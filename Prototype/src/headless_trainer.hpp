@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <random>
+#include <vector>
+#include "sorting_grid.hpp"
+
+// Measures how long rendering a number of frames takes with one configuration,
+// seen from the center of a grid cell looking into a view direction bin
+class TimingSource
+{
+public:
+  virtual ~TimingSource() = default;
+  // returns the time of `frames` frames in ms
+  virtual double timeFrames(uint32_t cell, uint32_t bin, int hashCode, uint32_t frames) = 0;
+};
+
+// Synthetic, reproducible timings to run the trainer without a GPU. Every cell, bin and
+// configuration has its own frame time, each measurement adds relative noise to it.
+class MockTimingSource : public TimingSource
+{
+public:
+  explicit MockTimingSource(uint32_t seed = 1, float relativeNoise = 0.02f)
+      : rng(seed)
+      , relativeNoise(relativeNoise)
+  {
+  }
+  double timeFrames(uint32_t cell, uint32_t bin, int hashCode, uint32_t frames) override;
+  double frameTime(uint32_t cell, uint32_t bin, int hashCode) const;  // noise free time of one frame in ms
+
+  uint32_t calls{0};
+
+private:
+  std::mt19937 rng;
+  float        relativeNoise;
+};
+
+struct TrainingStep
+{
+  uint32_t cell;
+  uint32_t bin;
+};
+
+struct HeadlessTrainingSettings
+{
+  uint32_t framesPerConfig{64};  // timed frames of one configuration in one step
+  uint32_t warmupFrames{8};      // rendered untimed after switching the configuration
+  uint32_t repetitions{1};       // timed cycles of every configuration in one step
+};
+
+// All bins of the live leaves of the grid, cells in the order of the interactive training
+std::vector<TrainingStep> buildTrainingSchedule(const Grid& grid);
+
+// Times every configuration on every step of the schedule and records the cycles in the grid.
+// The grid is not refined while training, so the schedule stays fixed. Returns the number of cycles.
+size_t runHeadlessTraining(Grid&                           grid,
+                           TimingSource&                   source,
+                           const std::vector<int>&         configurations,
+                           const HeadlessTrainingSettings& settings);
+
+// Runs the trainer against MockTimingSource and checks the schedule, the cycle count and the best
+// configuration of every bin, CPU only. Returns the number of failed checks
+int checkHeadlessTraining();
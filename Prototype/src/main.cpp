@@ -30,6 +30,12 @@
 #include "nvpsystem.hpp"
 #include "nvvk/context_vk.hpp"
 #include "sample_example.hpp"
+#include "exploration_policy.hpp"
+#include "frame_clock.hpp"
+#include "grid_file.hpp"
+#include "pipeline_compile_service.hpp"
+#include "headless_trainer.hpp"
+#include "sorting_key_bench.hpp"
 
 // Default search path for shaders
 std::vector<std::string> defaultSearchPaths;
@@ -47,6 +53,115 @@ static void onErrorCallback(int error, const char* description)
 static int const SAMPLE_WIDTH  = 1280;
 static int const SAMPLE_HEIGHT = 720;
 
+// Feature structures chained into the device creation, they must outlive nvvk::Context::initDevice
+struct DeviceFeatures
+{
+  VkPhysicalDeviceShaderClockFeaturesKHR                clock{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_CLOCK_FEATURES_KHR};
+  VkPhysicalDeviceAccelerationStructureFeaturesKHR      accel{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR};
+  VkPhysicalDeviceRayTracingPipelineFeaturesKHR         rtPipeline{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_FEATURES_KHR};
+  VkPhysicalDeviceRayQueryFeaturesKHR                   rayQuery{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_QUERY_FEATURES_KHR};
+  VkPhysicalDeviceRayTracingInvocationReorderFeaturesNV reorder{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_INVOCATION_REORDER_FEATURES_NV};
+};
+
+// Extensions and queues of the path tracer, shared by the windowed and the headless mode
+static void requestDeviceFeatures(nvvk::ContextCreateInfo& contextInfo, DeviceFeatures& features)
+{
+  contextInfo.setVersion(1, 3);                                               // Using Vulkan 1.3
+  contextInfo.addInstanceExtension(VK_EXT_DEBUG_UTILS_EXTENSION_NAME, true);  // Allow debug names
+  contextInfo.addDeviceExtension(VK_KHR_SHADER_CLOCK_EXTENSION_NAME, false, &features.clock);
+  // #VKRay: Activate the ray tracing extension
+  contextInfo.addDeviceExtension(VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME, false, &features.accel);
+  contextInfo.addDeviceExtension(VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME, false, &features.rtPipeline);
+  contextInfo.addDeviceExtension(VK_KHR_RAY_QUERY_EXTENSION_NAME, true, &features.rayQuery);  // Optional extension
+  contextInfo.addDeviceExtension(VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME);
+  contextInfo.addDeviceExtension(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME, true);  // Optional, variants link against shared hit groups
+  contextInfo.addDeviceExtension(VK_KHR_BUFFER_DEVICE_ADDRESS_EXTENSION_NAME);
+
+  // Extra queues for parallel load/build
+  contextInfo.addRequestedQueue(contextInfo.defaultQueueGCT, 1, 1.0f);  // Loading scene - mipmap generation
+
+  //add device Extension for SER own modification
+  contextInfo.addDeviceExtension(VK_NV_RAY_TRACING_INVOCATION_REORDER_EXTENSION_NAME, false, &features.reorder);
+}
+
+// Queues handed to SampleExample::setup, in the order of SampleExample::Queues
+static std::vector<nvvk::Queue> collectQueues(nvvk::Context& vkctx, nvvk::ContextCreateInfo& contextInfo)
+{
+  auto                     qGCT1 = vkctx.createQueue(contextInfo.defaultQueueGCT, "GCT1", 1.0f);
+  std::vector<nvvk::Queue> queues;
+  queues.push_back({vkctx.m_queueGCT.queue, vkctx.m_queueGCT.familyIndex, vkctx.m_queueGCT.queueIndex});
+  queues.push_back({qGCT1.queue, qGCT1.familyIndex, qGCT1.queueIndex});
+  queues.push_back({vkctx.m_queueC.queue, vkctx.m_queueC.familyIndex, vkctx.m_queueC.queueIndex});
+  queues.push_back({vkctx.m_queueT.queue, vkctx.m_queueT.familyIndex, vkctx.m_queueT.queueIndex});
+  return queues;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Headless training: no window, no swapchain, times every configuration on every cell and
+// view direction bin and writes the binary sorting grid. With a ray file it only records the
+// rays of one frame instead
+//
+static int runHeadless(const std::string& sceneFile, const std::string& hdrFilename, const std::string& gridFile,
+                       const std::string& gridDir, const std::string& shaderDir, const std::string& spirvCache,
+                       const HeadlessTrainingSettings& settings, uint32_t benchmarkVariants, uint32_t benchmarkSwitches,
+                       uint32_t benchmarkDynamic, const std::string& rayFile, int rayDepth)
+{
+  nvvk::ContextCreateInfo contextInfo(true);
+  DeviceFeatures          features;
+  requestDeviceFeatures(contextInfo, features);
+
+  nvvk::Context vkctx{};
+  vkctx.initInstance(contextInfo);
+  auto compatibleDevices = vkctx.getCompatibleDevices(contextInfo);
+  if(compatibleDevices.empty())
+  {
+    printf("No Vulkan device supports the required ray tracing extensions\n");
+    return 1;
+  }
+  vkctx.initDevice(compatibleDevices[0], contextInfo);
+
+  SampleExample sample;
+  sample.supportRayQuery(vkctx.hasDeviceExtension(VK_KHR_RAY_QUERY_EXTENSION_NAME));
+  sample.gridOutputDirectory = gridDir;
+  sample.shaderDirectory     = shaderDir;
+  sample.spirvCacheDirectory = spirvCache;
+  sample.setup(vkctx.m_instance, vkctx.m_device, vkctx.m_physicalDevice, collectQueues(vkctx, contextInfo));
+  sample.createHeadlessTarget({SAMPLE_WIDTH, SAMPLE_HEIGHT});
+
+  sample.loadEnvironmentHdr(nvh::findFile(hdrFilename, defaultSearchPaths, true));
+  sample.loadScene(nvh::findFile(sceneFile, defaultSearchPaths, true));
+  sample.createUniformBuffer();
+  sample.createDescriptorSetLayout();
+  sample.createRender(SampleExample::eRtxPipeline);
+  sample.resetFrame();
+  if(!gridFile.empty())
+  {
+    sample.loadSortingGrid(gridFile);
+  }
+
+  int result = 0;
+  if(!rayFile.empty())
+  {
+    result = sample.recordRays(rayFile, 0, 0, rayDepth) ? 0 : 1;
+  }
+  else if(benchmarkVariants > 0 || benchmarkSwitches > 0 || benchmarkDynamic > 0)
+  {
+    sample.benchmarkPipelineCreation(benchmarkVariants);
+    sample.benchmarkConfigurationSwitch(benchmarkSwitches);
+    sample.benchmarkDynamicSorting(benchmarkDynamic, settings.framesPerConfig, settings.warmupFrames);
+  }
+  else
+  {
+    sample.trainHeadless(settings);
+  }
+
+  vkDeviceWaitIdle(sample.getDevice());
+  sample.destroyResources();
+  sample.destroy();
+  vkctx.deinit();
+  return result;
+}
+
 //--------------------------------------------------------------------------------------------------
 // Application Entry
 //
@@ -55,6 +170,59 @@ int main(int argc, char** argv)
   InputParser parser(argc, argv);
   std::string sceneFile   = parser.getString("-f", "robot_toon/robot-toon.gltf");
   std::string hdrFilename = parser.getString("-e", "std_env.hdr");
+  std::string replayFile  = parser.getString("-replay", "");
+  std::string gridFile    = parser.getString("-grid", "");
+  std::string gridDir     = parser.getString("-griddir", "Sorting_Grid_Results");
+  std::string shaderDir   = parser.getString("-shaderdir", NVPSystem::exePath() + PROJECT_RELDIRECTORY + "shaders");
+  std::string spirvCache  = parser.getString("-spirvcache", "spirv_cache");
+
+  // Compare the exploration policies on a saved sorting grid, no window or GPU needed
+  if(!replayFile.empty())
+  {
+    return runExplorationReplay(replayFile, ReplaySettings());
+  }
+
+  // Time the host sorting keys and check them against the shader functions, CPU only
+  if(parser.exist("-keybench"))
+  {
+    return runSortingKeyBenchmark(uint32_t(parser.getInt("-keybench", 1 << 22)));
+  }
+  if(parser.exist("-keystats"))
+  {
+    return runSortingKeyStatistics(parser.getString("-keystats", "1000000"), uint32_t(parser.getInt("-keybits", 32)));
+  }
+
+  // Checks of the parts that run without a GPU, against mock timings
+  if(parser.exist("-selfcheck"))
+  {
+    int failures = checkGridJson();
+    failures += checkHeadlessTraining();
+    failures += checkFrameClock();
+    failures += checkPipelineCompileService();
+    printf(failures == 0 ? "all checks passed\n" : "%d checks failed\n", failures);
+    return failures == 0 ? 0 : 1;
+  }
+
+  // Search path for shaders and other media
+  defaultSearchPaths = {
+      NVPSystem::exePath() + PROJECT_NAME,
+      NVPSystem::exePath() + R"(media)",
+      NVPSystem::exePath() + PROJECT_RELDIRECTORY,
+      NVPSystem::exePath() + PROJECT_DOWNLOAD_RELDIRECTORY,
+  };
+
+  if(parser.exist("-headless"))
+  {
+    HeadlessTrainingSettings settings;
+    settings.framesPerConfig = uint32_t(parser.getInt("-frames", int(settings.framesPerConfig)));
+    uint32_t benchmarkVariants = uint32_t(parser.getInt("-pipelinebench", 0));
+    uint32_t benchmarkSwitches = uint32_t(parser.getInt("-switchbench", 0));
+    uint32_t benchmarkDynamic  = uint32_t(parser.getInt("-uberbench", 0));
+    std::string rayFile        = parser.getString("-recordrays", "");
+    int         rayDepth       = parser.getInt("-raydepth", 0);
+    return runHeadless(sceneFile, hdrFilename, gridFile, gridDir, shaderDir, spirvCache, settings, benchmarkVariants,
+                       benchmarkSwitches, benchmarkDynamic, rayFile, rayDepth);
+  }
 
   // Setup GLFW window
   glfwSetErrorCallback(onErrorCallback);
@@ -79,14 +247,6 @@ int main(int argc, char** argv)
   // Setup logging file
   //  nvprintSetLogFileName(PROJECT_NAME "_log.txt")
 
-  // Search path for shaders and other media
-  defaultSearchPaths = {
-      NVPSystem::exePath() + PROJECT_NAME,
-      NVPSystem::exePath() + R"(media)",
-      NVPSystem::exePath() + PROJECT_RELDIRECTORY,
-      NVPSystem::exePath() + PROJECT_DOWNLOAD_RELDIRECTORY,
-  };
-
   // Vulkan required extensions
   assert(glfwVulkanSupported() == 1);
   uint32_t count{0};
@@ -94,31 +254,11 @@ int main(int argc, char** argv)
 
   // Requesting Vulkan extensions and layers
   nvvk::ContextCreateInfo contextInfo(true);
-  contextInfo.setVersion(1, 3);                       // Using Vulkan 1.3
+  DeviceFeatures          deviceFeatures;
+  requestDeviceFeatures(contextInfo, deviceFeatures);
   for(uint32_t ext_id = 0; ext_id < count; ext_id++)  // Adding required extensions (surface, win32, linux, ..)
     contextInfo.addInstanceExtension(reqExtensions[ext_id]);
-  contextInfo.addInstanceExtension(VK_EXT_DEBUG_UTILS_EXTENSION_NAME, true);  // Allow debug names
-  contextInfo.addDeviceExtension(VK_KHR_SWAPCHAIN_EXTENSION_NAME);            // Enabling ability to present rendering
-
-  VkPhysicalDeviceShaderClockFeaturesKHR clockFeature{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_CLOCK_FEATURES_KHR};
-  contextInfo.addDeviceExtension(VK_KHR_SHADER_CLOCK_EXTENSION_NAME, false, &clockFeature);
-  // #VKRay: Activate the ray tracing extension
-  VkPhysicalDeviceAccelerationStructureFeaturesKHR accelFeature{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR};
-  contextInfo.addDeviceExtension(VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME, false, &accelFeature);
-  VkPhysicalDeviceRayTracingPipelineFeaturesKHR rtPipelineFeature{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_FEATURES_KHR};
-  contextInfo.addDeviceExtension(VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME, false, &rtPipelineFeature);
-  VkPhysicalDeviceRayQueryFeaturesKHR rayQueryFeatures{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_QUERY_FEATURES_KHR};
-  contextInfo.addDeviceExtension(VK_KHR_RAY_QUERY_EXTENSION_NAME, true, &rayQueryFeatures);  // Optional extension
-  contextInfo.addDeviceExtension(VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME);
-  contextInfo.addDeviceExtension(VK_KHR_BUFFER_DEVICE_ADDRESS_EXTENSION_NAME);
-
-  // Extra queues for parallel load/build
-  contextInfo.addRequestedQueue(contextInfo.defaultQueueGCT, 1, 1.0f);  // Loading scene - mipmap generation
-
-  //add device Extension for SER own modification
-	VkPhysicalDeviceRayTracingInvocationReorderFeaturesNV reorderFeature{
-	VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_INVOCATION_REORDER_FEATURES_NV };
-	contextInfo.addDeviceExtension(VK_NV_RAY_TRACING_INVOCATION_REORDER_EXTENSION_NAME, false, &reorderFeature);
+  contextInfo.addDeviceExtension(VK_KHR_SWAPCHAIN_EXTENSION_NAME);  // Enabling ability to present rendering
 
 // #define ENABLE_GPU_PRINTF //   Enabling printf in shaders
 // #extension GL_EXT_debug_printf
@@ -146,6 +286,9 @@ int main(int argc, char** argv)
 
   //
   SampleExample sample;
+  sample.gridOutputDirectory = gridDir;
+  sample.shaderDirectory     = shaderDir;
+  sample.spirvCacheDirectory = spirvCache;
   sample.supportRayQuery(vkctx.hasDeviceExtension(VK_KHR_RAY_QUERY_EXTENSION_NAME));
 
   // Window need to be opened to get the surface on which to draw
@@ -159,15 +302,8 @@ int main(int argc, char** argv)
   // - GTC1 for loading in parallel and generating mip-maps
   // - Compute for creating acceleration structures
   // - Transfer for loading HDR images, creating offscreen pipeline
-  auto                     qGCT1 = vkctx.createQueue(contextInfo.defaultQueueGCT, "GCT1", 1.0f);
-  std::vector<nvvk::Queue> queues;
-  queues.push_back({vkctx.m_queueGCT.queue, vkctx.m_queueGCT.familyIndex, vkctx.m_queueGCT.queueIndex});
-  queues.push_back({qGCT1.queue, qGCT1.familyIndex, qGCT1.queueIndex});
-  queues.push_back({vkctx.m_queueC.queue, vkctx.m_queueC.familyIndex, vkctx.m_queueC.queueIndex});
-  queues.push_back({vkctx.m_queueT.queue, vkctx.m_queueT.familyIndex, vkctx.m_queueT.queueIndex});
-
   // Create example
-  sample.setup(vkctx.m_instance, vkctx.m_device, vkctx.m_physicalDevice, queues);
+  sample.setup(vkctx.m_instance, vkctx.m_device, vkctx.m_physicalDevice, collectQueues(vkctx, contextInfo));
   sample.createSwapchain(surface, SAMPLE_WIDTH, SAMPLE_HEIGHT);
   sample.createDepthBuffer();
   sample.createRenderPass();
@@ -192,6 +328,11 @@ int main(int argc, char** argv)
     
     sample.createDescriptorSetLayout();
     sample.createRender(SampleExample::eRtxPipeline);
+    if(!gridFile.empty())
+    {
+      sample.m_busyReasonText = "Loading Sorting Grid";
+      sample.loadSortingGrid(gridFile);
+    }
     //sample.createUniformBufferProfiling();
     sample.resetFrame();
     sample.m_busy = false;
@@ -218,6 +359,7 @@ int main(int argc, char** argv)
     // Start rendering the scene
     profiler.beginFrame();  // GPU performance timer
     sample.prepareFrame();  // Waits for a framebuffer to be available
+    sample.collectCompletedFrames();
     sample.updateFrame();   // Increment/update rendering frame count
 
     // Start command buffer of this frame
@@ -266,6 +408,7 @@ int main(int argc, char** argv)
 
     // Submit for display
     vkEndCommandBuffer(cmdBuf);
+    sample.tagFrameFence();
     sample.submitFrame();
 
     
@@ -0,0 +1,149 @@
+#include "pipeline_cache_file.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+static const uint64_t FNV_PRIME = 0x100000001b3ull;
+
+uint64_t fnv1a(const void* data, size_t size, uint64_t hash)
+{
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  for(size_t i = 0; i < size; i++)
+  {
+    hash ^= bytes[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+void PipelineCacheStats::record(bool hit, double ms)
+{
+  created++;
+  if(hit)
+  {
+    hits++;
+    hitMs += ms;
+  }
+  else
+  {
+    missMs += ms;
+  }
+}
+
+double PipelineCacheStats::savedMs() const
+{
+  uint32_t misses = created - hits;
+  return misses ? double(hits) * missMs / double(misses) - hitMs : 0.0;
+}
+
+PipelineCacheKey makePipelineCacheKey(const VkPhysicalDeviceProperties& properties, uint64_t shaderHash)
+{
+  PipelineCacheKey key;
+  key.vendorID      = properties.vendorID;
+  key.deviceID      = properties.deviceID;
+  key.driverVersion = properties.driverVersion;
+  memcpy(key.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+  key.shaderHash = shaderHash;
+  return key;
+}
+
+static bool sameKey(const PipelineCacheKey& a, const PipelineCacheKey& b)
+{
+  return a.vendorID == b.vendorID && a.deviceID == b.deviceID && a.driverVersion == b.driverVersion
+         && memcmp(a.pipelineCacheUUID, b.pipelineCacheUUID, VK_UUID_SIZE) == 0 && a.shaderHash == b.shaderHash;
+}
+
+uint64_t hashShaderSources(const std::string& directory)
+{
+  static const char* extensions[] = {".rgen", ".rchit", ".rmiss", ".rahit", ".rint", ".rcall", ".glsl", ".h"};
+
+  std::error_code                    error;
+  std::vector<std::filesystem::path> sources;
+  for(const auto& entry : std::filesystem::directory_iterator(directory, error))
+  {
+    std::string extension = entry.path().extension().string();
+    if(entry.is_regular_file() && std::find(std::begin(extensions), std::end(extensions), extension) != std::end(extensions))
+      sources.push_back(entry.path());
+  }
+  std::sort(sources.begin(), sources.end());
+
+  uint64_t hash = FNV_OFFSET;
+  for(const std::filesystem::path& source : sources)
+  {
+    std::string   name = source.filename().string();
+    std::ifstream file(source, std::ios::binary);
+    std::string   contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    hash = fnv1a(name.data(), name.size(), hash);
+    hash = fnv1a(contents.data(), contents.size(), hash);
+  }
+  return hash;
+}
+
+bool loadPipelineCacheData(const std::string& filename, const PipelineCacheKey& key, std::vector<uint8_t>& data)
+{
+  data.clear();
+  std::ifstream in(filename, std::ios::binary);
+  if(!in)
+  {
+    printf("No pipeline cache %s, starting with an empty cache\n", filename.c_str());
+    return false;
+  }
+
+  PipelineCacheFileHeader header{};
+  in.read(reinterpret_cast<char*>(&header), sizeof(header));
+  if(!in || memcmp(header.magic, PIPELINE_CACHE_FILE_MAGIC, sizeof(header.magic)) != 0
+     || header.version != PIPELINE_CACHE_FILE_VERSION || header.headerSize != sizeof(PipelineCacheFileHeader))
+  {
+    printf("%s is not a version %u pipeline cache, it is ignored\n", filename.c_str(), PIPELINE_CACHE_FILE_VERSION);
+    return false;
+  }
+  if(!sameKey(header.key, key))
+  {
+    printf("Pipeline cache %s was created for another device, driver or shader source, it is ignored\n", filename.c_str());
+    return false;
+  }
+
+  data.resize(header.dataSize);
+  in.read(reinterpret_cast<char*>(data.data()), std::streamsize(data.size()));
+  if(!in || fnv1a(data.data(), data.size()) != header.dataHash)
+  {
+    printf("Pipeline cache %s is truncated or damaged, it is ignored\n", filename.c_str());
+    data.clear();
+    return false;
+  }
+  return true;
+}
+
+bool savePipelineCacheData(const std::string& filename, const PipelineCacheKey& key, const std::vector<uint8_t>& data)
+{
+  PipelineCacheFileHeader header{};
+  memcpy(header.magic, PIPELINE_CACHE_FILE_MAGIC, sizeof(header.magic));
+  header.version    = PIPELINE_CACHE_FILE_VERSION;
+  header.headerSize = sizeof(PipelineCacheFileHeader);
+  header.key        = key;
+  header.dataSize   = data.size();
+  header.dataHash   = fnv1a(data.data(), data.size());
+
+  // written next to the old file and renamed, so an interrupted save never leaves a broken cache
+  std::string temporary = filename + ".tmp";
+  {
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(data.data()), std::streamsize(data.size()));
+    if(!out)
+    {
+      printf("Could not write pipeline cache %s\n", temporary.c_str());
+      return false;
+    }
+  }
+  std::error_code error;
+  std::filesystem::rename(temporary, filename, error);
+  if(error)
+  {
+    printf("Could not replace pipeline cache %s: %s\n", filename.c_str(), error.message().c_str());
+    return false;
+  }
+  return true;
+}
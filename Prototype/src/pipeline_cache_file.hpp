@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "vulkan/vulkan_core.h"
+
+// On-disk VkPipelineCache data
+//
+// A header with the key the data was created under, followed by the vkGetPipelineCacheData blob.
+// Data created by another device, driver or shader source is discarded on load instead of
+// being handed to the driver, and the next save replaces it.
+
+const char     PIPELINE_CACHE_FILE_MAGIC[4] = {'S', 'P', 'C', 'F'};
+const uint32_t PIPELINE_CACHE_FILE_VERSION  = 1;
+
+struct PipelineCacheKey
+{
+  uint32_t vendorID{0};
+  uint32_t deviceID{0};
+  uint32_t driverVersion{0};
+  uint8_t  pipelineCacheUUID[VK_UUID_SIZE]{};
+  uint64_t shaderHash{0};  // see hashShaderSources
+};
+
+struct PipelineCacheFileHeader
+{
+  char             magic[4];
+  uint32_t         version;
+  uint32_t         headerSize;  // sizeof(PipelineCacheFileHeader) of the writer
+  uint32_t         padding;
+  PipelineCacheKey key;
+  uint64_t         dataSize;
+  uint64_t         dataHash;  // detects truncated or damaged files
+};
+
+// Creation feedback of the pipelines created in a session
+struct PipelineCacheStats
+{
+  uint32_t created{0};
+  uint32_t hits{0};      // found in the pipeline cache by the driver
+  double   hitMs{0.0};   // creation time of the hits
+  double   missMs{0.0};  // creation time of the others
+
+  void  record(bool hit, double ms);
+  float hitRate() const { return created ? float(hits) / float(created) : 0.0f; }
+  // time the hits would have taken at the mean time of a miss, minus what they took
+  double savedMs() const;
+};
+
+// FNV-1a, also hashes the sources for the SPIR-V cache
+const uint64_t FNV_OFFSET = 0xcbf29ce484222325ull;
+uint64_t       fnv1a(const void* data, size_t size, uint64_t hash = FNV_OFFSET);
+
+PipelineCacheKey makePipelineCacheKey(const VkPhysicalDeviceProperties& properties, uint64_t shaderHash);
+
+// FNV-1a over the names and contents of the shader sources in `directory`, sorted by name
+uint64_t hashShaderSources(const std::string& directory);
+
+// Both print the reason and return false on failure. `data` is left empty if the file is
+// missing, damaged or was written under a different key.
+bool loadPipelineCacheData(const std::string& filename, const PipelineCacheKey& key, std::vector<uint8_t>& data);
+bool savePipelineCacheData(const std::string& filename, const PipelineCacheKey& key, const std::vector<uint8_t>& data);
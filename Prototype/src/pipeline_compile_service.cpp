@@ -0,0 +1,236 @@
+#include "pipeline_compile_service.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+
+void PipelineCompileService::start(uint32_t numWorkers)
+{
+  stop();
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_stopping = false;
+  for(uint32_t i = 0; i < std::max(numWorkers, 1u); i++)
+    m_workers.emplace_back(&PipelineCompileService::work, this);
+}
+
+void PipelineCompileService::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stopping = true;
+  }
+  m_wake.notify_all();
+  for(std::thread& worker : m_workers)
+    worker.join();
+  m_workers.clear();
+
+  // whatever is left was never started
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for(auto& request : m_requests)
+    request.second.promise.set_value(PipelineStorage());
+  m_requests.clear();
+}
+
+std::shared_future<PipelineStorage> PipelineCompileService::request(uint64_t key, CompilePriority priority, Job job, Callback callback)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if(m_stopping)
+  {
+    std::promise<PipelineStorage> dropped;
+    dropped.set_value(PipelineStorage());
+    return dropped.get_future().share();
+  }
+
+  auto found = m_requests.find(key);
+  if(found != m_requests.end())
+  {
+    Request& pending = found->second;
+    pending.priority = std::max(pending.priority, priority);
+    if(callback)
+      pending.callbacks.emplace_back(std::move(callback));
+    return pending.future;
+  }
+
+  Request& added = m_requests[key];
+  added.priority = priority;
+  added.sequence = m_sequence++;
+  added.job      = std::move(job);
+  if(callback)
+    added.callbacks.emplace_back(std::move(callback));
+  added.future = added.promise.get_future().share();
+  m_wake.notify_one();
+  return added.future;
+}
+
+size_t PipelineCompileService::pending()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_requests.size();
+}
+
+void PipelineCompileService::work()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while(true)
+  {
+    // the queue holds a handful of requests, a scan is cheaper than keeping it sorted
+    // while merged requests change their priority
+    Request* next = nullptr;
+    uint64_t key  = 0;
+    for(auto& request : m_requests)
+    {
+      Request& candidate = request.second;
+      if(candidate.running)
+        continue;
+      if(!next || candidate.priority > next->priority
+         || (candidate.priority == next->priority && candidate.sequence < next->sequence))
+      {
+        next = &candidate;
+        key  = request.first;
+      }
+    }
+
+    if(m_stopping)
+      return;
+    if(!next)
+    {
+      m_wake.wait(lock);
+      continue;
+    }
+
+    next->running = true;
+    Job job       = std::move(next->job);
+    lock.unlock();
+    PipelineStorage result = job();
+    lock.lock();
+
+    // taken out before the callbacks run, a callback may request the next pipeline
+    auto                  found     = m_requests.find(key);
+    std::vector<Callback> callbacks = std::move(found->second.callbacks);
+    found->second.promise.set_value(result);
+    m_requests.erase(found);
+
+    lock.unlock();
+    for(const Callback& callback : callbacks)
+      callback(result);
+    lock.lock();
+  }
+}
+
+namespace {
+// Stands in for the pipeline builds: every job records its key, a gated job holds its worker
+// until the gate opens
+struct MockPipelineFactory
+{
+  std::mutex               mutex;
+  std::vector<uint64_t>    built;
+  std::promise<void>       gate;
+  std::shared_future<void> gateOpen{gate.get_future().share()};
+  std::promise<void>       started;  // set by the first gated job
+  std::atomic<bool>        anyStarted{false};
+
+  PipelineCompileService::Job job(uint64_t key, bool gated = false)
+  {
+    return [this, key, gated] {
+      if(gated)
+      {
+        if(!anyStarted.exchange(true))
+          started.set_value();
+        gateOpen.wait();
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      built.push_back(key);
+      PipelineStorage storage;
+      storage.variantKey = key;
+      return storage;
+    };
+  }
+};
+}  // namespace
+
+int checkPipelineCompileService()
+{
+  int  failures = 0;
+  auto expect   = [&](bool condition, const char* what) {
+    if(!condition)
+    {
+      printf("pipeline compile service: %s\n", what);
+      failures++;
+    }
+  };
+
+  // concurrent requests for one key, the job holds its worker until all of them are in
+  {
+    PipelineCompileService service;
+    MockPipelineFactory    factory;
+    service.start(4);
+    std::atomic<int>                                 callbacks{0};
+    std::vector<std::shared_future<PipelineStorage>> futures(8);
+    std::vector<std::thread>                         requesters;
+    for(size_t i = 0; i < futures.size(); i++)
+    {
+      requesters.emplace_back([&, i] {
+        futures[i] = service.request(1, ePriorityPrebuild, factory.job(1, true), [&](const PipelineStorage&) { callbacks++; });
+      });
+    }
+    for(std::thread& requester : requesters)
+      requester.join();
+    factory.gate.set_value();
+    bool same = true;
+    for(auto& future : futures)
+      same &= future.get().variantKey == 1;
+    service.stop();
+    expect(same && factory.built.size() == 1, "concurrent requests for one key did not build it once");
+    expect(callbacks == int(futures.size()), "a merged request lost its callback");
+  }
+
+  // one worker held by a gated job, the queue behind it is ordered when the gate opens
+  {
+    PipelineCompileService service;
+    MockPipelineFactory    factory;
+    service.start(1);
+    service.request(1, ePriorityBlocking, factory.job(1, true));
+    factory.started.get_future().wait();
+
+    std::vector<std::shared_future<PipelineStorage>> queued;
+    queued.push_back(service.request(2, ePriorityPrefetch, factory.job(2)));
+    for(uint64_t key = 3; key <= 5; key++)
+      queued.push_back(service.request(key, ePriorityPrebuild, factory.job(key)));
+    service.request(2, ePriorityBlocking, factory.job(2));
+    expect(service.pending() == 5, "a duplicate request was queued again");
+
+    factory.gate.set_value();
+    for(auto& future : queued)
+      future.wait();
+    service.stop();
+    expect(factory.built == std::vector<uint64_t>({1, 2, 3, 4, 5}),
+           "the upgraded request did not run first or a priority did not run in request order");
+  }
+
+  // stop while a job runs: the running one completes, the queued ones resolve empty without callbacks
+  {
+    PipelineCompileService service;
+    MockPipelineFactory    factory;
+    service.start(1);
+    auto held = service.request(1, ePriorityBlocking, factory.job(1, true));
+    factory.started.get_future().wait();
+    bool called = false;
+    auto queued = service.request(2, ePriorityBlocking, factory.job(2), [&](const PipelineStorage&) { called = true; });
+
+    // the gate opens once stop() refuses new requests, so the worker returns without taking the queued job
+    std::thread opener([&] {
+      auto probe = [] { return PipelineStorage(); };
+      while(service.request(3, ePriorityPrefetch, probe).wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        std::this_thread::yield();
+      factory.gate.set_value();
+    });
+    service.stop();
+    opener.join();
+
+    expect(held.get().variantKey == 1, "the running job did not complete on stop");
+    expect(queued.get().pipeline == VK_NULL_HANDLE && queued.get().variantKey == 0 && !called,
+           "a queued request did not resolve empty without its callback on stop");
+    expect(factory.built == std::vector<uint64_t>({1}), "a queued job ran after stop");
+  }
+  return failures;
+}
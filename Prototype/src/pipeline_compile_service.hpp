@@ -0,0 +1,69 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "pipeline_variant_cache.hpp"
+
+enum CompilePriority
+{
+  ePriorityPrefetch,  // speculative, nobody waits for it
+  ePriorityPrebuild,  // refills the buffer of unmeasured configurations
+  ePriorityPredicted, // the camera is expected to reach a cell that runs it, see CellPrefetcher
+  ePriorityBlocking,  // the render thread waits for it
+};
+
+// Builds pipelines on a pool of worker threads. Requests are keyed by their variant key, a
+// request for a key that is queued or being built returns the pending future instead of
+// building it again. The highest priority is built first, in request order within a priority.
+class PipelineCompileService
+{
+public:
+  using Job      = std::function<PipelineStorage()>;
+  using Callback = std::function<void(const PipelineStorage&)>;
+
+  ~PipelineCompileService() { stop(); }
+
+  void start(uint32_t numWorkers);
+  // waits for the running jobs, queued ones are dropped and resolve to an empty PipelineStorage
+  // without calling their callbacks
+  void stop();
+
+  // `callback` runs on the worker right after the job, also when the request was merged into a
+  // pending one. A merged request raises the pending one to its priority.
+  std::shared_future<PipelineStorage> request(uint64_t key, CompilePriority priority, Job job, Callback callback = nullptr);
+
+  size_t   pending();
+  uint32_t numWorkers() const { return uint32_t(m_workers.size()); }
+
+private:
+  struct Request
+  {
+    CompilePriority                     priority;
+    uint64_t                            sequence;
+    bool                                running{false};
+    Job                                 job;
+    std::vector<Callback>               callbacks;
+    std::promise<PipelineStorage>       promise;
+    std::shared_future<PipelineStorage> future;
+  };
+
+  void work();
+
+  std::vector<std::thread>              m_workers;
+  std::unordered_map<uint64_t, Request> m_requests;  // queued and running, by variant key
+  uint64_t                              m_sequence{0};
+  bool                                  m_stopping{true};  // until start
+  std::mutex                            m_mutex;
+  std::condition_variable               m_wake;
+};
+
+// Runs the service with a mock pipeline factory, CPU only: merged requests, priority upgrades,
+// request order and stop. Returns the number of failed checks
+int checkPipelineCompileService();
@@ -0,0 +1,91 @@
+#include "pipeline_variant_cache.hpp"
+#include <algorithm>
+
+void PipelineVariantCache::touch(Entry& entry, uint64_t frame)
+{
+  entry.lastUsedFrame = std::max(entry.lastUsedFrame, frame);
+  m_lru.splice(m_lru.begin(), m_lru, entry.lru);
+}
+
+bool PipelineVariantCache::find(uint64_t key, uint64_t frame, PipelineStorage& result)
+{
+  auto found = m_entries.find(key);
+  if(found == m_entries.end())
+  {
+    m_misses++;
+    return false;
+  }
+  m_hits++;
+  touch(found->second, frame);
+  result = found->second.pipeline;
+  return true;
+}
+
+bool PipelineVariantCache::insert(const PipelineStorage& pipeline, size_t bytes, uint64_t frame)
+{
+  if(m_entries.count(pipeline.variantKey))
+    return false;
+  m_lru.push_front(pipeline.variantKey);
+  Entry& entry        = m_entries[pipeline.variantKey];
+  entry.pipeline      = pipeline;
+  entry.bytes         = bytes;
+  entry.lastUsedFrame = frame;
+  entry.lru           = m_lru.begin();
+  m_bytes += bytes;
+  return true;
+}
+
+void PipelineVariantCache::markUsed(uint64_t key, uint64_t frame)
+{
+  auto found = m_entries.find(key);
+  if(found != m_entries.end())
+    touch(found->second, frame);
+}
+
+bool PipelineVariantCache::pin(uint64_t key)
+{
+  auto found = m_entries.find(key);
+  if(found == m_entries.end())
+    return false;
+  found->second.pins++;
+  return true;
+}
+
+void PipelineVariantCache::unpin(uint64_t key)
+{
+  auto found = m_entries.find(key);
+  if(found != m_entries.end() && found->second.pins > 0)
+    found->second.pins--;
+}
+
+void PipelineVariantCache::evict(uint64_t frame, const Destroy& destroy)
+{
+  auto candidate = m_lru.end();
+  while((m_entries.size() > entryBudget || m_bytes > memoryBudget) && candidate != m_lru.begin())
+  {
+    --candidate;
+    Entry& entry = m_entries[*candidate];
+    if(entry.pins > 0 || entry.lastUsedFrame + framesInFlight >= frame)
+      continue;
+
+    destroy(entry.pipeline);
+    m_bytes -= entry.bytes;
+    m_evictions++;
+    m_entries.erase(*candidate);
+    candidate = m_lru.erase(candidate);
+  }
+}
+
+void PipelineVariantCache::clear(const Destroy& destroy)
+{
+  for(auto& entry : m_entries)
+    destroy(entry.second.pipeline);
+  m_entries.clear();
+  m_lru.clear();
+  m_bytes = 0;
+}
+
+PipelineVariantCacheStats PipelineVariantCache::stats() const
+{
+  return {m_entries.size(), m_bytes, m_hits, m_misses, m_evictions};
+}
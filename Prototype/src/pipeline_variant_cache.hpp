@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <unordered_map>
+
+#include "glm/glm.hpp"
+#include "nvvk/sbtwrapper_vk.hpp"
+#include "shaders/host_device.h"
+
+struct PipelineStorage
+{
+  VkPipeline       pipeline{VK_NULL_HANDLE};
+  nvvk::SBTWrapper sbt;
+  SortingParameters parameters;
+  uint64_t         variantKey{0};  // see pipelineVariantKey
+};
+
+// Everything that changes the compiled pipeline: the parameter hash (which includes
+// numCoherenceBitsTotal), the sorting mode, profiling, whether the any hit shader is used and the
+// key encoding. The uber shader of dynamicSorting runs every configuration, its parameter hash is 0
+inline uint64_t pipelineVariantKey(int parameterHash, int sortingMode, bool profiling, bool anyHit, bool dynamicSorting = false, bool normalizedKeys = false)
+{
+  return uint64_t(uint32_t(parameterHash)) | uint64_t(uint8_t(sortingMode)) << 32 | uint64_t(profiling) << 40
+         | uint64_t(anyHit) << 41 | uint64_t(dynamicSorting) << 42 | uint64_t(normalizedKeys) << 43;
+}
+
+// Key of a pipeline holding the raygens of several configurations, see RtxPipeline::buildRaygenTable.
+// Never equal to a pipelineVariantKey, `generation` tells successive tables apart
+inline uint64_t raygenTableKey(uint32_t generation)
+{
+  return uint64_t(1) << 63 | generation;
+}
+
+struct PipelineVariantCacheStats
+{
+  size_t   entries{0};
+  size_t   bytes{0};
+  uint64_t hits{0};
+  uint64_t misses{0};
+  uint64_t evictions{0};
+};
+
+// Created pipelines by variant key, bounded by an entry and a memory budget. Over budget the least
+// recently used variants are destroyed first, but never one that is pinned (active or waiting in the
+// prebuild buffer) or was used by one of the last `framesInFlight` frames. Not thread safe.
+class PipelineVariantCache
+{
+public:
+  using Destroy = std::function<void(PipelineStorage&)>;
+
+  size_t   entryBudget{64};
+  size_t   memoryBudget{size_t(256) << 20};  // bytes, see insert
+  uint32_t framesInFlight{3};
+
+  // counts a hit or a miss, a hit marks the variant used in `frame`
+  bool find(uint64_t key, uint64_t frame, PipelineStorage& result);
+  // `bytes` is the memory accounted for the variant. Returns false if the key is already cached,
+  // the caller then still owns `pipeline`
+  bool insert(const PipelineStorage& pipeline, size_t bytes, uint64_t frame);
+  bool contains(uint64_t key) const { return m_entries.count(key) != 0; }  // neither a hit nor a miss
+  void markUsed(uint64_t key, uint64_t frame);
+  bool pin(uint64_t key);  // false if the key is not cached
+  void unpin(uint64_t key);
+
+  // destroys least recently used variants until both budgets hold or only protected ones are left
+  void evict(uint64_t frame, const Destroy& destroy);
+  // destroys every variant, pinned or not, the device must be idle
+  void clear(const Destroy& destroy);
+
+  PipelineVariantCacheStats stats() const;
+
+private:
+  struct Entry
+  {
+    PipelineStorage                pipeline;
+    size_t                         bytes{0};
+    uint64_t                       lastUsedFrame{0};
+    uint32_t                       pins{0};
+    std::list<uint64_t>::iterator lru;
+  };
+
+  void touch(Entry& entry, uint64_t frame);
+
+  std::unordered_map<uint64_t, Entry> m_entries;
+  std::list<uint64_t>                 m_lru;  // most recently used first
+  size_t                              m_bytes{0};
+  uint64_t                            m_hits{0};
+  uint64_t                            m_misses{0};
+  uint64_t                            m_evictions{0};
+};
@@ -0,0 +1,53 @@
+#include "retirement_queue.hpp"
+#include <algorithm>
+
+void RetirementQueue::retire(uint64_t frame, Destroy destroy)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(frame > m_completedFrame)
+    {
+      m_entries.push_back({frame, std::move(destroy)});
+      return;
+    }
+    m_destroyed++;
+  }
+  destroy();
+}
+
+size_t RetirementQueue::collect(uint64_t completedFrame)
+{
+  // the destroy calls run outside the lock, they may retire more
+  std::vector<Entry> completed;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_completedFrame = std::max(m_completedFrame, completedFrame);
+    auto pending     = std::stable_partition(m_entries.begin(), m_entries.end(),
+                                             [this](const Entry& entry) { return entry.frame > m_completedFrame; });
+    completed.assign(std::make_move_iterator(pending), std::make_move_iterator(m_entries.end()));
+    m_entries.erase(pending, m_entries.end());
+    m_destroyed += completed.size();
+  }
+  for(Entry& entry : completed)
+    entry.destroy();
+  return completed.size();
+}
+
+size_t RetirementQueue::flush()
+{
+  std::vector<Entry> all;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    all.swap(m_entries);
+    m_destroyed += all.size();
+  }
+  for(Entry& entry : all)
+    entry.destroy();
+  return all.size();
+}
+
+RetirementStats RetirementQueue::stats()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return {m_entries.size(), m_destroyed, m_completedFrame};
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+struct RetirementStats
+{
+  size_t   pending{0};
+  uint64_t destroyed{0};
+  uint64_t completedFrame{0};
+};
+
+// Resources that frames still in flight may use. A resource is retired with the serial of the
+// last frame that may have recorded it and destroyed once that frame is known to be complete,
+// frames complete in serial order. The owner learns about completed frames from their fences.
+class RetirementQueue
+{
+public:
+  using Destroy = std::function<void()>;
+
+  // destroys at once if `frame` already completed
+  void retire(uint64_t frame, Destroy destroy);
+  // destroys everything retired up to `completedFrame`, returns how many
+  size_t collect(uint64_t completedFrame);
+  // destroys everything, the device must be idle
+  size_t flush();
+
+  RetirementStats stats();
+
+private:
+  struct Entry
+  {
+    uint64_t frame;
+    Destroy  destroy;
+  };
+
+  std::vector<Entry> m_entries;
+  uint64_t           m_completedFrame{0};
+  uint64_t           m_destroyed{0};
+  std::mutex         m_mutex;
+};
@@ -24,15 +24,21 @@
 
 
 
+#include <algorithm>
+#include <cstring>
+#include <atomic>
 #include <thread>
 
 #include "nvh/alignment.hpp"
 #include "nvh/fileoperations.hpp"
 #include "nvvk/shaders_vk.hpp"
+#include "spirv_cache.hpp"
+#include "deferred_operation_pool.hpp"
 #include "rtx_pipeline.hpp"
 #include "scene.hpp"
 #include "tools.hpp"
 #include "sorting_grid.hpp"
+#include "sorting_keys.hpp"
 
 // Shaders
 #include "autogen/pathtrace.rahit.h"
@@ -76,6 +82,18 @@ void RtxPipeline::setup(const VkDevice& device, const VkPhysicalDevice& physical
   properties.pNext = &m_rtProperties;
   vkGetPhysicalDeviceProperties2(physicalDevice, &properties);
 
+  // requestDeviceFeatures enables VK_KHR_pipeline_library whenever the device has it
+  uint32_t extensionCount = 0;
+  vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, nullptr);
+  std::vector<VkExtensionProperties> extensions(extensionCount);
+  vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, extensions.data());
+  m_pipelineLibrarySupported = false;
+  for(const VkExtensionProperties& extension : extensions)
+    m_pipelineLibrarySupported |= strcmp(extension.extensionName, VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME) == 0;
+  LOGI("Pipeline libraries %s\n", m_pipelineLibrarySupported ? "supported, variants only link their raygen" : "not supported, variants are built monolithic");
+
+  // cache data of an earlier session is only reused on the same device, driver and shader sources
+  m_pipelineCacheKey = makePipelineCacheKey(properties.properties, hashShaderSources(shaderDirectory));
   createPipelineCache();
 
   m_sbtWrapper.setup(device, familyIndex, allocator, m_rtProperties);
@@ -95,7 +113,14 @@ void RtxPipeline::setup(const VkDevice& device, const VkPhysicalDevice& physical
 void RtxPipeline::destroy()
 {
 
+  // running compiles finish first, they use the layout and the pipeline cache
+  m_compileService.stop();
   destroyAsyncPipelineBuffer();
+  {
+    std::lock_guard<std::mutex> lock(compileMutex);
+    destroyHitGroupLibraries();
+    destroyStageShaders(m_stageShaders);
+  }
   m_sbtWrapper.destroy();
 
   vkDestroyPipeline(m_device, m_rtPipeline, nullptr);
@@ -111,6 +136,8 @@ void RtxPipeline::destroy()
   
   vkDestroyPipeline(m_device, m_rtPipeline_async, nullptr);
   vkDestroyPipelineLayout(m_device, m_rtPipelineLayout_async, nullptr);
+  if(m_pipelinesSinceFlush > 0)
+    flushPipelineCache();
   vkDestroyPipelineCache(m_device,m_PipelineCache,nullptr);
   m_PipelineCache = VK_NULL_HANDLE;
 
@@ -141,9 +168,10 @@ void RtxPipeline::create(const VkExtent2D& size, const std::vector<VkDescriptorS
     
   createPipelineLayout(rtDescSetLayouts,m_rtPipelineLayout);
 
-  activeElement = createPipeline(m_SERParameters);
-  activeElement.parameters = m_SERParameters;
+  activate(createPipeline(m_SERParameters, true), true);
 
+  // one core is left to the render thread
+  m_compileService.start(std::max(2u, std::thread::hardware_concurrency()) - 1);
     
     
   timer.print();
@@ -172,111 +200,205 @@ void RtxPipeline::createPipelineLayout(const std::vector<VkDescriptorSetLayout>&
 }
 
 
+// Miss, shadow miss and the triangle hit group, `anyHit` may be VK_SHADER_UNUSED_KHR
+static void appendMissAndHitGroups(std::vector<VkRayTracingShaderGroupCreateInfoKHR>& groups,
+                                   uint32_t                                           miss,
+                                   uint32_t                                           shadowMiss,
+                                   uint32_t                                           closestHit,
+                                   uint32_t                                           anyHit)
+{
+  VkRayTracingShaderGroupCreateInfoKHR group{VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR};
+  group.anyHitShader       = VK_SHADER_UNUSED_KHR;
+  group.closestHitShader   = VK_SHADER_UNUSED_KHR;
+  group.generalShader      = VK_SHADER_UNUSED_KHR;
+  group.intersectionShader = VK_SHADER_UNUSED_KHR;
+
+  // Miss
+  group.type          = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
+  group.generalShader = miss;
+  groups.push_back(group);
+
+  // Shadow Miss
+  group.generalShader = shadowMiss;
+  groups.push_back(group);
+
+  // closest hit shader
+  group.type             = VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_KHR;
+  group.generalShader    = VK_SHADER_UNUSED_KHR;
+  group.closestHitShader = closestHit;
+  group.anyHitShader     = anyHit;
+  groups.push_back(group);
+}
+
 //--------------------------------------------------------------------------------------------------
-// Pipeline for the ray tracer: all shaders, raygen, chit, miss
+// Creates the variant of `parameters` and adds it to the variant cache
 //
-PipelineStorage RtxPipeline::createPipeline(SortingParameters parameters)
+PipelineStorage RtxPipeline::createPipeline(SortingParameters parameters, bool pin, bool dynamicSorting)
 {
+  VkPipelineCreationFeedback creationFeedback{};
+  PipelineStorage newStorageElement = buildVariant(parameters, m_PipelineCache, creationFeedback, usePipelineLibrary, dynamicSorting);
+  if(newStorageElement.pipeline == VK_NULL_HANDLE)
+    return newStorageElement;
+  uint64_t key = newStorageElement.variantKey;
+
+  // the cache accounts the SBT buffer and an estimate of the pipeline itself
+  size_t variantBytes = pipelineBytesEstimate;
+  for(const VkStridedDeviceAddressRegionKHR& region : newStorageElement.sbt.getRegions())
+    variantBytes += size_t(region.size);
+
+  PipelineStorage duplicate;
+  {
+    std::lock_guard<std::mutex> lock(storageMutex);
+    if(!m_variants.insert(newStorageElement, variantBytes, m_frame))
+    {
+      // another thread created the same variant meanwhile, keep the cached one
+      duplicate = newStorageElement;
+      m_variants.find(key, m_frame, newStorageElement);
+    }
+    if(pin)
+      m_variants.pin(key);
+    if(creationFeedback.flags & VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT)
+    {
+      bool cacheHit = (creationFeedback.flags & VK_PIPELINE_CREATION_FEEDBACK_APPLICATION_PIPELINE_CACHE_HIT_BIT) != 0;
+      m_pipelineCacheStats.record(cacheHit, double(creationFeedback.duration) / 1000000.0);
+    }
+  }
 
-  SBTWrapper newWrapper;
-  newWrapper.setup(m_device,m_queueIndex,m_pAlloc,m_rtProperties);
+  if(duplicate.pipeline != VK_NULL_HANDLE)
+    destroyVariant(duplicate);
 
-  enum StageIndices
+  // saved periodically as well, a session that does not end through destroy() keeps its pipelines
+  bool flushDue;
   {
-    eRaygen,
-    eMiss,
-    eMiss2,
-    eClosestHit,
-    eAnyHit,
-    eShaderGroupCount
-  };
+    std::lock_guard<std::mutex> lock(pipelineCacheMutex);
+    m_pipelinesSinceFlush++;
+    flushDue = m_sinceCacheFlush.elapsed() > pipelineCacheFlushInterval * 1000.0;
+  }
+  if(flushDue)
+    flushPipelineCache();
 
+  return newStorageElement;
+}
 
-  // All stages
-  std::array<VkPipelineShaderStageCreateInfo, eShaderGroupCount> stages{};
-  VkPipelineShaderStageCreateInfo stage{VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO};
-  stage.pName = "main";  // All the same entry point
+//--------------------------------------------------------------------------------------------------
+// Pipeline for the ray tracer: all shaders, raygen, chit, miss
+// The stages are shared by all variants, a variant only adds its raygen specialization and the link
+//
+PipelineStorage RtxPipeline::buildVariant(const SortingParameters&   parameters,
+                                          VkPipelineCache            cache,
+                                          VkPipelineCreationFeedback& creationFeedback,
+                                          bool                       linkHitLibrary,
+                                          bool                       dynamicSorting)
+{
+  PipelineStorage variant = buildRaygenPipeline({parameters}, cache, creationFeedback, linkHitLibrary, dynamicSorting);
+  variant.variantKey      = dynamicSorting ? dynamicVariantKey() : variantKey(parameters);
+  return variant;
+}
 
-  // Raygen
-  //shaderc::SpvCompilationResult compresult = CompileShader("pathtrace.rgen",shaderc_raygen_shader);
-  //result3 = CompileShader("pathtrace.rgen",shaderc_raygen_shader);
+// Specialization constants of the raygen shader for `parameters`, cached by variant key. Called
+// with compileMutex held. The uber shader ignores the sorting parameters, it has one specialization
+nvvk::Specialization RtxPipeline::raygenSpecialization(const SortingParameters& parameters, bool dynamicSorting)
+{
+  uint64_t key = dynamicSorting ? dynamicVariantKey() : variantKey(parameters);
+  for(int i= 0; i < hashedParameterizations.size(); i++)
+  {
+    if(hashedParameterizations[i]==key)
+      return storedSpecializations[i];
+  }
 
-  int hashCode = hashParameters(parameters);
+  nvvk::Specialization specialization;
+  specialization.add(0,m_sortingMode);
+  specialization.add(1,m_enableProfiling);
+  //Add Sorting parameters as specialization constants
+  specialization.add(2,parameters.noSort); //No Sorting
+  specialization.add(3,parameters.hitObject); //HitObject
+  specialization.add(4,parameters.rayOrigin); //RayOrigin
+  specialization.add(5,parameters.rayDirection); //RayDirection
+  specialization.add(6,parameters.estimatedEndpoint); //EstEndPoint
+  specialization.add(7,parameters.realEndpoint); //RealEndpoint
+  specialization.add(8,parameters.sortAfterASTraversal); //AfterASTraversal
+  specialization.add(9,parameters.isFinished); //isFinished
+  specialization.add(12,dynamicSorting); //sorting parameters from the push constants
+  specialization.add(13,m_normalizedKeys); //fixed point keys in the scene bounds
+  specialization.add(14,int32_t(packedKeyComposition(parameters))); //bit budgets of the key features
+
+  storedSpecializations.emplace_back(specialization);
+  hashedParameterizations.emplace_back(key);
+  return specialization;
+}
 
-  bool foundOne = false;
+// One pipeline with a raygen group per entry of `raygens`, in that order, followed by the miss and
+// hit groups. A single entry is a regular variant, several are a raygen table. The returned
+// storage has no variant key, its parameters are those of the first raygen.
+PipelineStorage RtxPipeline::buildRaygenPipeline(const std::vector<SortingParameters>& raygens,
+                                                 VkPipelineCache                       cache,
+                                                 VkPipelineCreationFeedback&           creationFeedback,
+                                                 bool                                  linkHitLibrary,
+                                                 bool                                  dynamicSorting)
+{
+  if(raygens.empty())
+    return PipelineStorage();
 
-  VkShaderModule module;
-  if(!madeOne)
+  // the shader compiler, the stage shaders and the specialization cache are shared by all threads creating pipelines
+  std::unique_lock<std::mutex> compileLock(compileMutex);
+  if(m_stageShaders[eRaygen].module == VK_NULL_HANDLE)
   {
-    result3 = CompileShader("pathtrace.rgen",shaderc_raygen_shader);
-    hitshader = CompileShader("pathtrace.rchit",shaderc_closesthit_shader);
-    madeOne = true;
-    printf("made a new one\n");
+    MilliTimer timer;
+    uint32_t   cacheHits = m_spirvCacheHits;
+    if(!compileStageShaders(m_stageShaders, true))
+      return PipelineStorage();
+    LOGI("Shader stages ready in %.2f ms, %u of %d loaded from %s\n", timer.elapsed(), m_spirvCacheHits - cacheHits,
+         int(eShaderGroupCount), spirvCacheDirectory.c_str());
   }
-  module = glslCompiler.createModule(m_device,result3);
-  
 
-  //shaderc::SpvCompilationResult compresult2 = CompileShader("pathtrace.rgen",shaderc_raygen_shader);
-  //module = glslCompiler.createModule(m_device,results[0]);
-  //module = nvvk::createShaderModule(m_device, rgen.data(), sizeof(rgen));
-  stage.module    = module;
-  stage.stage     = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
-  stages[eRaygen] = stage;
+  SBTWrapper newWrapper;
+  newWrapper.setup(m_device,m_queueIndex,m_pAlloc,m_rtProperties);
 
+  // All stages, the raygens first. The other stages follow them in StageIndices order, shifted by
+  // the number of raygens beyond the first
+  uint32_t                                     numRaygens = uint32_t(raygens.size());
+  uint32_t                                     shift      = numRaygens - 1;
+  std::vector<VkPipelineShaderStageCreateInfo> stages(numRaygens + eShaderGroupCount - 1);
+  VkPipelineShaderStageCreateInfo              stage{VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO};
+  stage.pName = "main";  // All the same entry point
 
-  //add specializations
-  nvvk::Specialization specialization;
-  for(int i= 0; i < hashedParameterizations.size(); i++)
+  // Raygen, the same module specialized once per raygen. The specializations are all added before
+  // their infos are taken, they point into the elements
+  std::vector<nvvk::Specialization> specializations;
+  for(const SortingParameters& parameters : raygens)
+    specializations.emplace_back(raygenSpecialization(parameters, dynamicSorting));
+  stage.module = m_stageShaders[eRaygen].module;
+  stage.stage  = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
+  for(uint32_t i = 0; i < numRaygens; i++)
   {
-    if(hashedParameterizations[i]==hashCode)
-    {
-      specialization = storedSpecializations[i];
-      stage.module    = module;
-      foundOne = true;
-      break;
-    }
+    stages[i]                     = stage;
+    stages[i].pSpecializationInfo = specializations[i].getSpecialization();
   }
-  if(!foundOne)
-  {
-    specialization.add(0,m_sortingMode);
-    specialization.add(1,m_enableProfiling);
-    //Add Sorting parameters as specialization constants
-    specialization.add(2,parameters.noSort); //No Sorting
-    specialization.add(3,parameters.hitObject); //HitObject
-    specialization.add(4,parameters.rayOrigin); //RayOrigin
-    specialization.add(5,parameters.rayDirection); //RayDirection
-    specialization.add(6,parameters.estimatedEndpoint); //EstEndPoint
-    specialization.add(7,parameters.realEndpoint); //RealEndpoint
-    specialization.add(8,parameters.sortAfterASTraversal); //AfterASTraversal
-    specialization.add(9,parameters.isFinished); //isFinished
-
-    storedSpecializations.emplace_back(specialization);
-    hashedParameterizations.emplace_back(hashCode);
-  }
-  
-  stages[eRaygen].pSpecializationInfo = specialization.getSpecialization();
-  
-
 
   // Miss
-  stage.module  = CompileAndCreateShaderModule("pathtrace.rmiss",shaderc_miss_shader);
-  stage.stage   = VK_SHADER_STAGE_MISS_BIT_KHR;
-  stages[eMiss] = stage;
+  stage.module          = m_stageShaders[eMiss].module;
+  stage.stage           = VK_SHADER_STAGE_MISS_BIT_KHR;
+  stages[eMiss + shift] = stage;
 
   // The second miss shader is invoked when a shadow ray misses the geometry. It simply indicates that no occlusion has been found
-  stage.module   = CompileAndCreateShaderModule("pathtraceShadow.rmiss",shaderc_miss_shader);
-  stage.stage    = VK_SHADER_STAGE_MISS_BIT_KHR;
-  stages[eMiss2] = stage;
+  stage.module           = m_stageShaders[eMiss2].module;
+  stage.stage            = VK_SHADER_STAGE_MISS_BIT_KHR;
+  stages[eMiss2 + shift] = stage;
 
   // Hit Group - Closest Hit
-  stage.module        =glslCompiler.createModule(m_device,hitshader);// CompileAndCreateShaderModule("pathtrace.rchit",shaderc_closesthit_shader);
-  stage.stage         = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
-  stages[eClosestHit] = stage;
+  stage.module                = m_stageShaders[eClosestHit].module;
+  stage.stage                 = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
+  stages[eClosestHit + shift] = stage;
 
   // Hit Group - Any Hit
-  stage.module    = CompileAndCreateShaderModule("pathtrace.rahit",shaderc_anyhit_shader);
-  stage.stage     = VK_SHADER_STAGE_ANY_HIT_BIT_KHR;
-  stages[eAnyHit] = stage;
+  stage.module            = m_stageShaders[eAnyHit].module;
+  stage.stage             = VK_SHADER_STAGE_ANY_HIT_BIT_KHR;
+  stages[eAnyHit + shift] = stage;
+
+  // with a hit group library the variant only brings its raygens, the other stages are linked
+  VkPipeline library = linkHitLibrary && m_pipelineLibrarySupported ? hitGroupLibrary(cache) : VK_NULL_HANDLE;
+  VkRayTracingPipelineCreateInfoKHR libraryCreateInfo = m_hitLibraries[m_enableAnyhit].createInfo;
+  compileLock.unlock();
 
 
   // Shader groups
@@ -288,100 +410,176 @@ PipelineStorage RtxPipeline::createPipeline(SortingParameters parameters)
   group.intersectionShader = VK_SHADER_UNUSED_KHR;
 
   // Raygen
-  group.type          = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
-  group.generalShader = eRaygen;
-  groups.push_back(group);
+  group.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
+  for(uint32_t i = 0; i < numRaygens; i++)
+  {
+    group.generalShader = i;
+    groups.push_back(group);
+  }
 
-  // Miss
-  group.type          = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
-  group.generalShader = eMiss;
-  groups.push_back(group);
-
-  // Shadow Miss
-  group.type          = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
-  group.generalShader = eMiss2;
-  groups.push_back(group);
-
-  // closest hit shader
-  group.type             = VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_KHR;
-  group.generalShader    = VK_SHADER_UNUSED_KHR;
-  group.closestHitShader = eClosestHit;
-  if(m_enableAnyhit)
-    group.anyHitShader = eAnyHit;
-  groups.push_back(group);
+  // Miss, shadow miss and closest hit, the linked library appends the same groups after the raygens
+  if(library == VK_NULL_HANDLE)
+    appendMissAndHitGroups(groups, eMiss + shift, eMiss2 + shift, eClosestHit + shift,
+                           m_enableAnyhit ? uint32_t(eAnyHit + shift) : VK_SHADER_UNUSED_KHR);
 
   // --- Pipeline ---
   // Assemble the shader stages and recursion depth info into the ray tracing pipeline
   VkRayTracingPipelineCreateInfoKHR rayPipelineInfo{VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR};
-  m_createInfo.stageCount = static_cast<uint32_t>(stages.size());  // Stages are shaders
-  m_createInfo.pStages    = stages.data();
+  rayPipelineInfo.stageCount = library ? numRaygens : static_cast<uint32_t>(stages.size());  // Stages are shaders
+  rayPipelineInfo.pStages    = stages.data();
 
-  m_createInfo.groupCount = static_cast<uint32_t>(groups.size());  // 1-raygen, n-miss, n-(hit[+anyhit+intersect])
-  m_createInfo.pGroups    = groups.data();
+  rayPipelineInfo.groupCount = static_cast<uint32_t>(groups.size());  // n-raygen, n-miss, n-(hit[+anyhit+intersect])
+  rayPipelineInfo.pGroups    = groups.data();
 
-  m_createInfo.maxPipelineRayRecursionDepth = 2;  // Ray depth
-  m_createInfo.layout                       = m_rtPipelineLayout;
+  rayPipelineInfo.maxPipelineRayRecursionDepth = RAY_RECURSION_DEPTH;  // Ray depth
+  rayPipelineInfo.layout                       = m_rtPipelineLayout;
 
-  // Create a deferred operation (compiling in parallel)
-  bool                   useDeferred{true};
-  VkResult               result;
-  VkDeferredOperationKHR deferredOp{VK_NULL_HANDLE};
-  if(useDeferred)
+  VkPipelineLibraryCreateInfoKHR             libraryInfo{VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR};
+  VkRayTracingPipelineInterfaceCreateInfoKHR interfaceInfo = libraryInterface();
+  if(library != VK_NULL_HANDLE)
   {
-    result = vkCreateDeferredOperationKHR(m_device, nullptr, &deferredOp);
-    assert(result == VK_SUCCESS);
+    libraryInfo.libraryCount          = 1;
+    libraryInfo.pLibraries            = &library;
+    rayPipelineInfo.pLibraryInfo      = &libraryInfo;
+    rayPipelineInfo.pLibraryInterface = &interfaceInfo;
   }
-  //vkCreateRayTracingPipelinesKHR(m_device, deferredOp,m_PipelineCache, 1, &m_createInfo, nullptr, &pipeline);
-  VkPipeline newPipeline{VK_NULL_HANDLE};
-  vkCreateRayTracingPipelinesKHR(m_device, deferredOp,m_PipelineCache, 1, &m_createInfo, nullptr, &newPipeline);
 
+  // tells whether the driver found the pipeline in `cache` and how long creating it took
+  VkPipelineCreationFeedbackCreateInfo feedbackInfo{VK_STRUCTURE_TYPE_PIPELINE_CREATION_FEEDBACK_CREATE_INFO};
+  feedbackInfo.pPipelineCreationFeedback = &creationFeedback;
+  rayPipelineInfo.pNext                  = &feedbackInfo;
 
-  if(useDeferred)
+  VkPipeline newPipeline = createRayTracingPipeline(rayPipelineInfo, cache);
+  if(newPipeline == VK_NULL_HANDLE)
   {
-    // Query the maximum amount of concurrency and clamp to the desired maximum
-    uint32_t maxThreads{8};
-    uint32_t numLaunches = std::min(vkGetDeferredOperationMaxConcurrencyKHR(m_device, deferredOp), maxThreads);
-
-    std::vector<std::future<void>> joins;
-    for(uint32_t i = 0; i < numLaunches; i++)
-    {
-      VkDevice device{m_device};
-      joins.emplace_back(std::async(std::launch::async, [device, deferredOp]() {
-        // A return of VK_THREAD_IDLE_KHR should queue another job
-        vkDeferredOperationJoinKHR(device, deferredOp);
-      }));
-    }
-
-    for(auto& f : joins)
-    {
-      f.get();
-    }
-
-    // deferred operation is now complete.  'result' indicates success or failure
-    result = vkGetDeferredOperationResultKHR(m_device, deferredOp);
-    assert(result == VK_SUCCESS);
-    vkDestroyDeferredOperationKHR(m_device, deferredOp, nullptr);
+    LOGE("Creating the pipeline of variant %d with %u raygens failed\n", hashParameters(raygens[0]), numRaygens);
+    return PipelineStorage();
   }
   //storedPipelines.emplace_back(newPipeline);
 
-  newWrapper.create(newPipeline,m_createInfo);
+  {
+    std::lock_guard<std::mutex> lock(allocatorMutex);
+    if(library != VK_NULL_HANDLE)
+      newWrapper.create(newPipeline, rayPipelineInfo, {libraryCreateInfo});
+    else
+      newWrapper.create(newPipeline,rayPipelineInfo);
+  }
   //wrappers[0].create(pipelines[activePipeline],m_createInfo);
 
   PipelineStorage newStorageElement;
   newStorageElement.pipeline = newPipeline;
   newStorageElement.sbt = newWrapper;
-  storage.emplace_back(newStorageElement);
-
+  newStorageElement.parameters = raygens[0];
 
   //storedSBTs.emplace_back(newWrapper);
-  // --- Clean up ---
-  for(auto& s : stages)
-    vkDestroyShaderModule(m_device, s.module, nullptr);
-
   return newStorageElement;
 }
 
 
+// Payload and attribute limits, the library and every variant linked against it must agree
+VkRayTracingPipelineInterfaceCreateInfoKHR RtxPipeline::libraryInterface() const
+{
+  VkRayTracingPipelineInterfaceCreateInfoKHR interfaceInfo{VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_INTERFACE_CREATE_INFO_KHR};
+  interfaceInfo.maxPipelineRayPayloadSize      = MAX_RAY_PAYLOAD_SIZE;
+  interfaceInfo.maxPipelineRayHitAttributeSize = m_rtProperties.maxRayHitAttributeSize;
+  return interfaceInfo;
+}
+
+// The miss and hit groups of the current any hit setting as a pipeline library, built on first
+// use. Returns VK_NULL_HANDLE if the driver fails to build it, callers then build monolithic
+// pipelines. Called with compileMutex held.
+VkPipeline RtxPipeline::hitGroupLibrary(VkPipelineCache cache)
+{
+  HitGroupLibrary& library = m_hitLibraries[m_enableAnyhit];
+  if(library.pipeline != VK_NULL_HANDLE || library.failed)
+    return library.pipeline;
+
+  MilliTimer                      timer;
+  VkPipelineShaderStageCreateInfo stage{VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO};
+  stage.pName = "main";
+  library.stages.clear();
+  for(StageIndices index : {eMiss, eMiss2, eClosestHit, eAnyHit})
+  {
+    stage.module = m_stageShaders[index].module;
+    stage.stage  = index == eClosestHit ? VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR :
+                   index == eAnyHit     ? VK_SHADER_STAGE_ANY_HIT_BIT_KHR :
+                                          VK_SHADER_STAGE_MISS_BIT_KHR;
+    library.stages.push_back(stage);
+  }
+  library.groups.clear();
+  appendMissAndHitGroups(library.groups, 0, 1, 2, m_enableAnyhit ? 3 : VK_SHADER_UNUSED_KHR);
+
+  VkRayTracingPipelineInterfaceCreateInfoKHR interfaceInfo = libraryInterface();
+  VkRayTracingPipelineCreateInfoKHR          createInfo{VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR};
+  createInfo.flags                        = VK_PIPELINE_CREATE_LIBRARY_BIT_KHR;
+  createInfo.stageCount                   = uint32_t(library.stages.size());
+  createInfo.pStages                      = library.stages.data();
+  createInfo.groupCount                   = uint32_t(library.groups.size());
+  createInfo.pGroups                      = library.groups.data();
+  createInfo.maxPipelineRayRecursionDepth = RAY_RECURSION_DEPTH;
+  createInfo.pLibraryInterface            = &interfaceInfo;
+  createInfo.layout                       = m_rtPipelineLayout;
+
+  library.pipeline = createRayTracingPipeline(createInfo, cache);
+  if(library.pipeline == VK_NULL_HANDLE)
+  {
+    LOGE("Building the hit group library failed, pipelines are built without it\n");
+    library.failed = true;
+    return VK_NULL_HANDLE;
+  }
+
+  // kept for the SBTs of the linked variants, which only read the stages and groups
+  createInfo.pLibraryInterface = nullptr;
+  library.createInfo           = createInfo;
+  library.buildMs              = timer.elapsed();
+  LOGI("Built the hit group library%s in %.2f ms\n", m_enableAnyhit ? " with any hit" : "", library.buildMs);
+  return library.pipeline;
+}
+
+void RtxPipeline::destroyHitGroupLibraries()
+{
+  for(HitGroupLibrary& library : m_hitLibraries)
+  {
+    vkDestroyPipeline(m_device, library.pipeline, nullptr);
+    library = HitGroupLibrary();
+  }
+}
+
+// Creates the pipeline with a deferred operation, joined by the shared DeferredOperationPool
+VkPipeline RtxPipeline::createRayTracingPipeline(const VkRayTracingPipelineCreateInfoKHR& createInfo, VkPipelineCache cache)
+{
+  // Create a deferred operation (compiling in parallel)
+  bool                   useDeferred{true};
+  VkResult               result;
+  VkDeferredOperationKHR deferredOp{VK_NULL_HANDLE};
+  if(useDeferred)
+  {
+    result = vkCreateDeferredOperationKHR(m_device, nullptr, &deferredOp);
+    assert(result == VK_SUCCESS);
+  }
+  //vkCreateRayTracingPipelinesKHR(m_device, deferredOp,m_PipelineCache, 1, &m_createInfo, nullptr, &pipeline);
+  VkPipeline newPipeline{VK_NULL_HANDLE};
+  result = vkCreateRayTracingPipelinesKHR(m_device, deferredOp, cache, 1, &createInfo, nullptr, &newPipeline);
+
+
+  if(useDeferred && result == VK_OPERATION_DEFERRED_KHR)
+  {
+    // the pool's workers are shared by all variants built at the same time, concurrency is
+    // capped at the hardware threads however many are built
+    result = DeferredOperationPool::shared().join(m_device, deferredOp);
+  }
+  if(useDeferred)
+    vkDestroyDeferredOperationKHR(m_device, deferredOp, nullptr);
+
+  if(result != VK_SUCCESS && result != VK_OPERATION_NOT_DEFERRED_KHR)
+  {
+    vkDestroyPipeline(m_device, newPipeline, nullptr);
+    return VK_NULL_HANDLE;
+  }
+  return newPipeline;
+}
+
+
 //--------------------------------------------------------------------------------------------------
 // Ray Tracing the scene
 //
@@ -389,8 +587,59 @@ void RtxPipeline::run(const VkCommandBuffer& cmdBuf, const VkExtent2D& size, nvv
 {
   LABEL_SCOPE_VK(cmdBuf);
 
+  // the bound variant stays in flight for the next framesInFlight frames, eviction works around it
+  VkPipeline                                     pipeline;
+  std::array<VkStridedDeviceAddressRegionKHR, 4> regions;
+  {
+    std::lock_guard<std::mutex> lock(storageMutex);
+    m_frame++;
+    m_variants.entryBudget    = size_t(std::max(variantEntryBudget, 1));
+    m_variants.memoryBudget   = size_t(std::max(variantMemoryBudgetMB, 1)) << 20;
+    m_variants.framesInFlight = 0;  // evicted variants are retired until the fences of their frames signaled
+
+    // a selected raygen of a table, or an uber shader, built under other settings falls back to the active variant
+    if(m_raygenSlot >= 0 && (!useRaygenTable || m_raygenTable.context != variantContext()))
+    {
+      m_raygenSlot    = -1;
+      m_SERParameters = activeElement.parameters;
+    }
+    if(m_dynamicActive && m_dynamicElement.variantKey != dynamicVariantKey())
+    {
+      m_dynamicActive = false;
+      m_SERParameters = activeElement.parameters;
+    }
+    if(m_switchDelivered.pipeline != VK_NULL_HANDLE)
+    {
+      if(activeElement.pipeline != VK_NULL_HANDLE)
+        m_variants.unpin(activeElement.variantKey);
+      activeElement     = m_switchDelivered;
+      m_switchDelivered = PipelineStorage();
+      m_SERParameters   = activeElement.parameters;
+      m_raygenSlot      = -1;
+      m_dynamicActive   = false;
+      recordSwitch();
+    }
+    const PipelineStorage& bound = m_raygenSlot >= 0 ? m_raygenTable.storage : m_dynamicActive ? m_dynamicElement : activeElement;
+    m_variants.markUsed(bound.variantKey, m_frame);
+    pipeline = bound.pipeline;
+    regions  = bound.sbt.getRegions(uint32_t(std::max(m_raygenSlot, 0)));
+    m_variants.evict(m_frame, [this](PipelineStorage& element) { retireVariant(element); });
+
+    // read by the uber shader, the specialized variants have them as constants
+    m_state.numCoherenceBitsTotal = m_SERParameters.numCoherenceBitsTotal;
+    m_state.sortAfterASTraversal  = m_SERParameters.sortAfterASTraversal;
+    m_state.noSort                = m_SERParameters.noSort;
+    m_state.hitObject             = m_SERParameters.hitObject;
+    m_state.rayOrigin             = m_SERParameters.rayOrigin;
+    m_state.rayDirection          = m_SERParameters.rayDirection;
+    m_state.estimatedEndpoint     = m_SERParameters.estimatedEndpoint;
+    m_state.realEndpoint          = m_SERParameters.realEndpoint;
+    m_state.isFinished            = m_SERParameters.isFinished;
+    m_state.keyComposition        = packedKeyComposition(m_SERParameters);
+  }
 
-  vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, activeElement.pipeline);
+
+  vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipeline);
   vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, m_rtPipelineLayout, 0,
                           static_cast<uint32_t>(descSets.size()), descSets.data(), 0, nullptr);
   vkCmdPushConstants(cmdBuf, m_rtPipelineLayout,
@@ -398,8 +647,6 @@ void RtxPipeline::run(const VkCommandBuffer& cmdBuf, const VkExtent2D& size, nvv
                      0, sizeof(RtxState), &m_state);
 
 
-  auto& regions = activeElement.sbt.getRegions();
-  
   vkCmdTraceRaysKHR(cmdBuf, &regions[0], &regions[1], &regions[2], &regions[3], size.width, size.height, 1);
 }
 
@@ -415,16 +662,15 @@ void RtxPipeline::useAnyHit(bool enable)
 
 void RtxPipeline::setupGLSLCompiler()
 {
-  std::vector<std::string> defaultSearchPaths;
-  std::string shaderPath = "C:/Users/Frederik/Key_Inference/Prototype/shaders";
-  defaultSearchPaths.push_back(shaderPath);
-  nvvkhl::GlslIncluder glslIncluder(defaultSearchPaths);
-  for (std::string path : defaultSearchPaths)
+  m_includeDirectories = {shaderDirectory};
+  for (std::string path : m_includeDirectories)
   {
     glslCompiler.addInclude(path);
   }
   glslCompiler.options()->SetTargetSpirv(shaderc_spirv_version_1_4);
   glslCompiler.options()->SetTargetEnvironment(shaderc_target_env_vulkan,shaderc_env_version_vulkan_1_3);
+  // keep in sync with the options above, cached SPIR-V is only reused under the same options
+  m_compileOptions = "spirv1.4 vulkan1.3";
 
 }
 
@@ -432,7 +678,6 @@ void RtxPipeline::setupGLSLCompiler()
 shaderc::SpvCompilationResult RtxPipeline::CompileShader(std::string filename, shaderc_shader_kind shadertype)
 {
   shaderc::SpvCompilationResult compResult = glslCompiler.compileFile(filename,shadertype);
-  auto compilationSize = (compResult.end() - compResult.begin()) * sizeof(uint32_t);
   const uint32_t* pCode =  reinterpret_cast<const uint32_t*>(compResult.begin());
   
   rgen.clear();
@@ -441,12 +686,6 @@ shaderc::SpvCompilationResult RtxPipeline::CompileShader(std::string filename, s
     rgen.emplace_back(pCode[i]);
   }
 
-
-  //rgen.assign(pCode,pCode+compilationSize);
-  std::ofstream myfile;
-  myfile.open("example.txt");
-  myfile.write(reinterpret_cast<const char*>(pCode),compilationSize);
-  myfile.close();
   return compResult;
 }
 
@@ -460,6 +699,136 @@ VkShaderModule RtxPipeline::CompileAndCreateShaderModule(std::string filename, s
   return resultModule;
 }
 
+// SPIR-V of `filename` from the cache in spirvCacheDirectory, compiled and added to it on a miss
+bool RtxPipeline::compileSpirv(const char* filename, shaderc_shader_kind kind, std::vector<uint32_t>& spirv, bool useCache)
+{
+  std::string options = m_compileOptions + " kind " + std::to_string(int(kind));
+  std::string path    = spirvCachePath(spirvCacheDirectory, filename, spirvCacheKey(filename, m_includeDirectories, options));
+  if(useCache && loadCachedSpirv(path, spirv))
+  {
+    m_spirvCacheHits++;
+    return true;
+  }
+
+  shaderc::SpvCompilationResult compResult = glslCompiler.compileFile(filename, kind);
+  if(compResult.GetCompilationStatus() != shaderc_compilation_status_success)
+  {
+    LOGE("Compiling %s failed:\n%s\n", filename, compResult.GetErrorMessage().c_str());
+    return false;
+  }
+  spirv.assign(compResult.begin(), compResult.end());
+  if(useCache)
+    saveCachedSpirv(path, spirv);
+  return true;
+}
+
+// SPIR-V and module of every stage, on failure nothing is kept
+bool RtxPipeline::compileStageShaders(StageShaders& shaders, bool useCache)
+{
+  struct StageSource
+  {
+    const char*         filename;
+    shaderc_shader_kind kind;
+  };
+  static const StageSource sources[eShaderGroupCount] = {
+      {"pathtrace.rgen", shaderc_raygen_shader},          {"pathtrace.rmiss", shaderc_miss_shader},
+      {"pathtraceShadow.rmiss", shaderc_miss_shader},     {"pathtrace.rchit", shaderc_closesthit_shader},
+      {"pathtrace.rahit", shaderc_anyhit_shader},
+  };
+
+  for(int i = 0; i < eShaderGroupCount; i++)
+  {
+    MilliTimer timer;
+    if(!compileSpirv(sources[i].filename, sources[i].kind, shaders[i].spirv, useCache))
+    {
+      destroyStageShaders(shaders);
+      return false;
+    }
+    shaders[i].compileMs = float(timer.elapsed());
+    timer.reset();
+    shaders[i].module   = nvvk::createShaderModule(m_device, shaders[i].spirv.data(), shaders[i].spirv.size() * sizeof(uint32_t));
+    shaders[i].moduleMs = float(timer.elapsed());
+  }
+  return true;
+}
+
+void RtxPipeline::destroyStageShaders(StageShaders& shaders)
+{
+  for(StageShader& shader : shaders)
+  {
+    vkDestroyShaderModule(m_device, shader.module, nullptr);
+    shader = StageShader();
+  }
+}
+
+// Per variant creation time of `numVariants` legal configurations. Before the stages were shared,
+// every variant compiled both miss shaders and the any hit shader and created all five modules,
+// that cost is measured per stage and added to the link. The pipeline cache is bypassed so every
+// variant is really linked.
+void RtxPipeline::benchmarkVariantCreation(uint32_t numVariants)
+{
+  std::vector<SortingParameters> variants = enumerateLegalSortingParameters();
+  numVariants = std::min(numVariants, uint32_t(variants.size()));
+  if(numVariants == 0)
+    return;
+
+  double perVariantStagesMs = 0.0;
+  for(uint32_t i = 0; i < numVariants; i++)
+  {
+    StageShaders                shaders;
+    std::lock_guard<std::mutex> lock(compileMutex);
+    if(!compileStageShaders(shaders, false))
+      return;
+    for(int stage = 0; stage < eShaderGroupCount; stage++)
+    {
+      bool recompiled = stage == eMiss || stage == eMiss2 || stage == eAnyHit;
+      perVariantStagesMs += shaders[stage].moduleMs + (recompiled ? shaders[stage].compileMs : 0.0f);
+    }
+    destroyStageShaders(shaders);
+  }
+  perVariantStagesMs /= numVariants;
+
+  // the first variant compiles the shared stages if nothing did yet
+  VkPipelineCreationFeedback feedback{};
+  PipelineStorage            warmup = buildVariant(variants[0], VK_NULL_HANDLE, feedback, false);
+  if(warmup.pipeline == VK_NULL_HANDLE)
+    return;
+  destroyVariant(warmup);
+
+  MilliTimer timer;
+  for(uint32_t i = 0; i < numVariants; i++)
+  {
+    PipelineStorage variant = buildVariant(variants[i], VK_NULL_HANDLE, feedback, false);
+    destroyVariant(variant);
+  }
+  double linkMs = timer.elapsed() / numVariants;
+
+  LOGI("Creating %u variants: %.2f ms per variant with per variant stages (%.2f ms stages + %.2f ms link), %.2f ms with shared stages\n",
+       numVariants, perVariantStagesMs + linkMs, perVariantStagesMs, linkMs, linkMs);
+
+  if(!m_pipelineLibrarySupported)
+    return;
+
+  // built here if nothing did yet, so the loop below only times the link
+  double libraryMs = 0.0;
+  {
+    std::lock_guard<std::mutex> lock(compileMutex);
+    if(hitGroupLibrary(VK_NULL_HANDLE) == VK_NULL_HANDLE)
+      return;
+    libraryMs = m_hitLibraries[m_enableAnyhit].buildMs;
+  }
+
+  timer.reset();
+  for(uint32_t i = 0; i < numVariants; i++)
+  {
+    PipelineStorage variant = buildVariant(variants[i], VK_NULL_HANDLE, feedback, true);
+    destroyVariant(variant);
+  }
+  double linkedMs = timer.elapsed() / numVariants;
+
+  LOGI("Creating %u variants against the hit group library: %.2f ms per variant, %.2f ms once for the library\n",
+       numVariants, linkedMs, libraryMs);
+}
 
 void RtxPipeline::setSortingMode(int index)
 {
@@ -473,6 +842,36 @@ void RtxPipeline::enableProfiling(bool enable)
   createPipeline(m_SERParameters);
 }
 
+// The encoding is a specialization constant: the active variant, the raygen table and the prebuilt
+// variants are replaced by ones built with the new encoding
+void RtxPipeline::useNormalizedKeys(bool enable)
+{
+  if(enable == m_normalizedKeys)
+    return;
+  m_normalizedKeys = enable;
+
+  std::vector<PipelineStorage> stale;
+  {
+    std::lock_guard<std::mutex> lock(prebuildMutex);
+    stale.swap(PrebuildPipelineBuffer);
+  }
+  std::vector<int> tableHashCodes;
+  {
+    std::lock_guard<std::mutex> lock(storageMutex);
+    for(const PipelineStorage& element : stale)
+      m_variants.unpin(element.variantKey);
+    tableHashCodes = m_raygenTable.hashCodes;
+  }
+
+  // the variant of the other encoding may still be cached from an earlier toggle
+  PipelineStorage variant = findOrCreatePipeline(m_SERParameters);
+  if(variant.pipeline != VK_NULL_HANDLE)
+    activate(variant, false);
+  if(!tableHashCodes.empty())
+    buildRaygenTable(tableHashCodes);
+  topUpPrebuildBuffer();
+}
+
 
 void RtxPipeline::setPipeline(int index)
 {
@@ -496,13 +895,27 @@ int RtxPipeline::hashParameters(SortingParameters parameters)
   result |= parameters.realEndpoint ? 64: 0;
   result |= parameters.isFinished ? 128: 0;
 
+  // bits 8..13 hold the number of coherence bits, stored as 32 - n so that
+  // hashes recorded before the bit count was part of the hash still mean 32 bits
+  uint32_t coherenceBits = std::min(parameters.numCoherenceBitsTotal, 32u);
+  result |= int(32 - coherenceBits) << 8;
+
+  // bits 14..30 hold the bit budgets of the key features, 0 in hashes recorded before them
+  result |= int(packedKeyComposition(parameters)) << 14;
+
   return result;
 }
 
 SortingParameters RtxPipeline::rebuildFromhash(int hashCode)
 {
-  SortingParameters result;
-  result.numCoherenceBitsTotal = 32;
+  SortingParameters result{};
+  result.numCoherenceBitsTotal = 32 - ((hashCode >> 8) & 63);
+  uint32_t composition         = uint32_t(hashCode) >> 14;
+  result.originBits            = composition & sortkey::KEY_BUDGET_MAX;
+  result.directionBits         = (composition >> sortkey::KEY_BUDGET_BITS) & sortkey::KEY_BUDGET_MAX;
+  result.estimatedEndpointBits = (composition >> (2 * sortkey::KEY_BUDGET_BITS)) & sortkey::KEY_BUDGET_MAX;
+  result.realEndpointBits      = (composition >> (3 * sortkey::KEY_BUDGET_BITS)) & sortkey::KEY_BUDGET_MAX;
+  result.interleaveFeatures    = (composition & sortkey::KEY_INTERLEAVE_FLAG) != 0 ? 1 : 0;
   result.noSort = CHECK_BIT(hashCode,0);
   result.sortAfterASTraversal = CHECK_BIT(hashCode,1);
   result.hitObject = CHECK_BIT(hashCode,2);
@@ -542,89 +955,481 @@ return newObject.compResult;
 }
 
 
+// Starts from the data saved by an earlier session if it was created under m_pipelineCacheKey
 void RtxPipeline::createPipelineCache()
 {
+  std::vector<uint8_t> data;
+  loadPipelineCacheData(pipelineCacheFile, m_pipelineCacheKey, data);
 
   VkPipelineCacheCreateInfo createInfo{VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO};
   createInfo.pNext = nullptr;
-  createInfo.initialDataSize = 0;
+  createInfo.initialDataSize = data.size();
+  createInfo.pInitialData = data.empty() ? nullptr : data.data();
   createInfo.flags = 0;
 
   VkResult result = vkCreatePipelineCache(m_device,&createInfo,nullptr,&m_PipelineCache);
+  if(result != VK_SUCCESS && !data.empty())
+  {
+    // the driver refused the saved data, start empty
+    createInfo.initialDataSize = 0;
+    createInfo.pInitialData = nullptr;
+    result = vkCreatePipelineCache(m_device,&createInfo,nullptr,&m_PipelineCache);
+  }
   if(result == VK_SUCCESS)
   {
-    printf("Success\n");
+    LOGI("Pipeline cache created with %zu bytes of saved data\n", size_t(createInfo.initialDataSize));
   }
 
+  std::lock_guard<std::mutex> lock(pipelineCacheMutex);
+  m_sinceCacheFlush.reset();
+  m_pipelinesSinceFlush = 0;
 }
 
-void RtxPipeline::fillPipelineBuffer()
+void RtxPipeline::flushPipelineCache()
 {
- 
- if(PrebuildPipelineBuffer.size()<5)
- {
+  if(m_PipelineCache == VK_NULL_HANDLE)
+    return;
+
+  std::lock_guard<std::mutex> lock(pipelineCacheMutex);
+  size_t size = 0;
+  vkGetPipelineCacheData(m_device, m_PipelineCache, &size, nullptr);
+  std::vector<uint8_t> data(size);
+  // the cache can grow between both calls, an incomplete copy is not saved
+  if(size == 0 || vkGetPipelineCacheData(m_device, m_PipelineCache, &size, data.data()) != VK_SUCCESS)
+    return;
+  data.resize(size);
+
   MilliTimer timer;
-  LOGI("Create RtxPipeline:");
-  //create the new parameters
-  //SortingParameters newSortingParameters = morphSortingParameters(mostRecentParameters);
-  SortingParameters newSortingParameters = createSortingParameters1();
-  mostRecentParameters = newSortingParameters;
-  //create new pipeline
-  PipelineStorage newElement = createPipeline(newSortingParameters);
-  newElement.parameters = newSortingParameters;
-  PrebuildPipelineBuffer.emplace_back(newElement);    
-  timer.print();
- }
+  if(savePipelineCacheData(pipelineCacheFile, m_pipelineCacheKey, data))
+  {
+    LOGI("Saved %zu bytes of pipeline cache to %s in %.2f ms\n", size, pipelineCacheFile.c_str(), timer.elapsed());
+  }
+  m_sinceCacheFlush.reset();
+  m_pipelinesSinceFlush = 0;
+}
+
+PipelineCacheStats RtxPipeline::cacheStatistics()
+{
+  std::lock_guard<std::mutex> lock(storageMutex);
+  return m_pipelineCacheStats;
+}
+
+// Keeps NUM_PREBUILT_PIPELINES random unmeasured configurations built or being built
+void RtxPipeline::topUpPrebuildBuffer()
+{
+  std::lock_guard<std::mutex> lock(prebuildMutex);
+  while(useAsyncPipelineCreation && int(PrebuildPipelineBuffer.size()) + m_pendingPrebuilds < NUM_PREBUILT_PIPELINES)
+  {
+    //SortingParameters newSortingParameters = morphSortingParameters(mostRecentParameters);
+    SortingParameters newSortingParameters = createSortingParameters1();
+    mostRecentParameters = newSortingParameters;
+    m_pendingPrebuilds++;
+    m_compileService.request(
+        variantKey(newSortingParameters), ePriorityPrebuild,
+        [this, newSortingParameters]() { return findOrCreatePipeline(newSortingParameters); },
+        [this](const PipelineStorage& element) { addPrebuiltPipeline(element); });
+  }
+}
 
- 
+// Runs on a compile worker. The variant is pinned until setNewPipeline takes it, one the
+// cache evicted meanwhile is replaced by another request
+void RtxPipeline::addPrebuiltPipeline(const PipelineStorage& element)
+{
+  bool pinned;
+  {
+    std::lock_guard<std::mutex> lock(storageMutex);
+    // requested before the encoding, profiling or sorting mode changed
+    bool current = (element.variantKey & ~uint64_t(0xFFFFFFFF)) == variantContext();
+    pinned       = element.pipeline != VK_NULL_HANDLE && current && m_variants.pin(element.variantKey);
+  }
+  {
+    std::lock_guard<std::mutex> lock(prebuildMutex);
+    m_pendingPrebuilds = std::max(m_pendingPrebuilds - 1, 0);
+    if(pinned)
+      PrebuildPipelineBuffer.emplace_back(element);
+  }
+  if(!pinned)
+    topUpPrebuildBuffer();
+}
 
+bool RtxPipeline::hasPrebuiltPipeline()
+{
+  std::lock_guard<std::mutex> lock(prebuildMutex);
+  return !PrebuildPipelineBuffer.empty();
 }
 
 
 void RtxPipeline::setNewPipeline()
 {
 
-  activeElement = PrebuildPipelineBuffer[0];
-  m_SERParameters = activeElement.parameters;
-  PrebuildPipelineBuffer.erase(PrebuildPipelineBuffer.begin());
+  PipelineStorage prebuilt;
+  {
+    std::lock_guard<std::mutex> lock(prebuildMutex);
+    if(PrebuildPipelineBuffer.empty())
+      return;
+    prebuilt = PrebuildPipelineBuffer[0];
+    PrebuildPipelineBuffer.erase(PrebuildPipelineBuffer.begin());
+  }
+  activate(prebuilt, true);
+  topUpPrebuildBuffer();
 
 }
 
 
 void RtxPipeline::setNewPipeline(PipelineStorage newPipelineElement)
 {
-  activeElement = newPipelineElement;
-  m_SERParameters = activeElement.parameters;
+  activate(newPipelineElement, false);
   //PrebuildPipelineBuffer.erase(PrebuildPipelineBuffer.begin());
 }
-void RtxPipeline::activateAsyncPipelineCreation()
+
+// The active variant is pinned in the cache, `pinned` if the caller already holds a pin for it
+void RtxPipeline::activate(const PipelineStorage& element, bool pinned)
+{
+  std::lock_guard<std::mutex> lock(storageMutex);
+  if(!pinned)
+    m_variants.pin(element.variantKey);
+  if(activeElement.pipeline != VK_NULL_HANDLE)
+    m_variants.unpin(activeElement.variantKey);
+  activeElement   = element;
+  m_SERParameters = activeElement.parameters;
+  m_raygenSlot    = -1;
+  m_dynamicActive = false;
+  recordSwitch();
+}
+
+// Called with storageMutex held
+void RtxPipeline::recordSwitch()
 {
-    std::thread([&,this]() 
+  // every switch supersedes one requested with requestSwitch
+  m_switchRequested = false;
+  if(m_switchDelivered.pipeline != VK_NULL_HANDLE)
+    m_variants.unpin(m_switchDelivered.variantKey);
+  m_switchDelivered = PipelineStorage();
+
+  if(m_frame > m_completedFrame)
+  {
+    m_pendingSwitches.push_back({m_frame, MilliTimer()});
+    m_switchStats.switches++;
+  }
+}
+
+uint64_t RtxPipeline::currentFrame()
+{
+  std::lock_guard<std::mutex> lock(storageMutex);
+  return m_frame;
+}
+
+// Frames complete in order, `frame` completing means all frames before it did as well
+void RtxPipeline::frameCompleted(uint64_t frame)
+{
+  {
+    std::lock_guard<std::mutex> lock(storageMutex);
+    m_completedFrame = std::max(m_completedFrame, frame);
+    auto resolved    = std::remove_if(m_pendingSwitches.begin(), m_pendingSwitches.end(), [this](PendingSwitch& pending) {
+      if(pending.frame > m_completedFrame)
+        return false;
+      m_switchStats.avoidedMs += pending.sinceSwitch.elapsed();
+      return true;
+    });
+    m_pendingSwitches.erase(resolved, m_pendingSwitches.end());
+  }
+  m_retired.collect(frame);
+}
+
+SwitchStallStats RtxPipeline::switchStatistics()
+{
+  std::lock_guard<std::mutex> lock(storageMutex);
+  return m_switchStats;
+}
+
+// Destroyed once the frames recorded so far completed. Called with storageMutex held
+void RtxPipeline::retireVariant(const PipelineStorage& element)
+{
+  PipelineStorage retired = element;
+  m_retired.retire(m_frame, [this, retired]() mutable { destroyVariant(retired); });
+}
+
+uint64_t RtxPipeline::variantKey(const SortingParameters& parameters)
+{
+  return pipelineVariantKey(hashParameters(parameters), m_sortingMode, m_enableProfiling, m_enableAnyhit, false, m_normalizedKeys);
+}
+
+// The part of the variant key that all raygens of one pipeline share
+uint64_t RtxPipeline::variantContext()
+{
+  return pipelineVariantKey(0, m_sortingMode, m_enableProfiling, m_enableAnyhit, false, m_normalizedKeys);
+}
+
+uint64_t RtxPipeline::dynamicVariantKey()
+{
+  return pipelineVariantKey(0, m_sortingMode, m_enableProfiling, m_enableAnyhit, true, m_normalizedKeys);
+}
+
+void RtxPipeline::destroyVariant(PipelineStorage& element)
+{
+  vkDestroyPipeline(m_device, element.pipeline, nullptr);
+  std::lock_guard<std::mutex> lock(allocatorMutex);
+  element.sbt.destroy();
+}
+
+bool RtxPipeline::findPipeline(int hashCode, PipelineStorage& result)
+{
+  uint64_t key = pipelineVariantKey(hashCode, m_sortingMode, m_enableProfiling, m_enableAnyhit, false, m_normalizedKeys);
+  std::lock_guard<std::mutex> lock(storageMutex);
+  return m_variants.find(key, m_frame, result);
+}
+
+bool RtxPipeline::isPipelineReady(int hashCode)
+{
+  uint64_t                    key = pipelineVariantKey(hashCode, m_sortingMode, m_enableProfiling, m_enableAnyhit, false, m_normalizedKeys);
+  std::lock_guard<std::mutex> lock(storageMutex);
+  if(m_variants.contains(key))
+    return true;
+  const std::vector<int>& hashCodes = m_raygenTable.hashCodes;
+  return useRaygenTable && m_raygenTable.context == variantContext()
+         && std::find(hashCodes.begin(), hashCodes.end(), hashCode) != hashCodes.end();
+}
+
+PipelineVariantCacheStats RtxPipeline::variantStatistics()
+{
+  std::lock_guard<std::mutex> lock(storageMutex);
+  return m_variants.stats();
+}
+
+// Builds one pipeline with a raygen per configuration of `hashCodes` and makes it the raygen table.
+// The previous table is unpinned and left to the variant cache, frames in flight may still use it.
+// Every raygen is specialized and compiled by the driver, so the build cost grows with the table.
+bool RtxPipeline::buildRaygenTable(const std::vector<int>& hashCodes)
+{
+  std::vector<int>               unique;
+  std::vector<SortingParameters> raygens;
+  for(int hashCode : hashCodes)
+  {
+    if(std::find(unique.begin(), unique.end(), hashCode) == unique.end())
+    {
+      unique.emplace_back(hashCode);
+      raygens.emplace_back(rebuildFromhash(hashCode));
+    }
+  }
+  if(raygens.empty())
+    return false;
+
+  MilliTimer                 timer;
+  VkPipelineCreationFeedback creationFeedback{};
+  PipelineStorage            table = buildRaygenPipeline(raygens, m_PipelineCache, creationFeedback, usePipelineLibrary);
+  if(table.pipeline == VK_NULL_HANDLE)
+    return false;
+
+  // the raygen region covers one record, the others follow it
+  std::array<VkStridedDeviceAddressRegionKHR, 4> regions = table.sbt.getRegions();
+  size_t tableBytes = pipelineBytesEstimate + size_t(regions[0].stride) * (raygens.size() - 1);
+  for(const VkStridedDeviceAddressRegionKHR& region : regions)
+    tableBytes += size_t(region.size);
+
+  {
+    std::lock_guard<std::mutex> lock(storageMutex);
+    table.variantKey = raygenTableKey(++m_raygenTableGeneration);
+    m_variants.insert(table, tableBytes, m_frame);
+    m_variants.pin(table.variantKey);
+    if(m_raygenTable.storage.pipeline != VK_NULL_HANDLE)
+      m_variants.unpin(m_raygenTable.storage.variantKey);
+
+    m_raygenTable.storage   = table;
+    m_raygenTable.context   = variantContext();
+    m_raygenTable.hashCodes = unique;
+
+    // the running configuration keeps running, from the new table if it has it
+    auto found   = std::find(unique.begin(), unique.end(), hashParameters(m_SERParameters));
+    m_raygenSlot = found != unique.end() && m_raygenSlot >= 0 ? int(found - unique.begin()) : -1;
+    if(m_raygenSlot < 0 && !m_dynamicActive)
+      m_SERParameters = activeElement.parameters;
+  }
+  LOGI("Built a raygen table of %zu configurations in %.2f ms\n", unique.size(), timer.elapsed());
+  return true;
+}
+
+bool RtxPipeline::selectRaygen(int hashCode)
+{
+  std::lock_guard<std::mutex> lock(storageMutex);
+  if(!useRaygenTable || m_raygenTable.storage.pipeline == VK_NULL_HANDLE || m_raygenTable.context != variantContext())
+    return false;
+  const std::vector<int>& hashCodes = m_raygenTable.hashCodes;
+  auto                    found     = std::find(hashCodes.begin(), hashCodes.end(), hashCode);
+  if(found == hashCodes.end())
+    return false;
+  m_raygenSlot    = int(found - hashCodes.begin());
+  m_dynamicActive = false;
+  m_SERParameters = rebuildFromhash(hashCode);
+  recordSwitch();
+  return true;
+}
+
+size_t RtxPipeline::raygenTableSize()
+{
+  std::lock_guard<std::mutex> lock(storageMutex);
+  return m_raygenTable.hashCodes.size();
+}
+
+// The render thread waits for the uber shader once per sorting mode, profiling and any hit setting
+bool RtxPipeline::selectDynamic(int hashCode, bool promote)
+{
+  uint64_t key = dynamicVariantKey();
+  bool     built;
+  {
+    std::lock_guard<std::mutex> lock(storageMutex);
+    built = m_dynamicElement.pipeline != VK_NULL_HANDLE && m_dynamicElement.variantKey == key;
+  }
+  if(!built)
+  {
+    PipelineStorage dynamic;
+    bool            cached;
     {
-    while(useAsyncPipelineCreation)
+      std::lock_guard<std::mutex> lock(storageMutex);
+      cached = m_variants.find(key, m_frame, dynamic) && m_variants.pin(key);
+    }
+    if(!cached)
     {
-      if(m_rtPipelineLayout == VK_NULL_HANDLE)
-      {
-        //printf("still null\n");
-      }
-      else {
-        fillPipelineBuffer();
-      }
+      // pinned by createPipeline, nothing evicts it before it is taken below
+      dynamic = m_compileService
+                    .request(key, ePriorityBlocking, [this]() { return createPipeline(SortingParameters(), true, true); })
+                    .get();
+      if(dynamic.pipeline == VK_NULL_HANDLE)
+        return false;
     }
-  }).detach();
-  
 
-  //std::thread t1(buildStuff,m_rtPipelineLayout);
+    std::lock_guard<std::mutex> lock(storageMutex);
+    if(m_dynamicElement.pipeline != VK_NULL_HANDLE)
+      m_variants.unpin(m_dynamicElement.variantKey);
+    m_dynamicElement = dynamic;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(storageMutex);
+    m_dynamicActive = true;
+    m_raygenSlot    = -1;
+    m_SERParameters = rebuildFromhash(hashCode);
+    recordSwitch();
+  }
+
+  if(promote)
+  {
+    SortingParameters parameters = rebuildFromhash(hashCode);
+    m_compileService.request(variantKey(parameters), ePriorityPrefetch, [this, parameters]() { return findOrCreatePipeline(parameters); },
+                             [this, hashCode](const PipelineStorage& variant) {
+                               std::lock_guard<std::mutex> lock(storageMutex);
+                               if(!m_dynamicActive || hashParameters(m_SERParameters) != hashCode || !m_variants.pin(variant.variantKey))
+                                 return;
+                               if(activeElement.pipeline != VK_NULL_HANDLE)
+                                 m_variants.unpin(activeElement.variantKey);
+                               activeElement   = variant;
+                               m_dynamicActive = false;
+                               recordSwitch();
+                             });
+  }
+  return true;
+}
 
+bool RtxPipeline::dynamicSortingActive()
+{
+  std::lock_guard<std::mutex> lock(storageMutex);
+  return m_dynamicActive;
+}
+
+// A variant created meanwhile is taken from the cache instead, so a pipeline is never built twice
+PipelineStorage RtxPipeline::findOrCreatePipeline(SortingParameters parameters)
+{
+  PipelineStorage existing;
+  {
+    std::lock_guard<std::mutex> lock(storageMutex);
+    if(m_variants.find(variantKey(parameters), m_frame, existing))
+      return existing;
+  }
+  return createPipeline(parameters);
+}
+
+std::shared_future<PipelineStorage> RtxPipeline::requestPipeline(int hashCode, CompilePriority priority)
+{
+  SortingParameters parameters = rebuildFromhash(hashCode);
+  return m_compileService.request(variantKey(parameters), priority,
+                                  [this, parameters]() { return findOrCreatePipeline(parameters); });
+}
+
+void RtxPipeline::requestSwitch(int hashCode)
+{
+  SortingParameters parameters = rebuildFromhash(hashCode);
+  uint64_t          key        = variantKey(parameters);
+  {
+    std::lock_guard<std::mutex> lock(storageMutex);
+    if(m_switchDelivered.variantKey == key && m_switchDelivered.pipeline != VK_NULL_HANDLE)
+      return;
+    m_switchRequested = true;
+    m_switchTarget    = key;
+  }
+  // merged requests of the following frames add their callbacks, only the first one delivers
+  m_compileService.request(key, ePriorityBlocking, [this, parameters]() { return findOrCreatePipeline(parameters); },
+                           [this, key](const PipelineStorage& variant) {
+                             std::lock_guard<std::mutex> lock(storageMutex);
+                             if(!m_switchRequested || m_switchTarget != key || variant.pipeline == VK_NULL_HANDLE
+                                || !m_variants.pin(variant.variantKey))
+                               return;
+                             m_switchRequested = false;
+                             m_switchDelivered = variant;
+                           });
+}
+
+// Requests the pipelines of all configurations in `hashCodes` that have not been created yet and
+// returns when all of them are in the variant cache
+void RtxPipeline::createPipelines(const std::vector<int>& hashCodes, CompilePriority priority)
+{
+  std::vector<int>                                 missing;
+  std::vector<std::shared_future<PipelineStorage>> requests;
+  for(int hashCode : hashCodes)
+  {
+    PipelineStorage existing;
+    if(!findPipeline(hashCode, existing) && std::find(missing.begin(), missing.end(), hashCode) == missing.end())
+    {
+      missing.emplace_back(hashCode);
+      requests.emplace_back(requestPipeline(hashCode, priority));
+    }
+  }
+  if(missing.empty())
+    return;
+
+  MilliTimer timer;
+  for(auto& request : requests)
+    request.wait();
+  DeferredOperationStats deferred = DeferredOperationPool::shared().stats();
+  LOGI("Created %zu pipelines on %u workers in %.2f ms, %llu deferred operations joined on %u threads with %llu steals\n",
+       missing.size(), m_compileService.numWorkers(), timer.elapsed(), (unsigned long long)deferred.operations,
+       DeferredOperationPool::shared().numWorkers(), (unsigned long long)deferred.steals);
+}
+
+void RtxPipeline::activateAsyncPipelineCreation()
+{
+  topUpPrebuildBuffer();
 }
 
 void RtxPipeline::destroyAsyncPipelineBuffer()
 {
   
-  for(PipelineStorage element : storage)
   {
-    vkDestroyPipeline(m_device,element.pipeline,nullptr);
-    element.sbt.destroy();
+    std::lock_guard<std::mutex> lock(storageMutex);
+    m_variants.clear([this](PipelineStorage& element) { destroyVariant(element); });
+    m_raygenTable = RaygenTable();
+    m_raygenSlot  = -1;
+    m_dynamicElement = PipelineStorage();
+    m_dynamicActive  = false;
+    m_switchRequested = false;
+    m_switchDelivered = PipelineStorage();
+    m_pendingSwitches.clear();
+    m_completedFrame = m_frame;
+  }
+  m_retired.flush();
+  activeElement = PipelineStorage();
+  {
+    std::lock_guard<std::mutex> lock(prebuildMutex);
+    PrebuildPipelineBuffer.clear();
+    m_pendingPrebuilds = 0;
   }
 
   for(AsyncPipeline asyncPipeline : asyncPipelineBuffer)
@@ -633,6 +1438,5 @@ void RtxPipeline::destroyAsyncPipelineBuffer()
   }
   asyncPipelineBuffer = std::vector<AsyncPipeline>();
 
-storage = std::vector<PipelineStorage>();
   //pipelineCreateInfoBuffer = std::vector<VkRayTracingPipelineCreateInfoKHR>();
 }
\ No newline at end of file
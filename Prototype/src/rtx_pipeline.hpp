@@ -20,7 +20,9 @@
 
 #pragma once
 
+#include <array>
 #include <future>
+#include <mutex>
 
 #include "nvvk/resourceallocator_vk.hpp"
 #include "nvvk/debug_util_vk.hpp"
@@ -32,17 +34,24 @@
 #include "renderer.h"
 #include "shaders/host_device.h"
 #include "nvvkhl/glsl_compiler.hpp"
+#include "pipeline_cache_file.hpp"
+#include "pipeline_compile_service.hpp"
+#include "pipeline_variant_cache.hpp"
+#include "retirement_queue.hpp"
+#include "tools.hpp"
 
 using nvvk::SBTWrapper;
 
-const int NUM_PIPELINES_IN_BUFFER = 2;
+struct SwitchStallStats
+{
+  uint64_t switches{0};  // with frames in flight, each would have waited for the device before
+  double   avoidedMs{0.0};  // from each switch until the frames in flight at that point completed
+};
 
-  struct PipelineStorage
-  {
-    VkPipeline pipeline{VK_NULL_HANDLE};
-    SBTWrapper sbt;
-    SortingParameters parameters;
-  };
+const int NUM_PIPELINES_IN_BUFFER = 2;
+const int NUM_PREBUILT_PIPELINES  = 5;  // unmeasured configurations kept ready by the async pipeline creation
+const uint32_t RAY_RECURSION_DEPTH  = 2;
+const uint32_t MAX_RAY_PAYLOAD_SIZE = 256;  // bytes, at least sizeof(PtPayload) in shaders/globals.glsl
 /*
 
 Creating the RtCore renderer 
@@ -69,6 +78,10 @@ public:
   int* getSortingMode() {return &m_sortingMode;};
   int* getNumCoherenceBits() {return &m_numCoherenceBits;};
   void enableProfiling(bool enable);
+  // sorting keys quantize in the scene bounds to fixed point instead of taking the float bits of
+  // the world coordinates, see shaders/sorting_keys.h
+  void useNormalizedKeys(bool enable);
+  bool normalizedKeys() const { return m_normalizedKeys; }
   int hashParameters(SortingParameters parameters);
   SortingParameters rebuildFromhash(int hashCode);
 
@@ -76,10 +89,74 @@ public:
   bool     m_enableProfiling{false};
   void setNewPipeline();
   void setNewPipeline(PipelineStorage newPipelineElement);
-  std::vector<PipelineStorage> PrebuildPipelineBuffer;
+  // an already created pipeline with these parameters and the current sorting mode, profiling and any hit
+  bool findPipeline(int hashCode, PipelineStorage& result);
+  // true if switching to the configuration would not wait for a build: its variant is cached or the
+  // raygen table has it. Does not count as a use of the variant
+  bool isPipelineReady(int hashCode);
+  // Pipelines are built by the compile service, requestPipeline returns at once
+  std::shared_future<PipelineStorage> requestPipeline(int hashCode, CompilePriority priority);
+  // Requests the pipeline at ePriorityBlocking and switches to it at the first frame after it is built,
+  // the active pipeline keeps running meanwhile. Any other switch before then cancels it
+  void requestSwitch(int hashCode);
+  void createPipelines(const std::vector<int>& hashCodes, CompilePriority priority = ePriorityBlocking);
+  void benchmarkVariantCreation(uint32_t numVariants);  // logs the creation time per variant
+
+  // Variants link their raygen against a VK_KHR_pipeline_library of the miss and hit groups,
+  // without the extension or with this off every variant is a complete pipeline
+  bool usePipelineLibrary{true};
+  bool pipelineLibrarySupported() const { return m_pipelineLibrarySupported; }
+  bool hasPrebuiltPipeline();
+
+  // A raygen table is one pipeline and one SBT with a raygen group per configuration. Selecting one
+  // of its configurations only points the raygen region at another record, nothing is rebound or
+  // waited for. selectRaygen returns false if the configuration is not in the table, the table was
+  // built under another sorting mode, profiling or any hit setting, or useRaygenTable is off
+  bool   useRaygenTable{true};
+  bool   buildRaygenTable(const std::vector<int>& hashCodes);
+  bool   selectRaygen(int hashCode);
+  size_t raygenTableSize();
+
+  // The uber shader reads the sorting parameters from the push constants instead of specialization
+  // constants, so it runs any configuration without a pipeline of its own. It is built on the first
+  // selectDynamic under the current sorting mode, profiling and any hit setting; later switches only
+  // change m_SERParameters. The specialized variants are faster, the uber shader covers the time
+  // until one is built: with `promote` the variant of `hashCode` is requested in the background and
+  // replaces the uber shader once it is built, if the configuration still runs then
+  bool selectDynamic(int hashCode, bool promote = true);
+  bool dynamicSortingActive();
+
+  // run numbers the frames it records, currentFrame is the last one. The caller reports the frames
+  // whose fence signaled, variants evicted or replaced while they were in flight are destroyed then
+  uint64_t         currentFrame();
+  void             frameCompleted(uint64_t frame);
+  RetirementStats  retirementStatistics() { return m_retired.stats(); }
+  SwitchStallStats switchStatistics();
+
+  // Budgets of the pipeline variant cache, applied every frame
+  int                       variantEntryBudget{64};
+  int                       variantMemoryBudgetMB{256};
+  size_t                    pipelineBytesEstimate{size_t(1) << 20};  // driver memory of a pipeline, Vulkan does not report it
+  PipelineVariantCacheStats variantStatistics();
+
+  // GLSL sources and include path, and where their SPIR-V is cached, set before setup
+  std::string shaderDirectory{"shaders"};
+  std::string spirvCacheDirectory{"spirv_cache"};
+
+  // The pipeline cache is saved to pipelineCacheFile on destroy and every pipelineCacheFlushInterval
+  // seconds while pipelines are created, and loaded again by setup
+  std::string        pipelineCacheFile{"pipeline_cache.bin"};
+  float              pipelineCacheFlushInterval{30.0f};
+  void               flushPipelineCache();
+  PipelineCacheStats cacheStatistics();
 
   SortingParameters m_SERParameters{
     32,     //numCoherenceBitsTotal: 0-32 Zero meaning No sorting
+    0,      //originBits: bits of the key per feature, 0 shares the bits evenly
+    0,      //directionBits
+    0,      //estimatedEndpointBits
+    0,      //realEndpointBits
+    0,      //interleaveFeatures: 0 concatenated, 1 interleaved
     true,   //sortAfterASTraversal; when to sort->  0: before TraceRay; 1: after TraceRay
             //Which Information to encode into sortingKey:
     false,  //No Sorting
@@ -107,7 +184,24 @@ private:
 
 
 
-  PipelineStorage createPipeline(SortingParameters parameters);
+  PipelineStorage createPipeline(SortingParameters parameters, bool pin = false, bool dynamicSorting = false);
+  PipelineStorage buildVariant(const SortingParameters&   parameters,
+                               VkPipelineCache            cache,
+                               VkPipelineCreationFeedback& creationFeedback,
+                               bool                       linkHitLibrary,
+                               bool                       dynamicSorting = false);
+  PipelineStorage buildRaygenPipeline(const std::vector<SortingParameters>& raygens,
+                                      VkPipelineCache                       cache,
+                                      VkPipelineCreationFeedback&           creationFeedback,
+                                      bool                                  linkHitLibrary,
+                                      bool                                  dynamicSorting = false);
+  nvvk::Specialization raygenSpecialization(const SortingParameters& parameters, bool dynamicSorting);
+  uint64_t        variantKey(const SortingParameters& parameters);
+  uint64_t        variantContext();
+  uint64_t        dynamicVariantKey();
+  void            activate(const PipelineStorage& element, bool pinned);
+  void            destroyVariant(PipelineStorage& element);
+  void            retireVariant(const PipelineStorage& element);
   void createPipeline_async();
   void createPipelineLayout(const std::vector<VkDescriptorSetLayout>& rtDescSetLayouts,VkPipelineLayout& pipelineLayout);
   void createPipelineLayout_async(const std::vector<VkDescriptorSetLayout>& rtDescSetLayouts);
@@ -115,10 +209,16 @@ private:
 
   uint32_t m_nbHit{1};
   bool     m_enableAnyhit{true};
+  bool     m_normalizedKeys{false};
   int      m_sortingMode{0};
   int      m_numCoherenceBits{32};
-  VkPipelineCache m_PipelineCache;
+  VkPipelineCache m_PipelineCache{VK_NULL_HANDLE};
   void createPipelineCache();
+  PipelineCacheKey   m_pipelineCacheKey;
+  PipelineCacheStats m_pipelineCacheStats;  // guarded by storageMutex
+  MilliTimer         m_sinceCacheFlush;
+  uint32_t           m_pipelinesSinceFlush{0};
+  std::mutex         pipelineCacheMutex;  // m_sinceCacheFlush, m_pipelinesSinceFlush and the cache file
 
 
 private:
@@ -146,24 +246,65 @@ private:
   std::vector<ShaderObject> raygenShaders;
 
   shaderc::SpvCompilationResult* result2;
-  shaderc::SpvCompilationResult result3;
 
-  shaderc::SpvCompilationResult hitshader;
   shaderc::SpvCompilationResult missshader;
   std::vector<shaderc::SpvCompilationResult> results;
   std::vector<nvvk::Specialization> storedSpecializations;
-  std::vector<int> hashedParameterizations;
-  bool madeOne = false;
+  std::vector<uint64_t> hashedParameterizations;  // variant keys of storedSpecializations
   bool creatingPipeline = false;
 
   
 private:
   //nvvkhl::GlslIncluder glslIncluder;
   nvvkhl::GlslCompiler glslCompiler;
+  std::vector<std::string> m_includeDirectories;
+  std::string              m_compileOptions;  // part of the SPIR-V cache key
+  uint32_t                 m_spirvCacheHits{0};
+  bool compileSpirv(const char* filename, shaderc_shader_kind kind, std::vector<uint32_t>& spirv, bool useCache);
   std::unique_ptr<shaderc::CompileOptions> glslCompileOptions;
   void setupGLSLCompiler();
   VkShaderModule CompileAndCreateShaderModule(std::string filename, shaderc_shader_kind shadertype);
   shaderc::SpvCompilationResult CompileShader(std::string filename, shaderc_shader_kind shadertype);
+
+  // Stages of the ray tracing pipeline, also the shader group indices
+  enum StageIndices
+  {
+    eRaygen,
+    eMiss,
+    eMiss2,
+    eClosestHit,
+    eAnyHit,
+    eShaderGroupCount
+  };
+  struct StageShader
+  {
+    std::vector<uint32_t> spirv;
+    VkShaderModule        module{VK_NULL_HANDLE};
+    float                 compileMs{0.0f};  // creation times, for benchmarkVariantCreation
+    float                 moduleMs{0.0f};
+  };
+  using StageShaders = std::array<StageShader, eShaderGroupCount>;
+  // compiled once and shared by all variants until destroy, guarded by compileMutex
+  StageShaders m_stageShaders;
+
+  // Miss and hit groups of one any hit setting, built once and linked into every variant
+  struct HitGroupLibrary
+  {
+    VkPipeline                                        pipeline{VK_NULL_HANDLE};
+    bool                                              failed{false};  // not retried, variants are built monolithic
+    double                                            buildMs{0.0};
+    std::vector<VkPipelineShaderStageCreateInfo>      stages;
+    std::vector<VkRayTracingShaderGroupCreateInfoKHR> groups;
+    VkRayTracingPipelineCreateInfoKHR                 createInfo{VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR};  // read by the SBT of linked variants
+  };
+  HitGroupLibrary m_hitLibraries[2];  // without and with any hit, guarded by compileMutex, destroyed by destroy
+  bool            m_pipelineLibrarySupported{false};
+  VkPipeline      hitGroupLibrary(VkPipelineCache cache);
+  void            destroyHitGroupLibraries();
+  VkRayTracingPipelineInterfaceCreateInfoKHR libraryInterface() const;
+  VkPipeline createRayTracingPipeline(const VkRayTracingPipelineCreateInfoKHR& createInfo, VkPipelineCache cache);
+  bool         compileStageShaders(StageShaders& shaders, bool useCache);  // the benchmark times shaderc without the cache
+  void         destroyStageShaders(StageShaders& shaders);
   shaderc::SpvCompilationResult *getRayGenShaderObject();
 
   std::vector<uint32_t> rgen;
@@ -187,7 +328,9 @@ private:
 
   std::vector<AsyncPipeline> asyncPipelineBuffer;
 
-  void fillPipelineBuffer();
+  PipelineStorage findOrCreatePipeline(SortingParameters parameters);
+  void            topUpPrebuildBuffer();
+  void            addPrebuiltPipeline(const PipelineStorage& element);
   void buildPipeline();
   
   
@@ -206,7 +349,43 @@ private:
 
   //std::vector<VkPipeline> storedPipelines;
   //std::vector<SBTWrapper> storedSBTs;
-  std::vector<PipelineStorage> storage;
+  PipelineVariantCache         m_variants;
+  uint64_t                     m_frame{0};    // frames recorded by run, the clock of m_variants
+  std::mutex                   storageMutex;  // m_variants and m_frame, pipelines are created on several threads
+
+  struct RaygenTable
+  {
+    PipelineStorage  storage;       // in m_variants under a raygenTableKey, pinned while it is the table
+    uint64_t         context{0};    // pipelineVariantKey without the parameter hash
+    std::vector<int> hashCodes;     // raygen group i runs hashCodes[i]
+  };
+  RaygenTable                  m_raygenTable;               // guarded by storageMutex, like the two below
+  int                          m_raygenSlot{-1};            // raygen of m_raygenTable that run traces, -1 for activeElement
+  uint32_t                     m_raygenTableGeneration{0};
+  PipelineStorage              m_dynamicElement;            // the uber shader, pinned in m_variants
+  bool                         m_dynamicActive{false};      // run traces m_dynamicElement with m_SERParameters
+  bool                         m_switchRequested{false};    // by requestSwitch, guarded by storageMutex like the two below
+  uint64_t                     m_switchTarget{0};           // variant key of the requested switch
+  PipelineStorage              m_switchDelivered;           // built, pinned in m_variants until run takes it
+
+  // Switches happen without waiting for the device, their stall is measured instead
+  struct PendingSwitch
+  {
+    uint64_t   frame;  // last frame recorded before the switch
+    MilliTimer sinceSwitch;
+  };
+  RetirementQueue              m_retired;            // evicted variants until their last frame completed
+  uint64_t                     m_completedFrame{0};  // guarded by storageMutex, like the three below
+  std::vector<PendingSwitch>   m_pendingSwitches;
+  SwitchStallStats             m_switchStats;
+  void                         recordSwitch();
+  std::mutex                   compileMutex;    // shader compilation and the specialization cache of createPipeline
+  std::mutex                   allocatorMutex;  // SBT buffers of pipelines created on several threads
+
+  PipelineCompileService       m_compileService;
+  std::vector<PipelineStorage> PrebuildPipelineBuffer;  // pinned in m_variants until setNewPipeline takes them
+  int                          m_pendingPrebuilds{0};    // requested but not yet in PrebuildPipelineBuffer
+  std::mutex                   prebuildMutex;            // PrebuildPipelineBuffer and m_pendingPrebuilds
 
 
   
@@ -29,6 +29,7 @@
 #include <iostream>
 #include <algorithm>
 #include <limits>
+#include <cmath>
 #include <fstream>
 
 
@@ -38,10 +39,13 @@
 #include "rayquery.hpp"
 #include "rtx_pipeline.hpp"
 #include "sample_example.hpp"
+#include "grid_file.hpp"
+#include "gpu_frame_clock.hpp"
 #include "sample_gui.hpp"
 #include "tools.hpp"
 
 #include "sorting_grid.hpp"
+#include "sorting_key_bench.hpp"
 
 #include "nvml_monitor.hpp"
 
@@ -83,8 +87,11 @@ void SampleExample::setup(const VkInstance&               instance,
   m_skydome.setup(device, physicalDevice, queues[eTransfer].familyIndex, &m_alloc);
 
   // Create and setup all renderers
-  m_pRender[eRtxPipeline] = new RtxPipeline;
-  m_pRender[eRayQuery]    = new RayQuery;
+  RtxPipeline* rtx         = new RtxPipeline;
+  rtx->shaderDirectory     = shaderDirectory;
+  rtx->spirvCacheDirectory = spirvCacheDirectory;
+  m_pRender[eRtxPipeline]  = rtx;
+  m_pRender[eRayQuery]     = new RayQuery;
   for(auto r : m_pRender)
   {
     r->setup(m_device, physicalDevice, queues[eTransfer].familyIndex, &m_alloc);
@@ -102,11 +109,30 @@ void SampleExample::setup(const VkInstance&               instance,
   rng = rng2;
 
   createStorageBuffer();
+  createFrameClock();
 
 
   buildSortingGrid();
 }
 
+//--------------------------------------------------------------------------------------------------
+// Timestamps around the trace dispatch if the graphics queue supports them, otherwise the CPU frame time
+//
+void SampleExample::createFrameClock()
+{
+  frameClock.reset();
+  if(useGpuFrameClock)
+  {
+    auto gpuClock = std::make_unique<GpuFrameClock>();
+    if(gpuClock->init(m_device, m_physicalDevice, m_graphicsQueueIndex))
+    {
+      frameClock = std::move(gpuClock);
+      return;
+    }
+  }
+  frameClock = std::make_unique<CpuFrameClock>();
+}
+
 
 //--------------------------------------------------------------------------------------------------
 // Loading the scene file, setting up all scene buffers, create the acceleration structures
@@ -137,12 +163,37 @@ void SampleExample::loadEnvironmentHdr(const std::string& hdrFilename)
 
 void SampleExample::loadSortingGrid(const std::string& jsonFilename)
 {
+if(std::filesystem::path(jsonFilename).extension() == GRID_FILE_EXTENSION)
+{
+  loadSortingGridBinary(jsonFilename);
+  return;
+}
 
 std::ifstream f(jsonFilename);
 json j = json::parse(f);
 grid_x = j["Grid Dimensions (x,y,z)"][0];
 grid_y = j["Grid Dimensions (x,y,z)"][1];
 grid_z = j["Grid Dimensions (x,y,z)"][2];
+// grids saved before the binning was configurable use the six cube sides
+DirectionQuantizer quantizer;
+if(j.contains("Direction Binning"))
+{
+  quantizer.setMode(j["Direction Binning"]["mode"].get<std::string>());
+  quantizer.resolution = j["Direction Binning"]["resolution"].get<uint32_t>();
+}
+directionBinning = quantizer.mode;
+directionResolution = quantizer.resolution;
+if(j.contains("Adaptive Grid"))
+{
+  grid.adaptive.enabled = j["Adaptive Grid"]["enabled"].get<bool>();
+  grid.adaptive.maxDepth = j["Adaptive Grid"]["maxDepth"].get<uint32_t>();
+  grid.adaptive.splitVariation = j["Adaptive Grid"]["splitVariation"].get<float>();
+}
+if(j.contains("Statistics"))
+{
+  grid.statistics.requireSignificance = j["Statistics"]["requireSignificance"].get<bool>();
+  grid.statistics.confidence = j["Statistics"]["confidence"].get<float>();
+}
 buildSortingGrid();
 m_gui->gridX = grid_x;
 m_gui->gridY = grid_y;
@@ -150,20 +201,73 @@ m_gui->gridZ = grid_z;
 
 
 
-for(int i = 0; i < grid.gridDimensions.x; i++)
+// the JSON file only keeps the mean fps of every configuration, it is restored as a single cycle
+readGridJson(grid, j, timePerCycle);
+
+warmStartGrid();
+}
+// Restores a grid with all its timings, cells and octree from a .sgrid file
+void SampleExample::loadSortingGridBinary(const std::string& filename)
+{
+  MilliTimer timer;
+  if(!loadGridBinary(grid, filename))
+    return;
+  printf("loaded sorting grid %s in %.2f ms\n", filename.c_str(), timer.elapsed());
+
+  grid_x = grid.gridDimensions.x;
+  grid_y = grid.gridDimensions.y;
+  grid_z = grid.gridDimensions.z;
+  directionBinning = grid.quantizer.mode;
+  directionResolution = int(grid.quantizer.resolution);
+  bestKeys.assign(grid.numRootCells(), GridCube{});
+  fitStorageBuffer();
+  currentCell = 0;
+  m_gui->gridX = grid_x;
+  m_gui->gridY = grid_y;
+  m_gui->gridZ = grid_z;
+
+  warmStartGrid();
+}
+
+// After loading a trained grid: creates the distinct best pipelines of all bins in parallel and
+// switches to exploiting them, so rendering starts with the trained configurations
+void SampleExample::warmStartGrid()
+{
+  auto rtx = dynamic_cast<RtxPipeline*>(m_pRender[m_rndMethod]);
+  if(rtx == nullptr)
+    return;
+
+  std::vector<int> bestHashes;
+  for(const CubeSideStorage& side : grid.sides)
+  {
+    if(side.numElements > 0)
+      bestHashes.emplace_back(side.bestHash);
+  }
+  std::sort(bestHashes.begin(), bestHashes.end());
+  bestHashes.erase(std::unique(bestHashes.begin(), bestHashes.end()), bestHashes.end());
+  if(bestHashes.empty())
+    return;
+
+  rtx->createPipelines(bestHashes);
+  // switching between the best configurations of the grid only moves the raygen record
+  rtx->buildRaygenTable(bestHashes);
+
+  // trained cells continue at the lowest exploration rate instead of starting over
+  for(GridSpace& space : grid.gridSpaces)
   {
-    for(int j = 0; j < grid.gridDimensions.y; j++)
+    for(uint32_t bin = 0; bin < space.cube.numSides; bin++)
     {
-      for(int k = 0; k < grid.gridDimensions.z; k++)
+      if(grid.side(space, bin).numElements > 0)
       {
-        std::string s1 = "(" + std::to_string(i) + "," + std::to_string(j) + "," + std::to_string(k) + ")";
-        //auto k = j[s1];
+        space.adaptiveGridLearningRate = 0.1f;
+        break;
       }
     }
   }
-
-
+  useBestParameters = true;
+  printf("warm start with %zu best configurations\n", bestHashes.size());
 }
+
 //--------------------------------------------------------------------------------------------------
 // Loading asset in a separate thread
 // - Used by file drop and menu operation
@@ -206,7 +310,7 @@ void SampleExample::loadAssets(const char* filename)
       loadEnvironmentHdr(sfile);
       updateHdrDescriptors();
     }
-    if(extension == ".json")
+    if(extension == ".json" || extension == GRID_FILE_EXTENSION)
     {
       m_busyReasonText = "Loading Sorting Grid ";
       loadSortingGrid(sfile);
@@ -267,92 +371,47 @@ void SampleExample::resetFrame()
 
 void SampleExample::createStorageBuffer()
 {
-    m_GridSortingKeyBuffer = m_alloc.createBuffer(sizeof(GridCube) * MAXGRIDSIZE *MAXGRIDSIZE *MAXGRIDSIZE, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+  // room for the largest grid of the GUI, a larger loaded grid grows it in fitStorageBuffer
+  m_gridKeyBufferCells = std::max(size_t(MAXGRIDSIZE) * MAXGRIDSIZE * MAXGRIDSIZE, grid.numRootCells());
+  m_GridSortingKeyBuffer = m_alloc.createBuffer(sizeof(GridCube) * m_gridKeyBufferCells, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
                                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
   NAME_VK(m_GridSortingKeyBuffer.buffer);
 }
-GridCube SampleExample::determineBestTimesCube(GridSpace* currentGrid)
-{
-  GridCube cube;
-
-  float fastestTime = std::numeric_limits<float>::min();
-  int fastestHash = 0;
-  std::vector<TimingObject>* cubeSideTimingsUP = &getCubeSideElements(CubeSide::CubeUp,currentGrid)->storedElements;
-  for(TimingObject timing : *cubeSideTimingsUP)
-    {
-    if(timing.fps > fastestTime)
-      {
-      fastestTime = timing.fps;
-      fastestHash =timing.hashCode;
-      }
-  }
-  cube.up = fastestHash;
-
-  fastestTime = std::numeric_limits<float>::min();
-  fastestHash = 0;
-  std::vector<TimingObject>* cubeSideTimingsDOWN = &getCubeSideElements(CubeSide::CubeDown,currentGrid)->storedElements;
-  for(TimingObject timing : *cubeSideTimingsDOWN)
-  {
-    if(timing.fps > fastestTime)
-    {
-      fastestTime = timing.fps;
-      fastestHash =timing.hashCode;
-    }
-  }
-  cube.down = fastestHash;
 
-  fastestTime = std::numeric_limits<float>::min();
-  fastestHash = 0;
-  std::vector<TimingObject>* cubeSideTimingsRight = &getCubeSideElements(CubeSide::CubeRight,currentGrid)->storedElements;
-  for(TimingObject timing : *cubeSideTimingsRight)
-  {
-    if(timing.fps > fastestTime)
-    {
-      fastestTime = timing.fps;
-      fastestHash =timing.hashCode;
-    }
-  }
-  cube.right = fastestHash;
+// updateStorageBuffer writes one GridCube per root cell, the buffer is recreated when the grid has more
+void SampleExample::fitStorageBuffer()
+{
+  if(m_GridSortingKeyBuffer.buffer == VK_NULL_HANDLE || grid.numRootCells() <= m_gridKeyBufferCells)
+    return;
 
-  fastestTime = std::numeric_limits<float>::min();
-  fastestHash = 0;
-  std::vector<TimingObject>* cubeSideTimingsLeft = &getCubeSideElements(CubeSide::CubeLeft,currentGrid)->storedElements;
-  for(TimingObject timing : *cubeSideTimingsLeft)
+  vkDeviceWaitIdle(m_device);  // the buffer may still be read by a frame in flight
+  m_alloc.destroy(m_GridSortingKeyBuffer);
+  createStorageBuffer();
+  if(m_descSet != VK_NULL_HANDLE)
   {
-    if(timing.fps > fastestTime)
-    {
-      fastestTime = timing.fps;
-      fastestHash =timing.hashCode;
-    }
+    VkDescriptorBufferInfo gridKeysDesc{m_GridSortingKeyBuffer.buffer, 0, VK_WHOLE_SIZE};
+    VkWriteDescriptorSet   write = m_bind.makeWrite(m_descSet, EnvBindings::eGridKeys, &gridKeysDesc);
+    vkUpdateDescriptorSets(m_device, 1, &write, 0, nullptr);
   }
-  cube.left = fastestHash;
-
-  fastestTime = std::numeric_limits<float>::min();
-  fastestHash = 0;
-  std::vector<TimingObject>* cubeSideTimingsFront = &getCubeSideElements(CubeSide::CubeFront,currentGrid)->storedElements;
-  for(TimingObject timing : *cubeSideTimingsFront)
-  {
-    if(timing.fps > fastestTime)
-    {
-      fastestTime = timing.fps;
-      fastestHash =timing.hashCode;
-    }
-  }
-  cube.front = fastestHash;
-
-  fastestTime = std::numeric_limits<float>::min();
-  fastestHash = 0;
-  std::vector<TimingObject>* cubeSideTimingsback = &getCubeSideElements(CubeSide::CubeBack,currentGrid)->storedElements;
-  for(TimingObject timing : *cubeSideTimingsback)
+}
+GridCube SampleExample::determineBestTimesCube(GridSpace* currentGrid)
+{
+  // the best configuration of every bin is tracked while timing, no scan needed.
+  // A face of the display cube shows the bin its outward direction falls into.
+  int fastestHashes[NUM_CUBE_SIDES];
+  for(int side = 0; side < NUM_CUBE_SIDES; side++)
   {
-    if(timing.fps > fastestTime)
-    {
-      fastestTime = timing.fps;
-      fastestHash =timing.hashCode;
-    }
+    uint32_t bin = grid.quantizer.bin(cubeSideNormal(CubeSide(side)));
+    fastestHashes[side] = getCubeSideElements(bin, currentGrid)->bestHash;
   }
-  cube.back = fastestHash;
 
+  GridCube cube;
+  cube.up    = fastestHashes[CubeUp];
+  cube.down  = fastestHashes[CubeDown];
+  cube.left  = fastestHashes[CubeLeft];
+  cube.right = fastestHashes[CubeRight];
+  cube.front = fastestHashes[CubeFront];
+  cube.back  = fastestHashes[CubeBack];
   return cube;
 }
 void SampleExample::updateStorageBuffer(const VkCommandBuffer& cmdBuf)
@@ -366,26 +425,22 @@ void SampleExample::updateStorageBuffer(const VkCommandBuffer& cmdBuf)
   //upddate best keys data
 if(m_gui->VisualizeSortingGrid)
 {
-  for(int i = 0; i < grid_x;i++)
+  // cells are stored with the same dense index the shader uses: k*(grid_y*grid_x) + j*grid_x + i
+  // a split cell is displayed with the leaf at its center
+  for(size_t index = 0; index < grid.numRootCells(); index++)
   {
-    for(int j = 0; j < grid_y;j++)
-    {
-      for(int k = 0; k < grid_z;k++)
-      {
-        //determine index in buffer, densely packed
-        int index = k*(grid_y*grid_x) + j*grid_x + i;
-        
-        //determine best Key seen yet for each gridspace and viewing direction
-
-
-
-        bestKeys[index] = determineBestTimesCube(&grid.gridSpaces[k][j][i]);
-      }
-    }
+    //determine best Key seen yet for each gridspace and viewing direction
+    bestKeys[index] = determineBestTimesCube(&grid.gridSpaces[grid.leaf(uint32_t(index), glm::vec3(0.5f))]);
   }
 
-  
-  vkCmdUpdateBuffer(cmdBuf,m_GridSortingKeyBuffer.buffer,0,sizeof(GridCube[1000]),&bestKeys);
+  // vkCmdUpdateBuffer is limited to 65536 bytes per call
+  const VkDeviceSize maxUpdateSize = 65536;
+  VkDeviceSize       totalSize     = bestKeys.size() * sizeof(GridCube);
+  for(VkDeviceSize offset = 0; offset < totalSize; offset += maxUpdateSize)
+  {
+    VkDeviceSize size = std::min(maxUpdateSize, totalSize - offset);
+    vkCmdUpdateBuffer(cmdBuf, m_GridSortingKeyBuffer.buffer, offset, size, reinterpret_cast<const char*>(bestKeys.data()) + offset);
+  }
 }
 
 }
@@ -404,6 +459,7 @@ void SampleExample::createDescriptorSetLayout()
   m_bind.addBinding({EnvBindings::eHdr, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, flags});  // HDR image
   m_bind.addBinding({EnvBindings::eImpSamples, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flags});   // importance sampling
   m_bind.addBinding({EnvBindings::eGridKeys, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flags});   // importance sampling
+  m_bind.addBinding({EnvBindings::eRecordedRays, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flags});  // rays of recordRays
 
 
   m_descPool = m_bind.createPool(m_device, 1);
@@ -416,11 +472,13 @@ void SampleExample::createDescriptorSetLayout()
   VkDescriptorBufferInfo            sortParametersDesc{m_sortingParametersBuffer.buffer, 0, VK_WHOLE_SIZE};
   VkDescriptorBufferInfo            accelImpSmpl{m_skydome.m_accelImpSmpl.buffer, 0, VK_WHOLE_SIZE};
   VkDescriptorBufferInfo            gridKeysDesc{m_GridSortingKeyBuffer.buffer, 0, VK_WHOLE_SIZE};
+  VkDescriptorBufferInfo            recordedRaysDesc{m_recordedRaysBuffer.buffer, 0, VK_WHOLE_SIZE};
   writes.emplace_back(m_bind.makeWrite(m_descSet, EnvBindings::eSunSky, &sunskyDesc));
   writes.emplace_back(m_bind.makeWrite(m_descSet, EnvBindings::eHdr, &m_skydome.m_texHdr.descriptor));
   writes.emplace_back(m_bind.makeWrite(m_descSet, EnvBindings::eImpSamples, &accelImpSmpl));
   writes.emplace_back(m_bind.makeWrite(m_descSet, EnvBindings::eSortParameters, &sortParametersDesc));
   writes.emplace_back(m_bind.makeWrite(m_descSet, EnvBindings::eGridKeys, &gridKeysDesc));
+  writes.emplace_back(m_bind.makeWrite(m_descSet, EnvBindings::eRecordedRays, &recordedRaysDesc));
 
   vkUpdateDescriptorSets(m_device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
 }
@@ -452,6 +510,12 @@ void SampleExample::createUniformBuffer()
   m_sortingParametersBuffer = m_alloc.createBuffer(sizeof(SortingParameters), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
                                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT); 
   NAME_VK(m_sortingParametersBuffer.buffer);                           
+
+  // a single ray until recordRays grows it to the frame, the shader writes only inside the buffer
+  m_recordedRaysCapacity = 1;
+  m_recordedRaysBuffer   = m_alloc.createBuffer(sizeof(RecordedRay), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+  NAME_VK(m_recordedRaysBuffer.buffer);
   
 }
 
@@ -466,6 +530,7 @@ void SampleExample::destroyResources()
   m_alloc.destroy(m_sunAndSkyBuffer);
   m_alloc.destroy(m_sortingParametersBuffer);
   m_alloc.destroy(m_GridSortingKeyBuffer);
+  m_alloc.destroy(m_recordedRaysBuffer);
 
   // Descriptors
   vkDestroyDescriptorPool(m_device, m_descPool, nullptr);
@@ -486,12 +551,314 @@ void SampleExample::destroyResources()
     p = nullptr;
   }
 
+  if(m_timingQueryPool != VK_NULL_HANDLE)
+    vkDestroyQueryPool(m_device, m_timingQueryPool, nullptr);
+  frameClock.reset();
+
   // Memory
   m_staging.deinit();
   m_alloc.deinit();
 
 }
 
+//--------------------------------------------------------------------------------------------------
+// Headless training
+// The offscreen target is the only render target, the render pass is only needed by its tonemapper
+//
+void SampleExample::createHeadlessTarget(VkExtent2D size)
+{
+  m_size         = size;
+  m_renderRegion = {{0, 0}, size};
+  m_depthFormat  = nvvk::findDepthFormat(m_physicalDevice);
+  createRenderPass();
+  createOffscreenRender();
+  CameraManip.setWindowSize(int(size.width), int(size.height));
+}
+
+// Times frames on the GPU for the headless trainer
+class GpuTimingSource : public TimingSource
+{
+public:
+  GpuTimingSource(SampleExample& sample, uint32_t warmupFrames)
+      : m_sample(sample)
+      , m_warmupFrames(warmupFrames)
+  {
+  }
+  double timeFrames(uint32_t cell, uint32_t bin, int hashCode, uint32_t frames) override
+  {
+    return m_sample.renderTimedFrames(cell, bin, hashCode, frames, m_warmupFrames);
+  }
+
+private:
+  SampleExample& m_sample;
+  uint32_t       m_warmupFrames;
+};
+
+// Renders warmupFrames + frames frames with configuration `hashCode` from the center of `cell` looking
+// into `bin` and returns the GPU time of the last `frames` frames in ms, measured with timestamps
+double SampleExample::renderTimedFrames(uint32_t cell, uint32_t bin, int hashCode, uint32_t frames, uint32_t warmupFrames)
+{
+  auto rtx = dynamic_cast<RtxPipeline*>(m_pRender[m_rndMethod]);
+
+  glm::vec3 position = calculateCellCenter(cell);
+  CameraManip.setLookat(position, position + trainingLookDirection(bin), CameraManip.getUp());
+
+  if(rtx->hashParameters(rtx->m_SERParameters) != hashCode)
+  {
+    PipelineStorage pipeline;
+    if(!rtx->findPipeline(hashCode, pipeline))
+    {
+      rtx->createPipelines({hashCode});
+      rtx->findPipeline(hashCode, pipeline);
+    }
+    rtx->setNewPipeline(pipeline);
+  }
+
+  if(m_timingQueryPool == VK_NULL_HANDLE)
+  {
+    VkQueryPoolCreateInfo queryInfo{VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+    queryInfo.queryType  = VK_QUERY_TYPE_TIMESTAMP;
+    queryInfo.queryCount = 2;
+    vkCreateQueryPool(m_device, &queryInfo, nullptr, &m_timingQueryPool);
+  }
+
+  m_rtxState.size        = {m_size.width, m_size.height};
+  m_rtxState.SceneMax    = m_scene.getScene().m_dimensions.max;
+  m_rtxState.SceneMin    = m_scene.getScene().m_dimensions.min;
+  m_rtxState.SceneCenter = m_scene.getScene().m_dimensions.center;
+  m_rtxState.gridX       = grid_x;
+  m_rtxState.gridY       = grid_y;
+  m_rtxState.gridZ       = grid_z;
+
+  // every frame waits for the previous one, as it would behind a present
+  VkMemoryBarrier frameBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  frameBarrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+  frameBarrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+
+  nvvk::ProfilerVK  profiler;  // run() wants one, nothing is recorded into it
+  nvvk::CommandPool cmdPool(m_device, m_graphicsQueueIndex);
+  VkCommandBuffer   cmdBuf = cmdPool.createCommandBuffer();
+  vkCmdResetQueryPool(cmdBuf, m_timingQueryPool, 0, 2);
+  for(uint32_t frame = 0; frame < warmupFrames + frames; frame++)
+  {
+    updateFrame();
+    updateUniformBuffer(cmdBuf);
+    vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &frameBarrier, 0, nullptr, 0, nullptr);
+    if(frame == warmupFrames)
+      vkCmdWriteTimestamp(cmdBuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_timingQueryPool, 0);
+
+    m_pRender[m_rndMethod]->setPushContants(m_rtxState);
+    m_pRender[m_rndMethod]->run(cmdBuf, m_size, profiler, {m_accelStruct.getDescSet(), m_offscreen.getDescSet(), m_scene.getDescSet(), m_descSet});
+    vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &frameBarrier, 0, nullptr, 0, nullptr);
+  }
+  vkCmdWriteTimestamp(cmdBuf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_timingQueryPool, 1);
+  cmdPool.submitAndWait(cmdBuf);
+  rtx->frameCompleted(rtx->currentFrame());
+
+  uint64_t timestamps[2]{};
+  vkGetQueryPoolResults(m_device, m_timingQueryPool, 0, 2, sizeof(timestamps), timestamps, sizeof(uint64_t),
+                        VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(m_physicalDevice, &properties);
+  return double(timestamps[1] - timestamps[0]) * properties.limits.timestampPeriod / 1000000.0;
+}
+
+// Logs the creation time per pipeline variant with and without the shared shader stages
+void SampleExample::benchmarkPipelineCreation(uint32_t numVariants)
+{
+  auto rtx = dynamic_cast<RtxPipeline*>(m_pRender[m_rndMethod]);
+  if(rtx != nullptr)
+    rtx->benchmarkVariantCreation(numVariants);
+}
+
+static const size_t SWITCH_BENCH_CONFIGURATIONS = 8;  // raygens in the table of benchmarkConfigurationSwitch
+
+// Host time of a configuration switch while the previous frame is still in flight: through separate
+// pipelines with the vkDeviceWaitIdle the render loop used before setNewPipeline, through separate
+// pipelines retired by frame as the render loop does now, and through the raygen table
+void SampleExample::benchmarkConfigurationSwitch(uint32_t numSwitches)
+{
+  auto rtx = dynamic_cast<RtxPipeline*>(m_pRender[m_rndMethod]);
+  if(rtx == nullptr || numSwitches == 0)
+    return;
+
+  std::vector<int> configurations;
+  for(const SortingParameters& parameters : enumerateLegalSortingParameters())
+  {
+    if(configurations.size() == SWITCH_BENCH_CONFIGURATIONS)
+      break;
+    configurations.emplace_back(rtx->hashParameters(parameters));
+  }
+  rtx->createPipelines(configurations);
+  if(!rtx->buildRaygenTable(configurations))
+    return;
+  renderTimedFrames(0, 0, configurations[0], 1, 0);  // sets up the state the frames below push
+
+  nvvk::ProfilerVK  profiler;  // run() wants one, nothing is recorded into it
+  nvvk::CommandPool cmdPool(m_device, m_graphicsQueueIndex);
+  enum SwitchPath
+  {
+    eWaitIdle,
+    eRetire,
+    eRaygenTable,
+    eSwitchPathCount
+  };
+  double switchMs[eSwitchPathCount]{};
+  for(int path = 0; path < eSwitchPathCount; path++)
+  {
+    std::vector<VkCommandBuffer> frames;
+    for(uint32_t i = 0; i < numSwitches; i++)
+    {
+      VkCommandBuffer cmdBuf = cmdPool.createCommandBuffer();
+      updateUniformBuffer(cmdBuf);
+      m_pRender[m_rndMethod]->setPushContants(m_rtxState);
+      m_pRender[m_rndMethod]->run(cmdBuf, m_size, profiler, {m_accelStruct.getDescSet(), m_offscreen.getDescSet(), m_scene.getDescSet(), m_descSet});
+      cmdPool.submit(1, &cmdBuf, m_queue);
+      frames.emplace_back(cmdBuf);
+
+      int        next = configurations[(i + 1) % configurations.size()];
+      MilliTimer timer;
+      if(path == eRaygenTable)
+      {
+        rtx->selectRaygen(next);
+      }
+      else
+      {
+        PipelineStorage pipeline;
+        if(rtx->findPipeline(next, pipeline))
+        {
+          if(path == eWaitIdle)
+          {
+            vkDeviceWaitIdle(m_device);
+            rtx->frameCompleted(rtx->currentFrame());
+          }
+          rtx->setNewPipeline(pipeline);
+        }
+      }
+      switchMs[path] += timer.elapsed();
+    }
+    vkDeviceWaitIdle(m_device);
+    rtx->frameCompleted(rtx->currentFrame());
+    cmdPool.destroy(frames.size(), frames.data());
+  }
+
+  SwitchStallStats stalls = rtx->switchStatistics();
+  LOGI("Switching between %zu configurations %u times: %.3f ms per switch waiting for the device, %.3f ms retiring by frame, %.3f ms with the raygen table\n",
+       configurations.size(), numSwitches, switchMs[eWaitIdle] / numSwitches, switchMs[eRetire] / numSwitches,
+       switchMs[eRaygenTable] / numSwitches);
+  LOGI("%llu switches with frames in flight did not wait, %.2f ms of device waits avoided\n",
+       (unsigned long long)stalls.switches, stalls.avoidedMs);
+}
+
+// GPU time of the specialized pipeline and the uber shader for the first `numConfigurations` legal
+// configurations, from the center of the first cell. The difference is what the uber shader's
+// branches on the push constants cost
+void SampleExample::benchmarkDynamicSorting(uint32_t numConfigurations, uint32_t frames, uint32_t warmupFrames)
+{
+  auto rtx = dynamic_cast<RtxPipeline*>(m_pRender[m_rndMethod]);
+  if(rtx == nullptr || numConfigurations == 0)
+    return;
+
+  std::vector<int> configurations;
+  for(const SortingParameters& parameters : enumerateLegalSortingParameters())
+  {
+    if(configurations.size() == numConfigurations)
+      break;
+    configurations.emplace_back(rtx->hashParameters(parameters));
+  }
+  rtx->createPipelines(configurations);
+
+  double specializedMs = 0.0;
+  double dynamicMs     = 0.0;
+  for(int hashCode : configurations)
+  {
+    // renderTimedFrames keeps the uber shader, the configuration is already selected
+    double specialized = renderTimedFrames(0, 0, hashCode, frames, warmupFrames);
+    if(!rtx->selectDynamic(hashCode, false))
+      return;
+    double dynamic = renderTimedFrames(0, 0, hashCode, frames, warmupFrames);
+    LOGI("Configuration %d: %.3f ms specialized, %.3f ms uber shader (%+.1f%%)\n", hashCode, specialized / frames,
+         dynamic / frames, (dynamic / specialized - 1.0) * 100.0);
+    specializedMs += specialized;
+    dynamicMs += dynamic;
+  }
+  LOGI("Uber shader over %zu configurations: %+.1f%% GPU time compared to the specialized pipelines\n",
+       configurations.size(), (dynamicMs / specializedMs - 1.0) * 100.0);
+}
+
+bool SampleExample::recordRays(const std::string& filename, uint32_t cell, uint32_t bin, int depth)
+{
+  auto rtx = dynamic_cast<RtxPipeline*>(m_pRender[m_rndMethod]);
+  if(rtx == nullptr)
+    return false;
+
+  size_t numRays = size_t(m_size.width) * m_size.height;
+  if(numRays > m_recordedRaysCapacity)
+  {
+    vkDeviceWaitIdle(m_device);
+    m_alloc.destroy(m_recordedRaysBuffer);
+    m_recordedRaysCapacity = numRays;
+    m_recordedRaysBuffer   = m_alloc.createBuffer(sizeof(RecordedRay) * numRays, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    NAME_VK(m_recordedRaysBuffer.buffer);
+    VkDescriptorBufferInfo recordedRaysDesc{m_recordedRaysBuffer.buffer, 0, VK_WHOLE_SIZE};
+    VkWriteDescriptorSet   write = m_bind.makeWrite(m_descSet, EnvBindings::eRecordedRays, &recordedRaysDesc);
+    vkUpdateDescriptorSets(m_device, 1, &write, 0, nullptr);
+  }
+
+  // a zero direction marks the pixels whose path ended before `depth`
+  auto* mapped = static_cast<RecordedRay*>(m_alloc.map(m_recordedRaysBuffer));
+  memset(mapped, 0, numRays * sizeof(RecordedRay));
+  m_alloc.unmap(m_recordedRaysBuffer);
+
+  m_rtxState.recordRayDepth = depth;
+  renderTimedFrames(cell, bin, rtx->hashParameters(rtx->m_SERParameters), 1, 0);
+  m_rtxState.recordRayDepth = -1;
+
+  // waiting for the fence does not make the shader writes visible to the host
+  VkMemoryBarrier hostBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  hostBarrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+  hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  nvvk::CommandPool cmdPool(m_device, m_graphicsQueueIndex);
+  VkCommandBuffer   cmdBuf = cmdPool.createCommandBuffer();
+  vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &hostBarrier, 0, nullptr, 0, nullptr);
+  cmdPool.submitAndWait(cmdBuf);
+
+  std::vector<RecordedRay> rays;
+  rays.reserve(numRays);
+  mapped = static_cast<RecordedRay*>(m_alloc.map(m_recordedRaysBuffer));
+  for(size_t pixel = 0; pixel < numRays; pixel++)
+  {
+    if(mapped[pixel].direction != glm::vec3(0.0f))
+      rays.emplace_back(mapped[pixel]);
+  }
+  m_alloc.unmap(m_recordedRaysBuffer);
+
+  if(!writeRecordedRays(filename, rays, m_scene.getScene().m_dimensions.min, m_scene.getScene().m_dimensions.max))
+    return false;
+  printf("recorded %zu rays of bounce %d from cell %u, bin %u to %s\n", rays.size(), depth, cell, bin, filename.c_str());
+  return true;
+}
+
+// Trains every legal configuration on every cell and bin of the grid and saves the result
+void SampleExample::trainHeadless(const HeadlessTrainingSettings& settings)
+{
+  auto rtx = dynamic_cast<RtxPipeline*>(m_pRender[m_rndMethod]);
+  if(rtx == nullptr)
+    return;
+
+  std::vector<int> configurations;
+  for(const SortingParameters& parameters : enumerateLegalSortingParameters())
+    configurations.emplace_back(rtx->hashParameters(parameters));
+  rtx->createPipelines(configurations);
+
+  GpuTimingSource source(*this, settings.warmupFrames);
+  MilliTimer      timer;
+  size_t          cycles = runHeadlessTraining(grid, source, configurations, settings);
+  printf("headless training timed %zu cycles of %zu configurations in %.1f s\n", cycles, configurations.size(), timer.elapsed() / 1000.0);
+  SaveSortingGrid();
+}
+
 //--------------------------------------------------------------------------------------------------
 // Handling resize of the window
 //
@@ -615,6 +982,34 @@ void SampleExample::drawPost(VkCommandBuffer cmdBuf)
 // Ray tracing
 //////////////////////////////////////////////////////////////////////////
 
+// Frames complete in submission order, the newest frame whose fence signaled is enough
+void SampleExample::collectCompletedFrames()
+{
+  auto rtx = dynamic_cast<RtxPipeline*>(m_pRender[m_rndMethod]);
+  if(rtx == nullptr)
+    return;
+
+  m_fenceFrames.resize(m_waitFences.size(), 0);
+  uint64_t completed = 0;
+  for(size_t i = 0; i < m_waitFences.size(); i++)
+  {
+    if(m_fenceFrames[i] > completed && vkGetFenceStatus(m_device, m_waitFences[i]) == VK_SUCCESS)
+      completed = m_fenceFrames[i];
+  }
+  if(completed > 0)
+    rtx->frameCompleted(completed);
+}
+
+void SampleExample::tagFrameFence()
+{
+  auto rtx = dynamic_cast<RtxPipeline*>(m_pRender[m_rndMethod]);
+  if(rtx == nullptr)
+    return;
+
+  m_fenceFrames.resize(m_waitFences.size(), 0);
+  m_fenceFrames[getCurFrame()] = rtx->currentFrame();
+}
+
 void SampleExample::renderScene(const VkCommandBuffer& cmdBuf, nvvk::ProfilerVK& profiler)
 {
 #if defined(NVP_SUPPORTS_NVML)
@@ -631,6 +1026,12 @@ void SampleExample::renderScene(const VkCommandBuffer& cmdBuf, nvvk::ProfilerVK&
 
   auto sec = profiler.timeRecurring("Render", cmdBuf);
 
+  // frame times that completed since the last frame, doCycle of the next frame records them
+  frameSamples.clear();
+  frameClock->collect(frameSamples);
+  if(!frameSamples.empty())
+    latestFrameTimeMs = float(frameSamples.back().timeMs);
+
   // We are done rendering
   if(m_rtxState.frame >= m_maxFrames)
     return;
@@ -654,90 +1055,64 @@ void SampleExample::renderScene(const VkCommandBuffer& cmdBuf, nvvk::ProfilerVK&
 //std::cout << "SceneCenter: " << m_rtxState.SceneCenter.x << " "<<m_rtxState.SceneCenter.y <<" " << m_rtxState.SceneCenter.z << std::endl;
 //std::cout << "SceneMin: " << m_rtxState.SceneMin.x << " "<<m_rtxState.SceneMin.y <<" " << m_rtxState.SceneMin.z << std::endl;
 //std::cout << "SceneMax: " << m_rtxState.SceneMax.x << " "<<m_rtxState.SceneMax.y <<" " << m_rtxState.SceneMax.z << std::endl;
-glm::vec3 distScene = m_rtxState.SceneMax - m_rtxState.SceneMin;
 glm::vec3 cameraPos = CameraManip.getEye();
 glm::vec3 cameraInterest = glm::normalize(CameraManip.getCenter() - cameraPos);
-glm::vec3 up{0.0,1.0,0.0};
-glm::vec3 down{0.0,-1.0,0.0};
-glm::vec3 right{1.0,0.0,0.0};
-glm::vec3 left{-1.0,0.0,0.0};
-glm::vec3 front{0.0,0.0,1.0};
-glm::vec3 back{0.0,0.0,-1.0};
-float closestMatch = 0.0;
-CubeSide closestmatchedSide;
-float angle = glm::dot(cameraInterest,up);
-if(angle> closestMatch)
-{
-  closestMatch = angle;
-  closestmatchedSide = CubeUp;
-}
-angle = glm::dot(cameraInterest,down);
-if(angle > closestMatch)
-{
-  closestMatch = angle;
-  closestmatchedSide = CubeDown;
-}
-angle = glm::dot(cameraInterest,left);
-if(angle > closestMatch)
-{
-  closestMatch = angle;
-  closestmatchedSide = CubeLeft;
-}
-angle = glm::dot(cameraInterest,right);
-if(angle > closestMatch)
-{
-  closestMatch = angle;
-  closestmatchedSide = CubeRight;
-}
-angle = glm::dot(cameraInterest,front);
-if(angle > closestMatch)
-{
-  closestMatch = angle;
-  closestmatchedSide = CubeFront;
-}
-angle = glm::dot(cameraInterest,back);
-if(angle > closestMatch)
-{
-  closestMatch = angle;
-  closestmatchedSide = CubeBack;
-}
-currentLookDirection = closestmatchedSide;
-
-glm::vec3 gridSizes = glm::vec3(distScene.x/grid_x,distScene.y/grid_y, distScene.z/grid_z);
-
-float epsilon = 0.001f; // to ensure correct grid placement
+currentLookDirection = grid.quantizer.bin(cameraInterest);
+currentCell = cellAt(cameraPos, currentGridSpace, currentCellPosition);
 
-//clip cameraPos to bounds of Scene
-glm::vec3 clippedCameraPos = glm::vec3(glm::min(glm::max(cameraPos.x,m_rtxState.SceneMin.x),m_rtxState.SceneMax.x-epsilon),glm::min(glm::max(cameraPos.y,m_rtxState.SceneMin.y),m_rtxState.SceneMax.y-epsilon),glm::min(glm::max(cameraPos.z,m_rtxState.SceneMin.z),m_rtxState.SceneMax.z-epsilon));
-
-//if(cameraPos.x >m_rtxState.SceneMax.x || cameraPos.x < m_rtxState.SceneMin.x ||cameraPos.y >m_rtxState.SceneMax.y || cameraPos.y < m_rtxState.SceneMin.y ||cameraPos.z >m_rtxState.SceneMax.z || cameraPos.z < m_rtxState.SceneMin.z)
-//{
-  //currentGridSpace = glm::vec3(-1,-1,-1);
-//} else 
-{
-  glm::vec3 relativeCamPosition = clippedCameraPos - m_rtxState.SceneMin;
-
-  int gridSpaceX = glm::floor(relativeCamPosition.x / gridSizes.x);
-  int gridSpaceY = glm::floor(relativeCamPosition.y / gridSizes.y);
-  int gridSpaceZ = glm::floor(relativeCamPosition.z / gridSizes.z);
-
-  currentGridSpace = glm::vec3(gridSpaceX,gridSpaceY,gridSpaceZ);
-}
 auto rtx = dynamic_cast<RtxPipeline*>(m_pRender[m_rndMethod]);
+prefetchPipelines(rtx);
 if(useBestParameters)
 {
 
-  CubeSideStorage* cubeSide = getCubeSideElements(currentLookDirection,&grid.gridSpaces[currentGridSpace.z][currentGridSpace.y][currentGridSpace.x]);
-  PipelineStorage bestPipeline = cubeSide->bestPipeline;
-  int hash1 = rtx->hashParameters(bestPipeline.parameters);
+  CubeSideStorage* cubeSide = getCubeSideElements(currentLookDirection,&grid.gridSpaces[currentCell]);
+  int hash1 = cubeSide->bestHash;
   int hash2 = rtx->hashParameters(rtx->m_SERParameters);
   
-  if(bestPipeline.pipeline !=VK_NULL_HANDLE)
+  if(cubeSide->numElements > 0)
   {
-    if(hash1 != hash2)
+    // frame times of the running and the best pipeline as measured in this cell and view bin,
+    // the running one falls back to the current frame time if it was never timed here
+    int currentSlot = grid.findTiming(*cubeSide, hash2);
+    float currentFrameTime = currentSlot >= 0 && grid.timings.fps[currentSlot] > 0.0f ? 1000.0f / grid.timings.fps[currentSlot] : latestFrameTimeMs;
+    float bestFrameTime = cubeSide->bestpipelineFPS > 0.0f ? 1000.0f / cubeSide->bestpipelineFPS : 0.0f;
+
+    // with the prefetcher a best pipeline that is not built yet is requested and switched to once
+    // it is, the frame does not wait for it
+    if(cellPrefetcher.enabled && !useDynamicSorting && hash1 != hash2 && !rtx->isPipelineReady(hash1))
     {
-      vkDeviceWaitIdle(m_device);
-      rtx->setNewPipeline(bestPipeline);
+      rtx->requestPipeline(hash1, ePriorityBlocking);
+    }
+    else if(switchPolicy.shouldSwitch(hash2, currentFrameTime, hash1, bestFrameTime))
+    {
+      MilliTimer stallTimer;
+      // a best configuration in the raygen table is switched to without a wait
+      if(rtx->selectRaygen(hash1))
+      {
+        switchPolicy.recordSwitchStall(float(stallTimer.elapsed()));
+      }
+      else
+      {
+        // a best pipeline the variant cache evicted is built again in the background, the running
+        // pipeline or the uber shader covers the frames until it is
+        PipelineStorage bestPipeline;
+        if(!rtx->findPipeline(hash1, bestPipeline))
+        {
+          if(useDynamicSorting && rtx->selectDynamic(hash1))
+          {
+            switchPolicy.recordSwitchStall(float(stallTimer.elapsed()));
+          }
+          else
+          {
+            rtx->requestSwitch(hash1);
+          }
+        }
+        if(bestPipeline.pipeline != VK_NULL_HANDLE)
+        {
+          rtx->setNewPipeline(bestPipeline);
+          switchPolicy.recordSwitchStall(float(stallTimer.elapsed()));
+        }
+      }
     }
 
   }
@@ -750,8 +1125,10 @@ if(useBestParameters)
 
   
   auto render_ID = profiler.beginSection("Render Section",cmdBuf);
+  frameClock->beginFrame(cmdBuf, cycleMeasurement.cycle);
   m_pRender[m_rndMethod]->run(cmdBuf, render_size, profiler,
                               {m_accelStruct.getDescSet(), m_offscreen.getDescSet(), m_scene.getDescSet(), m_descSet});
+  frameClock->endFrame(cmdBuf);
   profiler.endSection(render_ID,cmdBuf);
 
 
@@ -921,11 +1298,11 @@ bool parametersLegalCheck(SortingParameters parameters)
   {
     return false;
   }
-  return true;
+  return keyCompositionLegalCheck(parameters);
 }
 SortingParameters SampleExample::createSortingParameters()
 {
-  SortingParameters result;
+  SortingParameters result{};
   bool isLegal = false;
   std::uniform_int_distribution<std::mt19937::result_type> dist32(1,32);
   std::uniform_int_distribution<std::mt19937::result_type> distBool(0,1);
@@ -943,7 +1320,7 @@ SortingParameters SampleExample::createSortingParameters()
     result.rayDirection = distBool(rng);
     result.rayOrigin =  distBool(rng);
     result.isFinished = distBool(rng);
-
+    randomKeyComposition(result, rng);
 
 
     isLegal = parametersLegalCheck(result);
@@ -955,11 +1332,24 @@ void SampleExample::beginSortingGridTraining()
 {
   constantGridlearningSpeed = 1.0f;
   trainingDirectionIndex = 0;
-  trainingPosition = glm::vec3(0,0,0);
 
-  glm::vec3 trainingStartPosition = calculateGridSpaceCenter(trainingPosition);
+  // same order as the uniform grid was always trained in, cells that are already split contribute their leaves
+  trainingCells.clear();
+  trainingCellIndex = 0;
+  for(int i = 0; i < grid_x; i++)
+  {
+    for(int j = 0; j < grid_y; j++)
+    {
+      for(int k = 0; k < grid_z; k++)
+      {
+        grid.collectLeaves(uint32_t(grid.cellIndex(glm::ivec3(i,j,k))), trainingCells);
+      }
+    }
+  }
+
+  glm::vec3 trainingStartPosition = calculateCellCenter(trainingCells[0]);
 
-  glm::vec3 newCameraDirection = trainingStartPosition+ lookDirections[trainingDirectionIndex];
+  glm::vec3 newCameraDirection = trainingStartPosition+ trainingLookDirection(trainingDirectionIndex);
   trainingDirectionIndex++;
 
     //glm::vec3 newCameraDirection = CameraManip.getCenter();
@@ -969,106 +1359,54 @@ void SampleExample::beginSortingGridTraining()
 
 void SampleExample::iterateTrainingPosition()
 {
-  glm::vec3 result;
+  // a cell that was split while it was trained appends its leaves to the schedule,
+  // so training time goes where the best configuration changes within a cell
+  uint32_t trainedCell = trainingCells[trainingCellIndex];
+  if(grid.isLive(trainedCell) && grid.gridSpaces[trainedCell].firstChild >= 0)
+  {
+    grid.collectLeaves(trainedCell, trainingCells);
+  }
 
-  if(trainingPosition.z+1 == grid_z)
+  // cells merged away in the meantime are skipped
+  do
   {
-    if(trainingPosition.y+1 == grid_y)
-    {
-      if(trainingPosition.x+1 == grid_x)
-      {
-        //finished training, each grid cell has been visited and fully tested.
-        performAutomaticTraining = false;
-      } else {
-        trainingPosition = glm::vec3(trainingPosition.x+1,0,0);
-      }
-    } else {
-      trainingPosition = glm::vec3(trainingPosition.x,trainingPosition.y+1,0);
-    }
-  } else {
-    trainingPosition = glm::vec3(trainingPosition.x,trainingPosition.y,trainingPosition.z+1);
+    trainingCellIndex++;
+  } while(trainingCellIndex < trainingCells.size() && !grid.isLive(trainingCells[trainingCellIndex]));
+
+  if(trainingCellIndex == trainingCells.size())
+  {
+    //finished training, each grid cell has been visited and fully tested.
+    performAutomaticTraining = false;
+    trainingCellIndex = 0;
   }
 
 }
 void SampleExample::doCycle()
 {
-  //timer
-  if(framesThisCycle == 0)
+  // a configuration is judged by the time of its frames as the frame clock measured them, with GPU
+  // timestamps that is the trace dispatch alone. The samples arrive late and carry their cycle
+  for(const FrameSample& sample : frameSamples)
   {
-    framesThisCycle++;
-
-    return;
+    cycleMeasurement.add(sample);
   }
+ // the length of a cycle stays wall clock time
  timeRemaining -= ImGui::GetIO().DeltaTime * 1000;
- framesThisCycle++;
 
- if(timeRemaining < 0.0)
+ if(timeRemaining < 0.0 && cycleMeasurement.frames > 0)
  {
 
 
-  printf(std::to_string(framesThisCycle).c_str());
-  printf("\n");
   timeRemaining = timePerCycle;
   auto rtx = dynamic_cast<RtxPipeline*>(m_pRender[m_rndMethod]);
   int hashCode = rtx->hashParameters(rtx->m_SERParameters);
-  bool foundOne = false;
-  bool foundOne2 = false;
 
-   //currentGrid = &sortingGrid[currentGridSpace.z][currentGridSpace.y][currentGridSpace.x];
-  GridSpace* currentGrid = &grid.gridSpaces[currentGridSpace.z][currentGridSpace.y][currentGridSpace.x];
+  GridSpace* currentGrid = &grid.gridSpaces[currentCell];
   
   CubeSideStorage* cubeSide = getCubeSideElements(currentLookDirection,currentGrid);
-  std::vector<TimingObject>* observedData = &cubeSide->storedElements;
-  
-
-  for(int i = 0; i < observedData->size(); i++)
-  {
-    TimingObject* object = &observedData->at(i);
-    if(hashCode == object->hashCode)
-    {
-      object->frames += framesThisCycle;
-      object->totalCycles += 1;
-      object->fps = object->frames*1000/(timePerCycle * object->totalCycles);
-
-      int bestPipelineParameterHash = rtx->hashParameters(cubeSide->bestPipeline.parameters);
-      
-
-      // when current parameters and the ones of the best pipeline are identical, update best pipeline timing
-      if(hashCode == bestPipelineParameterHash)
-      {
-        cubeSide->bestpipelineFPS = object->fps;
-      }
-      else {
-        //if they are different test if current parameters are faster, update bestPipeline if they are
-        if(object->fps > cubeSide->bestpipelineFPS)
-          {
-            cubeSide->bestpipelineFPS = object->fps;
-            cubeSide->bestPipeline = rtx->activeElement;
-          }
-      }
-
-      foundOne2 = true;
-      break;
-    }
-  }
-  if(!foundOne2)
-  {
-    TimingObject newTiming;
-    newTiming.hashCode = hashCode;
-    newTiming.frames = framesThisCycle;
-    newTiming.fps = framesThisCycle*1000/timePerCycle;
-    newTiming.totalCycles = 1;
-    observedData->emplace_back(newTiming);
-
-    if(newTiming.fps > cubeSide->bestpipelineFPS)
-      {
-        cubeSide->bestpipelineFPS = newTiming.fps;
-        cubeSide->bestPipeline = rtx->activeElement;
-        
-      }
-  }
+  // the record lookup is O(1) and the best configuration of the side is maintained incrementally
+  grid.recordCycle(*cubeSide, hashCode, int(cycleMeasurement.frames), float(cycleMeasurement.timeMs));
   int minNumberTestedConfigs = 5;
-  int numTestedConfigs = observedData->size();
+  int numTestedConfigs = cubeSide->numElements;
   float randValue = static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
   float val = glm::max(numTestedConfigs-minNumberTestedConfigs,0) / 5;
 
@@ -1078,10 +1416,10 @@ void SampleExample::doCycle()
     {
       iterateTrainingPosition();
     }
-    glm::vec3 newCameraPosition = calculateGridSpaceCenter(trainingPosition);
-    glm::vec3 newCameraDirection = newCameraPosition+ lookDirections[trainingDirectionIndex];
+    glm::vec3 newCameraPosition = calculateCellCenter(trainingCells[trainingCellIndex]);
+    glm::vec3 newCameraDirection = newCameraPosition+ trainingLookDirection(trainingDirectionIndex);
     trainingDirectionIndex = trainingDirectionIndex+1;
-    if(trainingDirectionIndex ==6)
+    if(trainingDirectionIndex == int(grid.quantizer.numBins()))
     {
       trainingDirectionIndex = 0;
     }
@@ -1089,29 +1427,40 @@ void SampleExample::doCycle()
     CameraManip.setLookat(newCameraPosition,newCameraDirection,CameraManip.getUp());
   }
 
-  framesThisCycle = 0;
-  float r = static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
-  
-  //with probability 1-epsilon, or no pipeline is porea
-  float epsilon = useConstantGridLearning ? constantGridlearningSpeed : currentGrid->adaptiveGridLearningRate;
-  if(r > epsilon || rtx->PrebuildPipelineBuffer.empty())
-  {
-
+  cycleMeasurement.next();
 
-      printf("exploit\n");
-      if(currentGrid->bestPipeline.pipeline != VK_NULL_HANDLE)
+  // the exploration policy picks a measured configuration or asks for a new one
+  ExplorationState explorationState = collectExplorationState(grid, *cubeSide);
+  explorationState.epsilon = useConstantGridLearning ? constantGridlearningSpeed : currentGrid->adaptiveGridLearningRate;
+  explorationState.untestedAvailable = rtx->hasPrebuiltPipeline() || useDynamicSorting;
+  int arm = explorationPolicy->choose(explorationState);
+  if(arm >= 0)
+  {
+      int armHash = explorationState.arms[arm].hashCode;
+      PipelineStorage armPipeline;
+      // arms whose pipeline the variant cache evicted are skipped for this cycle, unless the uber shader runs them
+      if(armHash != hashCode
+         && (rtx->selectRaygen(armHash) || rtx->findPipeline(armHash, armPipeline)
+             || (useDynamicSorting && rtx->selectDynamic(armHash))))
       {
-        rtx->setNewPipeline(currentGrid->bestPipeline);
-        printf("chose faster one\n");
+        if(armPipeline.pipeline != VK_NULL_HANDLE)
+          rtx->setNewPipeline(armPipeline);
+        printf(armHash == cubeSide->bestHash ? "exploit\n" : "revisit\n");
       }
-
-
-
   }
   //otherwise explore
-  else {
-      vkDeviceWaitIdle(m_device);
-      rtx->setNewPipeline();
+  else if(explorationState.untestedAvailable)
+  {
+      // without a prebuilt pipeline a new configuration is explored on the uber shader until its
+      // pipeline is built in the background
+      if(rtx->hasPrebuiltPipeline())
+      {
+        rtx->setNewPipeline();
+      }
+      else
+      {
+        rtx->selectDynamic(rtx->hashParameters(createSortingParameters1()));
+      }
       printf("explore\n");
       if(!useConstantGridLearning)
       {
@@ -1119,6 +1468,13 @@ void SampleExample::doCycle()
         currentGrid->adaptiveGridLearningRate = glm::max(currentGrid->adaptiveGridLearningRate,0.1f);
       }
   }
+
+  // the adaptive grid splits or merges around the cell that was just timed
+  if(grid.refine(currentCell))
+  {
+    currentCell = grid.leaf(currentGridSpace, currentCellPosition);
+    printf("adaptive grid now has %d cells\n", int(grid.numCells()));
+  }
  }
 
 }
@@ -1126,296 +1482,76 @@ void SampleExample::doCycle()
 
 void SampleExample::buildSortingGrid()
 {
-  std::vector<std::vector<std::vector<GridSpace>>> newSortingGrid;
-  //newSortingGrid.resize(grid_y,std::vector<GridSpace>(grid_x));
-  newSortingGrid.resize(grid_z,std::vector<std::vector<GridSpace> >(grid_y,std::vector<GridSpace>(grid_x)));
-  sortingGrid = newSortingGrid;
-  grid.gridSpaces = newSortingGrid;
-  grid.gridDimensions = glm::vec3(grid_x,grid_y,grid_z);
-  printf("build new Grid with dimension %d , %d \n",grid_y,grid_x);
+  DirectionQuantizer quantizer;
+  quantizer.mode = DirectionBinning(directionBinning);
+  quantizer.resolution = directionResolution;
+  grid.build(glm::ivec3(grid_x,grid_y,grid_z), quantizer);
+  bestKeys.assign(grid.numRootCells(), GridCube{});
+  fitStorageBuffer();
+  currentCell = 0;
+  printf("build new Grid with dimension %d , %d, %d \n",grid_x,grid_y,grid_z);
 }
 
 #include <ctime>
 
 //int SampleExample::getCubeSideHash()
 
-json SampleExample::fillJsonWithAllResults(json js)
+// direction of the camera when training a bin. Straight up or down is tilted slightly,
+// CameraManip.setLookat cannot look along its up vector
+glm::vec3 SampleExample::trainingLookDirection(uint32_t bin)
 {
-  CubeSideStorage* cubeside= getCubeSideElements(CubeUp,&grid.gridSpaces[0][0][0]);
-for(int i = 0; i < grid.gridDimensions.x; i++)
+  glm::vec3 direction = grid.quantizer.binCenter(bin);
+  if(glm::abs(direction.y) > 0.99f)
   {
-    for(int j = 0; j < grid.gridDimensions.y; j++)
-    {
-      for(int k = 0; k < grid.gridDimensions.z; k++)
-      {
-        std::string s1 = "(" + std::to_string(i) + "," + std::to_string(j) + "," + std::to_string(k) + ")";
-        //CubeSideStorage* cubeside= getCubeSideElements(CubeBack,&grid.gridSpaces[k][j][i]);
-        CubeSideStorage* cubeside= getCubeSideElements(CubeUp,&grid.gridSpaces[k][j][i]);
-
-        if(cubeside->storedElements.empty())
-        {
-          js[s1]["top"] = 1;
-        } else {
-          std::vector<int> hashcodes;
-          std::vector<float> times;
-          for(TimingObject timing : cubeside->storedElements)
-          {
-            //hashcodes.emplace_back(timing.hashCode);
-            //times.emplace_back(timing.fps);
-
-
-            js[s1]["top"][std::to_string(timing.hashCode)] = timing.fps;
-          }
-          //js[s1]["top"]["hashcodes"] = hashcodes;
-          //js[s1]["top"]["FPS"] = times;
-        }
-
-        cubeside= getCubeSideElements(CubeDown,&grid.gridSpaces[k][j][i]);
-
-        if(cubeside->storedElements.empty())
-        {
-          js[s1]["bottom"] = 1;
-        } else {
-          for(TimingObject timing : cubeside->storedElements)
-          {
-            
-            js[s1]["bottom"][std::to_string(timing.hashCode)] = timing.fps;
-          }
-        }
-
-          cubeside= getCubeSideElements(CubeLeft,&grid.gridSpaces[k][j][i]);
-
-          if(cubeside->storedElements.empty())
-          {
-            js[s1]["left"] = 1;
-          }
-          else {
-            for(TimingObject timing : cubeside->storedElements)
-            {
-              
-              js[s1]["left"][std::to_string(timing.hashCode)] = timing.fps;
-            }
-          }
-
-          cubeside= getCubeSideElements(CubeRight,&grid.gridSpaces[k][j][i]);
-
-          if(cubeside->storedElements.empty())
-          {
-            js[s1]["right"] = 1;
-          }
-          else {
-            for(TimingObject timing : cubeside->storedElements)
-            {
-              
-              js[s1]["right"][std::to_string(timing.hashCode)] = timing.fps;
-            }
-          }
-
-          cubeside= getCubeSideElements(CubeFront,&grid.gridSpaces[k][j][i]);
-
-          if(cubeside->storedElements.empty())
-          {
-            js[s1]["front"] = 1;
-          }
-          else {
-            for(TimingObject timing : cubeside->storedElements)
-            {
-              
-              js[s1]["front"][std::to_string(timing.hashCode)] = timing.fps;
-            }
-          }
-
-
-          cubeside= getCubeSideElements(CubeBack,&grid.gridSpaces[k][j][i]);
-          if(cubeside->storedElements.empty())
-          {
-            js[s1]["back"] = 1;
-          }
-          else {
-            
-            for(TimingObject timing : cubeside->storedElements)
-            {
-              
-              js[s1]["back"][std::to_string(timing.hashCode)] = timing.fps;
-              //js["Observations"][s1]["back"] = {}
-            }
-          }
-      }
-    }
+    direction.z += direction.y > 0.0f ? 0.1f : -0.1f;
   }
+  return direction;
+}
 
+json SampleExample::fillJsonWithAllResults(json js)
+{
+  writeGridJson(grid, js, false);
   return js;
 }
 
 json SampleExample::fillJsonWithBestResult(json js)
 {
-  std::string s1 = "(" + std::to_string(0) + "," + std::to_string(0) + "," + std::to_string(0) + ")";
-  CubeSideStorage* cubeside= getCubeSideElements(CubeUp,&grid.gridSpaces[0][0][0]);
-for(int i = 0; i < grid.gridDimensions.x; i++)
-  {
-    for(int j = 0; j < grid.gridDimensions.y; j++)
-    {
-      for(int k = 0; k < grid.gridDimensions.z; k++)
-      {
-        std::string s1 = "(" + std::to_string(i) + "," + std::to_string(j) + "," + std::to_string(k) + ")";
-        //CubeSideStorage* cubeside= getCubeSideElements(CubeBack,&grid.gridSpaces[k][j][i]);
-        CubeSideStorage* cubeside= getCubeSideElements(CubeUp,&grid.gridSpaces[k][j][i]);
-
-        if(cubeside->storedElements.empty())
-        {
-          js["Observations"][s1]["top"] = 1;
-        } else {
-          float fastestTime = std::numeric_limits<float>::min();
-          int fastestParameters = 0;
-          for(TimingObject timing : cubeside->storedElements)
-          {
-            if(timing.fps > fastestTime)
-            {
-              fastestTime = timing.fps;
-              fastestParameters = timing.hashCode;
-            }
-          }
-          js["Observations"][s1]["top"] = {fastestParameters,fastestTime};
-        }
-
-        cubeside= getCubeSideElements(CubeDown,&grid.gridSpaces[k][j][i]);
-
-        if(cubeside->storedElements.empty())
-        {
-          js["Observations"][s1]["bottom"] = 1;
-        } else {
-          float fastestTime = std::numeric_limits<float>::min();
-          int fastestParameters = 0;
-          for(TimingObject timing : cubeside->storedElements)
-          {
-            if(timing.fps > fastestTime)
-            {
-              fastestTime = timing.fps;
-              fastestParameters = timing.hashCode;
-            }
-          }
-          js["Observations"][s1]["bottom"] = {fastestParameters,fastestTime};
-        }
-
-          cubeside= getCubeSideElements(CubeLeft,&grid.gridSpaces[k][j][i]);
-
-          if(cubeside->storedElements.empty())
-          {
-            js["Observations"][s1]["left"] = 1;
-          }
-          else {
-            float fastestTime = std::numeric_limits<float>::min();
-            int fastestParameters = 0;
-            for(TimingObject timing : cubeside->storedElements)
-            {
-              if(timing.fps > fastestTime)
-              {
-                fastestTime = timing.fps;
-                fastestParameters = timing.hashCode;
-              }
-            }
-            js["Observations"][s1]["left"] = {fastestParameters,fastestTime};
-          }
-
-          cubeside= getCubeSideElements(CubeRight,&grid.gridSpaces[k][j][i]);
-
-          if(cubeside->storedElements.empty())
-          {
-            js["Observations"][s1]["right"] = 1;
-          }
-          else {
-            float fastestTime = std::numeric_limits<float>::min();
-            int fastestParameters = 0;
-            for(TimingObject timing : cubeside->storedElements)
-            {
-              if(timing.fps > fastestTime)
-              {
-                fastestTime = timing.fps;
-                fastestParameters = timing.hashCode;
-              }
-            }
-            js["Observations"][s1]["right"] = {fastestParameters,fastestTime};
-          }
-
-          cubeside= getCubeSideElements(CubeFront,&grid.gridSpaces[k][j][i]);
-
-          if(cubeside->storedElements.empty())
-          {
-            js["Observations"][s1]["front"] = 1;
-          }
-          else {
-            float fastestTime = std::numeric_limits<float>::min();
-            int fastestParameters = 0;
-            for(TimingObject timing : cubeside->storedElements)
-            {
-              if(timing.fps > fastestTime)
-              {
-                fastestTime = timing.fps;
-                fastestParameters = timing.hashCode;
-              }
-            }
-            js["Observations"][s1]["front"] = {fastestParameters,fastestTime};
-          }
-
-
-          cubeside= getCubeSideElements(CubeBack,&grid.gridSpaces[k][j][i]);
-          if(cubeside->storedElements.empty())
-          {
-            js["Observations"][s1]["back"] = 1;
-          }
-          else {
-            float fastestTime = std::numeric_limits<float>::min();
-            int fastestParameters = 0;
-            for(TimingObject timing : cubeside->storedElements)
-            {
-              if(timing.fps > fastestTime)
-              {
-                fastestTime = timing.fps;
-                fastestParameters = timing.hashCode;
-              }
-            }
-            js["Observations"][s1]["back"] = {fastestParameters,fastestTime};
-          }
-      }
-    }
-  }
-
+  writeGridJson(grid, js, true);
   return js;
 }
 void SampleExample::SaveSortingGrid()
 {
-
-
-  json j2;
-  j2["Grid Dimensions (x,y,z)"] = {grid.gridDimensions.x,grid.gridDimensions.y,grid.gridDimensions.z};
-
-  j2 = fillJsonWithAllResults(j2);
-  std::string s = j2.dump(4);
-
   time_t timestamp = time(&timestamp);
   struct tm * datetime = localtime(&timestamp);
-  //printf("%2d_%2d__%2d_%2d_%2d\n",datetime->tm_mday,datetime->tm_mon,datetime->tm_hour,datetime->tm_min,datetime->tm_sec);
 
   char buffer [80];
   strftime(buffer,80,"%d_%m-%H_%M_%S",datetime);
-  //printf(buffer);
-  std::string begin = "C:/Users/Frederik/Key_Inference_For_SER/Sorting_Grid_Results/";
-  std::string filename = std::string(buffer);
-  std::string end = ".json";
-  std::string fullFileName =begin + filename + end;
-  std::fstream fs;
-  std::ofstream outstream;
+  std::filesystem::path basePath = std::filesystem::path(gridOutputDirectory) / buffer;
+  std::error_code error;
+  std::filesystem::create_directories(gridOutputDirectory, error);
 
-  outstream.open(fullFileName, std::fstream::out | std::fstream::app);
-
-  outstream << s;
+  std::string fullFileName = basePath.string() + GRID_FILE_EXTENSION;
+  MilliTimer timer;
+  if(saveGridBinary(grid, fullFileName))
+  {
+    printf("saved sorting grid to %s in %.2f ms\n", fullFileName.c_str(), timer.elapsed());
+  }
 
-  outstream.close();
-  
-  printf("saved to file\n");
-  printf("with File name: ");
-  printf(fullFileName.c_str());
-  
+  // human readable dump of the same grid, slow for large grids
+  if(dumpGridJson)
+  {
+    json j2;
+    j2["Grid Dimensions (x,y,z)"] = {grid.gridDimensions.x,grid.gridDimensions.y,grid.gridDimensions.z};
+    j2["Direction Binning"] = {{"mode", grid.quantizer.modeName()}, {"resolution", grid.quantizer.resolution}};
+    j2["Adaptive Grid"] = {{"enabled", grid.adaptive.enabled}, {"maxDepth", grid.adaptive.maxDepth}, {"splitVariation", grid.adaptive.splitVariation}};
+    j2["Statistics"] = {{"requireSignificance", grid.statistics.requireSignificance}, {"confidence", grid.statistics.confidence}};
+    j2 = fillJsonWithAllResults(j2);
+
+    std::string jsonFileName = basePath.string() + ".json";
+    std::ofstream outstream(jsonFileName, std::fstream::out | std::fstream::trunc);
+    outstream << j2.dump(4);
+    printf("dumped sorting grid to %s\n", jsonFileName.c_str());
+  }
 }
 
 
@@ -1423,30 +1559,84 @@ void SampleExample::SaveSortingGrid()
 
 //CubeSideStorage SampleExa
 
-CubeSideStorage* SampleExample::getCubeSideElements(CubeSide side,GridSpace* currentGrid)
+CubeSideStorage* SampleExample::getCubeSideElements(uint32_t bin,GridSpace* currentGrid)
 {
-  if(side == CubeSide::CubeBack)
-  {
-    return &currentGrid->cube.backElements;
-  } else if(side == CubeSide::CubeDown)
+  return &grid.side(*currentGrid, bin);
+}
+
+
+glm::vec3 SampleExample::calculateCellCenter(uint32_t cell)
+{
+  const GridSpace& space = grid.gridSpaces[cell];
+  nvh::GltfScene& scene =  m_scene.getScene();
+
+  glm::vec3 cellSize = scene.m_dimensions.size / glm::vec3(grid_x,grid_y,grid_z);
+  return scene.m_dimensions.min + (glm::vec3(space.rootCell) + space.localMin + glm::vec3(0.5f * space.localSize)) * cellSize;
+}
+
+uint32_t SampleExample::cellAt(glm::vec3 position, glm::ivec3& gridSpace, glm::vec3& local)
+{
+  nvh::GltfScene& scene   = m_scene.getScene();
+  glm::vec3       epsilon = glm::vec3(0.001f);  // to ensure correct grid placement
+
+  glm::vec3 cellSize = scene.m_dimensions.size / glm::vec3(grid_x, grid_y, grid_z);
+  glm::vec3 clipped  = glm::clamp(position, scene.m_dimensions.min, scene.m_dimensions.max - epsilon);
+  glm::vec3 relative = (clipped - scene.m_dimensions.min) / cellSize;
+
+  gridSpace = glm::ivec3(glm::floor(relative));
+  local     = relative - glm::vec3(gridSpace);
+  return grid.leaf(gridSpace, local);
+}
+
+// Requests the best configurations of the cells the camera reaches next: the following cells of
+// the training schedule, or the cells along the camera velocity. Also counts how often crossing
+// into a cell found its best pipeline built
+void SampleExample::prefetchPipelines(RtxPipeline* rtx)
+{
+  float elapsedSeconds = float(prefetchClock.elapsed()) / 1000.0f;
+  prefetchClock.reset();
+  cellPrefetcher.update(CameraManip.getEye(), elapsedSeconds);
+
+  if(currentCell != previousCell)
   {
-    return &currentGrid->cube.downElements;
-  } else if(side == CubeSide::CubeFront)
+    CubeSideStorage* entered = getCubeSideElements(currentLookDirection, &grid.gridSpaces[currentCell]);
+    if(previousCell != ~0u && entered->numElements > 0)
+      cellPrefetcher.recordCrossing(entered->bestHash, rtx->isPipelineReady(entered->bestHash));
+    previousCell = currentCell;
+  }
+
+  std::vector<uint32_t> cells;
+  if(cellPrefetcher.enabled && performAutomaticTraining)
   {
-    return &currentGrid->cube.frontElements;
-  } else if(side == CubeSide::CubeLeft)
+    for(size_t i = trainingCellIndex + 1; i < trainingCells.size() && cells.size() < cellPrefetcher.pathSteps; i++)
+    {
+      if(grid.isLive(trainingCells[i]))
+        cells.emplace_back(trainingCells[i]);
+    }
+  }
+  else if(cellPrefetcher.enabled)
   {
-    return &currentGrid->cube.leftElements;
-  } else if(side == CubeSide::CubeRight)
+    glm::ivec3 gridSpace;
+    glm::vec3  local;
+    for(const glm::vec3& position : cellPrefetcher.predictPath())
+      cells.emplace_back(cellAt(position, gridSpace, local));
+  }
+
+  // the bin the camera looks into now is the most likely one on arrival
+  std::vector<int> targets;
+  for(uint32_t cell : cells)
   {
-    return &currentGrid->cube.rightElements;
-  } else//Cube up
+    CubeSideStorage* side = getCubeSideElements(currentLookDirection, &grid.gridSpaces[cell]);
+    if(cell != currentCell && side->numElements > 0)
+      targets.emplace_back(side->bestHash);
+  }
+  for(int hashCode : cellPrefetcher.setTargets(targets))
   {
-    return &currentGrid->cube.upElements;
+    if(!rtx->isPipelineReady(hashCode))
+      rtx->requestPipeline(hashCode, ePriorityPredicted);
   }
 }
 
-
 glm::vec3 SampleExample::calculateGridSpaceCenter(glm::vec3 gridspace)
 {
   glm::vec3 result{0.0,0.0,0.0};
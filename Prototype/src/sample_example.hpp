@@ -73,6 +73,11 @@ typedef nvvk::ResourceAllocatorDedicated Allocator;
 #include "queue.hpp"
 #include "nvvk/stagingmemorymanager_vk.hpp"
 #include "sorting_grid.hpp"
+#include "exploration_policy.hpp"
+#include "switch_policy.hpp"
+#include "cell_prefetcher.hpp"
+#include "headless_trainer.hpp"
+#include "frame_clock.hpp"
 
 class SampleGUI;
 
@@ -116,6 +121,17 @@ public:
   void destroyResources();
   void loadAssets(const char* filename);
   void loadEnvironmentHdr(const std::string& hdrFilename);
+
+  // Headless training: renders into the offscreen target only, without window or swapchain
+  void   createHeadlessTarget(VkExtent2D size);
+  double renderTimedFrames(uint32_t cell, uint32_t bin, int hashCode, uint32_t frames, uint32_t warmupFrames);
+  void   trainHeadless(const HeadlessTrainingSettings& settings);
+  void   benchmarkPipelineCreation(uint32_t numVariants);
+  void   benchmarkConfigurationSwitch(uint32_t numSwitches);
+  void   benchmarkDynamicSorting(uint32_t numConfigurations, uint32_t frames, uint32_t warmupFrames);
+  // Renders one frame from the center of `cell` into view direction bin `bin` and writes the ray of
+  // every pixel at bounce `depth` to a .rays file for -keystats. Pixels whose path ended earlier are left out
+  bool   recordRays(const std::string& filename, uint32_t cell, uint32_t bin, int depth);
   void loadScene(const std::string& filename);
   void onFileDrop(const char* filename) override;
   void onKeyboard(int key, int scancode, int action, int mods) override;
@@ -136,6 +152,7 @@ public:
   void beginSortingGridTraining();
   void iterateTrainingPosition();
   void doCycle();
+  void createFrameClock();
 
   Scene              m_scene;
   AccelStructure     m_accelStruct;
@@ -152,24 +169,20 @@ public:
   std::array<Renderer*, eNone> m_pRender{nullptr, nullptr};
   RndMethod                    m_rndMethod{eNone};
 
-  enum CubeSide
-{
-  CubeUp,
-  CubeDown,
-  CubeLeft,
-  CubeRight,
-  CubeFront,
-  CubeBack
-};
   bool useBestParameters = false;;
-  CubeSide currentLookDirection;
+  PipelineSwitchPolicy switchPolicy;  // when to follow the best pipeline with useBestParameters
+  CellPrefetcher       cellPrefetcher;  // builds the best pipelines of the cells the camera reaches next
+  uint32_t currentLookDirection{0};  // view direction bin of the camera, see Grid::quantizer
   nvvk::Buffer m_sunAndSkyBuffer;
   nvvk::Buffer m_profilingBuffer;
   nvvk::Buffer m_sortingParametersBuffer; //UniformBuffers that contains the parameters chosen by User or the Classificator for SER
   nvvk::Buffer m_GridSortingKeyBuffer;
-  const int MAXGRIDSIZE = 10;
+  size_t       m_gridKeyBufferCells{0};  // GridCube entries m_GridSortingKeyBuffer holds
+  nvvk::Buffer m_recordedRaysBuffer;      // host visible, one RecordedRay per pixel while recording
+  size_t       m_recordedRaysCapacity{0};
+  const int MAXGRIDSIZE = 32;  // limit of the GUI sliders, loaded grids may be larger
 
-  GridCube bestKeys[10*10*10];
+  std::vector<GridCube> bestKeys;  // one entry per grid cell, same dense index as Grid::gridSpaces
 
   int bestSortMode = eNoSorting;
   int DELAY_FRAMES = 4;
@@ -203,8 +216,15 @@ public:
   // #VKRay
   void renderScene(const VkCommandBuffer& cmdBuf, nvvk::ProfilerVK& profiler);
 
+  // Pipeline switches do not wait for the device. After prepareFrame the frames whose fence
+  // signaled are reported to the renderer, before submitFrame the frame is tagged to its fence
+  void collectCompletedFrames();
+  void tagFrameFence();
+  std::vector<uint64_t> m_fenceFrames;  // last renderer frame submitted with each of m_waitFences
+
   //creates a SortingParameters Struct
   void createStorageBuffer();
+  void fitStorageBuffer();  // grows m_GridSortingKeyBuffer to the root cells of the grid
   void updateStorageBuffer(const VkCommandBuffer& cmdBuf);
   SortingParameters createSortingParameters();
 
@@ -237,7 +257,9 @@ public:
       0,  //rayDirection;
       0,  // estimatedEndpoint;
       0,  // realEndpoint;
-      0  // isFinished;
+      0,  // isFinished;
+      0,  // keyComposition;
+      -1  // recordRayDepth;
             
   };
 
@@ -267,6 +289,7 @@ public:
   bool        m_descaling{false};
   int         m_descalingLevel{1};
   bool        m_busy{false};
+  VkQueryPool m_timingQueryPool{VK_NULL_HANDLE};  // timestamps of renderTimedFrames
   std::string m_busyReasonText;
 
 
@@ -280,7 +303,16 @@ public:
   float timePerCubeSide = 1000.0f;
 
   float timeRemaining = timePerCycle;
-  uint framesThisCycle = 0;
+
+  // per frame time of the trace dispatch that doCycle records, see createFrameClock
+  bool                        useGpuFrameClock{true};
+  std::unique_ptr<FrameClock> frameClock;
+  CycleMeasurement            cycleMeasurement;
+  std::vector<FrameSample>    frameSamples;  // collected by renderScene, consumed by doCycle
+  float                       latestFrameTimeMs{0.0f};
+
+  // configurations without a built pipeline run on the uber shader while theirs is built, see RtxPipeline::selectDynamic
+  bool useDynamicSorting{false};
 
   bool activateParametertesting = false;
 
@@ -290,6 +322,8 @@ public:
 
 float constantGridlearningSpeed = 0.2f;
 bool useConstantGridLearning = true;
+int explorationPolicyType = eEpsilonGreedy;
+std::unique_ptr<ExplorationPolicy> explorationPolicy = createExplorationPolicy(eEpsilonGreedy);
 
 bool performAutomaticTraining{false};
 bool GridWhite = false;
@@ -297,30 +331,42 @@ Grid grid;
 void buildSortingGrid();
 
 int trainingDirectionIndex = 0;
-glm::vec3 trainingPosition = glm::vec3(0,0,0);
+std::vector<uint32_t> trainingCells;  // schedule of grid cells visited by the automatic training
+size_t trainingCellIndex = 0;
 
-glm::vec3 lookDirections[6]{glm::vec3(0,1,0.1),glm::vec3(0,-1,-0.1),glm::vec3(-1,0,0),glm::vec3(1,0,0),glm::vec3(0,0,1),glm::vec3(0,0,-1)};
+glm::vec3 trainingLookDirection(uint32_t bin);
+
+// view direction binning of the next grid that is built
+int directionBinning = eCubeBinning;
+int directionResolution = 4;
 
 int grid_x = 2;
 int grid_y = 2;
 int grid_z = 2;
 
 glm::ivec3 currentGridSpace;
+glm::vec3 currentCellPosition{0.0f};  // camera position inside currentGridSpace in [0,1)^3
+uint32_t currentCell = 0;             // leaf of the adaptive grid the camera is in
+uint32_t previousCell = ~0u;          // currentCell of the last frame, to count crossings
+MilliTimer prefetchClock;             // time between two frames, for the camera velocity
+void prefetchPipelines(RtxPipeline* rtx);
 
 
 
 
-std::vector<std::vector<std::vector<GridSpace>>> sortingGrid;
-
 json fillJsonWithBestResult(json j);
 json fillJsonWithAllResults(json j);
 void SaveSortingGrid();
+std::string gridOutputDirectory{"Sorting_Grid_Results"};  // where SaveSortingGrid writes, set with -griddir
+std::string shaderDirectory{"shaders"};                   // GLSL sources of the ray tracing pipeline, set with -shaderdir
+std::string spirvCacheDirectory{"spirv_cache"};           // compiled shaders of earlier runs, set with -spirvcache
+bool dumpGridJson = false;                                // also write the grid as JSON next to the binary file
 
 
 
 bool waitingOnPipeline = false;
 
-CubeSideStorage* getCubeSideElements(CubeSide side,GridSpace* currentGrid);
+CubeSideStorage* getCubeSideElements(uint32_t bin,GridSpace* currentGrid);
 CubeSideStorage* getCubeSideStorage(GridSpace* currentGrid);
 
 GridCube determineBestTimesCube(GridSpace* currentGrid);
@@ -328,6 +374,11 @@ GridCube determineBestTimesCube(GridSpace* currentGrid);
 int getCubeSideHash(vec3 CubeCoords, CubeSide side);
 
 glm::vec3 calculateGridSpaceCenter(glm::vec3 gridSpace);
+glm::vec3 calculateCellCenter(uint32_t cell);
+// leaf of the grid that contains `position`, clipped to the scene; `gridSpace` and `local` as currentGridSpace and currentCellPosition
+uint32_t cellAt(glm::vec3 position, glm::ivec3& gridSpace, glm::vec3& local);
 
 void loadSortingGrid(const std::string& jsonFilename);
+void loadSortingGridBinary(const std::string& filename);
+void warmStartGrid();
 };
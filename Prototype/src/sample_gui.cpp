@@ -35,6 +35,7 @@
 #include "rtx_pipeline.hpp"
 #include "sample_example.hpp"
 #include "sample_gui.hpp"
+#include "sorting_keys.hpp"
 #include "tools.hpp"
 #include "iostream"
 #include <algorithm>
@@ -168,6 +169,18 @@ bool SampleGUI::guiRayTracing()
       rtx->enableProfiling(bProfiling);
       changed = true;
     }
+    bool bNormalizedKeys = rtx->normalizedKeys();
+    if(GuiH::Checkbox("Normalized Sorting Keys",
+                      "Quantize ray positions in the scene bounds to fixed point before interleaving them, instead of taking the bits of the float coordinates",
+                      &bNormalizedKeys, nullptr)
+       && !_se->performAutomaticTraining)
+    {
+      vkDeviceWaitIdle(_se->m_device);  // cannot run while changing this
+      rtx->useNormalizedKeys(bNormalizedKeys);
+      // the grid records do not tell the encodings apart, timings of the other one would mix in
+      _se->buildSortingGrid();
+      changed = true;
+    }
 
     ImGui::RadioButton("Manual",&manualSorting, 1);
     if(manualSorting > 0)
@@ -191,7 +204,34 @@ bool SampleGUI::guiRayTracing()
     }
 
     //changed |= GuiH::Slider("Number Coherence Bits", "", &_se->m_SERParameters.numCoherenceBitsTotal, nullptr, Normal, 0u, 64u);
-    GuiH::Slider("Number Coherence Bits", "", &rtx->m_SERParameters.numCoherenceBitsTotal, nullptr, Normal, 0u, 64u);
+    GuiH::Slider("Number Coherence Bits", "", &rtx->m_SERParameters.numCoherenceBitsTotal, nullptr, Normal, 0u, 32u);
+
+    // the bit budgets are specialization constants, changing them switches to their variant
+    SortingParameters composed = rtx->m_SERParameters;
+    bool              interleave = composed.interleaveFeatures != 0;
+    bool              recompose  = false;
+    recompose |= GuiH::Slider("Origin Bits", "Key bits of the ray origin, 0 shares the bits the other features leave",
+                              &composed.originBits, nullptr, Normal, 0u, 15u);
+    recompose |= GuiH::Slider("Direction Bits", "Key bits of the ray direction, 0 shares the bits the other features leave",
+                              &composed.directionBits, nullptr, Normal, 0u, 15u);
+    recompose |= GuiH::Slider("Estimated Endpoint Bits", "Key bits of the estimated endpoint, 0 shares the bits the other features leave",
+                              &composed.estimatedEndpointBits, nullptr, Normal, 0u, 15u);
+    recompose |= GuiH::Slider("Real Endpoint Bits", "Key bits of the endpoint of the last bounce, 0 shares the bits the other features leave",
+                              &composed.realEndpointBits, nullptr, Normal, 0u, 15u);
+    recompose |= GuiH::Checkbox("Interleave Key Features", "Interleave the features bit by bit instead of concatenating them", &interleave);
+    composed.interleaveFeatures = interleave ? 1 : 0;
+    int composedHash            = rtx->hashParameters(composed);
+    if(recompose && composedHash != rtx->hashParameters(rtx->m_SERParameters))
+    {
+      PipelineStorage pipeline;
+      if(!rtx->findPipeline(composedHash, pipeline))
+      {
+        rtx->createPipelines({composedHash});
+        rtx->findPipeline(composedHash, pipeline);
+      }
+      rtx->setNewPipeline(pipeline);
+      changed = true;
+    }
   }
   
   GuiH::Group<bool>("Profiling", false, [&] {
@@ -307,7 +347,7 @@ bool SampleGUI::guiSortingGrid()
   bool changed{false};
   auto  Normal = ImGuiH::Control::Flags::Normal;
 
-  if(GuiH::Slider("Grid X", "", &gridX, nullptr, Normal, 1, 10) || GuiH::Slider("Grid Y", "", &gridY, nullptr, Normal, 1, 10) || GuiH::Slider("Grid Z", "", &gridZ, nullptr, Normal, 1, _se->MAXGRIDSIZE))
+  if(GuiH::Slider("Grid X", "", &gridX, nullptr, Normal, 1, _se->MAXGRIDSIZE) || GuiH::Slider("Grid Y", "", &gridY, nullptr, Normal, 1, _se->MAXGRIDSIZE) || GuiH::Slider("Grid Z", "", &gridZ, nullptr, Normal, 1, _se->MAXGRIDSIZE))
   {
     if(!_se->performAutomaticTraining)
     {
@@ -325,15 +365,46 @@ bool SampleGUI::guiSortingGrid()
     }
 
   }
+  bool binningChanged = GuiH::Selection("View Direction Binning", "How the camera direction is mapped to timing bins", &_se->directionBinning, nullptr, Normal,
+                                        {"Cube Sides", "Octahedral"});
+  if(_se->directionBinning == eOctahedralBinning)
+  {
+    binningChanged |= GuiH::Slider("Octahedral Resolution", "Bins per axis, resolution^2 bins in total", &_se->directionResolution, nullptr, Normal, 2, 16);
+  }
+  if(binningChanged)
+  {
+    if(!_se->performAutomaticTraining)
+    {
+      _se->buildSortingGrid();
+      changed = true;
+    }
+    else {
+      _se->directionBinning = _se->grid.quantizer.mode;
+      _se->directionResolution = _se->grid.quantizer.resolution;
+    }
+  }
   ImGui::Text(("Current Grid Position [x,y,z]: ("+  std::to_string(_se->currentGridSpace.x) + "," +  std::to_string(_se->currentGridSpace.y)  + "," +  std::to_string(_se->currentGridSpace.z) + ")").c_str());
 
+  if(GuiH::Selection("Exploration Policy", "How the next configuration of a cube side is chosen", &_se->explorationPolicyType, nullptr, Normal,
+                     {"Epsilon Greedy", "UCB1", "Thompson Sampling"}))
+  {
+    _se->explorationPolicy = createExplorationPolicy(ExplorationPolicyType(_se->explorationPolicyType));
+  }
+  GuiH::Checkbox("Adaptive Grid", "Split cells whose best configuration varies, merge them back when the children agree", &_se->grid.adaptive.enabled);
+  if(_se->grid.adaptive.enabled)
+  {
+    GuiH::Slider("Max Octree Depth", "", &_se->grid.adaptive.maxDepth, nullptr, Normal, 0u, 6u);
+    GuiH::Slider("Split Variation", "Relative standard deviation of the best configuration that splits a cell", &_se->grid.adaptive.splitVariation, nullptr, Normal, 0.01f, 1.0f);
+    const GridSpace& cell = _se->grid.gridSpaces[_se->currentCell];
+    ImGui::Text("Cells: %d, current cell depth %d, size %.3f", int(_se->grid.numCells()), int(cell.depth), cell.localSize);
+  }
   GuiH::Checkbox("Use Constant Grid Learning Speed","",&_se->useConstantGridLearning);
   if(_se->useConstantGridLearning)
   {
     GuiH::Slider("Constant Learning Speed","",&_se->constantGridlearningSpeed,nullptr,Normal,0.01f,1.0f,nullptr);
   } else 
   {
-    float currentAdaptiveLearningRate = _se->grid.gridSpaces[_se->currentGridSpace.z][_se->currentGridSpace.y][_se->currentGridSpace.x].adaptiveGridLearningRate;
+    float currentAdaptiveLearningRate = _se->grid.gridSpaces[_se->currentCell].adaptiveGridLearningRate;
   
     ImGui::Text(("Current Grid Cell learning Rate: "+ std::to_string(currentAdaptiveLearningRate)).c_str());
   }
@@ -348,19 +419,68 @@ bool SampleGUI::guiSortingGrid()
       //rtx->destroyAsyncPipelineBuffer();
     }
   }
+  PipelineCacheStats cacheStats = rtx->cacheStatistics();
+  ImGui::Text("Pipeline cache: %u of %u hits (%.0f%%), %.0f ms compile time saved", cacheStats.hits, cacheStats.created,
+              cacheStats.hitRate() * 100.0f, cacheStats.savedMs());
+  GuiH::Slider("Variant Budget", "Pipelines kept alive before the least recently used ones are destroyed",
+               &rtx->variantEntryBudget, nullptr, Normal, 1, 256);
+  GuiH::Slider("Variant Memory Budget (MB)", "SBT size plus an estimate per pipeline", &rtx->variantMemoryBudgetMB,
+               nullptr, Normal, 16, 4096);
+  if(rtx->pipelineLibrarySupported())
+    GuiH::Checkbox("Link Variants Against Hit Library", "New variants only compile their raygen and link the shared miss and hit groups",
+                   &rtx->usePipelineLibrary);
+  GuiH::Checkbox("Switch Through Raygen Table", "Configurations in the raygen table are switched to by moving the raygen record, without a new pipeline",
+                 &rtx->useRaygenTable);
+  ImGui::Text("Raygen table: %zu configurations", rtx->raygenTableSize());
+  GuiH::Checkbox("Uber Shader For Unbuilt Configurations", "Explore and switch to configurations without a pipeline on one shader reading them from the push constants, their pipelines are built in the background",
+                 &_se->useDynamicSorting);
+  GuiH::Checkbox("Prefetch Pipelines Of Next Cells", "Build the best configurations of the cells the camera reaches next, along its velocity or the training path",
+                 &_se->cellPrefetcher.enabled);
+  GuiH::Slider("Prefetch Lookahead [s]", "How far ahead along the camera velocity cells are predicted",
+               &_se->cellPrefetcher.lookaheadSeconds, nullptr, Normal, 0.1f, 5.0f);
+  PrefetchStats prefetchStats = _se->cellPrefetcher.stats();
+  ImGui::Text("Cell crossings: %llu, %.0f%% found their best pipeline built, %.0f%% were predicted",
+              (unsigned long long)prefetchStats.crossings, prefetchStats.hitRate() * 100.0f, prefetchStats.predictedRate() * 100.0f);
+  SwitchStallStats switchStats     = rtx->switchStatistics();
+  RetirementStats  retirementStats = rtx->retirementStatistics();
+  ImGui::Text("Switches without device wait: %llu, %.1f ms of stalls avoided, %zu variants awaiting their frames",
+              (unsigned long long)switchStats.switches, switchStats.avoidedMs, retirementStats.pending);
+  PipelineVariantCacheStats variantStats = rtx->variantStatistics();
+  ImGui::Text("Pipeline variants: %zu (%.1f MB), %llu hits, %llu misses, %llu evicted", variantStats.entries,
+              double(variantStats.bytes) / (1024.0 * 1024.0), (unsigned long long)variantStats.hits,
+              (unsigned long long)variantStats.misses, (unsigned long long)variantStats.evictions);
   //printf("Current Grid Position [x,y]: (%d , %d)\n", _se->currentGridSpace.x,_se->currentGridSpace.y);
 
   if(GuiH::button("save SortingGrid to File","save",""))
   {
     _se->SaveSortingGrid();
   }
+  GuiH::Checkbox("Dump Grid as JSON","Also write the saved grid as JSON, slow for large grids",&(_se->dumpGridJson));
   if(GuiH::button("NewAsyncPipeline","useNewPipeline",""))
   {
-    vkDeviceWaitIdle(_se->m_device);
     rtx->setNewPipeline();
     //rtx->setNewPipeline_WithoutDestroying();
   }
-  ImGui::Text("%d",_se->currentLookDirection);
+  ImGui::Text("%d (%s)",int(_se->currentLookDirection),_se->grid.quantizer.binName(_se->currentLookDirection).c_str());
+  GuiH::Checkbox("Require Significance","Only replace the best configuration if it is faster at the confidence level",&_se->grid.statistics.requireSignificance);
+  if(_se->grid.statistics.requireSignificance)
+  {
+    GuiH::Slider("Confidence","One sided confidence of the frame time comparison",&_se->grid.statistics.confidence,nullptr,Normal,0.5f,0.999f);
+  }
+  const GridSpace& statisticsCell = _se->grid.gridSpaces[_se->currentCell];
+  if(uint32_t(_se->currentLookDirection) < statisticsCell.cube.numSides && ImGui::TreeNode("Frame Time Statistics"))
+  {
+    const CubeSideStorage& side = _se->grid.side(statisticsCell, uint32_t(_se->currentLookDirection));
+    for(uint32_t element = 0; element < side.numElements; element++)
+    {
+      uint32_t     slot   = _se->grid.firstSlot(side) + element;
+      TimingObject timing = _se->grid.getTiming(side, element);
+      ImGui::Text("%c %6d  n %3d  %.3f +- %.3f ms  [%.3f, %.3f]", timing.hashCode == side.bestHash ? '*' : ' ', timing.hashCode,
+                  timing.totalCycles, timing.frameTimeMean, _se->grid.frameTimeConfidenceInterval(slot), timing.frameTimeMin,
+                  timing.frameTimeMax);
+    }
+    ImGui::TreePop();
+  }
   if(GuiH::Checkbox("Visualize Sorting method","",&VisualizeSortingGrid))
   {
     if(VisualizeSortingGrid)
@@ -398,7 +518,21 @@ bool SampleGUI::guiSortingGrid()
     ImGui::Text(("estimatedEndpoint: "+ std::to_string(rtx->m_SERParameters.estimatedEndpoint)).c_str());
     ImGui::Text(("realEndpoint: "+ std::to_string(rtx->m_SERParameters.realEndpoint)).c_str());
     ImGui::Text(("isFinished: "+ std::to_string(rtx->m_SERParameters.isFinished)).c_str());
+    sortkey::KeyBudget keyBits = sortkey::keyBudget(keyComposition(rtx->m_SERParameters));
+    ImGui::Text("Key bits: finished %u, origin %u, direction %u, estimated endpoint %u, real endpoint %u, %s",
+                keyBits.bits[sortkey::KEY_FEATURE_FINISHED], keyBits.bits[sortkey::KEY_FEATURE_ORIGIN],
+                keyBits.bits[sortkey::KEY_FEATURE_DIRECTION], keyBits.bits[sortkey::KEY_FEATURE_ESTIMATED_ENDPOINT],
+                keyBits.bits[sortkey::KEY_FEATURE_REAL_ENDPOINT],
+                rtx->m_SERParameters.interleaveFeatures != 0 ? "interleaved" : "concatenated");
+
 
+  if(GuiH::Checkbox("Time Trace Dispatch on GPU","Judge configurations by timestamps around the trace dispatch instead of the frame time",&_se->useGpuFrameClock))
+  {
+    vkDeviceWaitIdle(_se->m_device);  // frames in flight still write the timestamps
+    _se->createFrameClock();
+    _se->cycleMeasurement.next();
+  }
+  ImGui::Text("Frame clock: %s, late samples discarded: %u", _se->frameClock->name(), _se->cycleMeasurement.discarded);
 
   if( GuiH::Checkbox("perform automatic training","",&_se->performAutomaticTraining))
   {
@@ -417,6 +551,19 @@ bool SampleGUI::guiSortingGrid()
   if(!(_se->activateParametertesting ||_se->performAutomaticTraining))
   {
     GuiH::Checkbox("always use best Parameters found","",&(_se->useBestParameters));
+    if(_se->useBestParameters)
+    {
+      PipelineSwitchPolicy& policy = _se->switchPolicy;
+      GuiH::Checkbox("Switch Cost Model","Only switch when the predicted gain outweighs the stall of the switch",&policy.enabled);
+      if(policy.enabled)
+      {
+        GuiH::Slider("Switch Horizon [frames]","Frames the gain of a switch is integrated over",&policy.horizonFrames,nullptr,Normal,1.0f,600.0f);
+        GuiH::Slider("Switch Hysteresis","Minimal relative frame time gain",&policy.hysteresis,nullptr,Normal,0.0f,0.5f);
+        GuiH::Slider("Bind Cost [ms]","",&policy.bindCostMs,nullptr,Normal,0.0f,5.0f);
+      }
+      ImGui::Text("Switches performed: %u, avoided: %u", policy.switchesPerformed, policy.switchesAvoided);
+      ImGui::Text("Predicted switch cost: %.3f ms (stall %.3f ms)", policy.predictedSwitchCost(), policy.stallEstimate());
+    }
   }
   
   return changed;
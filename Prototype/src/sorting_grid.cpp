@@ -1,4 +1,7 @@
 #include "sorting_grid.hpp"
+#include "sorting_keys.hpp"
+#include <algorithm>
+#include <cmath>
 #include <random>
 #include <fstream>
 
@@ -27,13 +30,72 @@ bool parametersLegalCheck1(SortingParameters parameters)
     return false;
   }
   
-  return true;
+  return keyCompositionLegalCheck(parameters);
+}
+
+// budgets of the key features in feature order, with the flag that enables each of them
+static uint32_t keyFeatureBudgets(SortingParameters& parameters, uint32_t* budgets[4], bool enabled[4])
+{
+  budgets[0] = &parameters.originBits;
+  budgets[1] = &parameters.directionBits;
+  budgets[2] = &parameters.estimatedEndpointBits;
+  budgets[3] = &parameters.realEndpointBits;
+  enabled[0] = parameters.rayOrigin;
+  enabled[1] = parameters.rayDirection;
+  enabled[2] = parameters.estimatedEndpoint;
+  enabled[3] = parameters.realEndpoint;
+  return uint32_t(enabled[0]) + enabled[1] + enabled[2] + enabled[3];
+}
+
+bool keyCompositionLegalCheck(SortingParameters parameters)
+{
+  // the hash of an unsorted configuration has no composition
+  if(parameters.noSort)
+    return true;
+
+  uint32_t* budgets[4];
+  bool      enabled[4];
+  uint32_t  numFeatures = keyFeatureBudgets(parameters, budgets, enabled);
+  uint32_t  totalBits   = std::min(parameters.numCoherenceBitsTotal, 32u);
+  uint32_t  available   = parameters.isFinished ? std::max(totalBits, 1u) - 1u : totalBits;
+  uint32_t  requested   = 0;
+  uint32_t  shares      = 0;
+  for(int f = 0; f < 4; f++)
+  {
+    if(!enabled[f])
+      continue;
+    if(*budgets[f] > sortkey::KEY_BUDGET_MAX)
+      return false;
+    requested += *budgets[f];
+    shares += *budgets[f] == 0 ? 1 : 0;
+  }
+  // a feature left without bits builds the key of the configuration without it, and a single
+  // feature after the finished bit is the same interleaved or concatenated
+  if(requested + shares > available)
+    return false;
+  return parameters.interleaveFeatures == 0 || numFeatures >= 2;
+}
+
+void randomKeyComposition(SortingParameters& parameters, std::mt19937& rng)
+{
+  std::uniform_int_distribution<uint32_t> distBudget(1, sortkey::KEY_BUDGET_MAX);
+  std::uniform_int_distribution<uint32_t> distBool(0, 1);
+
+  uint32_t* budgets[4];
+  bool      enabled[4];
+  uint32_t  numFeatures = keyFeatureBudgets(parameters, budgets, enabled);
+  for(int f = 0; f < 4; f++)
+  {
+    // half of the features take an even share
+    *budgets[f] = enabled[f] && !parameters.noSort && distBool(rng) ? distBudget(rng) : 0;
+  }
+  parameters.interleaveFeatures = !parameters.noSort && numFeatures >= 2 ? distBool(rng) : 0;
 }
 SortingParameters createSortingParameters1()
 {
   std::random_device device;
   std::mt19937 e2(device());
-  SortingParameters result;
+  SortingParameters result{};
   bool isLegal = false;
   std::uniform_int_distribution<std::mt19937::result_type> dist32(1,32);
   std::uniform_int_distribution<std::mt19937::result_type> distBool(0,1);
@@ -53,7 +115,7 @@ SortingParameters createSortingParameters1()
     result.rayDirection = distBool(e2);
     result.rayOrigin =  distBool(e2);
     result.isFinished = distBool(e2);
-    
+    randomKeyComposition(result, e2);
     
     
 
@@ -66,9 +128,58 @@ SortingParameters createSortingParameters1()
 
 
 
+// All legal parameter sets with the full number of coherence bits, in a fixed order. The sets with even
+// shares and concatenated features come first, in the order they had before the budgets were enumerated.
+// Sets with two or more key features follow with a budget set: interleaved even shares, and half of the
+// bits for one feature with the others sharing the rest, concatenated and interleaved
+std::vector<SortingParameters> enumerateLegalSortingParameters()
+{
+  std::vector<SortingParameters> result;
+  std::vector<SortingParameters> budgeted;
+  for(uint32_t flags = 0; flags < 256; flags++)
+  {
+    SortingParameters parameters{};
+    parameters.numCoherenceBitsTotal = 32;
+    parameters.sortAfterASTraversal  = (flags & 1) != 0;
+    parameters.estimatedEndpoint     = (flags & 2) != 0;
+    parameters.realEndpoint          = (flags & 4) != 0;
+    parameters.noSort                = (flags & 8) != 0;
+    parameters.hitObject             = (flags & 16) != 0;
+    parameters.rayDirection          = (flags & 32) != 0;
+    parameters.rayOrigin             = (flags & 64) != 0;
+    parameters.isFinished            = (flags & 128) != 0;
+    if(!parametersLegalCheck1(parameters))
+      continue;
+    result.emplace_back(parameters);
+
+    uint32_t* budgets[4];
+    bool      enabled[4];
+    if(parameters.noSort || keyFeatureBudgets(parameters, budgets, enabled) < 2)
+      continue;
+    uint32_t half = std::min((parameters.numCoherenceBitsTotal - (parameters.isFinished ? 1u : 0u)) / 2, sortkey::KEY_BUDGET_MAX);
+    for(int emphasized = -1; emphasized < 4; emphasized++)
+    {
+      if(emphasized >= 0 && !enabled[emphasized])
+        continue;
+      for(uint32_t interleave = 0; interleave < 2; interleave++)
+      {
+        SortingParameters composed = parameters;
+        keyFeatureBudgets(composed, budgets, enabled);
+        if(emphasized >= 0)
+          *budgets[emphasized] = half;
+        composed.interleaveFeatures = interleave;
+        if((emphasized >= 0 || interleave != 0) && parametersLegalCheck1(composed))
+          budgeted.emplace_back(composed);
+      }
+    }
+  }
+  result.insert(result.end(), budgeted.begin(), budgeted.end());
+  return result;
+}
+
 SortingParameters morphSortingParameters(SortingParameters parameters)
 {
-  SortingParameters result;
+  SortingParameters result{};
 
   std::random_device device;
   std::mt19937 e2(device());
@@ -130,6 +241,18 @@ SortingParameters morphSortingParameters(SortingParameters parameters)
       result.isFinished &= 1;
     }
 
+    // one key feature budget or the interleaving is redrawn, sets that build no new key are rejected below
+    std::uniform_int_distribution<std::mt19937::result_type> distComposition(0, 4);
+    std::uniform_int_distribution<std::mt19937::result_type> distBudget(0, sortkey::KEY_BUDGET_MAX);
+    uint32_t* budgets[4];
+    bool      enabled[4];
+    keyFeatureBudgets(result, budgets, enabled);
+    uint32_t changed = distComposition(e2);
+    if(changed < 4)
+      *budgets[changed] = distBudget(e2);
+    else
+      result.interleaveFeatures ^= 1;
+
   
 
     isLegal = parametersLegalCheck1(result);
@@ -171,4 +294,625 @@ void SortingGrid::buildSortingGrid()
   printf("build new Grid with dimension (%d , %d, %d) \n",gridZ,gridY,gridX);
 }
 
-*/
\ No newline at end of file
+*/
+
+void TimingPool::resize(size_t numSlots)
+{
+  hashCode.assign(numSlots, 0);
+  frames.assign(numSlots, 0);
+  fps.assign(numSlots, 0.0f);
+  totalCycles.assign(numSlots, 0);
+  fpsM2.assign(numSlots, 0.0f);
+  frameTimeMean.assign(numSlots, 0.0f);
+  frameTimeM2.assign(numSlots, 0.0f);
+  frameTimeMin.assign(numSlots, 0.0f);
+  frameTimeMax.assign(numSlots, 0.0f);
+  indexTable.assign(numSlots * 2, 0);
+  rankTree.assign(numSlots, 0);
+  freeBlocks.clear();
+}
+
+// index of the free list of a block size, its log2
+static uint32_t blockLevel(uint32_t blockSize)
+{
+  uint32_t level = 0;
+  while((1u << level) < blockSize)
+    level++;
+  return level;
+}
+
+uint32_t TimingPool::allocate(uint32_t blockSize)
+{
+  uint32_t level = blockLevel(blockSize);
+  if(level < freeBlocks.size() && !freeBlocks[level].empty())
+  {
+    uint32_t first = freeBlocks[level].back();
+    freeBlocks[level].pop_back();
+    return first;
+  }
+
+  uint32_t first    = uint32_t(numSlots());
+  size_t   numSlots = size_t(first) + blockSize;
+  hashCode.resize(numSlots, 0);
+  frames.resize(numSlots, 0);
+  fps.resize(numSlots, 0.0f);
+  totalCycles.resize(numSlots, 0);
+  fpsM2.resize(numSlots, 0.0f);
+  frameTimeMean.resize(numSlots, 0.0f);
+  frameTimeM2.resize(numSlots, 0.0f);
+  frameTimeMin.resize(numSlots, 0.0f);
+  frameTimeMax.resize(numSlots, 0.0f);
+  indexTable.resize(numSlots * 2, 0);
+  rankTree.resize(numSlots, 0);
+  return first;
+}
+
+void TimingPool::release(uint32_t firstSlot, uint32_t blockSize)
+{
+  // the records are overwritten by the next owner, only its hash index has to start out empty
+  std::fill_n(indexTable.begin() + size_t(firstSlot) * 2, size_t(blockSize) * 2, 0u);
+  uint32_t level = blockLevel(blockSize);
+  if(freeBlocks.size() <= level)
+    freeBlocks.resize(level + 1);
+  freeBlocks[level].push_back(firstSlot);
+}
+
+TimingObject TimingPool::get(uint32_t slot) const
+{
+  TimingObject timing;
+  timing.hashCode    = hashCode[slot];
+  timing.frames      = frames[slot];
+  timing.fps         = fps[slot];
+  timing.totalCycles = totalCycles[slot];
+  timing.fpsM2       = fpsM2[slot];
+  timing.frameTimeMean = frameTimeMean[slot];
+  timing.frameTimeM2   = frameTimeM2[slot];
+  timing.frameTimeMin  = frameTimeMin[slot];
+  timing.frameTimeMax  = frameTimeMax[slot];
+  return timing;
+}
+
+void TimingPool::set(uint32_t slot, const TimingObject& timing)
+{
+  hashCode[slot]    = timing.hashCode;
+  frames[slot]      = timing.frames;
+  fps[slot]         = timing.fps;
+  totalCycles[slot] = timing.totalCycles;
+  fpsM2[slot]       = timing.fpsM2;
+  frameTimeMean[slot] = timing.frameTimeMean;
+  frameTimeM2[slot]   = timing.frameTimeM2;
+  frameTimeMin[slot]  = timing.frameTimeMin;
+  frameTimeMax[slot]  = timing.frameTimeMax;
+}
+
+float TimingPool::fpsVariance(uint32_t slot) const
+{
+  return totalCycles[slot] > 1 ? fpsM2[slot] / float(totalCycles[slot] - 1) : 0.0f;
+}
+
+float TimingPool::frameTimeVariance(uint32_t slot) const
+{
+  return totalCycles[slot] > 1 ? frameTimeM2[slot] / float(totalCycles[slot] - 1) : 0.0f;
+}
+
+// Inverse of the standard normal distribution (Acklam), relative error below 1.2e-9
+static double normalQuantile(double p)
+{
+  static const double a[] = {-3.969683028665376e+01, 2.209460984245205e+02, -2.759285104469687e+02,
+                             1.383577518672690e+02,  -3.066479806614716e+01, 2.506628277459239e+00};
+  static const double b[] = {-5.447609879822406e+01, 1.615858368580409e+02, -1.556989798598866e+02,
+                             6.680131188771972e+01,  -1.328068155288572e+01};
+  static const double c[] = {-7.784894002430293e-03, -3.223964580411365e-01, -2.400758277161838e+00,
+                             -2.549732539343734e+00, 4.374664141464968e+00,  2.938163982698783e+00};
+  static const double d[] = {7.784695709041462e-03, 3.224671290700398e-01, 2.445134137142996e+00, 3.754408661907416e+00};
+
+  p = std::min(std::max(p, 1e-12), 1.0 - 1e-12);
+  if(p < 0.02425)
+  {
+    double q = std::sqrt(-2.0 * std::log(p));
+    return (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) / ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1.0);
+  }
+  if(p > 1.0 - 0.02425)
+    return -normalQuantile(1.0 - p);
+  double q = p - 0.5;
+  double r = q * q;
+  return (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r + a[5]) * q
+         / (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1.0);
+}
+
+// Quantile of Student's t distribution with `dof` degrees of freedom, Cornish-Fisher expansion
+// around the normal quantile (Abramowitz & Stegun 26.7.5), within 5% for one degree of freedom
+static double studentTQuantile(double p, double dof)
+{
+  double z  = normalQuantile(p);
+  double z2 = z * z;
+  double g1 = (z2 + 1.0) * z / 4.0;
+  double g2 = ((5.0 * z2 + 16.0) * z2 + 3.0) * z / 96.0;
+  double g3 = (((3.0 * z2 + 19.0) * z2 + 17.0) * z2 - 15.0) * z / 384.0;
+  double g4 = ((((79.0 * z2 + 776.0) * z2 + 1482.0) * z2 - 1920.0) * z2 - 945.0) * z / 92160.0;
+  return z + (g1 + (g2 + (g3 + g4 / dof) / dof) / dof) / dof;
+}
+
+
+void Grid::build(glm::ivec3 dimensions, const DirectionQuantizer& directionQuantizer)
+{
+  gridDimensions = dimensions;
+  quantizer      = directionQuantizer;
+  gridSpaces.assign(size_t(dimensions.x) * dimensions.y * dimensions.z, GridSpace());
+
+  // the bins of a cell are neighbours, both in `sides` and in the timing pool
+  uint32_t numBins = quantizer.numBins();
+  sides.assign(gridSpaces.size() * numBins, CubeSideStorage());
+  for(size_t cell = 0; cell < gridSpaces.size(); cell++)
+  {
+    gridSpaces[cell].cube.firstSide = uint32_t(cell * numBins);
+    gridSpaces[cell].cube.numSides  = numBins;
+    gridSpaces[cell].rootCell       = glm::ivec3(int(cell % dimensions.x), int(cell / dimensions.x % dimensions.y),
+                                                 int(cell / (size_t(dimensions.x) * dimensions.y)));
+  }
+  freeChildBlocks.clear();
+  // sides get their block with the first record
+  timings.resize(0);
+}
+
+TimingObject Grid::getTiming(const CubeSideStorage& side, uint32_t element) const
+{
+  return timings.get(firstSlot(side) + element);
+}
+
+// start position of a parameter hash inside the index table of a side
+static uint32_t indexTableStart(int hashCode, uint32_t tableSize)
+{
+  uint32_t h = uint32_t(hashCode) * 2654435761u;
+  h ^= h >> 15;
+  return h & (tableSize - 1);
+}
+
+int Grid::fastestTiming(const CubeSideStorage& side) const
+{
+  uint32_t element = side.numElements > 0 ? timings.rankTree[firstSlot(side) + 1] : 0;
+  return element < side.numElements ? int(firstSlot(side) + element) : -1;
+}
+
+int Grid::findTiming(const CubeSideStorage& side, int hashCode) const
+{
+  if(side.capacity == 0)
+    return -1;
+  // the table is at most half full, so probing always ends on an empty entry
+  uint32_t        tableSize = side.capacity * 2;
+  const uint32_t* table     = &timings.indexTable[size_t(side.firstSlot) * 2];
+  for(uint32_t probe = indexTableStart(hashCode, tableSize);; probe = (probe + 1) & (tableSize - 1))
+  {
+    if(table[probe] == 0)
+      return -1;
+    uint32_t slot = firstSlot(side) + table[probe] - 1;
+    if(timings.hashCode[slot] == hashCode)
+      return int(slot);
+  }
+}
+
+uint32_t Grid::addTiming(CubeSideStorage& side, const TimingObject& timing)
+{
+  if(side.numElements == side.capacity)
+    growSide(side);
+
+  uint32_t slot = firstSlot(side) + side.numElements;
+  timings.set(slot, timing);
+  insertIndex(timings, side, side.numElements);
+  side.numElements++;
+  updateRank(timings, side, slot - firstSlot(side));
+  return slot;
+}
+
+void Grid::repackTimings()
+{
+  TimingPool packed;
+  packed.resize(0);
+  for(CubeSideStorage& side : sides)
+  {
+    uint32_t oldFirst = side.firstSlot;
+    side.capacity     = side.numElements > 0 ? std::max(side.capacity, TimingPool::minBlockSize) : 0;
+    side.firstSlot    = side.capacity > 0 ? packed.allocate(side.capacity) : 0;
+    for(uint32_t element = 0; element < side.numElements; element++)
+    {
+      packed.set(side.firstSlot + element, timings.get(oldFirst + element));
+      insertIndex(packed, side, element);
+    }
+    rebuildRank(packed, side);
+  }
+  timings = std::move(packed);
+}
+
+bool Grid::recordCycle(CubeSideStorage& side, int hashCode, int frames, float cycleTime)
+{
+  int slot = findTiming(side, hashCode);
+  if(slot < 0)
+  {
+    TimingObject newTiming;
+    newTiming.hashCode    = hashCode;
+    newTiming.frames      = 0;
+    newTiming.fps         = 0.0f;
+    newTiming.totalCycles = 0;
+    slot                  = int(addTiming(side, newTiming));
+  }
+  // fps is the running mean of the per cycle fps, the spread is accumulated with Welford's update.
+  // Cycles may differ in length, the headless trainer times a fixed number of frames instead
+  float cycleFps  = frames * 1000 / cycleTime;
+  float lastMean  = timings.fps[slot];
+  timings.frames[slot] += frames;
+  timings.totalCycles[slot] += 1;
+  timings.fps[slot] = lastMean + (cycleFps - lastMean) / timings.totalCycles[slot];
+  timings.fpsM2[slot] += (cycleFps - lastMean) * (cycleFps - timings.fps[slot]);
+
+  // a cycle without a finished frame took at least the whole cycle per frame
+  float cycleFrameTime = frames > 0 ? cycleTime / frames : cycleTime;
+  float lastFrameTime  = timings.frameTimeMean[slot];
+  int   cycles         = timings.totalCycles[slot];
+  timings.frameTimeMean[slot] = lastFrameTime + (cycleFrameTime - lastFrameTime) / cycles;
+  timings.frameTimeM2[slot] += (cycleFrameTime - lastFrameTime) * (cycleFrameTime - timings.frameTimeMean[slot]);
+  timings.frameTimeMin[slot] = cycles == 1 ? cycleFrameTime : std::min(timings.frameTimeMin[slot], cycleFrameTime);
+  timings.frameTimeMax[slot] = cycles == 1 ? cycleFrameTime : std::max(timings.frameTimeMax[slot], cycleFrameTime);
+
+  updateRank(timings, side, uint32_t(slot) - firstSlot(side));
+
+  // when the configuration is the current best, its timing is updated. If it got slower the fastest
+  // record of the side may beat it now, it is taken from the rank tree as the others are not measured again soon
+  if(side.numElements > 1 && hashCode == side.bestHash)
+  {
+    side.bestpipelineFPS = timings.fps[slot];
+    uint32_t leader      = uint32_t(fastestTiming(side));
+    if(leader != uint32_t(slot) && (!statistics.requireSignificance || significantlyFaster(leader, uint32_t(slot))))
+    {
+      side.bestpipelineFPS = timings.fps[leader];
+      side.bestHash        = timings.hashCode[leader];
+    }
+    return false;
+  }
+  //if they are different test if current parameters are faster, update best if they are
+  int  bestSlot = findTiming(side, side.bestHash);
+  bool faster   = bestSlot >= 0 && timings.frameTimeMean[slot] < timings.frameTimeMean[bestSlot];
+  if(statistics.requireSignificance && bestSlot >= 0)
+  {
+    faster = significantlyFaster(uint32_t(slot), uint32_t(bestSlot));
+  }
+  if(side.numElements == 1 || bestSlot < 0 || faster)
+  {
+    side.bestpipelineFPS = timings.fps[slot];
+    side.bestHash        = hashCode;
+    return true;
+  }
+  return false;
+}
+
+bool Grid::significantlyFaster(uint32_t slot, uint32_t otherSlot) const
+{
+  int   n1    = timings.totalCycles[slot];
+  int   n2    = timings.totalCycles[otherSlot];
+  float mean1 = timings.frameTimeMean[slot];
+  float mean2 = timings.frameTimeMean[otherSlot];
+  // the faster one needs a spread of its own, a single cycle can always be lucky
+  if(mean1 >= mean2 || n1 < 2)
+    return false;
+
+  // a best configuration measured only once is assumed to vary like the faster one,
+  // otherwise it could never be replaced while only the faster one is revisited
+  float variance1 = timings.frameTimeVariance(slot);
+  float variance2 = n2 > 1 ? timings.frameTimeVariance(otherSlot) : variance1;
+  double a = double(variance1) / n1;
+  double b = double(variance2) / n2;
+  if(a + b <= 0.0)
+    return true;
+
+  // Welch-Satterthwaite degrees of freedom
+  double dof = (a + b) * (a + b) / (a * a / std::max(n1 - 1, 1) + b * b / std::max(n2 - 1, 1));
+  double t   = (mean2 - mean1) / std::sqrt(a + b);
+  return t > studentTQuantile(statistics.confidence, std::max(dof, 1.0));
+}
+
+float Grid::frameTimeConfidenceInterval(uint32_t slot) const
+{
+  int n = timings.totalCycles[slot];
+  if(n < 2)
+    return 0.0f;
+  double t = studentTQuantile(0.5 + 0.5 * statistics.confidence, double(n - 1));
+  return float(t * std::sqrt(timings.frameTimeVariance(slot) / n));
+}
+
+// Moves the records of a full side into a block of twice the size, the old block is released for reuse.
+// Costs O(records of the side), the other sides keep their blocks.
+void Grid::growSide(CubeSideStorage& side)
+{
+  CubeSideStorage grown = side;
+  grown.capacity        = std::max(side.capacity * 2, TimingPool::minBlockSize);
+  grown.firstSlot       = timings.allocate(grown.capacity);
+  for(uint32_t element = 0; element < side.numElements; element++)
+  {
+    timings.set(grown.firstSlot + element, timings.get(side.firstSlot + element));
+    insertIndex(timings, grown, element);
+  }
+  rebuildRank(timings, grown);
+  if(side.capacity > 0)
+    timings.release(side.firstSlot, side.capacity);
+  side = grown;
+}
+
+void Grid::insertIndex(TimingPool& pool, const CubeSideStorage& side, uint32_t element) const
+{
+  uint32_t  tableSize = side.capacity * 2;
+  uint32_t* table     = &pool.indexTable[size_t(side.firstSlot) * 2];
+  int       hashCode  = pool.hashCode[size_t(side.firstSlot) + element];
+
+  uint32_t probe = indexTableStart(hashCode, tableSize);
+  while(table[probe] != 0)
+    probe = (probe + 1) & (tableSize - 1);
+  table[probe] = element + 1;
+}
+
+
+// The element with the lower mean frame time, unused slots and records without a measured cycle lose
+uint32_t Grid::fasterElement(const TimingPool& pool, const CubeSideStorage& side, uint32_t element, uint32_t other) const
+{
+  auto measured = [&](uint32_t e) {
+    return e < side.numElements && pool.totalCycles[side.firstSlot + e] > 0 && pool.frameTimeMean[side.firstSlot + e] > 0.0f;
+  };
+  if(!measured(other))
+    return element;
+  if(!measured(element))
+    return other;
+  return pool.frameTimeMean[side.firstSlot + other] < pool.frameTimeMean[side.firstSlot + element] ? other : element;
+}
+
+void Grid::updateRank(TimingPool& pool, const CubeSideStorage& side, uint32_t element) const
+{
+  uint32_t* tree = &pool.rankTree[side.firstSlot];
+  for(uint32_t node = (side.capacity + element) / 2; node > 0; node /= 2)
+  {
+    // children at capacity and beyond are the leaves, element = child - capacity
+    uint32_t left  = 2 * node < side.capacity ? tree[2 * node] : 2 * node - side.capacity;
+    uint32_t right = 2 * node < side.capacity ? tree[2 * node + 1] : 2 * node + 1 - side.capacity;
+    tree[node]     = fasterElement(pool, side, left, right);
+  }
+}
+
+void Grid::rebuildRank(TimingPool& pool, const CubeSideStorage& side) const
+{
+  uint32_t* tree = &pool.rankTree[side.firstSlot];
+  for(uint32_t node = side.capacity > 0 ? side.capacity - 1 : 0; node > 0; node--)
+  {
+    uint32_t left  = 2 * node < side.capacity ? tree[2 * node] : 2 * node - side.capacity;
+    uint32_t right = 2 * node < side.capacity ? tree[2 * node + 1] : 2 * node + 1 - side.capacity;
+    tree[node]     = fasterElement(pool, side, left, right);
+  }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Adaptive octree below the uniform cells
+//
+uint32_t Grid::leaf(uint32_t cell, glm::vec3 local) const
+{
+  while(gridSpaces[cell].firstChild >= 0)
+  {
+    glm::ivec3 half(local.x >= 0.5f, local.y >= 0.5f, local.z >= 0.5f);
+    local = local * 2.0f - glm::vec3(half);
+    cell  = uint32_t(gridSpaces[cell].firstChild + half.x + half.y * 2 + half.z * 4);
+  }
+  return cell;
+}
+
+void Grid::collectLeaves(uint32_t cell, std::vector<uint32_t>& leaves) const
+{
+  if(gridSpaces[cell].firstChild < 0)
+  {
+    leaves.push_back(cell);
+    return;
+  }
+  for(int child = 0; child < 8; child++)
+    collectLeaves(uint32_t(gridSpaces[cell].firstChild + child), leaves);
+}
+
+bool Grid::isLive(uint32_t cell) const
+{
+  while(gridSpaces[cell].parent >= 0)
+  {
+    int first = gridSpaces[gridSpaces[cell].parent].firstChild;
+    if(first < 0 || cell < uint32_t(first) || cell >= uint32_t(first) + 8)
+      return false;
+    cell = uint32_t(gridSpaces[cell].parent);
+  }
+  return true;
+}
+
+void Grid::collectFreeChildBlocks()
+{
+  // child blocks are appended behind the uniform cells, a block is free when its cells are not live
+  freeChildBlocks.clear();
+  for(size_t first = numRootCells(); first + 8 <= gridSpaces.size(); first += 8)
+  {
+    if(!isLive(uint32_t(first)))
+      freeChildBlocks.push_back(uint32_t(first));
+  }
+}
+
+bool Grid::refine(uint32_t cell)
+{
+  if(!adaptive.enabled)
+    return false;
+
+  if(splitWanted(gridSpaces[cell]))
+  {
+    split(cell);
+    return true;
+  }
+  int parent = gridSpaces[cell].parent;
+  if(parent >= 0 && mergeWanted(gridSpaces[parent]))
+  {
+    merge(uint32_t(parent));
+    return true;
+  }
+  return false;
+}
+
+bool Grid::splitWanted(const GridSpace& space) const
+{
+  if(space.firstChild >= 0 || space.depth >= adaptive.maxDepth)
+    return false;
+
+  int requiredCycles = adaptive.minCycles << std::min(space.merges, 10u);
+  for(uint32_t bin = 0; bin < space.cube.numSides; bin++)
+  {
+    const CubeSideStorage& side = sides[space.cube.firstSide + bin];
+    int                    slot = side.numElements > 0 ? findTiming(side, side.bestHash) : -1;
+    if(slot < 0 || timings.totalCycles[slot] < requiredCycles || timings.fps[slot] <= 0.0f)
+      continue;
+    if(std::sqrt(timings.fpsVariance(slot)) / timings.fps[slot] > adaptive.splitVariation)
+      return true;
+  }
+  return false;
+}
+
+bool Grid::mergeWanted(const GridSpace& parent) const
+{
+  // every child needs some evidence before the children count as agreeing
+  for(int child = 0; child < 8; child++)
+  {
+    const GridSpace& space    = gridSpaces[parent.firstChild + child];
+    bool             measured = false;
+    if(space.firstChild >= 0)
+      return false;
+    for(uint32_t bin = 0; bin < space.cube.numSides && !measured; bin++)
+    {
+      const CubeSideStorage& side = sides[space.cube.firstSide + bin];
+      int                    slot = side.numElements > 0 ? findTiming(side, side.bestHash) : -1;
+      measured                    = slot >= 0 && timings.totalCycles[slot] >= adaptive.minCycles;
+    }
+    if(!measured)
+      return false;
+  }
+
+  for(uint32_t bin = 0; bin < parent.cube.numSides; bin++)
+  {
+    int agreedHash = -1;
+    for(int child = 0; child < 8; child++)
+    {
+      const CubeSideStorage& side = sides[gridSpaces[parent.firstChild + child].cube.firstSide + bin];
+      if(side.numElements == 0)
+        continue;
+      if(agreedHash >= 0 && side.bestHash != agreedHash)
+        return false;
+      agreedHash = side.bestHash;
+    }
+  }
+  return true;
+}
+
+void Grid::split(uint32_t cell)
+{
+  uint32_t numBins = quantizer.numBins();
+  uint32_t first;
+  if(!freeChildBlocks.empty())
+  {
+    first = freeChildBlocks.back();
+    freeChildBlocks.pop_back();
+    for(uint32_t child = first; child < first + 8; child++)
+    {
+      for(uint32_t bin = 0; bin < numBins; bin++)
+        clearSide(side(gridSpaces[child], bin));
+    }
+  }
+  else
+  {
+    first = uint32_t(gridSpaces.size());
+    gridSpaces.resize(gridSpaces.size() + 8);
+    for(uint32_t child = first; child < first + 8; child++)
+    {
+      gridSpaces[child].cube.firstSide = uint32_t(sides.size());
+      gridSpaces[child].cube.numSides  = numBins;
+      sides.resize(sides.size() + numBins);
+    }
+  }
+
+  GridSpace& parent = gridSpaces[cell];
+  for(uint32_t octant = 0; octant < 8; octant++)
+  {
+    GridSpace& child = gridSpaces[first + octant];
+    TimingCube cube  = child.cube;
+    child            = GridSpace();
+    child.cube       = cube;
+    child.parent     = int(cell);
+    child.depth      = parent.depth + 1;
+    child.rootCell   = parent.rootCell;
+    child.localSize  = parent.localSize * 0.5f;
+    child.localMin   = parent.localMin + glm::vec3(float(octant & 1), float((octant >> 1) & 1), float(octant >> 2)) * child.localSize;
+    child.adaptiveGridLearningRate = parent.adaptiveGridLearningRate;
+
+    // children start out with the best configuration of their parent
+    for(uint32_t bin = 0; bin < numBins; bin++)
+    {
+      CubeSideStorage&       childSide  = side(child, bin);
+      const CubeSideStorage& parentSide = side(parent, bin);
+      childSide.bestHash                = parentSide.bestHash;
+      childSide.bestpipelineFPS         = parentSide.bestpipelineFPS;
+    }
+  }
+  parent.firstChild = int(first);
+}
+
+void Grid::merge(uint32_t cell)
+{
+  uint32_t first = uint32_t(gridSpaces[cell].firstChild);
+  for(uint32_t child = first; child < first + 8; child++)
+  {
+    // the merged records are not needed by the children anymore, their blocks are released right away
+    for(uint32_t bin = 0; bin < quantizer.numBins(); bin++)
+    {
+      mergeSideInto(side(gridSpaces[cell], bin), side(gridSpaces[child], bin));
+      clearSide(side(gridSpaces[child], bin));
+    }
+  }
+  gridSpaces[cell].firstChild = -1;
+  gridSpaces[cell].merges++;
+  freeChildBlocks.push_back(first);
+}
+
+// Adds the records of `source` to `target`, statistics of the same configuration are pooled
+void Grid::mergeSideInto(CubeSideStorage& target, const CubeSideStorage& source)
+{
+  for(uint32_t element = 0; element < source.numElements; element++)
+  {
+    TimingObject timing = getTiming(source, element);
+    int          slot   = findTiming(target, timing.hashCode);
+    if(slot < 0)
+    {
+      addTiming(target, timing);
+      continue;
+    }
+    float cycles      = float(timings.totalCycles[slot]);
+    float total       = cycles + float(timing.totalCycles);
+    float delta       = timing.fps - timings.fps[slot];
+    timings.fps[slot] = (cycles * timings.fps[slot] + timing.totalCycles * timing.fps) / total;
+    timings.fpsM2[slot] += timing.fpsM2 + delta * delta * cycles * timing.totalCycles / total;
+    float frameDelta            = timing.frameTimeMean - timings.frameTimeMean[slot];
+    timings.frameTimeMean[slot] = (cycles * timings.frameTimeMean[slot] + timing.totalCycles * timing.frameTimeMean) / total;
+    timings.frameTimeM2[slot] += timing.frameTimeM2 + frameDelta * frameDelta * cycles * timing.totalCycles / total;
+    timings.frameTimeMin[slot] = std::min(timings.frameTimeMin[slot], timing.frameTimeMin);
+    timings.frameTimeMax[slot] = std::max(timings.frameTimeMax[slot], timing.frameTimeMax);
+    timings.frames[slot] += timing.frames;
+    timings.totalCycles[slot] += timing.totalCycles;
+    updateRank(timings, target, uint32_t(slot) - firstSlot(target));
+  }
+
+  int fastest = fastestTiming(target);
+  if(fastest >= 0)
+  {
+    target.bestpipelineFPS = timings.fps[fastest];
+    target.bestHash        = timings.hashCode[fastest];
+  }
+}
+
+void Grid::clearSide(CubeSideStorage& side)
+{
+  if(side.capacity > 0)
+    timings.release(side.firstSlot, side.capacity);
+  side = CubeSideStorage();
+}
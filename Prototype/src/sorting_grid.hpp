@@ -7,6 +7,7 @@
 #include "rtx_pipeline.hpp"
 #include <unordered_map>
 #include "json.hpp"
+#include "direction_quantizer.hpp"
 
   struct TimingObject
   {
@@ -14,22 +15,65 @@
     int frames;
     float fps;
     int totalCycles;
+    float fpsM2{0.0f};  // sum of squared deviations of the per cycle fps from the mean (Welford)
+    // mean frame time of every cycle in ms, totalCycles samples
+    float frameTimeMean{0.0f};
+    float frameTimeM2{0.0f};
+    float frameTimeMin{0.0f};
+    float frameTimeMax{0.0f};
+  };
+
+  // Struct-of-arrays storage for the TimingObjects of all cube sides of a Grid.
+  // Every cube side owns a block of consecutive slots sized for its own records (a power of two,
+  // see CubeSideStorage), so the records of one side are contiguous in each array.
+  // Next to it every block has an open addressing table of twice its size, starting at entry
+  // 2*firstSlot, mapping a parameter hash to element+1 (0 = empty), which makes finding a configuration O(1).
+  // Blocks left behind when a side grows are reused by the next side that needs a block of that size.
+  // rankTree holds a tournament tree per block over the mean frame time of its records: entry
+  // firstSlot + node (node 1 is the root, node n has the children 2n and 2n+1, the leaves are the
+  // elements) is the element with the lower mean of its subtree. The fastest record is at the root,
+  // updating a record walks up log2 of the block size nodes.
+  struct TimingPool
+  {
+    static constexpr uint32_t minBlockSize{2};
+    std::vector<int>      hashCode;
+    std::vector<int>      frames;
+    std::vector<float>    fps;
+    std::vector<int>      totalCycles;
+    std::vector<float>    fpsM2;
+    std::vector<float>    frameTimeMean;
+    std::vector<float>    frameTimeM2;
+    std::vector<float>    frameTimeMin;
+    std::vector<float>    frameTimeMax;
+    std::vector<uint32_t> indexTable;
+    std::vector<uint32_t> rankTree;
+    std::vector<std::vector<uint32_t>> freeBlocks;  // first slot of released blocks, by log2 of their size
+
+    size_t       numSlots() const { return hashCode.size(); }
+    void         resize(size_t numSlots);  // resets the pool to `numSlots` empty slots without free blocks
+    uint32_t     allocate(uint32_t blockSize);  // first slot of an empty block, reuses a released one if possible
+    void         release(uint32_t firstSlot, uint32_t blockSize);
+    TimingObject get(uint32_t slot) const;
+    void         set(uint32_t slot, const TimingObject& timing);
+    float        fpsVariance(uint32_t slot) const;  // sample variance of the per cycle fps
+    float        frameTimeVariance(uint32_t slot) const;  // sample variance of the per cycle frame time
   };
 
   struct CubeSideStorage
   {
-    std::vector<TimingObject> storedElements;
-    PipelineStorage bestPipeline;
+    uint32_t firstSlot{0};    // block of this side inside Grid::timings
+    uint32_t capacity{0};     // slots of that block, 0 until the first record
+    uint32_t numElements{0};  // used slots of that block
+    int bestHash{0};          // parameter hash of the fastest configuration seen, kept up to date by Grid::recordCycle
+                              // its pipeline is looked up with RtxPipeline::findPipeline, which may have evicted it
     float bestpipelineFPS = 0.0f;
   };
+
+  // the view direction bins of one cell, a range of Grid::sides
   struct TimingCube
   {
-    CubeSideStorage upElements;
-    CubeSideStorage downElements;
-    CubeSideStorage leftElements;
-    CubeSideStorage rightElements;
-    CubeSideStorage frontElements;
-    CubeSideStorage backElements;
+    uint32_t firstSide{0};
+    uint32_t numSides{0};
   };
 
 
@@ -39,13 +83,102 @@
   float adaptiveGridLearningRate = 1.0f;
   GridCube bestKeyCube;
   float BestPipelineFPS = std::numeric_limits<float>::min();
-  PipelineStorage bestPipeline;
+
+  // octree below a uniform grid cell, the 8 children of a cell are consecutive cells
+  int        parent{-1};
+  int        firstChild{-1};  // -1 for leaves
+  uint32_t   depth{0};
+  uint32_t   merges{0};       // times the children of this cell were merged back
+  glm::ivec3 rootCell{0};     // uniform grid cell this cell lies in
+  glm::vec3  localMin{0.0f};  // position inside the uniform cell, in units of the uniform cell size
+  float      localSize{1.0f};
+};
+
+// When enabled, a leaf splits into 8 children once the per cycle fps of its best configuration
+// varies by more than splitVariation (relative standard deviation) in any bin. Children that all
+// agree on the best configuration of every bin are merged back into their parent.
+struct AdaptiveGridSettings
+{
+  bool     enabled{false};
+  uint32_t maxDepth{3};
+  int      minCycles{8};  // cycles of the best configuration before a cell may split, doubled after every merge
+  float    splitVariation{0.15f};
+};
+
+// A configuration only replaces the best one of a bin when its mean frame time is lower with the given
+// confidence (one sided Welch t-test), so a single lucky cycle does not decide. Disabled, the lower mean frame time wins.
+struct TimingStatisticsSettings
+{
+  bool  requireSignificance{true};
+  float confidence{0.95f};
 };
 
+// Sorting grid, all cells live in one contiguous array.
+// The uniform cell of grid space (i,j,k) is stored at k*(gy*gx) + j*gx + i, the same dense
+// index used for the GridCube buffer on the GPU. Octree cells of the adaptive grid follow them.
+// Each cell has quantizer.numBins() view direction bins, stored cell by cell in `sides`.
 struct Grid
 {
-  std::vector<std::vector<std::vector<GridSpace>>> gridSpaces;
-  glm::vec3 gridDimensions;
+  std::vector<GridSpace>       gridSpaces;
+  std::vector<CubeSideStorage> sides;
+  glm::ivec3                   gridDimensions{0};
+  DirectionQuantizer           quantizer;
+  AdaptiveGridSettings         adaptive;
+  TimingStatisticsSettings     statistics;
+  TimingPool                   timings;
+
+  void build(glm::ivec3 dimensions, const DirectionQuantizer& directionQuantizer);
+
+  size_t     numCells() const { return gridSpaces.size(); }
+  size_t     numRootCells() const { return size_t(gridDimensions.x) * gridDimensions.y * gridDimensions.z; }
+  int        cellIndex(glm::ivec3 gridSpace) const
+  {
+    return gridSpace.z * (gridDimensions.y * gridDimensions.x) + gridSpace.y * gridDimensions.x + gridSpace.x;
+  }
+  GridSpace& at(glm::ivec3 gridSpace) { return gridSpaces[cellIndex(gridSpace)]; }
+  CubeSideStorage& side(const GridSpace& space, uint32_t bin) { return sides[space.cube.firstSide + bin]; }
+
+  // Leaf below `cell` that contains `local`, a position inside the cell in [0,1)^3. O(depth)
+  uint32_t leaf(uint32_t cell, glm::vec3 local) const;
+  uint32_t leaf(glm::ivec3 gridSpace, glm::vec3 local) const { return leaf(uint32_t(cellIndex(gridSpace)), local); }
+  void     collectLeaves(uint32_t cell, std::vector<uint32_t>& leaves) const;
+  bool     isLive(uint32_t cell) const;  // false for cells of merged child blocks
+  void     collectFreeChildBlocks();     // rebuilds the reuse list after the cells were restored from a file
+
+  // Splits or merges around the leaf `cell` according to `adaptive`. Returns true if the tree
+  // changed; references to cells and sides are invalid afterwards.
+  bool refine(uint32_t cell);
+
+  // Access to the TimingObjects of a single cube side
+  uint32_t     firstSlot(const CubeSideStorage& side) const { return side.firstSlot; }
+  TimingObject getTiming(const CubeSideStorage& side, uint32_t element) const;
+  int          findTiming(const CubeSideStorage& side, int hashCode) const;  // slot or -1
+  int          fastestTiming(const CubeSideStorage& side) const;  // slot with the lowest mean frame time or -1, O(1)
+  uint32_t     addTiming(CubeSideStorage& side, const TimingObject& timing);  // returns the slot
+  void         repackTimings();  // moves every side into its own block of a new pool and rebuilds the hash index, after loading them
+
+  // Adds the frames rendered during one cycle of `cycleTime` ms with configuration `hashCode`
+  // and updates the best configuration of the side in O(log records). Returns true if `hashCode` became the best.
+  bool recordCycle(CubeSideStorage& side, int hashCode, int frames, float cycleTime);
+
+  // true if the frame time of `slot` is lower than that of `otherSlot` at statistics.confidence
+  bool  significantlyFaster(uint32_t slot, uint32_t otherSlot) const;
+  float frameTimeConfidenceInterval(uint32_t slot) const;  // half width of the two sided interval of the mean, 0 below two cycles
+
+private:
+  std::vector<uint32_t> freeChildBlocks;  // first cell of merged child blocks, reused by the next split
+
+  bool splitWanted(const GridSpace& space) const;
+  bool mergeWanted(const GridSpace& parent) const;
+  void split(uint32_t cell);
+  void merge(uint32_t cell);
+  void mergeSideInto(CubeSideStorage& target, const CubeSideStorage& source);
+  void clearSide(CubeSideStorage& side);
+  void growSide(CubeSideStorage& side);
+  void insertIndex(TimingPool& pool, const CubeSideStorage& side, uint32_t element) const;
+  uint32_t fasterElement(const TimingPool& pool, const CubeSideStorage& side, uint32_t element, uint32_t other) const;
+  void     updateRank(TimingPool& pool, const CubeSideStorage& side, uint32_t element) const;
+  void     rebuildRank(TimingPool& pool, const CubeSideStorage& side) const;
 };
 
 //SortingParameters mostRecentParameters;
@@ -87,8 +220,13 @@ SortingGrid1::~SortingGrid1()
 */
 
 SortingParameters createSortingParameters1();
+std::vector<SortingParameters> enumerateLegalSortingParameters();
 SortingParameters morphSortingParameters(SortingParameters parameters);
 bool parametersLegalCheck1(SortingParameters parameters);
+// false for bit budgets that build the same key as another legal set, see packKeyComposition
+bool keyCompositionLegalCheck(SortingParameters parameters);
+// draws the bit budgets of the enabled key features and the interleaving, not always legal
+void randomKeyComposition(SortingParameters& parameters, std::mt19937& rng);
 
 void storeSortingGrid1();
 
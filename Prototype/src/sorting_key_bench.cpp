@@ -0,0 +1,503 @@
+#include "sorting_key_bench.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+
+static_assert(sizeof(RecordedRay) == 7 * sizeof(float), "recorded rays are stored as 7 floats");
+
+static const char* sortingModeName(int sortingMode)
+{
+  switch(sortingMode)
+  {
+    case eOrigin:
+      return "origin";
+    case eReis:
+      return "reis";
+    case eCosta:
+      return "costa";
+    case eAila:
+      return "aila";
+    case eTwoPoint:
+      return "two point";
+    case eEndPointEst:
+      return "endpoint est";
+    case eEndEstAdaptive:
+      return "endpoint adaptive";
+    default:
+      return "none";
+  }
+}
+
+static sortkey::KeyQuantization keyQuantization(bool normalized, glm::vec3 sceneMin, glm::vec3 sceneMax)
+{
+  sortkey::KeyQuantization quantization;
+  quantization.normalized = normalized;
+  quantization.sceneMin   = sceneMin;
+  quantization.sceneMax   = sceneMax;
+  return quantization;
+}
+
+bool loadRecordedRays(const std::string& filename, std::vector<RecordedRay>& rays, glm::vec3& sceneMin, glm::vec3& sceneMax)
+{
+  std::ifstream file(filename, std::ios::binary);
+  if(!file.is_open())
+  {
+    printf("could not open recorded rays %s\n", filename.c_str());
+    return false;
+  }
+
+  RayFileHeader header{};
+  file.read(reinterpret_cast<char*>(&header), sizeof(header));
+  if(!file || memcmp(header.magic, RAY_FILE_MAGIC, sizeof(RAY_FILE_MAGIC)) != 0 || header.version != RAY_FILE_VERSION)
+  {
+    printf("%s is not a recorded ray file of version %u\n", filename.c_str(), RAY_FILE_VERSION);
+    return false;
+  }
+
+  rays.resize(header.numRays);
+  file.read(reinterpret_cast<char*>(rays.data()), std::streamsize(rays.size() * sizeof(RecordedRay)));
+  if(!file)
+  {
+    printf("%s is truncated, it should hold %u rays\n", filename.c_str(), header.numRays);
+    rays.clear();
+    return false;
+  }
+  sceneMin = glm::vec3(header.sceneMin[0], header.sceneMin[1], header.sceneMin[2]);
+  sceneMax = glm::vec3(header.sceneMax[0], header.sceneMax[1], header.sceneMax[2]);
+  return true;
+}
+
+bool writeRecordedRays(const std::string& filename, const std::vector<RecordedRay>& rays, glm::vec3 sceneMin, glm::vec3 sceneMax)
+{
+  RayFileHeader header{};
+  memcpy(header.magic, RAY_FILE_MAGIC, sizeof(RAY_FILE_MAGIC));
+  header.version = RAY_FILE_VERSION;
+  header.numRays = uint32_t(rays.size());
+  for(int axis = 0; axis < 3; axis++)
+  {
+    header.sceneMin[axis] = sceneMin[axis];
+    header.sceneMax[axis] = sceneMax[axis];
+  }
+
+  std::ofstream file(filename, std::ios::binary);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(rays.data()), std::streamsize(rays.size() * sizeof(RecordedRay)));
+  if(!file)
+  {
+    printf("could not write recorded rays %s\n", filename.c_str());
+    return false;
+  }
+  return true;
+}
+
+std::vector<RecordedRay> syntheticRays(uint32_t numRays, glm::vec3 sceneMin, glm::vec3 sceneMax)
+{
+  std::mt19937                          rng(1);
+  std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+  std::normal_distribution<float>       gauss(0.0f, 1.0f);
+  float                                 sceneExtent = sortkey::largestSceneExtent(sceneMin, sceneMax);
+
+  std::vector<RecordedRay> rays(numRays);
+  for(RecordedRay& ray : rays)
+  {
+    ray.origin    = glm::mix(sceneMin, sceneMax, glm::vec3(unit(rng), unit(rng), unit(rng)));
+    ray.direction = glm::normalize(glm::vec3(gauss(rng), gauss(rng), gauss(rng)) + glm::vec3(0.0f, 0.0f, 1e-6f));
+    ray.hitT      = unit(rng) < 0.2f ? sortkey::SORTKEY_NO_HIT : unit(rng) * sceneExtent;
+  }
+  return rays;
+}
+
+KeyStatistics keyStatistics(const std::vector<uint32_t>& keys, uint32_t coherenceBits, bool mostSignificant)
+{
+  KeyStatistics statistics;
+  if(keys.empty() || coherenceBits == 0)
+    return statistics;
+
+  coherenceBits = std::min(coherenceBits, 32u);
+  uint32_t              mask = coherenceBits == 32 ? ~0u : (1u << coherenceBits) - 1;
+  uint32_t              drop = mostSignificant ? 32 - coherenceBits : 0;
+  std::vector<uint32_t> buckets(keys.size());
+  for(size_t i = 0; i < keys.size(); ++i)
+    buckets[i] = (keys[i] >> drop) & mask;
+  std::sort(buckets.begin(), buckets.end());
+
+  double total   = double(buckets.size());
+  size_t largest = 0;
+  for(size_t begin = 0; begin < buckets.size();)
+  {
+    size_t end = begin;
+    while(end < buckets.size() && buckets[end] == buckets[begin])
+      ++end;
+    double p = double(end - begin) / total;
+    statistics.entropy -= p * std::log2(p);
+    statistics.distinctKeys++;
+    largest = std::max(largest, end - begin);
+    begin   = end;
+  }
+
+  double possible          = std::min(std::ldexp(1.0, int(coherenceBits)), total);
+  statistics.occupancy     = double(statistics.distinctKeys) / possible;
+  statistics.largestBucket = double(largest) / total;
+  return statistics;
+}
+
+KeyLocality keyLocality(const std::vector<RecordedRay>& rays, const std::vector<uint32_t>& keys, float sceneExtent)
+{
+  KeyLocality locality;
+  if(rays.size() < 2)
+    return locality;
+
+  std::vector<uint32_t> order(rays.size());
+  for(uint32_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&keys](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+
+  for(size_t i = 1; i < order.size(); ++i)
+  {
+    const RecordedRay& previous = rays[order[i - 1]];
+    const RecordedRay& ray      = rays[order[i]];
+    float cosine = glm::clamp(glm::dot(glm::normalize(previous.direction), glm::normalize(ray.direction)), -1.0f, 1.0f);
+    locality.originStep += glm::length(ray.origin - previous.origin);
+    locality.directionStep += std::acos(cosine);
+  }
+  locality.originStep /= double(order.size() - 1) * std::max(sceneExtent, 1e-6f);
+  locality.directionStep *= 180.0 / 3.14159265358979323846 / double(order.size() - 1);
+  return locality;
+}
+
+// Composed key expected from the budgets alone, one bit at a time from the most significant one
+static uint32_t composedKeyBitByBit(const sortkey::KeyBudget& budget, const sortkey::KeyFeatureValues& features, bool interleave)
+{
+  std::vector<std::pair<int, uint32_t>> order;  // feature, bit of the feature value
+  if(interleave)
+  {
+    for(uint32_t level = 0; level < 32; ++level)
+      for(int f = 0; f < sortkey::KEY_NUM_FEATURES; ++f)
+        if(level < budget.bits[f])
+          order.push_back({f, 31 - level});
+  }
+  else
+  {
+    for(int f = 0; f < sortkey::KEY_NUM_FEATURES; ++f)
+      for(uint32_t b = 0; b < budget.bits[f]; ++b)
+        order.push_back({f, 31 - b});
+  }
+
+  uint32_t key = 0;
+  for(size_t i = 0; i < order.size(); ++i)
+  {
+    uint32_t bit = (features.values[order[i].first] >> order[i].second) & 1u;
+    key |= bit << (order.size() - 1 - i);
+  }
+  return key;
+}
+
+// Checks the budgets and bit layout of composed keys, returns the number of failed checks
+static int checkKeyComposition()
+{
+  int  failures = 0;
+  auto expect   = [&](bool condition, const char* what) {
+    if(!condition)
+    {
+      printf("key composition: %s\n", what);
+      failures++;
+    }
+  };
+
+  SortingParameters parameters{};
+  parameters.numCoherenceBitsTotal = 32;
+  parameters.rayOrigin             = true;
+  parameters.rayDirection          = true;
+  sortkey::KeyBudget budget        = sortkey::keyBudget(keyComposition(parameters));
+  expect(budget.bits[sortkey::KEY_FEATURE_ORIGIN] == 16 && budget.bits[sortkey::KEY_FEATURE_DIRECTION] == 16,
+         "two auto features do not split 32 bits evenly");
+
+  parameters.originBits = 10;
+  budget                = sortkey::keyBudget(keyComposition(parameters));
+  expect(budget.bits[sortkey::KEY_FEATURE_ORIGIN] == 10 && budget.bits[sortkey::KEY_FEATURE_DIRECTION] == 22,
+         "an auto feature does not get the bits an explicit budget leaves");
+
+  parameters.isFinished            = true;
+  parameters.numCoherenceBitsTotal = 8;
+  budget                           = sortkey::keyBudget(keyComposition(parameters));
+  expect(budget.bits[sortkey::KEY_FEATURE_FINISHED] == 1 && budget.bits[sortkey::KEY_FEATURE_ORIGIN] == 7
+             && budget.bits[sortkey::KEY_FEATURE_DIRECTION] == 0,
+         "budgets over the total are not clamped in feature order");
+
+  sortkey::KeyFeatureValues finished{};
+  finished.values[sortkey::KEY_FEATURE_FINISHED] = 0x80000000u;
+  expect(sortkey::composeSortingKey(keyComposition(parameters), finished) == 0x80u, "the finished flag is not the top key bit");
+
+  parameters.rayOrigin = false;
+  parameters.originBits = 15;
+  budget                = sortkey::keyBudget(keyComposition(parameters));
+  expect(budget.bits[sortkey::KEY_FEATURE_ORIGIN] == 0, "a disabled feature gets bits");
+
+  parameters.numCoherenceBitsTotal = 6;
+  parameters.rayOrigin             = true;
+  parameters.originBits            = 3;
+  parameters.isFinished            = false;
+  parameters.interleaveFeatures    = 1;
+  sortkey::KeyFeatureValues pattern{};
+  pattern.values[sortkey::KEY_FEATURE_ORIGIN]    = 0xA0000000u;  // 101
+  pattern.values[sortkey::KEY_FEATURE_DIRECTION] = 0x40000000u;  // 010, interleaved 10 01 10
+  expect(sortkey::composeSortingKey(keyComposition(parameters), pattern) == 0x26u, "features are not interleaved origin first");
+
+  sortkey::KeyComposition unpacked = keyComposition(parameters);
+  expect(unpacked.interleave && unpacked.requestedBits[sortkey::KEY_FEATURE_ORIGIN] == 3
+             && unpacked.requestedBits[sortkey::KEY_FEATURE_DIRECTION] == 0,
+         "the packed composition does not round trip");
+
+  // random budgets of every feature selection and a few totals against the bit by bit layout
+  std::mt19937                            rng(7);
+  std::uniform_int_distribution<uint32_t> value;
+  for(uint32_t total : {1u, 7u, 16u, 31u, 32u})
+  {
+    for(uint32_t flags = 0; flags < 32; ++flags)
+    {
+      for(int sample = 0; sample < 64; ++sample)
+      {
+        uint32_t                packed      = value(rng) & (sortkey::KEY_INTERLEAVE_FLAG * 2 - 1);
+        sortkey::KeyComposition composition = sortkey::keyComposition(total, flags & 2, flags & 4, flags & 8, flags & 16, flags & 1, packed);
+        sortkey::KeyBudget features = sortkey::keyBudget(composition);
+        uint32_t           used     = 0;
+        for(int f = 0; f < sortkey::KEY_NUM_FEATURES; ++f)
+          used += features.bits[f];
+        bool anyAuto = false;
+        for(int f = 0; f < sortkey::KEY_NUM_FEATURES; ++f)
+          anyAuto |= composition.enabled[f] && composition.requestedBits[f] == 0;
+        expect(used <= total && (!anyAuto || used == total), "the budgets do not add up to the total");
+
+        sortkey::KeyFeatureValues values;
+        for(int f = 0; f < sortkey::KEY_NUM_FEATURES; ++f)
+          values.values[f] = value(rng);
+        expect(sortkey::composeSortingKey(composition, values) == composedKeyBitByBit(features, values, composition.interleave),
+               "the composed key differs from the bit by bit layout");
+      }
+    }
+  }
+  return failures;
+}
+
+// Keys of a few fixed rays in the scene bounds of the benchmark, as the shader functions of
+// shaders/sorting_keys.h compute them. The CPU paths are compared with these functions, this table
+// catches changes to the functions themselves; update it only when the keys are meant to change.
+// With the float bits the Reis mode yields 0 for every ray, which the table records as well
+static const glm::vec3   GOLDEN_SCENE_MIN(-10.0f, -2.0f, -10.0f);
+static const glm::vec3   GOLDEN_SCENE_MAX(10.0f, 8.0f, 10.0f);
+static const RecordedRay GOLDEN_RAYS[4] = {
+    {{1.5f, 0.25f, -3.0f}, {0.0f, 0.0f, 1.0f}, 4.0f},
+    {{-7.0f, 5.5f, 9.0f}, {0.6f, 0.0f, -0.8f}, 12.5f},
+    {{0.0f, 0.0f, 0.0f}, {0.0f, -1.0f, 0.0f}, sortkey::SORTKEY_NO_HIT},
+    {{9.5f, -1.75f, 2.0f}, {-0.48f, 0.6f, 0.64f}, 0.75f},
+};
+
+struct GoldenKeys
+{
+  int      mode;
+  bool     normalized;
+  uint32_t keys[4];
+};
+
+static const GoldenKeys GOLDEN_KEYS[] = {
+    {eOrigin, false, {0x5fffffffu, 0x8a7fffffu, 0x00000000u, 0x67bfffffu}},
+    {eOrigin, true, {0x85762762u, 0x67b5bb5bu, 0x17fb7fb7u, 0xb25a95a9u}},
+    {eReis, false, {0x00000000u, 0x00000000u, 0x00000000u, 0x00000000u}},
+    {eReis, true, {0x857620aau, 0x67b5b9ebu, 0x17fb7c7fu, 0xb25a92cau}},
+    {eCosta, false, {0xa0000000u, 0xb00000c0u, 0xf0000000u, 0x9e000020u}},
+    {eCosta, true, {0x2a000027u, 0x7a0001bbu, 0x1f00017fu, 0xb2000095u}},
+    {eAila, false, {0xfc5e3800u, 0xfc3553a2u, 0x000a2800u, 0xfc49a073u}},
+    {eAila, true, {0x8572f8f3u, 0x67b8b65du, 0x17f16dbeu, 0xb2577a08u}},
+    {eTwoPoint, false, {0xffffffffu, 0xffffffffu, 0x08000008u, 0xebff7cffu}},
+    {eTwoPoint, true, {0x9484be6cu, 0x789edb4bu, 0x02df7db6u, 0xb6492fa5u}},
+    {eEndPointEst, false, {0xffffffffu, 0x4b6fdb4bu, 0x49249249u, 0x6db02dd8u}},
+    {eEndPointEst, true, {0xb404b66cu, 0x6ed4926fu, 0x02db6db6u, 0xb76b4924u}},
+    {eEndEstAdaptive, false, {0xffffffffu, 0xffffffffu, 0x49249249u, 0x252fed90u}},
+    {eEndEstAdaptive, true, {0x9096ff48u, 0x6e46ff4bu, 0x02db6db6u, 0xb6492d6fu}},
+};
+
+// 32 bit keys of the finished flag, 10 origin bits and an even share of direction and real endpoint,
+// the third ray finishes its path
+struct GoldenComposedKeys
+{
+  bool     interleave;
+  bool     normalized;
+  uint32_t keys[4];
+};
+
+static const GoldenComposedKeys GOLDEN_COMPOSED_KEYS[] = {
+    {false, false, {0x2ff557ffu, 0x453d5fffu, 0x801ffc20u, 0x33cf5fafu}},
+    {false, true, {0x42a55652u, 0x33cf5de2u, 0x8be3fc0bu, 0x593652d9u}},
+    {true, false, {0x3aefbefbu, 0x76cf3cbfu, 0xa4934925u, 0x1fd39ef7u}},
+    {true, true, {0x508aaa39u, 0x0fdb9a75u, 0x8032df7fu, 0x71f83c2au}},
+};
+
+// Compares the keys of every mode, encoding and supported path with the table, returns the number of mismatches
+static int checkGoldenKeys()
+{
+  int failures = 0;
+  for(const GoldenKeys& golden : GOLDEN_KEYS)
+  {
+    sortkey::KeyQuantization quantization = keyQuantization(golden.normalized, GOLDEN_SCENE_MIN, GOLDEN_SCENE_MAX);
+    for(int path = 0; path < eKeyPathCount; ++path)
+    {
+      if(!sortingKeyPathSupported(SortingKeyPath(path)))
+        continue;
+      uint32_t keys[4];
+      computeSortingKeys(golden.mode, GOLDEN_RAYS, 4, quantization, SortingKeyPath(path), keys);
+      for(int ray = 0; ray < 4; ++ray)
+      {
+        if(keys[ray] == golden.keys[ray])
+          continue;
+        printf("golden key: %s %s ray %d on the %s path is 0x%08x, expected 0x%08x\n", sortingModeName(golden.mode),
+               golden.normalized ? "normalized" : "float bits", ray, sortingKeyPathName(SortingKeyPath(path)), keys[ray],
+               golden.keys[ray]);
+        failures++;
+      }
+    }
+  }
+
+  for(const GoldenComposedKeys& golden : GOLDEN_COMPOSED_KEYS)
+  {
+    sortkey::KeyQuantization quantization = keyQuantization(golden.normalized, GOLDEN_SCENE_MIN, GOLDEN_SCENE_MAX);
+    sortkey::KeyComposition  composition =
+        sortkey::keyComposition(32, true, true, false, true, true, sortkey::packKeyComposition(10, 0, 0, 0, golden.interleave));
+    for(int ray = 0; ray < 4; ++ray)
+    {
+      const RecordedRay& recorded = GOLDEN_RAYS[ray];
+      uint32_t key = sortkey::SortingKeyComposed(composition, recorded.origin, recorded.direction, recorded.hitT, ray == 2, quantization);
+      if(key == golden.keys[ray])
+        continue;
+      printf("golden key: composed %s %s ray %d is 0x%08x, expected 0x%08x\n", golden.interleave ? "interleaved" : "concatenated",
+             golden.normalized ? "normalized" : "float bits", ray, key, golden.keys[ray]);
+      failures++;
+    }
+  }
+  return failures;
+}
+
+int runSortingKeyBenchmark(uint32_t numRays)
+{
+  if(checkKeyComposition() != 0)
+    return 1;
+  printf("composed key layouts match\n");
+  if(checkGoldenKeys() != 0)
+    return 1;
+  printf("keys of the golden rays match\n");
+
+  const glm::vec3 sceneMin(-10.0f, -2.0f, -10.0f);
+  const glm::vec3 sceneMax(10.0f, 8.0f, 10.0f);
+  const int       repetitions = 5;
+
+  std::vector<RecordedRay> rays = syntheticRays(numRays, sceneMin, sceneMax);
+  std::vector<uint32_t>    reference(numRays);
+  std::vector<uint32_t>    keys(numRays);
+
+  printf("%u rays, best of %d runs\n", numRays, repetitions);
+  printf("%-18s %-10s", "mode", "encoding");
+  for(int path = 0; path < eKeyPathCount; ++path)
+    printf(" %10s", sortingKeyPathName(SortingKeyPath(path)));
+  printf("   [Mkeys/s]\n");
+
+  uint64_t mismatches = 0;
+  for(int mode = eOrigin; mode <= eEndEstAdaptive; ++mode)
+  {
+    for(bool normalized : {false, true})
+    {
+      sortkey::KeyQuantization quantization = keyQuantization(normalized, sceneMin, sceneMax);
+      computeSortingKeys(mode, rays.data(), rays.size(), quantization, eKeyPathReference, reference.data());
+
+      printf("%-18s %-10s", sortingModeName(mode), normalized ? "normalized" : "float bits");
+      for(int path = 0; path < eKeyPathCount; ++path)
+      {
+        if(!sortingKeyPathSupported(SortingKeyPath(path)))
+        {
+          printf(" %10s", "-");
+          continue;
+        }
+
+        double best = 1e30;
+        for(int run = 0; run < repetitions; ++run)
+        {
+          auto begin = std::chrono::steady_clock::now();
+          computeSortingKeys(mode, rays.data(), rays.size(), quantization, SortingKeyPath(path), keys.data());
+          best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+        }
+        printf(" %10.1f", numRays / best * 1e-6);
+
+        for(uint32_t i = 0; i < numRays; ++i)
+          mismatches += keys[i] != reference[i];
+      }
+      printf("\n");
+    }
+  }
+
+  if(mismatches != 0)
+  {
+    printf("%llu keys differ from the reference\n", (unsigned long long)mismatches);
+    return 1;
+  }
+  printf("all paths match the reference\n");
+  return 0;
+}
+
+int runSortingKeyStatistics(const std::string& source, uint32_t coherenceBits)
+{
+  std::vector<RecordedRay> rays;
+  glm::vec3                sceneMin(-10.0f, -2.0f, -10.0f);
+  glm::vec3                sceneMax(10.0f, 8.0f, 10.0f);
+
+  char*         end       = nullptr;
+  unsigned long synthetic = strtoul(source.c_str(), &end, 10);
+  if(!source.empty() && *end == '\0')
+  {
+    rays = syntheticRays(uint32_t(synthetic), sceneMin, sceneMax);
+    printf("%zu synthetic rays", rays.size());
+  }
+  else
+  {
+    if(!loadRecordedRays(source, rays, sceneMin, sceneMax))
+      return 1;
+    printf("%zu rays of %s", rays.size(), source.c_str());
+  }
+  if(rays.empty())
+  {
+    printf(", nothing to measure\n");
+    return 1;
+  }
+  printf(", %u key bits: the lowest ones reorderThreadNV considers | the most significant ones | neighbours once sorted\n",
+         coherenceBits);
+  printf("%-18s %-10s %11s %10s %8s | %11s %10s %8s | %7s %9s\n", "mode", "encoding", "entropy [b]", "occupancy",
+         "largest", "entropy [b]", "occupancy", "largest", "origin", "direction");
+  float sceneExtent = sortkey::largestSceneExtent(sceneMin, sceneMax);
+
+  // any path builds the same keys, take a fast one
+  SortingKeyPath path = eKeyPathScalar;
+  for(SortingKeyPath candidate : {eKeyPathAVX2, eKeyPathBMI2})
+  {
+    if(sortingKeyPathSupported(candidate))
+      path = candidate;
+  }
+
+  std::vector<uint32_t> keys(rays.size());
+  for(int mode = eOrigin; mode <= eEndEstAdaptive; ++mode)
+  {
+    for(bool normalized : {false, true})
+    {
+      computeSortingKeys(mode, rays.data(), rays.size(), keyQuantization(normalized, sceneMin, sceneMax), path, keys.data());
+      KeyStatistics low = keyStatistics(keys, coherenceBits);
+      KeyStatistics top = keyStatistics(keys, coherenceBits, true);
+      KeyLocality   locality = keyLocality(rays, keys, sceneExtent);
+      printf("%-18s %-10s %11.2f %9.2f%% %7.2f%% | %11.2f %9.2f%% %7.2f%% | %6.2f%% %8.1f\n", sortingModeName(mode),
+             normalized ? "normalized" : "float bits", low.entropy, low.occupancy * 100.0, low.largestBucket * 100.0,
+             top.entropy, top.occupancy * 100.0, top.largestBucket * 100.0, locality.originStep * 100.0,
+             locality.directionStep);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "sorting_keys.hpp"
+
+// CPU tools for the sorting keys, none of them needs a window or a GPU
+
+// Recorded ray files (.rays): a RayFileHeader followed by numRays RecordedRay, 7 little endian
+// floats each (origin, direction, hitT). The scene bounds are the ones of RtxState, the normalized
+// keys quantize in them. The headless mode records them from the path tracer with -recordrays.
+const char     RAY_FILE_MAGIC[4] = {'R', 'A', 'Y', 'S'};
+const uint32_t RAY_FILE_VERSION  = 1;
+
+struct RayFileHeader
+{
+  char     magic[4];
+  uint32_t version;
+  uint32_t numRays;
+  float    sceneMin[3];
+  float    sceneMax[3];
+};
+
+// Returns false with a message if the file is missing, of another version or truncated
+bool loadRecordedRays(const std::string& filename, std::vector<RecordedRay>& rays, glm::vec3& sceneMin, glm::vec3& sceneMax);
+
+// Writes the rays in the layout loadRecordedRays reads, returns false with a message on a write error
+bool writeRecordedRays(const std::string& filename, const std::vector<RecordedRay>& rays, glm::vec3 sceneMin, glm::vec3 sceneMax);
+
+// Origins in the scene bounds, directions over the sphere, a fifth of the rays missed
+std::vector<RecordedRay> syntheticRays(uint32_t numRays, glm::vec3 sceneMin, glm::vec3 sceneMax);
+
+// How well the keys of a set of rays spread over 2^coherenceBits buckets. reorderThreadNV only
+// considers the lowest `coherenceBits` bits of the key, in Morton order those are the finest ones.
+// The most significant bits are the coarse cells, mostSignificant buckets by them instead.
+struct KeyStatistics
+{
+  uint64_t distinctKeys{0};   // occupied buckets
+  double   entropy{0.0};      // bits, at most min(coherenceBits, log2 of the ray count)
+  double   occupancy{0.0};    // occupied buckets / min(2^coherenceBits, ray count)
+  double   largestBucket{0.0};  // share of the rays in the fullest bucket
+};
+
+KeyStatistics keyStatistics(const std::vector<uint32_t>& keys, uint32_t coherenceBits, bool mostSignificant = false);
+
+// Entropy also rewards keys that are noise. This is what sorting is for: the mean distance of the
+// origins, relative to the largest scene extent, and the mean angle of the directions of rays
+// that are next to each other once sorted by their whole key
+struct KeyLocality
+{
+  double originStep{0.0};
+  double directionStep{0.0};  // degrees
+};
+
+KeyLocality keyLocality(const std::vector<RecordedRay>& rays, const std::vector<uint32_t>& keys, float sceneExtent);
+
+// Computes the sorting keys of numRays synthetic rays in every sorting mode and key encoding on
+// every key path the CPU supports, prints Mkeys/s and checks each path against the reference.
+// Returns 1 when a path builds a different key, so the result can gate a build of the shaders.
+int runSortingKeyBenchmark(uint32_t numRays);
+
+// Prints the KeyStatistics of the lowest and the most significant bits of every sorting mode with
+// the float bit and the normalized encoding.
+// `source` is a .rays file or a number of synthetic rays
+int runSortingKeyStatistics(const std::string& source, uint32_t coherenceBits);
@@ -0,0 +1,472 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <glm/glm.hpp>
+
+#include "shaders/host_device.h"
+#include "shaders/sorting_keys.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SORTING_KEYS_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#endif
+
+// Functions compiled for an instruction set the build does not target, only called after
+// sortingKeyPathSupported said the CPU has it
+#if defined(SORTING_KEYS_X86) && (defined(__GNUC__) || defined(__clang__))
+#define SORTKEY_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SORTKEY_TARGET(isa)
+#endif
+
+// Host side sorting keys, for offline tools and for checking the shaders
+//
+// computeSortingKeys() returns the keys createSortingKey() of keyCreation.glsl builds for recorded
+// rays. The rays are quantized with the functions the shader runs (shaders/sorting_keys.h), then
+// interleaved by one of the paths below. All of them return the keys of the reference path
+// bit for bit; they only differ in speed. The GPU evaluates atan, acos and normalize with its
+// own precision, so keys of the direction based modes can differ from the shader in the last bits.
+// Normalized keys quantize in the scene bounds to fixed point, see KeyQuantization.
+
+enum SortingKeyPath
+{
+  eKeyPathReference,  // the loops of sorting_keys.h, one bit at a time
+  eKeyPathScalar,     // magic number bit spreading
+  eKeyPathAVX2,       // the same on four keys at once
+  eKeyPathBMI2,       // one pdep per field
+  eKeyPathCount
+};
+
+inline const char* sortingKeyPathName(SortingKeyPath path)
+{
+  switch(path)
+  {
+    case eKeyPathReference:
+      return "reference";
+    case eKeyPathScalar:
+      return "scalar";
+    case eKeyPathAVX2:
+      return "avx2";
+    case eKeyPathBMI2:
+      return "bmi2";
+    default:
+      return "unknown";
+  }
+}
+
+inline bool sortingKeyPathSupported(SortingKeyPath path)
+{
+  if(path == eKeyPathReference || path == eKeyPathScalar)
+    return true;
+#if defined(SORTING_KEYS_X86) && (defined(__GNUC__) || defined(__clang__))
+  if(path == eKeyPathAVX2)
+    return __builtin_cpu_supports("avx2");
+  if(path == eKeyPathBMI2)
+    return __builtin_cpu_supports("bmi2");
+#elif defined(SORTING_KEYS_X86) && defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  if(info[0] < 7)
+    return false;
+  __cpuidex(info, 7, 0);
+  if(path == eKeyPathBMI2)
+    return (info[1] & (1 << 8)) != 0;
+  if(path == eKeyPathAVX2)
+  {
+    int features[4];
+    __cpuid(features, 1);
+    bool osSavesYmm = (features[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+    return osSavesYmm && (info[1] & (1 << 5)) != 0;
+  }
+#endif
+  return false;
+}
+
+// The key composition of the parameters, see packKeyComposition. Budgets of disabled features are
+// left out, so parameters that build the same key pack the same
+inline uint32_t packedKeyComposition(const SortingParameters& parameters)
+{
+  return sortkey::packKeyComposition(parameters.rayOrigin ? parameters.originBits : 0u,
+                                     parameters.rayDirection ? parameters.directionBits : 0u,
+                                     parameters.estimatedEndpoint ? parameters.estimatedEndpointBits : 0u,
+                                     parameters.realEndpoint ? parameters.realEndpointBits : 0u,
+                                     parameters.interleaveFeatures != 0);
+}
+
+inline sortkey::KeyComposition keyComposition(const SortingParameters& parameters)
+{
+  return sortkey::keyComposition(parameters.numCoherenceBitsTotal, parameters.rayOrigin, parameters.rayDirection,
+                                 parameters.estimatedEndpoint, parameters.realEndpoint, parameters.isFinished,
+                                 packedKeyComposition(parameters));
+}
+
+inline bool sortingModeHasKey(int sortingMode)
+{
+  return sortingMode >= eOrigin && sortingMode <= eEndEstAdaptive;
+}
+
+namespace sortkey {
+
+// The key of one ray by the shader functions, what every path has to match
+inline uint referenceKey(int sortingMode, const RecordedRay& ray, const KeyQuantization& quantization)
+{
+  switch(sortingMode)
+  {
+    case eOrigin:
+      return SortingKeyOrigin(ray.origin, quantization);
+    case eReis:
+      return SortingKeyReis(ray.origin, ray.direction, quantization);
+    case eCosta:
+      return SortingKeyCosta(ray.origin, ray.direction, quantization);
+    case eAila:
+      return SortingKeyAila(ray.origin, ray.direction, quantization);
+    case eTwoPoint:
+      return SortingKeyTwoPoint(ray.origin, ray.direction, ray.hitT, quantization);
+    case eEndPointEst:
+      return SortingKeyEndPointEstimationHard(ray.origin, ray.direction, quantization);
+    case eEndEstAdaptive:
+      return SortingKeyEndPointEstimationAdaptive(ray.origin, ray.direction, ray.hitT, quantization);
+    default:
+      return 0;
+  }
+}
+
+// The quantization step of referenceKey, the endpoint estimations interleave the endpoint with
+// itself so they get it as both points
+inline void quantizeRay(int sortingMode, const RecordedRay& ray, const KeyQuantization& quantization, float sceneExtent, ivec3& ia, ivec3& ib)
+{
+  switch(sortingMode)
+  {
+    case eOrigin:
+      ia = quantizePosition(ray.origin, 8388607.0f, quantization);
+      ib = ivec3(0);
+      break;
+    case eReis:
+      ia = quantizePosition(ray.origin, 255.0f, quantization);
+      ib = quantizeSphericalDirection(ray.direction, 255.0f, quantization);
+      break;
+    case eCosta:
+      ia = quantizePosition(ray.origin, 8191.0f, quantization);
+      ib = quantizeSphericalDirection(ray.direction, 8191.0f, quantization);
+      break;
+    case eAila:
+      ia = quantizePosition(ray.origin, 8191.0f, quantization);
+      ib = quantizeDirection(ray.direction, 8191.0f, quantization);
+      break;
+    case eTwoPoint:
+      ia = quantizePosition(ray.origin, 32767.0f, quantization);
+      ib = quantizePosition(rayEndpoint(ray.origin, ray.direction, ray.hitT), 32767.0f, quantization);
+      break;
+    case eEndPointEst:
+      ib = quantizePosition(rayEndpoint(ray.origin, ray.direction, 0.2f * sceneExtent), 32767.0f, quantization);
+      ia = ib;
+      break;
+    case eEndEstAdaptive:
+      ib = quantizePosition(rayEndpoint(ray.origin, ray.direction, estimatedRayLength(ray.hitT, sceneExtent)), 32767.0f, quantization);
+      ia = ib;
+      break;
+    default:
+      ia = ivec3(0);
+      ib = ivec3(0);
+  }
+}
+
+//-----------------------------------------------------------------------
+// Layouts
+//
+// The morton* loops as tables: bits [shift, shift + width) of one quantized component go to the
+// Morton bits offset, offset + stride, ... Strides are 2, 3 or 6.
+
+enum KeySource
+{
+  eSourceAX,
+  eSourceAY,
+  eSourceAZ,
+  eSourceBX,
+  eSourceBY,
+  eSourceBZ,
+  eNumKeySources
+};
+
+struct KeyField
+{
+  uint32_t source;
+  uint32_t shift;
+  uint32_t width;
+  uint32_t stride;
+  uint32_t offset;
+};
+
+struct KeyLayout
+{
+  const KeyField* fields;
+  uint32_t        numFields;
+};
+
+// Normalized Reis keys are the low half of mortonReis, its layout is moved up into the half the paths return
+inline KeyLayout keyLayout(int sortingMode, bool normalized)
+{
+  static const KeyField origin[] = {
+      {eSourceAX, 2, 21, 3, 3},
+      {eSourceAY, 2, 21, 3, 2},
+      {eSourceAZ, 2, 21, 3, 1},
+      {eSourceAX, 0, 1, 3, 0},
+  };
+  static const KeyField reis[] = {
+      {eSourceAX, 1, 7, 3, 13}, {eSourceAY, 1, 7, 3, 12}, {eSourceAZ, 1, 7, 3, 11},
+      {eSourceAX, 0, 1, 3, 10}, {eSourceBX, 3, 5, 2, 1},  {eSourceBY, 3, 5, 2, 0},
+  };
+  static const KeyField reisNormalized[] = {
+      {eSourceAX, 1, 7, 3, 45}, {eSourceAY, 1, 7, 3, 44}, {eSourceAZ, 1, 7, 3, 43},
+      {eSourceAX, 0, 1, 3, 42}, {eSourceBX, 3, 5, 2, 33}, {eSourceBY, 3, 5, 2, 32},
+  };
+  static const KeyField costa[] = {
+      {eSourceBX, 9, 4, 2, 57},  {eSourceBY, 9, 4, 2, 56},  {eSourceAX, 1, 7, 3, 22},
+      {eSourceAY, 1, 7, 3, 21},  {eSourceAZ, 1, 7, 3, 20},
+  };
+  static const KeyField aila[] = {
+      {eSourceAX, 10, 3, 3, 57}, {eSourceAY, 10, 3, 3, 56}, {eSourceAZ, 10, 3, 3, 55},
+      {eSourceAX, 1, 9, 6, 6},   {eSourceAY, 1, 9, 6, 5},   {eSourceAZ, 1, 9, 6, 4},
+      {eSourceBX, 4, 9, 6, 3},   {eSourceBY, 4, 9, 6, 2},   {eSourceBZ, 4, 9, 6, 1},
+  };
+  static const KeyField twoPoint[] = {
+      {eSourceAX, 4, 11, 6, 3},  {eSourceAY, 4, 11, 6, 2},  {eSourceAZ, 4, 11, 6, 1},
+      {eSourceBX, 5, 10, 6, 6},  {eSourceBY, 5, 10, 6, 5},  {eSourceBZ, 5, 10, 6, 4},
+      {eSourceBX, 0, 1, 6, 0},
+  };
+
+  switch(sortingMode)
+  {
+    case eOrigin:
+      return {origin, uint32_t(std::size(origin))};
+    case eReis:
+      return normalized ? KeyLayout{reisNormalized, uint32_t(std::size(reisNormalized))} : KeyLayout{reis, uint32_t(std::size(reis))};
+    case eCosta:
+      return {costa, uint32_t(std::size(costa))};
+    case eAila:
+      return {aila, uint32_t(std::size(aila))};
+    case eTwoPoint:
+    case eEndPointEst:
+    case eEndEstAdaptive:
+      return {twoPoint, uint32_t(std::size(twoPoint))};
+    default:
+      return {nullptr, 0};
+  }
+}
+
+// The Morton bits a field writes, the mask pdep deposits into
+inline uint64_t fieldDepositMask(const KeyField& field)
+{
+  uint64_t mask = 0;
+  for(uint32_t i = 0; i < field.width; ++i)
+    mask |= uint64_t(1) << (field.offset + i * field.stride);
+  return mask;
+}
+
+inline uint64_t fieldBits(uint32_t value, const KeyField& field)
+{
+  return (value >> field.shift) & ((uint64_t(1) << field.width) - 1);
+}
+
+//-----------------------------------------------------------------------
+// Scalar
+//
+
+// bit i to bit 2i, 32 bits
+inline uint64_t spread2(uint64_t x)
+{
+  x &= 0xffffffffull;
+  x = (x | (x << 16)) & 0x0000ffff0000ffffull;
+  x = (x | (x << 8)) & 0x00ff00ff00ff00ffull;
+  x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0full;
+  x = (x | (x << 2)) & 0x3333333333333333ull;
+  x = (x | (x << 1)) & 0x5555555555555555ull;
+  return x;
+}
+
+// bit i to bit 3i, 21 bits
+inline uint64_t spread3(uint64_t x)
+{
+  x &= 0x1fffffull;
+  x = (x | (x << 32)) & 0x001f00000000ffffull;
+  x = (x | (x << 16)) & 0x001f0000ff0000ffull;
+  x = (x | (x << 8)) & 0x100f00f00f00f00full;
+  x = (x | (x << 4)) & 0x10c30c30c30c30c3ull;
+  x = (x | (x << 2)) & 0x1249249249249249ull;
+  return x;
+}
+
+// bit i to bit 6i, 11 bits
+inline uint64_t spread6(uint64_t x)
+{
+  return spread3(spread2(x & 0x7ffull));
+}
+
+inline uint64_t spread(uint64_t x, uint32_t stride)
+{
+  return stride == 2 ? spread2(x) : stride == 3 ? spread3(x) : spread6(x);
+}
+
+inline void interleaveScalar(const KeyLayout& layout, const uint32_t* const* sources, size_t count, uint32_t* keys)
+{
+  for(size_t i = 0; i < count; ++i)
+  {
+    uint64_t mortonCode = 0;
+    for(uint32_t f = 0; f < layout.numFields; ++f)
+    {
+      const KeyField& field = layout.fields[f];
+      mortonCode |= spread(fieldBits(sources[field.source][i], field), field.stride) << field.offset;
+    }
+    keys[i] = uint32_t(mortonCode >> 32);
+  }
+}
+
+#ifdef SORTING_KEYS_X86
+
+//-----------------------------------------------------------------------
+// BMI2
+//
+
+SORTKEY_TARGET("bmi2")
+inline void interleaveBMI2(const KeyLayout& layout, const uint32_t* const* sources, size_t count, uint32_t* keys)
+{
+  uint64_t masks[16];
+  for(uint32_t f = 0; f < layout.numFields; ++f)
+    masks[f] = fieldDepositMask(layout.fields[f]);
+
+  for(size_t i = 0; i < count; ++i)
+  {
+    uint64_t mortonCode = 0;
+    for(uint32_t f = 0; f < layout.numFields; ++f)
+    {
+      const KeyField& field = layout.fields[f];
+      // pdep takes as many low bits as the mask has, the bits above the field drop out
+      mortonCode |= _pdep_u64(uint64_t(sources[field.source][i] >> field.shift), masks[f]);
+    }
+    keys[i] = uint32_t(mortonCode >> 32);
+  }
+}
+
+//-----------------------------------------------------------------------
+// AVX2
+//
+
+SORTKEY_TARGET("avx2")
+inline __m256i spread2AVX2(__m256i x)
+{
+  x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi64(x, 16)), _mm256_set1_epi64x(0x0000ffff0000ffffll));
+  x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi64(x, 8)), _mm256_set1_epi64x(0x00ff00ff00ff00ffll));
+  x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi64(x, 4)), _mm256_set1_epi64x(0x0f0f0f0f0f0f0f0fll));
+  x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi64(x, 2)), _mm256_set1_epi64x(0x3333333333333333ll));
+  x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi64(x, 1)), _mm256_set1_epi64x(0x5555555555555555ll));
+  return x;
+}
+
+SORTKEY_TARGET("avx2")
+inline __m256i spread3AVX2(__m256i x)
+{
+  x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi64(x, 32)), _mm256_set1_epi64x(0x001f00000000ffffll));
+  x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi64(x, 16)), _mm256_set1_epi64x(0x001f0000ff0000ffll));
+  x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi64(x, 8)), _mm256_set1_epi64x(0x100f00f00f00f00fll));
+  x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi64(x, 4)), _mm256_set1_epi64x(0x10c30c30c30c30c3ll));
+  x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi64(x, 2)), _mm256_set1_epi64x(0x1249249249249249ll));
+  return x;
+}
+
+SORTKEY_TARGET("avx2")
+inline void interleaveAVX2(const KeyLayout& layout, const uint32_t* const* sources, size_t count, uint32_t* keys)
+{
+  const __m256i highHalves = _mm256_setr_epi32(1, 3, 5, 7, 0, 2, 4, 6);
+
+  size_t i = 0;
+  for(; i + 4 <= count; i += 4)
+  {
+    __m256i mortonCode = _mm256_setzero_si256();
+    for(uint32_t f = 0; f < layout.numFields; ++f)
+    {
+      const KeyField& field = layout.fields[f];
+      __m256i bits = _mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(sources[field.source] + i)));
+      bits = _mm256_srl_epi64(bits, _mm_cvtsi32_si128(int(field.shift)));
+      bits = _mm256_and_si256(bits, _mm256_set1_epi64x((1ll << field.width) - 1));
+      if(field.stride == 2)
+        bits = spread2AVX2(bits);
+      else if(field.stride == 3)
+        bits = spread3AVX2(bits);
+      else
+        bits = spread3AVX2(spread2AVX2(bits));
+      mortonCode = _mm256_or_si256(mortonCode, _mm256_sll_epi64(bits, _mm_cvtsi32_si128(int(field.offset))));
+    }
+    __m256i packed = _mm256_permutevar8x32_epi32(mortonCode, highHalves);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(keys + i), _mm256_castsi256_si128(packed));
+  }
+
+  const uint32_t* rest[eNumKeySources];
+  for(int s = 0; s < eNumKeySources; ++s)
+    rest[s] = sources[s] + i;
+  interleaveScalar(layout, rest, count - i, keys + i);
+}
+
+#endif
+
+}  // namespace sortkey
+
+// Writes the key of each ray to `keys`, 0 for modes without a key. `path` has to be supported,
+// see sortingKeyPathSupported
+inline void computeSortingKeys(int                             sortingMode,
+                               const RecordedRay*              rays,
+                               size_t                          count,
+                               const sortkey::KeyQuantization& quantization,
+                               SortingKeyPath                  path,
+                               uint32_t*                       keys)
+{
+  float sceneExtent = sortkey::largestSceneExtent(quantization.sceneMin, quantization.sceneMax);
+
+  if(path == eKeyPathReference || !sortingModeHasKey(sortingMode))
+  {
+    for(size_t i = 0; i < count; ++i)
+      keys[i] = sortkey::referenceKey(sortingMode, rays[i], quantization);
+    return;
+  }
+
+  // Quantized in chunks, the components side by side as the interleaves read them
+  const size_t      CHUNK  = 256;
+  sortkey::KeyLayout layout = sortkey::keyLayout(sortingMode, quantization.normalized);
+  uint32_t          lanes[sortkey::eNumKeySources][CHUNK];
+  const uint32_t*   sources[sortkey::eNumKeySources];
+  for(int s = 0; s < sortkey::eNumKeySources; ++s)
+    sources[s] = lanes[s];
+
+  for(size_t begin = 0; begin < count; begin += CHUNK)
+  {
+    size_t chunk = count - begin < CHUNK ? count - begin : CHUNK;
+    for(size_t i = 0; i < chunk; ++i)
+    {
+      sortkey::ivec3 ia, ib;
+      sortkey::quantizeRay(sortingMode, rays[begin + i], quantization, sceneExtent, ia, ib);
+      for(int c = 0; c < 3; ++c)
+      {
+        lanes[sortkey::eSourceAX + c][i] = uint32_t(ia[c]);
+        lanes[sortkey::eSourceBX + c][i] = uint32_t(ib[c]);
+      }
+    }
+
+    switch(path)
+    {
+#ifdef SORTING_KEYS_X86
+      case eKeyPathAVX2:
+        sortkey::interleaveAVX2(layout, sources, chunk, keys + begin);
+        break;
+      case eKeyPathBMI2:
+        sortkey::interleaveBMI2(layout, sources, chunk, keys + begin);
+        break;
+#endif
+      default:
+        sortkey::interleaveScalar(layout, sources, chunk, keys + begin);
+    }
+  }
+}
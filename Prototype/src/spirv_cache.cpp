@@ -0,0 +1,133 @@
+#include "spirv_cache.hpp"
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include "pipeline_cache_file.hpp"
+
+static const uint32_t SPIRV_MAGIC        = 0x07230203;
+static const size_t   SPIRV_HEADER_WORDS = 5;
+
+static std::filesystem::path findSource(const std::string&              name,
+                                        const std::filesystem::path&    includingDirectory,
+                                        const std::vector<std::string>& includeDirectories)
+{
+  std::error_code error;
+  if(!includingDirectory.empty() && std::filesystem::is_regular_file(includingDirectory / name, error))
+    return includingDirectory / name;
+  for(const std::string& directory : includeDirectories)
+  {
+    if(std::filesystem::is_regular_file(std::filesystem::path(directory) / name, error))
+      return std::filesystem::path(directory) / name;
+  }
+  return {};
+}
+
+// Hashes the file and then the files it includes in the order they appear. A file is hashed
+// once, like its include guard would let it be compiled once.
+static uint64_t hashSource(const std::string&               name,
+                           const std::filesystem::path&     includingDirectory,
+                           const std::vector<std::string>&  includeDirectories,
+                           std::set<std::filesystem::path>& visited,
+                           uint64_t                         hash)
+{
+  hash = fnv1a(name.data(), name.size(), hash);
+  std::filesystem::path path = findSource(name, includingDirectory, includeDirectories).lexically_normal();
+  if(path.empty() || !visited.insert(path).second)
+    return hash;
+
+  std::ifstream file(path, std::ios::binary);
+  std::string   contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  hash = fnv1a(contents.data(), contents.size(), hash);
+
+  std::istringstream lines(contents);
+  std::string        line;
+  while(std::getline(lines, line))
+  {
+    size_t directive = line.find_first_not_of(" \t");
+    if(directive == std::string::npos || line[directive] != '#')
+      continue;
+    directive = line.find_first_not_of(" \t", directive + 1);
+    if(directive == std::string::npos || line.compare(directive, 7, "include") != 0)
+      continue;
+
+    size_t open = line.find_first_of("\"<", directive + 7);
+    if(open == std::string::npos)
+      continue;
+    bool   quoted = line[open] == '"';
+    size_t close  = line.find(quoted ? '"' : '>', open + 1);
+    if(close == std::string::npos)
+      continue;
+
+    // "file" is looked up next to the including file first, <file> only in the include directories
+    std::string included = line.substr(open + 1, close - open - 1);
+    hash = hashSource(included, quoted ? path.parent_path() : std::filesystem::path(), includeDirectories, visited, hash);
+  }
+  return hash;
+}
+
+uint64_t spirvCacheKey(const std::string& filename, const std::vector<std::string>& includeDirectories, const std::string& options)
+{
+  std::set<std::filesystem::path> visited;
+  uint64_t                        hash = hashSource(filename, {}, includeDirectories, visited, FNV_OFFSET);
+  return fnv1a(options.data(), options.size(), hash);
+}
+
+std::string spirvCachePath(const std::string& directory, const std::string& filename, uint64_t key)
+{
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)key);
+  std::string name = std::filesystem::path(filename).filename().string() + "." + hex + ".spv";
+  return (std::filesystem::path(directory) / name).string();
+}
+
+bool loadCachedSpirv(const std::string& path, std::vector<uint32_t>& spirv)
+{
+  spirv.clear();
+  std::ifstream in(path, std::ios::binary | std::ios::ate);
+  if(!in)
+    return false;
+
+  std::streamsize size = in.tellg();
+  if(size < std::streamsize(SPIRV_HEADER_WORDS * sizeof(uint32_t)) || size % sizeof(uint32_t) != 0)
+  {
+    printf("%s is not SPIR-V, it is ignored\n", path.c_str());
+    return false;
+  }
+  spirv.resize(size_t(size) / sizeof(uint32_t));
+  in.seekg(0);
+  in.read(reinterpret_cast<char*>(spirv.data()), size);
+  if(!in || spirv[0] != SPIRV_MAGIC)
+  {
+    printf("%s is not SPIR-V, it is ignored\n", path.c_str());
+    spirv.clear();
+    return false;
+  }
+  return true;
+}
+
+bool saveCachedSpirv(const std::string& path, const std::vector<uint32_t>& spirv)
+{
+  std::error_code error;
+  std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+
+  // written next to the final file and renamed, so a concurrent reader never sees half a shader
+  std::string temporary = path + ".tmp";
+  {
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(spirv.data()), std::streamsize(spirv.size() * sizeof(uint32_t)));
+    if(!out)
+    {
+      printf("Could not write %s\n", temporary.c_str());
+      return false;
+    }
+  }
+  std::filesystem::rename(temporary, path, error);
+  if(error)
+  {
+    printf("Could not write %s: %s\n", path.c_str(), error.message().c_str());
+    return false;
+  }
+  return true;
+}
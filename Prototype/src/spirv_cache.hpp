@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Content addressed cache of compiled shaders
+//
+// A shader is stored under a key hashed from its source, the sources of everything it includes,
+// directly or not, and the compile options. Editing any of them changes the key, so entries are
+// never stale and are never overwritten, only joined by new ones.
+
+// FNV-1a over the source of `filename` and its transitive #includes, resolved like the compiler
+// does: next to the including file first, then in `includeDirectories`. Includes that are not
+// found only contribute their name. `options` describes everything else that changes the SPIR-V.
+uint64_t spirvCacheKey(const std::string& filename, const std::vector<std::string>& includeDirectories, const std::string& options);
+
+// <directory>/<filename>.<key as hex>.spv
+std::string spirvCachePath(const std::string& directory, const std::string& filename, uint64_t key);
+
+// Return false for missing files and files that are not SPIR-V, `spirv` is left empty then
+bool loadCachedSpirv(const std::string& path, std::vector<uint32_t>& spirv);
+bool saveCachedSpirv(const std::string& path, const std::vector<uint32_t>& spirv);
@@ -0,0 +1,44 @@
+#include "switch_policy.hpp"
+
+bool PipelineSwitchPolicy::shouldSwitch(int currentHash, float currentFrameTime, int candidateHash, float candidateFrameTime)
+{
+  if(candidateHash == currentHash)
+  {
+    lastAvoidedHash = -1;
+    return false;
+  }
+
+  bool switchNow = !enabled;
+  if(enabled && candidateFrameTime > 0.0f)
+  {
+    // without timings of the running pipeline there is nothing to weigh, take the known one
+    if(currentFrameTime <= 0.0f)
+    {
+      switchNow = true;
+    }
+    else
+    {
+      float gain = currentFrameTime - candidateFrameTime;
+      switchNow  = gain > hysteresis * currentFrameTime && gain * horizonFrames > predictedSwitchCost();
+    }
+  }
+
+  if(switchNow)
+  {
+    switchesPerformed++;
+    lastAvoidedHash = -1;
+  }
+  else if(candidateHash != lastAvoidedHash)
+  {
+    // count every rejected target once, not every frame it stays rejected
+    switchesAvoided++;
+    lastAvoidedHash = candidateHash;
+  }
+  return switchNow;
+}
+
+void PipelineSwitchPolicy::recordSwitchStall(float stallMs)
+{
+  stallEstimateMs = stallMeasured ? stallEstimateMs * 0.8f + stallMs * 0.2f : stallMs;
+  stallMeasured   = true;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+
+// Decides whether switching to the best pipeline of the current cell and view bin pays off.
+// A switch costs the stall it causes (measured, smoothed) plus binding the new pipeline. It is
+// only done when the frame time saved over the next `horizonFrames` frames exceeds that cost
+// and the new pipeline is faster by more than `hysteresis` of the current frame time, so moving
+// along a cell boundary does not switch back and forth every frame.
+class PipelineSwitchPolicy
+{
+public:
+  bool  enabled{true};         // when disabled every differing best pipeline is switched to
+  float horizonFrames{60.0f};  // frames over which the gain of a switch is integrated
+  float hysteresis{0.05f};     // minimal relative frame time gain
+  float bindCostMs{0.05f};     // cost of binding a new pipeline, on top of the stall
+
+  // frame times in ms, <= 0 if unknown
+  bool shouldSwitch(int currentHash, float currentFrameTime, int candidateHash, float candidateFrameTime);
+  void recordSwitchStall(float stallMs);
+
+  float predictedSwitchCost() const { return stallEstimateMs + bindCostMs; }
+  float stallEstimate() const { return stallEstimateMs; }
+
+  uint32_t switchesPerformed{0};
+  uint32_t switchesAvoided{0};
+
+private:
+  float stallEstimateMs{1.0f};  // assumption until the first switch has been measured
+  bool  stallMeasured{false};
+  int   lastAvoidedHash{-1};
+};